@@ -0,0 +1,763 @@
+/*
+ * udptunnel : Lightweight TCP over UDP Tunneling
+ *
+ * Copyright (C) 2014 Jingyu jingyu.niu@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* In process benchmarks of the tunnel internals, linked with everything
+   but udptunnel.c. Run one at a time, see usage(). */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+
+#if !defined(_WIN32) && !defined(_WIN64)
+#include <sys/resource.h>
+#endif
+
+#include "log.h"
+#include "tunnel_i.h"
+#include "channel.h"
+
+static void usage()
+{
+    printf("Usage: bench layout [channels]\n"
+           "   or: bench header [count]\n"
+           "   or: bench crypto [MB]\n"
+           "   or: bench scale [channels]\n"
+           "   or: bench vectors\n"
+           "         layout      channel_handle_message() rate on as many\n"
+           "                     channels, 1000 and 200000 by default.\n"
+           "         header      Encode and decode as many data message\n"
+           "                     headers of each version, 20000000 by\n"
+           "                     default.\n"
+           "         crypto      Cycles per byte to seal and open as many\n"
+           "                     MB of datagrams of each size, 64 by\n"
+           "                     default.\n"
+           "         scale       Open, find and reopen as many channels on\n"
+           "                     one peer, 500000 by default.\n"
+           "         vectors     Known answer tests of the ciphers, with\n"
+           "                     and without SIMD. Fails on a mismatch.\n"
+           "\n");
+    exit(-1);
+}
+
+/* Random order, so every message of a large set finds its channel out of
+   the cache. */
+static uint32_t *bench_shuffle(uint32_t n)
+{
+    uint32_t *order = (uint32_t *)malloc(n * sizeof(uint32_t));
+    uint32_t seed = 2463534242u;
+    uint32_t i, j, v;
+
+    if (!order)
+        return NULL;
+
+    for (i = 0; i < n; i++)
+        order[i] = i;
+
+    for (i = n - 1; i > 0; i--) {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        j = seed % (i + 1);
+        v = order[i];
+        order[i] = order[j];
+        order[j] = v;
+    }
+
+    return order;
+}
+
+/* Server tunnel on an ephemeral loopback port, with one peer whose
+   address is a socket nobody reads. */
+static Tunnel *bench_server(Peer **peer, SOCKET *sink)
+{
+    TunnelConfig config;
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+    Tunnel *t;
+
+    tunnel_config_init(&config);
+    t = tunnel_create_server("127.0.0.1", "0", NULL, &config);
+    if (!t) {
+        printf("Create tunnel error.\n");
+        return NULL;
+    }
+
+    *sink = socket_create(AF_INET, SOCK_DGRAM, "127.0.0.1", "0");
+    if (*sink == INVALID_SOCKET ||
+        getsockname(*sink, (struct sockaddr *)&addr, &addrlen) < 0) {
+        printf("Create peer socket error(%d).\n", socket_errno());
+        tunnel_close(t);
+        return NULL;
+    }
+
+    *peer = peer_get(t, (struct sockaddr *)&addr, addrlen);
+    if (!*peer) {
+        printf("Create peer, out of memory.\n");
+        socket_close(*sink);
+        tunnel_close(t);
+        return NULL;
+    }
+    (*peer)->version = MESSAGE_VERSION_2;
+
+    return t;
+}
+
+/* Messages per second through channel_handle_message(), in millions. The
+   channels have no TCP socket and a full write queue. */
+static double bench_dispatch(Channel **chs, const uint32_t *order,
+                             uint32_t n, Buffer *buf, uint8_t type,
+                             uint32_t sn, uint32_t count)
+{
+    Message *msg = message_of(buf);
+    uint64_t start;
+    uint32_t i;
+    Channel *ch;
+
+    msg->type = type;
+    msg->sn = sn;
+
+    start = tunnel_clock_us();
+    for (i = 0; i < count; i++) {
+        ch = chs[order[i % n]];
+        msg->channel_id = ch->id;
+        channel_handle_message(ch, msg, buf);
+    }
+
+    return (double)count / (tunnel_clock_us() - start);
+}
+
+static int bench_layout_run(Tunnel *t, Peer *peer, uint32_t n)
+{
+    Channel **chs = (Channel **)calloc(n, sizeof(Channel *));
+    uint32_t *order = bench_shuffle(n);
+    uint32_t count = n < 4000000 ? 4000000 : n;
+    Buffer *buf = buffer_alloc(&t->data_pool);
+    double ack, data, acked;
+    Message *msg;
+    Channel *ch;
+    uint32_t i;
+    int rc = -1;
+
+    if (!chs || !order || !buf) {
+        printf("Out of memory.\n");
+        goto out;
+    }
+
+    msg = message_of(buf);
+    memset(msg, 0, MESSAGE_HEADER_LEN);
+    msg->length = 1;
+    buf->len = MESSAGE_HEADER_LEN + 1;
+
+    for (i = 0; i < n; i++) {
+        chs[i] = channel_create_server(t, i + 1, "127.0.0.1", "9", peer);
+        if (!chs[i]) {
+            printf("Channel %u, out of memory.\n", i + 1);
+            goto out;
+        }
+
+        chs[i]->state = CHANNEL_CONNECTED;
+        chs[i]->udp2tcp_queued = CHANNEL_WRITE_QUEUE_MAX;
+        channel_confirmed(chs[i]);
+    }
+
+    /* An ACK of nothing in flight reads the send path only, new data
+       dropped on the full queue the receive path too. Data sent again is
+       ACKed, a sendto() to the peer. */
+    ack = bench_dispatch(chs, order, n, buf, MSG_CHANNEL_DATA_ACK, 0, count);
+    data = bench_dispatch(chs, order, n, buf, MSG_CHANNEL_DATA, 1, count);
+    acked = bench_dispatch(chs, order, n, buf, MSG_CHANNEL_DATA, 0,
+                           n < 200000 ? n : 200000);
+
+    printf("%10u %10.1f %10.1f %10.2f\n", n, ack, data, acked);
+    rc = 0;
+
+out:
+    for (i = 0; chs && i < n && chs[i]; i++) {
+        ch = chs[i];
+        ch->udp2tcp_queued = 0;
+        channel_close(ch);
+    }
+    if (buf)
+        buffer_release(buf);
+    free(order);
+    free(chs);
+    return rc;
+}
+
+static int bench_layout(int argc, char *argv[])
+{
+    Tunnel *t;
+    Peer *peer;
+    SOCKET sink;
+    int rc = 0;
+
+    t = bench_server(&peer, &sink);
+    if (!t)
+        return -1;
+
+    printf("Channel: %d bytes, send path in bytes 0-%d, receive path to "
+           "%d.\n", (int)sizeof(Channel),
+           (int)(offsetof(Channel, tcp_sock) + sizeof(SOCKET) - 1),
+           (int)(offsetof(Channel, tcp2udp_timeout) + sizeof(uint32_t) - 1));
+    printf("channel_handle_message(), millions of messages per second:\n");
+    printf("%10s %10s %10s %10s\n", "channels", "ack", "data", "data+ack");
+
+    if (argc > 0) {
+        rc = bench_layout_run(t, peer, (uint32_t)atoi(argv[0]));
+    } else {
+        rc = bench_layout_run(t, peer, 1000);
+        if (rc == 0)
+            rc = bench_layout_run(t, peer, 200000);
+    }
+
+    peer_release(t, peer);
+    socket_close(sink);
+    tunnel_close(t);
+    return rc;
+}
+
+/* Server channels on one peer, ns to allocate and add one by the next free
+   id, to find one by id, and to open one again after every other one is
+   closed. An id still in use must never be given again. */
+static int bench_scale(int argc, char *argv[])
+{
+    uint32_t n = argc > 0 ? (uint32_t)atoi(argv[0]) : 500000;
+    uint64_t start, add, lookup, reopen;
+    uint32_t i, cid, found = 0, dup = 0, k = 0;
+    Channel *ch, *next;
+    Tunnel *t;
+    Peer *peer;
+    SOCKET sink;
+    int rc = -1;
+
+    if (n < 2)
+        usage();
+
+    t = bench_server(&peer, &sink);
+    if (!t)
+        return -1;
+
+    start = tunnel_clock_us();
+    for (i = 0; i < n; i++) {
+        cid = tunnel_next_cid(peer);
+        ch = channel_create_server(t, cid, "127.0.0.1", "9", peer);
+        if (!ch || !tunnel_add_channel(ch)) {
+            printf("Channel %u, out of memory.\n", cid);
+            goto out;
+        }
+    }
+    add = tunnel_clock_us() - start;
+
+    start = tunnel_clock_us();
+    for (i = 0; i < 4 * n; i++)
+        found += tunnel_get_channel(peer, 1 + i * 2654435761u % n) != NULL;
+    lookup = tunnel_clock_us() - start;
+
+    for (ch = t->channels; ch; ch = next) {
+        next = ch->next;
+        if (k++ & 1)
+            tunnel_delete_channel(t, ch);
+    }
+
+    start = tunnel_clock_us();
+    for (i = 0; i < n / 2; i++) {
+        cid = tunnel_next_cid(peer);
+        dup += tunnel_get_channel(peer, cid) != NULL;
+        ch = channel_create_server(t, cid, "127.0.0.1", "9", peer);
+        if (!ch || !tunnel_add_channel(ch)) {
+            printf("Channel %u, out of memory.\n", cid);
+            goto out;
+        }
+    }
+    reopen = tunnel_clock_us() - start;
+
+    printf("%u channels on one peer, ns each:\n", n);
+    printf("%10s %10s %10s\n", "add", "lookup", "reopen");
+    printf("%10.0f %10.1f %10.0f\n", 1e3 * add / n,
+           1e3 * lookup / (4.0 * n), 1e3 * reopen / (n / 2));
+    printf("%u of %u found, %u ids given twice, last id %u, %d open.\n",
+           found, 4 * n, dup, peer->cid, t->nchannels);
+#if !defined(_WIN32) && !defined(_WIN64)
+    {
+        struct rusage ru;
+        getrusage(RUSAGE_SELF, &ru);
+        printf("Peak RSS %ld MB.\n", ru.ru_maxrss / 1024);
+    }
+#endif
+    rc = dup ? -1 : 0;
+
+out:
+    for (ch = t->channels; ch; ch = next) {
+        next = ch->next;
+        tunnel_delete_channel(t, ch);
+    }
+    peer_release(t, peer);
+    socket_close(sink);
+    tunnel_close(t);
+    return rc;
+}
+
+/* Data message headers of each wire version, ns to encode and to decode
+   one. A header is decoded in place, so batches of them are copied into
+   cache line sized buffers before their decoding is timed. */
+static int bench_header(int argc, char *argv[])
+{
+    static char bufs[512][POOL_CACHELINE];
+    uint32_t count = argc > 0 ? (uint32_t)atoi(argv[0]) : 20000000;
+    volatile uint32_t sink = 0;
+    uint64_t start, decode;
+    double encode;
+    MessageHeader hdr;
+    Message *msg;
+    uint32_t i, j;
+    int v;
+
+    if (count < 512)
+        usage();
+
+    printf("Data message header, ns each:\n");
+    printf("%10s %10s %10s %10s\n", "version", "bytes", "encode", "decode");
+
+    for (v = MESSAGE_VERSION_1; v <= MESSAGE_VERSION_MAX; v++) {
+        start = tunnel_clock_us();
+        for (i = 0; i < count; i++) {
+            message_init_header(&hdr, v, MSG_CHANNEL_DATA, 0,
+                                (i & 0x3FFF) + 1, i & 0xFFFF, 1024);
+            sink += hdr.len;
+        }
+        encode = 1000.0 * (tunnel_clock_us() - start) / count;
+
+        message_init_header(&hdr, v, MSG_CHANNEL_DATA, 0, 1234, 40000, 16);
+        decode = 0;
+        for (i = 0; i < count / 512; i++) {
+            for (j = 0; j < 512; j++)
+                memcpy(bufs[j] + MESSAGE_HEADER_LEN, hdr.data, hdr.len);
+
+            start = tunnel_clock_us();
+            for (j = 0; j < 512; j++) {
+                msg = message_decode(bufs[j] + MESSAGE_HEADER_LEN,
+                                     hdr.len + 16);
+                sink += msg->sn;
+            }
+            decode += tunnel_clock_us() - start;
+        }
+
+        printf("%10d %10d %10.1f %10.1f\n", v, hdr.len, encode,
+               1000.0 * decode / (count / 512 * 512));
+    }
+
+    return 0;
+}
+
+/* Seal datagrams of each size with one cipher path and open them again,
+   cycles per byte from the counters of crypto.c. */
+static int bench_crypto_run(const char *name, uint8_t cipher, uint32_t mb)
+{
+    static const size_t sizes[] = { 64, 256, 1400, 8192 };
+    static uint8_t data[8192];
+    static uint8_t sealed[MESSAGE_MAX_HEADER_LEN + 8192 + CRYPTO_OVERHEAD];
+    uint8_t key[CRYPTO_KEY_LEN];
+    uint8_t client_nonce[CRYPTO_NONCE_LEN];
+    uint8_t server_nonce[CRYPTO_NONCE_LEN];
+    uint8_t confirm[CRYPTO_TAG_LEN];
+    Crypto *client = crypto_create();
+    Crypto *server = crypto_create();
+    CryptoKeys keys;
+    MessageHeader hdr;
+    uint32_t count, i;
+    size_t j, len;
+    int rc = -1;
+
+    if (!client || !server) {
+        printf("Out of memory.\n");
+        goto out;
+    }
+
+    memset(key, 0x55, sizeof(key));
+    memset(client_nonce, 0x01, sizeof(client_nonce));
+    memset(server_nonce, 0x02, sizeof(server_nonce));
+    crypto_derive(&keys, key, cipher, 0, client_nonce, server_nonce, 0,
+                  confirm);
+    crypto_set_keys(client, &keys, 0);
+    crypto_derive(&keys, key, cipher, 0, client_nonce, server_nonce, 1,
+                  confirm);
+    crypto_set_keys(server, &keys, 1);
+
+    printf("%-14s", name);
+    for (j = 0; j < sizeof(sizes) / sizeof(sizes[0]); j++) {
+        message_init_header(&hdr, MESSAGE_VERSION_2, MSG_CHANNEL_DATA, 0,
+                            1, 1, sizes[j]);
+        count = (uint32_t)((uint64_t)mb * 1024 * 1024 / sizes[j]);
+
+        client->seal_bytes = client->seal_cycles = 0;
+        server->open_bytes = server->open_cycles = 0;
+        for (i = 0; i < count; i++) {
+            len = crypto_seal(client, sealed, hdr.data, hdr.len, data,
+                              sizes[j]);
+            if (crypto_open(server, sealed, len) < 0) {
+                printf("\nDatagram %u of %d bytes, not authentic.\n", i,
+                       (int)sizes[j]);
+                goto out;
+            }
+        }
+
+        if (!client->seal_cycles)
+            printf(" %13s", "n/a");
+        else
+            printf(" %6.2f/%-6.2f",
+                   (double)client->seal_cycles / client->seal_bytes,
+                   (double)server->open_cycles / server->open_bytes);
+    }
+    printf("\n");
+    rc = 0;
+
+out:
+    crypto_free(client);
+    crypto_free(server);
+    return rc;
+}
+
+static int bench_crypto(int argc, char *argv[])
+{
+    uint32_t mb = argc > 0 ? (uint32_t)atoi(argv[0]) : 64;
+    uint8_t ciphers;
+    int rc = 0;
+
+    if (mb == 0)
+        usage();
+
+    /* It logs what the CPU has */
+    utlog_set_level(UDPTUNNEL_LOG_INFO);
+    crypto_init();
+    utlog_set_level(UDPTUNNEL_LOG_ERROR);
+    ciphers = crypto_ciphers();
+
+    printf("Cycles per byte, sealing/opening:\n");
+    printf("%-14s %13s %13s %13s %13s\n", "", "64 B", "256 B", "1400 B",
+           "8192 B");
+
+    if (ciphers & CRYPTO_AES256_GCM)
+        rc = bench_crypto_run("AES-GCM", CRYPTO_AES256_GCM, mb);
+    if (rc == 0)
+        rc = bench_crypto_run("ChaCha20", CRYPTO_CHACHA20_POLY1305, mb);
+
+    /* ChaCha20 has a portable path too, AES-GCM has none */
+    crypto_disable_simd();
+    if (rc == 0)
+        rc = bench_crypto_run("ChaCha20 plain", CRYPTO_CHACHA20_POLY1305, mb);
+
+    return rc;
+}
+
+/* Known answers, in full: RFC 8439 2.8.2 and GCM test case 16 */
+typedef struct bench_aead_vector {
+    uint8_t cipher;
+    const char *key;
+    const char *nonce;
+    const char *ad;
+    const char *plain;
+    const char *sealed;
+    const char *tag;
+} BenchAeadVector;
+
+static const BenchAeadVector bench_aead_vectors[] = {
+    {
+        CRYPTO_CHACHA20_POLY1305,
+        "808182838485868788898a8b8c8d8e8f"
+        "909192939495969798999a9b9c9d9e9f",
+        "070000004041424344454647",
+        "50515253c0c1c2c3c4c5c6c7",
+        "4c616469657320616e642047656e746c656d656e206f662074686520636c6173"
+        "73206f66202739393a204966204920636f756c64206f6666657220796f75206f"
+        "6e6c79206f6e652074697020666f7220746865206675747572652c2073756e73"
+        "637265656e20776f756c642062652069742e",
+        "d31a8d34648e60db7b86afbc53ef7ec2a4aded51296e08fea9e2b5a736ee62d6"
+        "3dbea45e8ca9671282fafb69da92728b1a71de0a9e060b2905d6a5b67ecd3b36"
+        "92ddbd7f2d778b8c9803aee328091b58fab324e4fad675945585808b4831d7bc"
+        "3ff4def08e4b7a9de576d26586cec64b6116",
+        "1ae10b594f09e26a7e902ecbd0600691"
+    },
+    {
+        CRYPTO_AES256_GCM,
+        "feffe9928665731c6d6a8f9467308308"
+        "feffe9928665731c6d6a8f9467308308",
+        "cafebabefacedbaddecaf888",
+        "feedfacedeadbeeffeedfacedeadbeefabaddad2",
+        "d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d8a318a72"
+        "1c3c0c95956809532fcf0e2449a6b525b16aedf5aa0de657ba637b39",
+        "522dc1f099567d07f47f37a32a84427d643a8cdcbfe5c0c97598a2bd2555d1aa"
+        "8cb08e48590dbb3da7b08b1056828838c5f61e6393ba7a0abcc9f662",
+        "76fc6ece0f4e1768cddf8853bb2d551b"
+    },
+};
+
+/* Tags from OpenSSL of the key, nonce, header and data patterns of
+   bench_vectors_run(), at the lengths where the block and SIMD paths take
+   over from each other */
+typedef struct bench_tag_vector {
+    uint8_t cipher;
+    size_t len;
+    const char *tag;
+} BenchTagVector;
+
+static const BenchTagVector bench_tag_vectors[] = {
+    { CRYPTO_CHACHA20_POLY1305, 0, "84f8862da293837709bc9c53244851c6" },
+    { CRYPTO_CHACHA20_POLY1305, 1, "4b408fba62b0167717fa6d694a428e25" },
+    { CRYPTO_CHACHA20_POLY1305, 15, "8b4231ba697df38ae2f64f7d513fe180" },
+    { CRYPTO_CHACHA20_POLY1305, 16, "7c4f4fae703d32cc4bcc9b33ccf52eb2" },
+    { CRYPTO_CHACHA20_POLY1305, 63, "0bd7fd012256a308a587d614c70d41de" },
+    { CRYPTO_CHACHA20_POLY1305, 64, "9721d64289f850796d7e7661191625ee" },
+    { CRYPTO_CHACHA20_POLY1305, 127, "6828efc71ed76475e9b4ef7412d46574" },
+    { CRYPTO_CHACHA20_POLY1305, 128, "fb2dcc7e7967047057e56c851250d41a" },
+    { CRYPTO_CHACHA20_POLY1305, 129, "ddb72db900039d726cd36c15be580c5f" },
+    { CRYPTO_CHACHA20_POLY1305, 255, "6638a6adec6dab528e15ce8ed98edf10" },
+    { CRYPTO_CHACHA20_POLY1305, 256, "d4ee090c83859f6b89cf29de4606a602" },
+    { CRYPTO_CHACHA20_POLY1305, 257, "00f1e7c151960ee420ed8b8d13af19d6" },
+    { CRYPTO_CHACHA20_POLY1305, 511, "a7d781b0d50de75c42738950a3b7ca8c" },
+    { CRYPTO_CHACHA20_POLY1305, 512, "0d64aa00287c3c9f49139d46948e66ff" },
+    { CRYPTO_CHACHA20_POLY1305, 513, "05fdef71a30bc03fdea991ee3fcd0a01" },
+    { CRYPTO_CHACHA20_POLY1305, 1400, "aebf1ed7a2e94f1603c89c64a4cc0dbb" },
+    { CRYPTO_CHACHA20_POLY1305, 4099, "f13ba951ad54f7253ac8f34128295730" },
+    { CRYPTO_CHACHA20_POLY1305, 8192, "0acd49662d1f38601bcc1a1e410dbe19" },
+    { CRYPTO_AES256_GCM, 0, "2ffde0c486e00fe194ae1d9b81e4486d" },
+    { CRYPTO_AES256_GCM, 1, "388a4b9a2076310f82bb92a1ea70e35a" },
+    { CRYPTO_AES256_GCM, 15, "d53054af4afa4c7a9d7cbfc794ab9a6b" },
+    { CRYPTO_AES256_GCM, 16, "b09f7fcfa1eb1cfde48cf78979c9548f" },
+    { CRYPTO_AES256_GCM, 63, "57c8cca6e6a5e8176bcc30b14e465d3a" },
+    { CRYPTO_AES256_GCM, 64, "33efb12be0e8b6e4d5c2e2b0f16ca935" },
+    { CRYPTO_AES256_GCM, 127, "4654f90c1c42c7b3232960649a5950eb" },
+    { CRYPTO_AES256_GCM, 128, "9eb0f06d21ba1b7f7654fdfd33ed3685" },
+    { CRYPTO_AES256_GCM, 129, "20bb9b578540948c197880831f3e37fb" },
+    { CRYPTO_AES256_GCM, 255, "38d66f0f7abbc9277827bb56c35e0a1e" },
+    { CRYPTO_AES256_GCM, 256, "f4f210920308357feba1286141e93808" },
+    { CRYPTO_AES256_GCM, 257, "0f26d630c1ab03c5f29756bea97f4ae5" },
+    { CRYPTO_AES256_GCM, 511, "2761131b08cf2d2f8878b0acd8541ba7" },
+    { CRYPTO_AES256_GCM, 512, "6803745057ce5a01d5b18f751be04002" },
+    { CRYPTO_AES256_GCM, 513, "5f06a5912ab94d0e0200ecf5cbd4ebaa" },
+    { CRYPTO_AES256_GCM, 1400, "2a2e7408e889f403806f5696c0ae7b0c" },
+    { CRYPTO_AES256_GCM, 4099, "707ab7f3f65e40f11993c72b3e6a4c65" },
+    { CRYPTO_AES256_GCM, 8192, "8f5af446255a22dd0bda018516d8ab32" },
+};
+
+/* SipHash-2-4 reference vectors: key 00..0f, message 00..n-1 */
+static const uint64_t bench_siphash_vectors[64] = {
+        0x726fdb47dd0e0e31ull, 0x74f839c593dc67fdull, 0x0d6c8009d9a94f5aull,
+        0x85676696d7fb7e2dull, 0xcf2794e0277187b7ull, 0x18765564cd99a68dull,
+        0xcbc9466e58fee3ceull, 0xab0200f58b01d137ull, 0x93f5f5799a932462ull,
+        0x9e0082df0ba9e4b0ull, 0x7a5dbbc594ddb9f3ull, 0xf4b32f46226bada7ull,
+        0x751e8fbc860ee5fbull, 0x14ea5627c0843d90ull, 0xf723ca908e7af2eeull,
+        0xa129ca6149be45e5ull, 0x3f2acc7f57c29bdbull, 0x699ae9f52cbe4794ull,
+        0x4bc1b3f0968dd39cull, 0xbb6dc91da77961bdull, 0xbed65cf21aa2ee98ull,
+        0xd0f2cbb02e3b67c7ull, 0x93536795e3a33e88ull, 0xa80c038ccd5ccec8ull,
+        0xb8ad50c6f649af94ull, 0xbce192de8a85b8eaull, 0x17d835b85bbb15f3ull,
+        0x2f2e6163076bcfadull, 0xde4daaaca71dc9a5ull, 0xa6a2506687956571ull,
+        0xad87a3535c49ef28ull, 0x32d892fad841c342ull, 0x7127512f72f27cceull,
+        0xa7f32346f95978e3ull, 0x12e0b01abb051238ull, 0x15e034d40fa197aeull,
+        0x314dffbe0815a3b4ull, 0x027990f029623981ull, 0xcadcd4e59ef40c4dull,
+        0x9abfd8766a33735cull, 0x0e3ea96b5304a7d0ull, 0xad0c42d6fc585992ull,
+        0x187306c89bc215a9ull, 0xd4a60abcf3792b95ull, 0xf935451de4f21df2ull,
+        0xa9538f0419755787ull, 0xdb9acddff56ca510ull, 0xd06c98cd5c0975ebull,
+        0xe612a3cb9ecba951ull, 0xc766e62cfcadaf96ull, 0xee64435a9752fe72ull,
+        0xa192d576b245165aull, 0x0a8787bf8ecb74b2ull, 0x81b3e73d20b49b6full,
+        0x7fa8220ba3b2eceaull, 0x245731c13ca42499ull, 0xb78dbfaf3a8d83bdull,
+        0xea1ad565322a1a0bull, 0x60e61c23a3795013ull, 0x6606d7e446282b93ull,
+        0x6ca4ecb15c5f91e1ull, 0x9f626da15c9625f3ull, 0xe51b38608ef25f57ull,
+        0x958a324ceb064572ull
+};
+
+static size_t bench_unhex(const char *hex, uint8_t *out)
+{
+    size_t n = 0;
+    unsigned int v;
+
+    while (hex[0] && hex[1] && sscanf(hex, "%2x", &v) == 1) {
+        out[n++] = (uint8_t)v;
+        hex += 2;
+    }
+
+    return n;
+}
+
+/* Seal plain and compare with sealed, if known, and tag. Then open it,
+   and with one bit of the tag flipped it must not open. Returns 1 if the
+   cipher is not there, -1 on a mismatch. */
+static int bench_aead_check(uint8_t cipher, const uint8_t *key,
+                            const uint8_t *nonce, const uint8_t *ad,
+                            size_t adlen, const uint8_t *plain, size_t len,
+                            const uint8_t *sealed, const uint8_t *tag)
+{
+    static uint8_t p[8192];
+    uint8_t t[CRYPTO_TAG_LEN];
+
+    memcpy(p, plain, len);
+    if (crypto_aead_seal(cipher, key, nonce, ad, adlen, p, len, t) < 0)
+        return 1;
+
+    if ((sealed && memcmp(p, sealed, len)) ||
+        memcmp(t, tag, CRYPTO_TAG_LEN))
+        return -1;
+
+    if (crypto_aead_open(cipher, key, nonce, ad, adlen, p, len, t) < 0 ||
+        memcmp(p, plain, len))
+        return -1;
+
+    crypto_aead_seal(cipher, key, nonce, ad, adlen, p, len, t);
+    t[len % CRYPTO_TAG_LEN] ^= 1;
+    if (crypto_aead_open(cipher, key, nonce, ad, adlen, p, len, t) == 0)
+        return -1;
+
+    return 0;
+}
+
+/* All vectors of both ciphers on the paths the CPU takes now. Returns the
+   mismatches. */
+static int bench_vectors_run(const char *name)
+{
+    static uint8_t plain[8192];
+    static uint8_t sealed[8192];
+    const BenchAeadVector *v;
+    const BenchTagVector *tv;
+    uint8_t key[CRYPTO_KEY_LEN];
+    uint8_t nonce[12];
+    uint8_t ad[32];
+    uint8_t tag[CRYPTO_TAG_LEN];
+    size_t adlen, len, i;
+    int passed = 0, failed = 0, skipped = 0;
+    int rc;
+
+    for (i = 0; i < sizeof(bench_aead_vectors) /
+                    sizeof(bench_aead_vectors[0]); i++) {
+        v = &bench_aead_vectors[i];
+        bench_unhex(v->key, key);
+        bench_unhex(v->nonce, nonce);
+        adlen = bench_unhex(v->ad, ad);
+        len = bench_unhex(v->plain, plain);
+        bench_unhex(v->sealed, sealed);
+        bench_unhex(v->tag, tag);
+
+        rc = bench_aead_check(v->cipher, key, nonce, ad, adlen, plain, len,
+                              sealed, tag);
+        if (rc < 0)
+            printf("%s: %s vector %d, mismatch.\n", name,
+                   crypto_cipher_name(v->cipher), (int)i + 1);
+        passed += rc == 0;
+        failed += rc < 0;
+        skipped += rc > 0;
+    }
+
+    for (i = 0; i < CRYPTO_KEY_LEN; i++)
+        key[i] = (uint8_t)(i * 29 + 7);
+    for (i = 0; i < sizeof(nonce); i++)
+        nonce[i] = (uint8_t)(i * 13 + 5);
+    for (i = 0; i < 8; i++)
+        ad[i] = (uint8_t)(0xa0 + i);
+    for (i = 0; i < sizeof(plain); i++)
+        plain[i] = (uint8_t)(i * 7 + 3);
+
+    for (i = 0; i < sizeof(bench_tag_vectors) /
+                    sizeof(bench_tag_vectors[0]); i++) {
+        tv = &bench_tag_vectors[i];
+        bench_unhex(tv->tag, tag);
+
+        rc = bench_aead_check(tv->cipher, key, nonce, ad, 8, plain, tv->len,
+                              NULL, tag);
+        if (rc < 0)
+            printf("%s: %s of %d bytes, mismatch.\n", name,
+                   crypto_cipher_name(tv->cipher), (int)tv->len);
+        passed += rc == 0;
+        failed += rc < 0;
+        skipped += rc > 0;
+    }
+
+    printf("%-14s %d passed, %d failed, %d skipped.\n", name, passed,
+           failed, skipped);
+    return failed;
+}
+
+/* Known answer tests of the ciphers, on the SIMD paths the CPU has and
+   on the portable ones. */
+static int bench_vectors(void)
+{
+    uint8_t key[16];
+    uint8_t msg[64];
+    int failed = 0;
+    int i;
+
+    /* It logs what the CPU has */
+    utlog_set_level(UDPTUNNEL_LOG_INFO);
+    crypto_init();
+    utlog_set_level(UDPTUNNEL_LOG_ERROR);
+
+    for (i = 0; i < 16; i++)
+        key[i] = (uint8_t)i;
+    for (i = 0; i < 64; i++) {
+        msg[i] = (uint8_t)i;
+        if (crypto_siphash(key, msg, i) != bench_siphash_vectors[i]) {
+            printf("SipHash of %d bytes, mismatch.\n", i);
+            failed++;
+        }
+    }
+    printf("%-14s %d passed, %d failed.\n", "SipHash", 64 - failed, failed);
+
+    failed += bench_vectors_run("SIMD");
+
+    /* AES-GCM has no portable path, it is skipped */
+    crypto_disable_simd();
+    failed += bench_vectors_run("Plain");
+
+    return failed ? -1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int rc = 0;
+
+#if defined(_WIN32) || defined(_WIN64)
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+        printf("WSAStartup failed.");
+        return -1;
+    }
+#endif
+
+    if (argc < 2)
+        usage();
+
+    utlog_set_level(UDPTUNNEL_LOG_ERROR);
+
+    if (strcmp(argv[1], "layout") == 0)
+        rc = bench_layout(argc - 2, argv + 2);
+    else if (strcmp(argv[1], "header") == 0)
+        rc = bench_header(argc - 2, argv + 2);
+    else if (strcmp(argv[1], "crypto") == 0)
+        rc = bench_crypto(argc - 2, argv + 2);
+    else if (strcmp(argv[1], "scale") == 0)
+        rc = bench_scale(argc - 2, argv + 2);
+    else if (strcmp(argv[1], "vectors") == 0)
+        rc = bench_vectors();
+    else
+        usage();
+
+#if defined(_WIN32) || defined(_WIN64)
+    WSACleanup();
+#endif
+
+    return rc < 0 ? 1 : 0;
+}
@@ -0,0 +1,56 @@
+/*
+ * udptunnel : Lightweight TCP over UDP Tunneling
+ *
+ * Copyright (C) 2014 Jingyu jingyu.niu@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <assert.h>
+
+#include "config.h"
+
+#include "buffer.h"
+
+Buffer *buffer_alloc(Pool *pool)
+{
+    Buffer *b = (Buffer *)pool_alloc(pool);
+    if (!b)
+        return NULL;
+
+    b->next = NULL;
+    b->pool = pool;
+    b->refcnt = 1;
+    b->zc_id = 0;
+    b->len = 0;
+    b->offset = 0;
+
+    return b;
+}
+
+Buffer *buffer_ref(Buffer *b)
+{
+    b->refcnt++;
+    return b;
+}
+
+void buffer_release(Buffer *b)
+{
+    if (!b)
+        return;
+
+    assert(b->refcnt > 0);
+
+    if (--b->refcnt == 0)
+        pool_free(b->pool, b);
+}
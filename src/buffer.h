@@ -0,0 +1,63 @@
+/*
+ * udptunnel : Lightweight TCP over UDP Tunneling
+ *
+ * Copyright (C) 2014 Jingyu jingyu.niu@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __BUFFER_H__
+#define __BUFFER_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "pool.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Reference counted message buffer from a pool. The buffer goes back to
+   its pool when the last reference is released. */
+typedef struct buffer {
+    struct buffer *next;                /* Queue link, owner defined */
+    Pool *pool;
+    int refcnt;
+    uint32_t zc_id;                     /* Last zero copy send id, see
+                                           zerocopy_pending() */
+    int len;                            /* Bytes used in data */
+    int offset;                         /* Bytes already consumed */
+    char data[1];
+} Buffer;
+
+/* Pool object size for buffers of datalen bytes */
+#define BUFFER_SIZE(datalen)            (offsetof(Buffer, data) + (datalen))
+
+Buffer *buffer_alloc(Pool *pool);
+
+Buffer *buffer_ref(Buffer *b);
+
+void buffer_release(Buffer *b);
+
+/* Someone else (e.g. the kernel) still holds a reference */
+static inline int buffer_shared(const Buffer *b)
+{
+    return b->refcnt > 1;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __BUFFER_H__ */
@@ -19,129 +19,404 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
-#include <sys/time.h>
 
 #include "config.h"
 
 #include "message.h"
 #include "log.h"
+#include "dedup.h"
 
 #include "channel.h"
 
-Channel *channel_create_server(Tunnel *t, uint16_t cid,
+/* Compile time checks of the cache lines struct channel says the per
+   message paths read, an array of negative size fails the build. */
+typedef char channel_send_line_check[
+    offsetof(Channel, tcp_sock) + sizeof(SOCKET) <= POOL_CACHELINE ? 1 : -1];
+typedef char channel_receive_line_check[
+    offsetof(Channel, tcp2udp_timeout) + sizeof(uint32_t) <=
+    2 * POOL_CACHELINE ? 1 : -1];
+
+/* Channels and their data buffers come from the tunnel pools, the tunnel
+   is owned by one thread so no locking is needed. */
+static Channel *channel_alloc(Tunnel *t, Peer *peer)
+{
+    Channel *ch = (Channel *)pool_alloc(&t->channel_pool);
+    if (!ch)
+        return NULL;
+
+    memset(ch, 0, sizeof(Channel));
+    ch->tunnel = t;
+    ch->peer = peer_ref(peer);
+    ch->window = 1;
+
+    ch->next = t->channels;
+    if (t->channels)
+        t->channels->prev = ch;
+    t->channels = ch;
+    t->nchannels++;
+
+    ch->peer_next = peer->channels;
+    if (peer->channels)
+        peer->channels->peer_prev = ch;
+    peer->channels = ch;
+    peer->nchannels++;
+    peer->opened++;
+
+    return ch;
+}
+
+static inline ChannelSegment *channel_segment(Channel *ch, uint16_t sn)
+{
+    return (ChannelSegment *)ch->ring->data + (sn & (ch->window - 1));
+}
+
+/* The send ring is allocated on demand and released once the channel has
+   been idle for CHANNEL_HIBERNATE_TIME. A ring still pinned by zero copy
+   sends stays alive until the kernel is done with it. */
+static void channel_release_ring(Channel *ch)
+{
+    ChannelSegment *seg;
+    Peer *peer = ch->peer;
+    uint16_t i;
+
+    for (i = 0; ch->ring && i < ch->inflight; i++) {
+        seg = channel_segment(ch, ch->tcp2udp_una + i);
+        buffer_release(seg->wire);
+
+        /* Not waited for on its path any more */
+        if (!seg->acked && seg->path < peer->npaths)
+            path_forget(&peer->paths[seg->path]);
+    }
+
+    buffer_release(ch->ring);
+    ch->ring = NULL;
+    ch->ring_tail = 0;
+    ch->ring_sent = 0;
+    ch->ring_head = 0;
+    ch->zc_fenced = 0;
+}
+
+static Buffer *channel_get_ring(Channel *ch)
+{
+    if (!ch->ring)
+        ch->ring = buffer_alloc(&ch->tunnel->ring_pool);
+
+    return ch->ring;
+}
+
+/* Ring data at a stream offset */
+static inline char *channel_ring_data(Channel *ch, uint32_t pos)
+{
+    Tunnel *t = ch->tunnel;
+
+    return ch->ring->data + t->window * sizeof(ChannelSegment) +
+           (pos & (t->ring_size - 1));
+}
+
+static inline int channel_ring_full(Channel *ch)
+{
+    return ch->ring_head - ch->ring_tail == ch->tunnel->ring_size;
+}
+
+/* An ACK tells the peer got the data, not that the kernel is done with a
+   zero copy send of it: a resend may still be queued. Neither TCP data
+   nor segment headers go into the space freed by ACKs until the last
+   send of it completed. Returns 1 if the ring space is still pinned. */
+static int channel_ring_pinned(Channel *ch)
+{
+    Zerocopy *zc = &ch->tunnel->zc;
+
+    if (!ch->zc_fenced)
+        return 0;
+
+    if (zerocopy_pending(zc, ch->zc_fence)) {
+        zerocopy_reap(zc);
+        if (zerocopy_pending(zc, ch->zc_fence))
+            return 1;
+    }
+
+    ch->zc_fenced = 0;
+    return 0;
+}
+
+/* Set up and on the opening list from creation until the other end has
+   the channel, a server channel is half open meanwhile */
+static int channel_alloc_setup(Channel *ch)
+{
+    Tunnel *t = ch->tunnel;
+    ChannelSetup *s = (ChannelSetup *)pool_alloc(&t->setup_pool);
+    if (!s)
+        return -1;
+
+    memset(s, 0, sizeof(ChannelSetup));
+    s->next = t->opening;
+    if (t->opening)
+        t->opening->setup->prev = ch;
+    t->opening = ch;
+    ch->setup = s;
+
+    if (ch->mode == CHANNEL_MODE_SERVER)
+        t->half_open++;
+
+    return 0;
+}
+
+static void channel_release_setup(Channel *ch)
+{
+    Tunnel *t = ch->tunnel;
+    ChannelSetup *s = ch->setup;
+
+    if (!s)
+        return;
+
+    if (s->prev)
+        s->prev->setup->next = s->next;
+    else
+        t->opening = s->next;
+    if (s->next)
+        s->next->setup->prev = s->prev;
+
+    if (ch->mode == CHANNEL_MODE_SERVER) {
+        tunnel_forget_open(t, ch);
+        t->half_open--;
+    }
+
+    pool_free(&t->setup_pool, s);
+    ch->setup = NULL;
+}
+
+static void channel_free(Channel *ch)
+{
+    Tunnel *t = ch->tunnel;
+    Peer *peer = ch->peer;
+
+    channel_release_setup(ch);
+    channel_release_ring(ch);
+
+    if (ch->prev)
+        ch->prev->next = ch->next;
+    else
+        t->channels = ch->next;
+    if (ch->next)
+        ch->next->prev = ch->prev;
+    t->nchannels--;
+
+    if (ch->peer_prev)
+        ch->peer_prev->peer_next = ch->peer_next;
+    else
+        peer->channels = ch->peer_next;
+    if (ch->peer_next)
+        ch->peer_next->peer_prev = ch->peer_prev;
+    peer->nchannels--;
+
+    peer_release(t, peer);
+    pool_free(&t->channel_pool, ch);
+}
+
+Channel *channel_create_server(Tunnel *t, uint32_t cid,
                                const char *host, const char *port,
-                               const struct sockaddr *tunnelAddr,
-                               socklen_t addrlen)
+                               Peer *peer)
 {
-    Channel *ch = (Channel *)calloc(1, sizeof(Channel));
+    Channel *ch = channel_alloc(t, peer);
     if (!ch) {
         log_error("New channel(%d), out of memory.", cid);
         return NULL;
     }
 
-    ch->tunnel = t;
     ch->id = cid;
     ch->state = CHANNEL_CONNECTING;
     ch->mode = CHANNEL_MODE_SERVER;
 
-    ch->udp_sock = t->udp_svr_sock;
     ch->tcp_sock = INVALID_SOCKET;
 
-    memcpy(&ch->tunnel_addr, tunnelAddr, addrlen);
-    ch->tunnel_addr_Len = addrlen;
-
     ch->udp2tcp_state = CHANNEL_WAIT_DATA;
     ch->tcp2udp_state = CHANNEL_WAIT_DATA;
 
-    gettimeofday(&ch->keepalive, NULL);
-    ch->keepalive.tv_sec += CHANNEL_KEEPALIVE_TIMEOUT;
+    ch->keepalive = tunnel_clock() + CHANNEL_KEEPALIVE_TIMEOUT * 1000;
 
-    /* store remote host & port in tcp2udp_data temporary */
-    /* Format: host\0port\0 */
-    strcpy(ch->tcp2udp_data, host);
-    strcpy(ch->tcp2udp_data + strlen(host) + 1, port);
+    /* Remote host & port are kept until connected */
+    if (channel_alloc_setup(ch) < 0) {
+        log_error("New channel(%d), out of memory.", cid);
+        channel_free(ch);
+        return NULL;
+    }
+
+    strcpy(ch->setup->host, host);
+    strcpy(ch->setup->port, port);
 
     return ch;
 }
 
-Channel *channel_create_client(Tunnel *t, SOCKET tcp_sock, uint16_t cid,
-                               const struct sockaddr *tunnelAddr,
-                               socklen_t addrlen)
+Channel *channel_create_client(Tunnel *t, SOCKET tcp_sock, uint32_t cid,
+                               Peer *peer)
 {
-    Channel *ch = (Channel *)calloc(1, sizeof(Channel));
+    Channel *ch = channel_alloc(t, peer);
     if (!ch) {
         log_error("New channel(%d), out of memory.", -cid);
         return NULL;
     }
 
-    ch->tunnel = t;
     ch->id = cid;
     ch->state = CHANNEL_CONNECTING;
     ch->mode = CHANNEL_MODE_CLIENT;
 
-    ch->udp_sock = t->udp_svr_sock;
     ch->tcp_sock = tcp_sock;
-
-    memcpy(&ch->tunnel_addr, tunnelAddr, addrlen);
-    ch->tunnel_addr_Len = addrlen;
+    if (tcp_sock != INVALID_SOCKET)
+        socket_set_nonblock(tcp_sock);
 
     ch->udp2tcp_state = CHANNEL_WAIT_DATA;
     ch->tcp2udp_state = CHANNEL_WAIT_DATA;
 
-    gettimeofday(&ch->keepalive, NULL);
-    ch->keepalive.tv_sec += CHANNEL_KEEPALIVE_TIMEOUT;
+    ch->keepalive = tunnel_clock() + CHANNEL_KEEPALIVE_TIMEOUT * 1000;
+
+    if (channel_alloc_setup(ch) < 0) {
+        log_error("New channel(%d), out of memory.", -cid);
+        channel_free(ch);
+        return NULL;
+    }
 
     return ch;
 }
 
-int channel_connect(Channel *ch)
+/* Connected to the remote, the setup may be gone already */
+static int channel_connected(Channel *ch, const char *how)
+{
+    socket_set_nonblock(ch->tcp_sock);
+    tunnel_sockets_clear_write(ch->tunnel, ch->tcp_sock);
+
+    ch->state = CHANNEL_CONNECTED;
+
+    ch->udp2tcp_state = CHANNEL_WAIT_DATA;
+    ch->tcp2udp_state = CHANNEL_WAIT_DATA;
+
+    ch->keepalive = tunnel_clock() + CHANNEL_KEEPALIVE_TIMEOUT * 1000;
+
+    /* Add peer socket to tunnel fdset */
+    tunnel_sockets_set(ch->tunnel, ch->tcp_sock);
+
+    log_info("Channel(%d) %s %s, opened.", ch->id, how,
+             socket_remote_name(ch->tcp_sock));
+
+    /* Early data, or data that overtook the handshake */
+    return channel_udp2tcp_flush(ch);
+}
+
+int channel_connect_start(Channel *ch)
 {
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
     char *host, *port;
 
-    assert(ch->state == CHANNEL_CONNECTING);
+    assert(ch->state == CHANNEL_CONNECTING &&
+           ch->tcp_sock == INVALID_SOCKET);
+
+    host = ch->setup->host;
+    port = ch->setup->port;
+    ch->tcp_sock = prewarm_take(&ch->tunnel->prewarm, host, port,
+                                tunnel_clock());
+    if (ch->tcp_sock != INVALID_SOCKET)
+        return channel_connected(ch, "took a connection to");
+
+    if (socket_resolve(AF_INET, SOCK_STREAM, host, port, &addr,
+                       &addrlen) < 0) {
+        log_error("New channel(%d), %s:%s does not resolve.", ch->id, host,
+                  port);
+        return -1;
+    }
 
-    host = ch->tcp2udp_data;
-    port = host + strlen(host) + 1;
-    ch->tcp_sock = socket_connect(AF_INET, SOCK_STREAM, host, port);
+    ch->tcp_sock = socket_connect_start((struct sockaddr *)&addr, addrlen);
     if (ch->tcp_sock == INVALID_SOCKET) {
         log_error("New channel(%d), connect to %s:%s error:%d.",
                   ch->id, host, port, socket_errno());
         return -1;
     }
 
-    ch->state = CHANNEL_CONNECTED;
+    /* Writable once done */
+    tunnel_sockets_set_write(ch->tunnel, ch->tcp_sock);
+    ch->keepalive = tunnel_clock() + CHANNEL_CONNECT_TIMEOUT * 1000;
 
-    ch->udp2tcp_state = CHANNEL_WAIT_DATA;
-    ch->tcp2udp_state = CHANNEL_WAIT_DATA;
+    log_debug("Channel(%d) connecting to %s:%s.", ch->id, host, port);
+    return 0;
+}
 
-    /* Add peer socket to tunnel fdset */
-    tunnel_sockets_set(ch->tunnel, ch->tcp_sock);
+int channel_connect_done(Channel *ch)
+{
+    int rc;
+
+    assert(ch->state == CHANNEL_CONNECTING &&
+           ch->tcp_sock != INVALID_SOCKET);
+
+    rc = socket_connect_done(ch->tcp_sock);
+    if (rc > 0)
+        return channel_connected(ch, "connected to");
+
+    if (rc < 0) {
+        log_error("Channel(%d) connect to the remote failed.", ch->id);
+        return -1;
+    }
 
-    log_info("Channel(%d) connected to %s:%s, opened.",
-             ch->id, host, port);
+    if (CLOCK_AFTER(tunnel_clock(), ch->keepalive)) {
+        log_error("Channel(%d) connect to the remote timed out.", ch->id);
+        return -1;
+    }
 
     return 0;
 }
 
-/* For client side */
-void channel_opened(Channel *ch, uint16_t new_id)
+void channel_confirmed(Channel *ch)
 {
-    assert(ch->state == CHANNEL_CONNECTING);
+    /* host & port are not needed any more */
+    channel_release_setup(ch);
+}
 
-    /* Add TCP socket to tunnel fdset */
-    tunnel_sockets_set(ch->tunnel, ch->tcp_sock);
+size_t channel_early_data(Channel *ch, const char **data)
+{
+    /* Nothing was sent, the data starts the ring */
+    if (!ch->ring)
+        return 0;
 
-    ch->id = new_id;
+    *data = channel_ring_data(ch, ch->ring_tail);
 
-    ch->state = CHANNEL_CONNECTED;
-    ch->tcp2udp_state = CHANNEL_WAIT_DATA;
-    ch->udp2tcp_state = CHANNEL_WAIT_DATA;
+    return ch->ring_head - ch->ring_tail;
+}
 
-    gettimeofday(&ch->keepalive, NULL);
-    ch->keepalive.tv_sec += CHANNEL_KEEPALIVE_TIME;
+void channel_open_sent(Channel *ch)
+{
+    ChannelSetup *s = ch->setup;
 
-    log_info("Channel(%d) for %s opened.", ch->id,
-             socket_remote_name(ch->tcp_sock));
+    s->sent = tunnel_clock();
+    s->rto = peer_rto(ch->peer);
+    s->timeout = s->sent + s->rto;
+    s->resent = 0;
+}
+
+int channel_open_timeout(Channel *ch, uint32_t now)
+{
+    ChannelSetup *s = ch->setup;
+
+    if (!CLOCK_AFTER(now, s->timeout))
+        return 0;
+
+    if (s->resent >= CHANNEL_OPEN_MAX_RESEND)
+        return -1;
+
+    s->resent++;
+    s->rto = s->rto * 2 < PEER_MAX_RTO ? s->rto * 2 : PEER_MAX_RTO;
+    s->timeout = now + s->rto;
+
+    return 1;
+}
+
+uint32_t channel_open_done(Channel *ch)
+{
+    ChannelSetup *s = ch->setup;
+    uint32_t elapsed = tunnel_clock() - s->sent;
+
+    /* Karn: a resent message leaves it open which one was answered */
+    if (!s->resent)
+        peer_rtt_sample(ch->peer, elapsed);
+
+    return elapsed;
 }
 
 static inline uint16_t channel_next_sn(Channel *ch)
@@ -154,7 +429,20 @@ static inline uint16_t channel_next_sn(Channel *ch)
 
 int channel_socket_isset(Channel *ch, fd_set *fds)
 {
-    return FD_ISSET(ch->tcp_sock, fds);
+    return ch->tcp_sock != INVALID_SOCKET && FD_ISSET(ch->tcp_sock, fds);
+}
+
+int channel_socket_writable(Channel *ch, fd_set *wfds)
+{
+    return ch->udp2tcp_queue && ch->tcp_sock != INVALID_SOCKET &&
+           FD_ISSET(ch->tcp_sock, wfds);
+}
+
+int channel_socket_connecting(Channel *ch, fd_set *wfds)
+{
+    return ch->mode == CHANNEL_MODE_SERVER &&
+           ch->state == CHANNEL_CONNECTING &&
+           ch->tcp_sock != INVALID_SOCKET && FD_ISSET(ch->tcp_sock, wfds);
 }
 
 void channel_mark_to_close(Channel *ch)
@@ -163,32 +451,35 @@ void channel_mark_to_close(Channel *ch)
      log_debug("Channel(%d) requested to close.", ch->id);
 }
 
-static inline int channel_is_timeout(Channel *ch)
+void channel_reset(Channel *ch)
 {
-    struct timeval now;
+    ch->state = CHANNEL_CLOSE;
 
-    gettimeofday(&now, NULL);
-    if (timercmp(&now, &ch->keepalive, >)) {
-        return 1;
-    } else
-        return 0;
+    if (ch->tcp_sock != INVALID_SOCKET)
+        socket_set_abortive(ch->tcp_sock);
+
+    log_info("Channel(%d) reset by the peer.", ch->id);
+}
+
+static inline int channel_is_timeout(Channel *ch)
+{
+    return CLOCK_AFTER(tunnel_clock(), ch->keepalive);
 }
 
 static inline int channel_send_message(Channel *ch, uint8_t type, uint16_t sn,
                                        void *data, size_t len)
 {
-    return message_send(ch->udp_sock, type, ch->id, sn, data, len,
-                       (const struct sockaddr *)&ch->tunnel_addr,
-                        ch->tunnel_addr_Len);
+    return tunnel_send_message(ch->tunnel, ch->peer, type, ch->id, sn,
+                               data, len);
 }
 
-/* For client side: send & update keep-alive */
+/* For client side, to servers without MSG_CAP_KEEPALIVE: send & update
+   keep-alive */
 static int channel_send_keepalive(Channel *ch)
 {
     int rc = 0;
 
-    gettimeofday(&ch->keepalive, NULL);
-    ch->keepalive.tv_sec += CHANNEL_KEEPALIVE_TIME;
+    ch->keepalive = tunnel_clock() + CHANNEL_KEEPALIVE_TIME * 1000;
 
     rc = channel_send_message(ch, MSG_CHANNEL_KEEPALIVE,
                               channel_next_sn(ch), NULL, 0);
@@ -196,175 +487,780 @@ static int channel_send_keepalive(Channel *ch)
         log_warning("Channel(%d) send keep-alive failed, retry later.", ch->id);
         return -1;
     } else {
-        log_info("Channel(%d) send keep-alive.", ch->id);
+        log_debug("Channel(%d) send keep-alive.", ch->id);
     }
 
     return 0;
 }
 
-/* For server side: update keep-alive when received MSG_CHANNEL_KEEPALIVE. */
-static void channel_update_keepalive(Channel *ch)
+static void channel_udp2tcp_clear(Channel *ch)
 {
-    gettimeofday(&ch->keepalive, NULL);
-    ch->keepalive.tv_sec += CHANNEL_KEEPALIVE_TIME;
+    Buffer *buf;
+
+    while (ch->udp2tcp_queue) {
+        buf = ch->udp2tcp_queue;
+        ch->udp2tcp_queue = buf->next;
+        buffer_release(buf);
+    }
+
+    while (ch->udp2tcp_reorder) {
+        buf = ch->udp2tcp_reorder;
+        ch->udp2tcp_reorder = buf->next;
+        buffer_release(buf);
+    }
 
-    log_info("Channel(%d) updated keep-alive.", ch->id);
+    ch->udp2tcp_queued = 0;
 }
 
-/* Call after channel got UDP->TCP data, send it to TCP socket.
-   Returns data length on success;  < 0 if error. */
-static int channel_udp2tcp_data(Channel *ch, uint16_t sn,
-                                const char *data, size_t len)
+/* Close once the data queued for the TCP peer has been written. Returns
+   -1 if the channel can be closed right away. */
+static int channel_linger(Channel *ch, int notify)
+{
+    if (notify && ch->state != CHANNEL_CLOSE)
+        channel_send_message(ch, MSG_CHANNEL_CLOSE,
+                             channel_next_sn(ch), NULL, 0);
+
+    channel_mark_to_close(ch);
+
+    /* Nobody to write to without a TCP peer */
+    if (!ch->udp2tcp_queue || ch->tcp_sock == INVALID_SOCKET)
+        return -1;
+
+    tunnel_sockets_clear(ch->tunnel, ch->tcp_sock);
+    ch->keepalive = tunnel_clock() + CHANNEL_LINGER_TIME * 1000;
+
+    log_debug("Channel(%d) lingering, %d bytes to write.",
+              ch->id, ch->udp2tcp_queued);
+
+    return 0;
+}
+
+/* Write queued UDP->TCP data to the TCP socket without blocking, fully
+   written buffers go back to the pool. Returns 0 on success (maybe with
+   data still queued), -1 on error or when a closed channel is done. */
+int channel_udp2tcp_flush(Channel *ch)
 {
     int rc;
-    int resend = 0;
+    int count;
+    int left;
+    Buffer *buf;
+    const void *bufs[CHANNEL_WRITE_BATCH];
+    size_t lens[CHANNEL_WRITE_BATCH];
+
+    /* Data may overtake the handshake, keep it until connected */
+    if (ch->tcp_sock == INVALID_SOCKET || ch->state == CHANNEL_CONNECTING)
+        return 0;
 
-    assert(ch->udp2tcp_state == CHANNEL_WAIT_DATA);
+    while (ch->udp2tcp_queue) {
+        count = 0;
+        for (buf = ch->udp2tcp_queue; buf && count < CHANNEL_WRITE_BATCH;
+             buf = buf->next) {
+            bufs[count] = buf->data + buf->offset;
+            lens[count] = buf->len - buf->offset;
+            count++;
+        }
 
-    if (ch->udp2tcp_state != CHANNEL_WAIT_DATA) {
-        /* Ingnore the imcoming data. */
-        log_error("Channel(%d) UDP->TCP data, wrong state.", ch->id);
+        rc = socket_sendv(ch->tcp_sock, bufs, lens, count);
+        if (rc < 0) {
+            if (socket_would_block()) {
+                /* Wait for the TCP socket to be writable */
+                tunnel_sockets_set_write(ch->tunnel, ch->tcp_sock);
+                return 0;
+            }
+
+            log_error("Channel(%d) UDP->TCP data send to %s error:%d.",
+                      ch->id, socket_remote_name(ch->tcp_sock),
+                      socket_errno());
+            return -1;
+        }
+
+        log_debug("Channel(%d) UDP->TCP data sent to %s, %d bytes.",
+                  ch->id, socket_remote_name(ch->tcp_sock), rc);
+
+        ch->udp2tcp_queued -= rc;
+
+        while (ch->udp2tcp_queue) {
+            buf = ch->udp2tcp_queue;
+            left = buf->len - buf->offset;
+            if (rc < left) {
+                buf->offset += rc;
+                break;
+            }
+
+            rc -= left;
+            ch->udp2tcp_queue = buf->next;
+            buffer_release(buf);
+        }
+    }
+
+    tunnel_sockets_clear_write(ch->tunnel, ch->tcp_sock);
+
+    return ch->state == CHANNEL_CLOSE ? -1 : 0;
+}
+
+static int channel_udp2tcp_ack(Channel *ch, uint16_t sn)
+{
+    int rc;
+
+    rc = channel_send_message(ch, MSG_CHANNEL_DATA_ACK, sn, NULL, 0);
+    if (rc <= 0) {
+        log_error("Channel(%d) send UDP->TCP data(%d) ack to %s error:%d.", 
+                  ch->id, sn, 
+                  socket_addr_name(peer_addr(ch->peer)),
+                  socket_errno());
         return -1;
     }
 
+    log_debug("Channel(%d) sent UDP->TCP data(%d) ack to %s.", ch->id, sn, 
+              socket_addr_name(peer_addr(ch->peer)));
+
+    return 0;
+}
+
+static void channel_udp2tcp_append(Channel *ch, Buffer *buf)
+{
+    Buffer **tail;
+
+    buf->next = NULL;
+    for (tail = &ch->udp2tcp_queue; *tail; tail = &(*tail)->next)
+        ;
+    *tail = buf;
+}
+
+static inline uint16_t channel_buffer_sn(const Buffer *buf)
+{
+    /* Decoded header is right in front of the queued payload */
+    return ((const Message *)(buf->data + buf->offset -
+                              MESSAGE_HEADER_LEN))->sn;
+}
+
+/* Buffer to queue for data being taken, payload from offset to len,
+   *len is the payload length. Dedup payloads are decoded into a buffer of
+   their own, laid out like a received one. Returns NULL if the data is
+   not taken, it is then not ACKed and resent. */
+static Buffer *channel_udp2tcp_take(Channel *ch, Buffer *buf, size_t *len)
+{
+    Tunnel *t = ch->tunnel;
+    Message *msg = message_of(buf);
+    Buffer *data;
+    int rc;
+
+    if (msg->type != MSG_CHANNEL_DATA_DEDUP) {
+        buf->offset += MESSAGE_HEADER_LEN;
+        buf->len = buf->offset + *len;
+        return buffer_ref(buf);
+    }
+
+    if (!ch->peer->dedup) {
+        log_warning("Channel(%d) UDP->TCP data(%d), no dedup cache.",
+                    ch->id, msg->sn);
+        return NULL;
+    }
+
+    data = buffer_alloc(&t->data_pool);
+    if (!data) {
+        log_warning("Channel(%d) UDP->TCP data(%d), out of buffers.",
+                    ch->id, msg->sn);
+        return NULL;
+    }
+
+    rc = dedup_decode(ch->peer->dedup, msg->data, *len,
+                      data->data + MESSAGE_HEADER_LEN, t->max_payload);
+    if (rc <= 0) {
+        log_warning("Channel(%d) UDP->TCP data(%d), %s dedup data.",
+                    ch->id, msg->sn, rc < 0 ? "malformed" : "unknown");
+        buffer_release(data);
+        return NULL;
+    }
+
+    memcpy(data->data, msg, MESSAGE_HEADER_LEN);
+    ((Message *)data->data)->type = MSG_CHANNEL_DATA;
+    ((Message *)data->data)->length = (uint16_t)rc;
+    data->offset = MESSAGE_HEADER_LEN;
+    data->len = MESSAGE_HEADER_LEN + rc;
+    *len = rc;
+
+    return data;
+}
+
+int channel_take_early_data(Channel *ch, const char *data, size_t len)
+{
+    Buffer *buf;
+    Message *msg;
+
+    buf = buffer_alloc(&ch->tunnel->data_pool);
+    if (!buf) {
+        log_warning("Channel(%d) early data, out of buffers.", ch->id);
+        return 0;
+    }
+
+    /* Laid out like a received message */
+    msg = (Message *)buf->data;
+    memset(msg, 0, MESSAGE_HEADER_LEN);
+    msg->type = MSG_CHANNEL_DATA;
+    msg->channel_id = ch->id;
+    msg->sn = 1;
+    msg->length = (uint16_t)len;
+    memcpy(msg->data, data, len);
+    buf->offset = MESSAGE_HEADER_LEN;
+    buf->len = MESSAGE_HEADER_LEN + len;
+
+    channel_udp2tcp_append(ch, buf);
+    ch->udp2tcp_queued += len;
+    ch->udp2tcp_sn = 1;
+
+    log_debug("Channel(%d) UDP->TCP early data(1), %d bytes.", ch->id,
+              (int)len);
+
+    return channel_udp2tcp_flush(ch) < 0 ? -1 : 1;
+}
+
+/* Stop-and-wait peer: any sn other than the last one is new data. */
+static int channel_udp2tcp_single(Channel *ch, uint16_t sn, Buffer *buf,
+                                  size_t len)
+{
+    Buffer *data = NULL;
+
     if (ch->udp2tcp_sn != sn) {
         /* New data */
+        if (ch->udp2tcp_queued + len > CHANNEL_WRITE_QUEUE_MAX) {
+            /* TCP peer is too slow, no ACK, the data will be resent. */
+            log_debug("Channel(%d) UDP->TCP data(%d), queue full, dropped.",
+                      ch->id, sn);
+            return 0;
+        }
+
+        if (len && !(data = channel_udp2tcp_take(ch, buf, &len)))
+            return 0;
+
         ch->udp2tcp_sn = sn;
         log_debug("Channel(%d) UDP->TCP data(%d), %d bytes.", ch->id, sn, len);
     } else {
         /* Resend data, do not copy it again. */
-        resend = 1;
         log_debug("Channel(%d) UDP->TCP data(%d, resend), %d bytes.", 
                   ch->id, sn, len);
     }
 
-    /* Send ACK */
-    rc = channel_send_message(ch, MSG_CHANNEL_DATA_ACK, sn, NULL, 0);
-    if (rc <= 0) {
-        log_error("Channel(%d) send UDP->TCP data(%d) ack to %s error:%d.", 
-                  ch->id, sn, 
-                  socket_addr_name((const struct sockaddr *)(&ch->tunnel_addr)),
-                  socket_errno());
+    if (channel_udp2tcp_ack(ch, sn) < 0) {
+        buffer_release(data);
         return -1;
-    } else {
-        log_debug("Channel(%d) sent UDP->TCP data(%d) ack to %s.", ch->id, sn, 
-                 socket_addr_name((const struct sockaddr *)(&ch->tunnel_addr)));
     }
 
-    if (!resend) {
-        /* Send data to TCP peer */
-        int bytes_sent = 0;
+    if (data) {
+        /* Hand the buffer over to the TCP write queue */
+        channel_udp2tcp_append(ch, data);
+        ch->udp2tcp_queued += len;
+
+        if (channel_udp2tcp_flush(ch) < 0)
+            return -1;
+    }
+
+    return len;
+}
 
-        while ((size_t)bytes_sent < len) {
-            rc = send(ch->tcp_sock, data + bytes_sent, len - bytes_sent, 0);
-            if (rc <= 0) {
-                log_error("Channel(%d) UDP->TCP data(%d) send to %s error:%d.", 
-                          ch->id, sn, socket_remote_name(ch->tcp_sock),
-                          socket_errno());
-                return -1;
+/* Windowed peer: data sn are consecutive, anything within the window
+   ahead of the next expected sn is ACKed and kept until the gap is
+   filled. */
+static int channel_udp2tcp_window(Channel *ch, uint16_t sn, Buffer *buf,
+                                  size_t len)
+{
+    uint16_t next = ch->udp2tcp_sn + 1;
+    uint16_t ahead = sn - next;
+    Buffer *data;
+    Buffer **p;
+
+    if (ahead >= ch->window) {
+        if ((uint16_t)(next - sn) <= 0x8000) {
+            /* Taken already, the ACK was lost */
+            log_debug("Channel(%d) UDP->TCP data(%d, resend), %d bytes.",
+                      ch->id, sn, len);
+            return channel_udp2tcp_ack(ch, sn) < 0 ? -1 : 0;
+        }
 
-            }
+        log_debug("Channel(%d) UDP->TCP data(%d), beyond window, dropped.",
+                  ch->id, sn);
+        return 0;
+    }
 
-            log_debug("Channel(%d) UDP->TCP data(%d) sent to %s, %d bytes.", 
-                      ch->id, sn, socket_remote_name(ch->tcp_sock), rc);
+    for (p = &ch->udp2tcp_reorder; *p; p = &(*p)->next) {
+        uint16_t pos = channel_buffer_sn(*p) - next;
 
-            bytes_sent += rc;
+        if (pos == ahead) {
+            /* Held already, the ACK was lost */
+            return channel_udp2tcp_ack(ch, sn) < 0 ? -1 : 0;
         }
+
+        if (pos > ahead)
+            break;
+    }
+
+    /* The data filling a gap is always taken, held data may fill the queue
+       on its own with large messages. */
+    if (ch->udp2tcp_queued + len > CHANNEL_WRITE_QUEUE_MAX &&
+        (ahead || !ch->udp2tcp_reorder)) {
+        /* TCP peer is too slow, no ACK, the data will be resent. */
+        log_debug("Channel(%d) UDP->TCP data(%d), queue full, dropped.",
+                  ch->id, sn);
+        return 0;
+    }
+
+    data = channel_udp2tcp_take(ch, buf, &len);
+    if (!data)
+        return 0;
+
+    log_debug("Channel(%d) UDP->TCP data(%d), %d bytes%s.", ch->id, sn, len,
+              ahead ? ", out of order" : "");
+
+    if (channel_udp2tcp_ack(ch, sn) < 0) {
+        buffer_release(data);
+        return -1;
+    }
+
+    data->next = *p;
+    *p = data;
+    ch->udp2tcp_queued += len;
+
+    /* Move what is in order now to the write queue */
+    while (ch->udp2tcp_reorder &&
+           channel_buffer_sn(ch->udp2tcp_reorder) == next) {
+        buf = ch->udp2tcp_reorder;
+        ch->udp2tcp_reorder = buf->next;
+        channel_udp2tcp_append(ch, buf);
+        ch->udp2tcp_sn = next++;
     }
 
+    if (channel_udp2tcp_flush(ch) < 0)
+        return -1;
+
     return len;
 }
 
-/* Call after got ACK for TCP->UDP data.
-   Returns 0 is no erro, or <0 on error */
-static int channel_tcp2udp_data_ack(Channel *ch, uint16_t sn)
+/* Call after channel got UDP->TCP data, the message buffer is queued for
+   the TCP socket as is.
+   Returns data length on success;  < 0 if error. */
+static int channel_udp2tcp_data(Channel *ch, uint16_t sn, Buffer *buf,
+                                size_t len)
 {
-    if (ch->tcp2udp_state != CHANNEL_WAIT_DATA_ACK) {
-        /* Ignore */
-        log_warning("Channel(%d) TCP->UDP data(%d) ack, wrong state. Ignored.",
-                    ch->id, sn);
-        return 0;
+    assert(ch->udp2tcp_state == CHANNEL_WAIT_DATA);
+
+    if (ch->udp2tcp_state != CHANNEL_WAIT_DATA) {
+        /* Ingnore the imcoming data. */
+        log_error("Channel(%d) UDP->TCP data, wrong state.", ch->id);
+        return -1;
     }
 
-    if (ch->tcp2udp_sn != sn) {
-        /* Ignore */
-        log_warning("Channel(%d) TCP->UDP data ack, "
-                    "wrong sn(%d expected, %d reveived). Ignored.",
-                    ch->id, ch->tcp2udp_sn, sn);
+    if (ch->state == CHANNEL_CLOSE)
         return 0;
+
+    if (ch->window > 1)
+        return channel_udp2tcp_window(ch, sn, buf, len);
+
+    return channel_udp2tcp_single(ch, sn, buf, len);
+}
+
+/* Decompress a data message into a buffer of its own, laid out like a
+   received one. Returns NULL if it is malformed or out of buffers, the
+   data is then dropped and resent. */
+static Buffer *channel_inflate(Channel *ch, const Message *msg)
+{
+    Tunnel *t = ch->tunnel;
+    uint64_t start = tunnel_clock_us();
+    Buffer *buf;
+    int rc;
+
+    buf = buffer_alloc(&t->data_pool);
+    if (!buf) {
+        log_warning("Channel(%d) UDP->TCP data(%d), out of buffers.",
+                    ch->id, msg->sn);
+        return NULL;
     }
 
-    log_debug("Channel(%d) TCP->UDP data(%d) ack.", ch->id, sn);
+    rc = decompress_block(msg->data, msg->length,
+                          buf->data + MESSAGE_HEADER_LEN, t->max_payload);
+    if (rc < 0) {
+        log_warning("Channel(%d) UDP->TCP data(%d), malformed compressed "
+                    "data.", ch->id, msg->sn);
+        buffer_release(buf);
+        return NULL;
+    }
 
-    /* reset tcp2udp states */
-    ch->tcp2udp_state = CHANNEL_WAIT_DATA;
+    memcpy(buf->data, msg, MESSAGE_HEADER_LEN);
+    ((Message *)buf->data)->flags &= ~MSG_FLAG_COMPRESSED;
+    ((Message *)buf->data)->length = (uint16_t)rc;
+    buf->len = MESSAGE_HEADER_LEN + rc;
 
-    /* Add TCP socket to tunnel fdset again */
-    tunnel_sockets_set(ch->tunnel, ch->tcp_sock);
+    ch->inflate.in += msg->length;
+    ch->inflate.out += rc;
+    ch->inflate.blocks++;
+    ch->inflate.usec += tunnel_clock_us() - start;
 
-    return 0;
+    return buf;
 }
 
-/* Returns the number of bytes sent, 0 if no data to send or waiting for ACK, 
-   -1 if error */
-static int channel_send_tcp2udp_data(Channel *ch)
+static int channel_udp2tcp_compressed(Channel *ch, const Message *msg)
 {
+    Buffer *buf;
     int rc;
 
-    if (ch->tcp2udp_data_len == 0)
+    buf = channel_inflate(ch, msg);
+    if (!buf)
         return 0;
 
-    if (ch->tcp2udp_resent >= CHANNEL_DATA_MAX_RESEND) {
-        log_error("Channel(%d) TCP->UDP data(%d) resend to %s, "
-                 "too many retries.",
-                 ch->id, ch->tcp2udp_sn, 
-                 socket_addr_name((const struct sockaddr *)(&ch->tunnel_addr)));
-        return -1;
-    }
+    rc = channel_udp2tcp_data(ch, msg->sn, buf,
+                              buf->len - MESSAGE_HEADER_LEN);
+    buffer_release(buf);
+
+    return rc;
+}
+
+/* Sent by the path the peer has room on, a resend by another one than
+   last time if it can */
+static int channel_send_segment(Channel *ch, ChannelSegment *seg)
+{
+    Peer *peer = ch->peer;
+    uint32_t now = tunnel_clock();
+    uint16_t sn = seg->sn;
+    int path = -1;
+    int rc;
 
-    rc = channel_send_message(ch, MSG_CHANNEL_DATA, ch->tcp2udp_sn, 
-                              ch->tcp2udp_data, ch->tcp2udp_data_len);
+    if (peer->paths) {
+        path = path_pick(peer->paths, peer->npaths,
+                         seg->resent ? seg->path : -1);
+        path_sent(&peer->paths[path], now);
+    }
+    seg->path = (uint8_t)(path < 0 ? 0 : path);
+    seg->sent = now;
+
+    /* Header was encoded when the segment was cut, resend it as is. */
+    if (seg->wire) {
+        rc = tunnel_sendv(ch->tunnel, peer, path, &seg->hdr,
+                          seg->wire->data, seg->size, seg->wire);
+        seg->zc_id = seg->wire->zc_id;
+    } else {
+        rc = tunnel_sendv(ch->tunnel, peer, path, &seg->hdr,
+                          channel_ring_data(ch, seg->pos), seg->size,
+                          ch->ring);
+        seg->zc_id = ch->ring->zc_id;
+    }
     if (rc <= 0) {
         log_error("Channel(%d) TCP->UDP data(%d) %s to %s error:%d.", ch->id, 
-                  ch->tcp2udp_sn, ch->tcp2udp_resent ? "resend" : "send",
-                  socket_addr_name((const struct sockaddr *)(&ch->tunnel_addr)),
+                  sn, seg->resent ? "resend" : "send",
+                  socket_addr_name(peer_addr(ch->peer)),
                   socket_errno());
         return -1;
     }
 
-    log_debug("Channel(%d)  TCP->UDP data(%d) %s to %s.",
-              ch->id, ch->tcp2udp_sn,
-              ch->tcp2udp_resent ? "resent" : "sent",
-              socket_addr_name((const struct sockaddr *)(&ch->tunnel_addr)));
-
-    ch->tcp2udp_state = CHANNEL_WAIT_DATA_ACK;
+    log_debug("Channel(%d) TCP->UDP data(%d) %s to %s, %d bytes.",
+              ch->id, sn, seg->resent ? "resent" : "sent",
+              socket_addr_name(peer_addr(ch->peer)), seg->size);
 
-    gettimeofday(&ch->tcp2udp_timeout, NULL);
-    ch->tcp2udp_timeout.tv_sec += (ch->tcp2udp_resent+1)*CHANNEL_DATA_TIMEOUT;
+    /* Over paths, a message late by the round trip of its own goes
+       again by another, the resends back off as for a single one */
+    if (path >= 0 && !seg->resent)
+        seg->timeout = now + path_rto(&peer->paths[path]);
+    else
+        seg->timeout = now + (seg->resent + 1) * CHANNEL_DATA_TIMEOUT * 1000;
 
     return rc;
 }
 
-/* Returns the number of bytes sent, 0 if no data to send or waiting for ACK, 
-   -1 if error */
+/* Compress a new segment's payload in place, resends send it as is.
+   Returns the payload size on the wire. */
+static uint16_t channel_deflate(Channel *ch, char *data, uint16_t len,
+                                uint8_t *flags)
+{
+    Tunnel *t = ch->tunnel;
+    uint64_t start = tunnel_clock_us();
+    size_t size = 0;
+    Buffer *tmp;
+
+    if (ch->deflate_skip) {
+        ch->deflate_skip--;
+    } else if (len >= COMPRESS_MIN_LEN && compress_worth(data, len)) {
+        /* Worth it only if it saves 1/16 at least */
+        tmp = buffer_alloc(&t->data_pool);
+        if (tmp) {
+            size = compress_block(&t->compressor, data, len, tmp->data,
+                                  len - len / 16);
+            if (size)
+                memcpy(data, tmp->data, size);
+            else
+                ch->deflate_skip = CHANNEL_DEFLATE_BACKOFF;
+            buffer_release(tmp);
+        }
+    }
+
+    ch->deflate.in += len;
+    ch->deflate.usec += tunnel_clock_us() - start;
+
+    if (!size) {
+        ch->deflate.out += len;
+        ch->deflate.skipped++;
+        return len;
+    }
+
+    ch->deflate.out += size;
+    ch->deflate.blocks++;
+    *flags |= MSG_FLAG_COMPRESSED;
+
+    return (uint16_t)size;
+}
+
+/* Leave out chunks the peer holds already. The payload goes into a
+   buffer of its own and may take more ring data than fits on the wire.
+   end is the ring data up to the end of the ring. Returns 0 if the
+   segment is to be sent as is. */
+static int channel_dedup(Channel *ch, ChannelSegment *seg, uint32_t end)
+{
+    Tunnel *t = ch->tunnel;
+    Peer *peer = ch->peer;
+    DedupBlock b;
+    size_t size;
+    Buffer *wire;
+
+    b.data = channel_ring_data(ch, seg->pos);
+    b.len = end;
+    if (b.len > (size_t)peer->pmtu.ceiling + DEDUP_MAX_CHUNK)
+        b.len = (size_t)peer->pmtu.ceiling + DEDUP_MAX_CHUNK;
+    b.max = peer->pmtu.ceiling;
+    b.more = b.len < ch->ring_head - ch->ring_sent || !ch->tcp2udp_eof;
+    b.lead = ch->dedup_lead;
+
+    if (b.len < DEDUP_MIN_CHUNK && !b.lead)
+        return 0;
+
+    wire = buffer_alloc(&t->data_pool);
+    if (!wire)
+        return 0;
+
+    size = dedup_encode(peer->dedup, &b, wire->data, peer->pmtu.size,
+                        tunnel_clock());
+    if (!size) {
+        buffer_release(wire);
+        return 0;
+    }
+
+    seg->wire = wire;
+    seg->len = (uint16_t)b.taken;
+    seg->size = (uint16_t)size;
+    seg->store_seq = b.first;
+    seg->stores = b.count;
+    ch->dedup_lead = b.lead;
+
+    return 1;
+}
+
+/* Cut the unsent ring data into messages while the window allows.
+   Returns 0 on success, -1 if error */
+static int channel_send_tcp2udp_data(Channel *ch)
+{
+    Tunnel *t = ch->tunnel;
+    ChannelSegment *seg;
+    uint32_t len;
+    uint32_t end;
+    uint16_t sn;
+    uint8_t type;
+    uint8_t flags;
+    char *data;
+
+    while (ch->inflight < ch->window && ch->ring_sent != ch->ring_head) {
+        /* Retried on the next idle check */
+        if (channel_ring_pinned(ch))
+            break;
+
+        /* The path weights pace the sends of a bonded peer, a channel
+           with nothing in flight always gets one out. */
+        if (ch->peer->paths && ch->inflight &&
+            !path_room(ch->peer->paths, ch->peer->npaths))
+            break;
+
+        /* A message never wraps around the end of the ring */
+        len = ch->ring_head - ch->ring_sent;
+        end = t->ring_size - (ch->ring_sent & (t->ring_size - 1));
+        if (len > end)
+            len = end;
+
+        /* Windowed data sn are consecutive, a stop-and-wait peer takes the
+           channel sn. */
+        sn = ch->window > 1 ? ch->tcp2udp_sn + 1 : channel_next_sn(ch);
+
+        seg = channel_segment(ch, sn);
+        seg->pos = ch->ring_sent;
+        seg->resent = 0;
+        seg->acked = 0;
+        seg->sn = sn;
+        seg->stores = 0;
+        seg->wire = NULL;
+
+        /* Sent with the request before, the same bytes again */
+        if (ch->early && len > ch->early)
+            len = ch->early;
+
+        type = MSG_CHANNEL_DATA;
+        if (!ch->early && (ch->peer->caps & MSG_CAP_DEDUP) &&
+            channel_dedup(ch, seg, len)) {
+            type = MSG_CHANNEL_DATA_DEDUP;
+            data = seg->wire->data;
+        } else {
+            if (len > ch->peer->pmtu.size)
+                len = ch->peer->pmtu.size;
+            seg->len = (uint16_t)len;
+            seg->size = seg->len;
+            data = channel_ring_data(ch, seg->pos);
+            ch->dedup_lead = ch->dedup_lead > len ? ch->dedup_lead - len : 0;
+        }
+        ch->early = 0;
+
+        flags = 0;
+        if (ch->peer->caps & MSG_CAP_COMPRESS)
+            seg->size = channel_deflate(ch, data, seg->size, &flags);
+
+        message_init_header(&seg->hdr, ch->peer->version, type, flags,
+                            ch->id, sn, seg->size);
+
+        if (ch->inflight++ == 0)
+            ch->tcp2udp_una = sn;
+        ch->tcp2udp_sn = sn;
+        ch->ring_sent += seg->len;
+
+        if (channel_send_segment(ch, seg) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+/* Call after got ACK for TCP->UDP data.
+   Returns 0 on success, -1 if error or the channel is to be closed */
+static int channel_tcp2udp_data_ack(Channel *ch, uint16_t sn)
+{
+    ChannelSegment *seg;
+
+    if ((uint16_t)(sn - ch->tcp2udp_una) >= ch->inflight ||
+        channel_segment(ch, sn)->acked) {
+        log_debug("Channel(%d) TCP->UDP data(%d) ack, not in flight. "
+                  "Ignored.", ch->id, sn);
+        return 0;
+    }
+
+    log_debug("Channel(%d) TCP->UDP data(%d) ack.", ch->id, sn);
+
+    seg = channel_segment(ch, sn);
+    seg->acked = 1;
+
+    /* The round trip of a resent one tells nothing */
+    if (seg->path < ch->peer->npaths)
+        path_acked(&ch->peer->paths[seg->path],
+                   seg->resent ? 0 : tunnel_clock() - seg->sent,
+                   tunnel_clock());
+
+    /* The peer holds what the message stored now */
+    if (seg->wire) {
+        dedup_confirm(ch->peer->dedup, seg->store_seq, seg->stores);
+        buffer_release(seg->wire);
+        seg->wire = NULL;
+    }
+
+    /* Slide the window over the ACKed head */
+    while (ch->inflight) {
+        seg = channel_segment(ch, ch->tcp2udp_una);
+        if (!seg->acked)
+            break;
+
+        /* A send by copy leaves an older id, waiting for it is safe */
+        if (zerocopy_busy(&ch->tunnel->zc) &&
+            (!ch->zc_fenced || (int32_t)(seg->zc_id - ch->zc_fence) > 0)) {
+            ch->zc_fence = seg->zc_id;
+            ch->zc_fenced = 1;
+        }
+
+        ch->ring_tail += seg->len;
+        ch->tcp2udp_una++;
+        ch->inflight--;
+    }
+
+    if (ch->ring_tail == ch->ring_head) {
+        if (ch->tcp2udp_eof)
+            return channel_linger(ch, 1);
+
+        /* Keep the ring for a while, the next read is likely to come
+           soon. */
+        ch->tcp2udp_timeout = tunnel_clock() + CHANNEL_HIBERNATE_TIME * 1000;
+    }
+
+    if (ch->tcp2udp_state == CHANNEL_WAIT_DATA_ACK && !ch->tcp2udp_eof &&
+        !channel_ring_full(ch)) {
+        /* Add TCP socket to tunnel fdset again */
+        ch->tcp2udp_state = CHANNEL_WAIT_DATA;
+        tunnel_sockets_set(ch->tunnel, ch->tcp_sock);
+    }
+
+    return channel_send_tcp2udp_data(ch);
+}
+
+/* Returns 0 on success, -1 if error */
 static int channel_check_and_resend_tcp2udp_data(Channel *ch)
 {
-    int rc = 0;
-    struct timeval now;
+    ChannelSegment *seg;
+    uint32_t now = tunnel_clock();
+    uint16_t i;
+
+    if (ch->tcp2udp_state == CHANNEL_WAIT_BUFFER) {
+        /* Try again to read TCP data */
+        ch->tcp2udp_state = CHANNEL_WAIT_DATA;
+        tunnel_sockets_set(ch->tunnel, ch->tcp_sock);
+        return 0;
+    }
+
+    for (i = 0; i < ch->inflight; i++) {
+        seg = channel_segment(ch, ch->tcp2udp_una + i);
+        if (seg->acked || !CLOCK_AFTER(now, seg->timeout))
+            continue;
+
+        if (seg->resent >= CHANNEL_DATA_MAX_RESEND) {
+            log_error("Channel(%d) TCP->UDP data(%d) resend to %s, "
+                     "too many retries.",
+                     ch->id, seg->sn,
+                     socket_addr_name(peer_addr(ch->peer)));
+            return -1;
+        }
 
-    gettimeofday(&now, NULL);
-    if((ch->tcp2udp_state == CHANNEL_WAIT_DATA_ACK) &&
-            timercmp(&now, &ch->tcp2udp_timeout, >)) {
-        ch->tcp2udp_resent++;
-        rc = channel_send_tcp2udp_data(ch);
+        if (seg->path < ch->peer->npaths)
+            path_lost(&ch->peer->paths[seg->path], now);
+
+        /* Segments already cut keep their size, later ones get smaller */
+        if (++seg->resent == PMTU_BLACK_HOLE_RESENDS &&
+            seg->size > ch->peer->pmtu.base)
+            pmtu_black_hole(&ch->peer->pmtu, now);
+
+        if (channel_send_segment(ch, seg) < 0)
+            return -1;
     }
 
-    return rc;
+    /* Data held back for a zero copy send */
+    if (ch->zc_fenced && !ch->setup && ch->ring_sent != ch->ring_head &&
+        !channel_ring_pinned(ch) && channel_send_tcp2udp_data(ch) < 0)
+        return -1;
+
+    if (ch->ring && ch->ring_tail == ch->ring_head &&
+        ch->state == CHANNEL_CONNECTED && !ch->tcp2udp_eof &&
+        CLOCK_AFTER(now, ch->tcp2udp_timeout)) {
+        /* Hibernate: idle channel gives its ring back */
+        channel_release_ring(ch);
+        log_debug("Channel(%d) hibernated.", ch->id);
+    }
+
+    return 0;
 }
 
-/* Returns the number of bytes got, 0 if peer socket is closed. <0 if error */
+/* Drain the TCP socket into the send ring, as much as the ring takes.
+   Returns > 0 on success, 0 if the channel is to be closed, < 0 if error */
 int channel_tcp2udp_data(Channel *ch)
 {
+    Tunnel *t = ch->tunnel;
+    uint32_t space;
+    uint32_t end;
+    int total = 0;
     int rc;
 
     assert(ch->tcp2udp_state == CHANNEL_WAIT_DATA);
@@ -374,49 +1270,183 @@ int channel_tcp2udp_data(Channel *ch)
         return -1;
     }
 
-    rc = recv(ch->tcp_sock, ch->tcp2udp_data, sizeof(ch->tcp2udp_data), 0);
-    if (rc == 0) {
-        log_debug("Channel(%d) associated TCP socket closed.", ch->id);
-        return 0;
-    } else if (rc < 0) {
+    if (!channel_get_ring(ch)) {
+        /* Buffer budget exhausted, retry on next idle check */
+        log_warning("Channel(%d) TCP->UDP data, out of buffers.", ch->id);
+        ch->tcp2udp_state = CHANNEL_WAIT_BUFFER;
+        tunnel_sockets_clear(t, ch->tcp_sock);
+        return 1;
+    }
+
+    if (channel_ring_pinned(ch)) {
+        /* The same as out of buffers, the kernel is done soon */
+        log_debug("Channel(%d) TCP->UDP data, ring pinned by zero copy.",
+                  ch->id);
+        ch->tcp2udp_state = CHANNEL_WAIT_BUFFER;
+        tunnel_sockets_clear(t, ch->tcp_sock);
+        return 1;
+    }
+
+    while (!channel_ring_full(ch)) {
+        space = t->ring_size - (ch->ring_head - ch->ring_tail);
+        end = t->ring_size - (ch->ring_head & (t->ring_size - 1));
+        if (space > end)
+            space = end;
+
+        rc = recv(ch->tcp_sock, channel_ring_data(ch, ch->ring_head),
+                  space, 0);
+        if (rc == 0) {
+            log_debug("Channel(%d) associated TCP socket closed.", ch->id);
+            ch->tcp2udp_eof = 1;
+            break;
+        } else if (rc < 0) {
+            if (socket_would_block())
+                break;
 #if defined(_WIN32) || defined(_WIN64)
-        if (WSAGetLastError() == WSAECONNRESET) {
-            log_debug("Channel(%d) associated TCP socket reseted.", ch->id);
-            return 0;
-        }
+            if (WSAGetLastError() == WSAECONNRESET) {
+                log_debug("Channel(%d) associated TCP socket reseted.",
+                          ch->id);
+                return 0;
+            }
 #endif
-        log_error("Channel(%d) associated TCP socket read error:%d.",
-                  ch->id, socket_errno());
+            log_error("Channel(%d) TCP->UDP data receive error:%d.",
+                      ch->id, socket_errno());
+            return -1;
+        }
+
+        ch->ring_head += rc;
+        total += rc;
+
+        if ((uint32_t)rc < space)
+            break;
+    }
+
+    log_debug("Channel(%d) TCP->UDP data, %d bytes read, %d in ring.",
+              ch->id, total, ch->ring_head - ch->ring_tail);
+
+    if (ch->tcp2udp_eof || channel_ring_full(ch)) {
+        /* Remove TCP socket from tunnel fdset until ACKs free the ring */
+        ch->tcp2udp_state = CHANNEL_WAIT_DATA_ACK;
+        tunnel_sockets_clear(t, ch->tcp_sock);
+    }
+
+    /* Fast open, kept until the server has the channel */
+    if (ch->setup && ch->mode == CHANNEL_MODE_CLIENT)
+        return 1;
+
+    if (channel_send_tcp2udp_data(ch) < 0)
         return -1;
+
+    if (ch->tcp2udp_eof && ch->ring_tail == ch->ring_head)
+        return channel_linger(ch, 1) < 0 ? 0 : 1;
+
+    return 1;
+}
+
+/* For client side */
+int channel_opened(Channel *ch, uint32_t new_id, uint16_t early)
+{
+    ChannelSetup *s = ch->setup;
+    int taken = s->early && early == s->early;
+
+    assert(ch->state == CHANNEL_CONNECTING);
+
+    ch->id = new_id;
+
+    ch->state = CHANNEL_CONNECTED;
+    ch->udp2tcp_state = CHANNEL_WAIT_DATA;
+
+    ch->keepalive = tunnel_clock() + CHANNEL_KEEPALIVE_TIME * 1000;
+
+    if (taken) {
+        /* Data message 1 went with the request */
+        ch->ring_tail = early;
+        ch->ring_sent = early;
+        if (ch->window > 1)
+            ch->tcp2udp_sn = 1;
+        else
+            ch->sn = 1;
+    } else {
+        ch->early = s->early;
     }
 
-    ch->tcp2udp_data_len = rc;
-    ch->tcp2udp_sn = channel_next_sn(ch);
-    ch->tcp2udp_resent = 0;
+    channel_release_setup(ch);
 
-    log_debug("Channel(%d) TCP->UDP data(%d), %d bytes.", ch->id, 
-              ch->tcp2udp_sn, ch->tcp2udp_data_len);
+    /* Opened ahead into the pool, no connection yet */
+    if (ch->tcp_sock == INVALID_SOCKET) {
+        log_debug("Channel(%d) opened ahead.", ch->id);
+        return 0;
+    }
 
-    /* Remove TCP socket from tunnel fdset. */
-    tunnel_sockets_clear(ch->tunnel, ch->tcp_sock);
+    log_info("Channel(%d) for %s opened%s.", ch->id,
+             socket_remote_name(ch->tcp_sock),
+             taken ? ", early data taken" : "");
+
+    /* Fast open reads while opening, until the ring is full or the TCP
+       peer is done */
+    if (ch->tcp2udp_state == CHANNEL_WAIT_DATA)
+        tunnel_sockets_set(ch->tunnel, ch->tcp_sock);
+
+    if (!ch->ring)
+        return 0;
+
+    if (ch->ring_tail == ch->ring_head) {
+        if (ch->tcp2udp_eof)
+            return channel_linger(ch, 1);
+
+        ch->tcp2udp_timeout = tunnel_clock() +
+                              CHANNEL_HIBERNATE_TIME * 1000;
+    }
 
     return channel_send_tcp2udp_data(ch);
 }
 
-int channel_handle_message(Channel *ch, Message *msg)
+/* For client side */
+int channel_bind(Channel *ch, SOCKET tcp_sock)
+{
+    assert(ch->state == CHANNEL_CONNECTED &&
+           ch->tcp_sock == INVALID_SOCKET);
+
+    ch->tcp_sock = tcp_sock;
+    socket_set_nonblock(tcp_sock);
+
+    tunnel_sockets_set(ch->tunnel, tcp_sock);
+
+    log_info("Channel(%d) for %s opened ahead, taken.", ch->id,
+             socket_remote_name(tcp_sock));
+
+    /* What the remote sent first is waiting */
+    return channel_udp2tcp_flush(ch);
+}
+
+int channel_handle_message(Channel *ch, Message *msg, Buffer *buf)
 {
     int rc = 0;
 
     assert(msg->channel_id == ch->id);
 
+    if ((msg->flags & MSG_FLAG_ACK) &&
+        channel_tcp2udp_data_ack(ch, (uint16_t)msg->ack) < 0)
+        return -1;
+
     switch (msg->type) {
     case MSG_CHANNEL_KEEPALIVE:
-        /* For server side. */
-        channel_update_keepalive(ch);
+        /* For server side, from older clients. The peer was heard. */
         break;
 
     case MSG_CHANNEL_DATA:
-        rc = channel_udp2tcp_data(ch, msg->sn, msg->data, msg->length);
+    case MSG_CHANNEL_DATA_DEDUP:
+        if (msg->flags & MSG_FLAG_COMPRESSED) {
+            rc = channel_udp2tcp_compressed(ch, msg);
+            break;
+        }
+
+        if (ch->peer->caps & MSG_CAP_COMPRESS) {
+            ch->inflate.in += msg->length;
+            ch->inflate.out += msg->length;
+            ch->inflate.skipped++;
+        }
+        rc = channel_udp2tcp_data(ch, msg->sn, buf, msg->length);
         break;
 
     case MSG_CHANNEL_DATA_ACK:
@@ -424,8 +1454,8 @@ int channel_handle_message(Channel *ch, Message *msg)
         break;
 
     case MSG_CHANNEL_CLOSE:
-        channel_mark_to_close(ch);
-        rc = -1; /* Tunnel will close current channel. */
+        /* Tunnel will close current channel once written out. */
+        rc = channel_linger(ch, 0);
         break;
     }
 
@@ -434,16 +1464,47 @@ int channel_handle_message(Channel *ch, Message *msg)
 
 int channel_idle(Channel *ch)
 {
-    if (channel_is_timeout(ch)) {
-        if (ch->mode == CHANNEL_MODE_CLIENT)
-            channel_send_keepalive(ch);
-        else
-            return -1; /* Tunnel will close current channel. */
+    if (ch->state == CHANNEL_CLOSE) {
+        /* Lingering, give up on a TCP peer that does not read */
+        return channel_is_timeout(ch) ? -1 : 0;
     }
 
+    /* Connect failures are not always told by select() */
+    if (ch->mode == CHANNEL_MODE_SERVER && ch->state == CHANNEL_CONNECTING &&
+        ch->tcp_sock != INVALID_SOCKET)
+        return channel_connect_done(ch) < 0 ? -1 : 0;
+
+    /* Liveness is the peer's, the tunnel closes the channels of a peer
+       gone quiet */
+    if (ch->mode == CHANNEL_MODE_CLIENT &&
+        !(ch->peer->caps & MSG_CAP_KEEPALIVE) && channel_is_timeout(ch))
+        channel_send_keepalive(ch);
+
     return channel_check_and_resend_tcp2udp_data(ch);
 }
 
+int channel_path_down(Channel *ch, int path)
+{
+    ChannelSegment *seg;
+    uint16_t i;
+    int n = 0;
+
+    for (i = 0; i < ch->inflight; i++) {
+        seg = channel_segment(ch, ch->tcp2udp_una + i);
+        if (seg->acked || seg->path != path)
+            continue;
+
+        path_forget(&ch->peer->paths[path]);
+        if (seg->resent < CHANNEL_DATA_MAX_RESEND)
+            seg->resent++;
+
+        if (channel_send_segment(ch, seg) > 0)
+            n++;
+    }
+
+    return n;
+}
+
 void channel_close(Channel *ch)
 {
     assert(ch);
@@ -455,10 +1516,36 @@ void channel_close(Channel *ch)
 
     if (ch->tcp_sock != INVALID_SOCKET) {
         tunnel_sockets_clear(ch->tunnel, ch->tcp_sock);
+        tunnel_sockets_clear_write(ch->tunnel, ch->tcp_sock);
         socket_close(ch->tcp_sock);
     }
 
+    channel_udp2tcp_clear(ch);
+
+    channel_log_stats(ch);
     log_info("Channel(%d) closed.", ch->id);
 
-    free(ch);
+    channel_free(ch);
+}
+
+static void channel_log_compress_stats(Channel *ch, const char *what,
+                                       const CompressStats *cs,
+                                       uint64_t raw, uint64_t wire)
+{
+    log_info("Channel(%d) %s %llu bytes to %llu, %.1f%% on the wire, "
+             "%lu messages, %lu as is, %llu us.", ch->id, what,
+             (unsigned long long)cs->in, (unsigned long long)cs->out,
+             raw ? wire * 100.0 / raw : 100.0,
+             (unsigned long)cs->blocks, (unsigned long)cs->skipped,
+             (unsigned long long)cs->usec);
+}
+
+void channel_log_stats(Channel *ch)
+{
+    if (ch->deflate.in)
+        channel_log_compress_stats(ch, "compressed", &ch->deflate,
+                                   ch->deflate.in, ch->deflate.out);
+    if (ch->inflate.in)
+        channel_log_compress_stats(ch, "decompressed", &ch->inflate,
+                                   ch->inflate.out, ch->inflate.in);
 }
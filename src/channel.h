@@ -23,6 +23,8 @@
 
 #include "socket.h"
 #include "message.h"
+#include "buffer.h"
+#include "peer.h"
 #include "tunnel_i.h"
 
 #ifdef __cplusplus
@@ -35,7 +37,12 @@ extern "C" {
 /* Channel data max resend */
 #define CHANNEL_DATA_MAX_RESEND             10
 
-/* Channel keep-alive time */
+/* New channel request or ack sent again, backing off from the peer's
+   RTO, see peer_rto(). The channel is given up after that. */
+#define CHANNEL_OPEN_MAX_RESEND             6
+
+/* Channel keep-alive time, for servers without MSG_CAP_KEEPALIVE only.
+   Others take the peer keepalive, see peer.h. */
 #define CHANNEL_KEEPALIVE_TIME              60 /* seconds */
 
 /* Channel keep-alive max retry */
@@ -50,6 +57,7 @@ extern "C" {
 #define CHANNEL_CONNECTED                   2
 #define CHANNEL_WAIT_DATA                   3
 #define CHANNEL_WAIT_DATA_ACK               4
+#define CHANNEL_WAIT_BUFFER                 5   /* Out of buffers */
 #define CHANNEL_CLOSE                       255
 
 #define CHANNEL_MODE_CLIENT                 0
@@ -60,63 +68,234 @@ extern "C" {
 #define CHANNEL_MESSAGE                     1
 #define CHANNEL_TCP_ACTIVE                  2
 
+/* Idle time before the TCP->UDP send ring is given back to the pool */
+#define CHANNEL_HIBERNATE_TIME              5 /* seconds */
+
+/* Max bytes queued for a slow TCP peer, new data is not ACKed beyond */
+#define CHANNEL_WRITE_QUEUE_MAX             (64 * 1024)
+
+/* Max buffers written by one TCP send */
+#define CHANNEL_WRITE_BATCH                 SOCKET_SENDV_MAX
+
+/* Time to write out queued data after the channel was closed */
+#define CHANNEL_LINGER_TIME                 10 /* seconds */
+
+/* Time for a connect to the remote to be done */
+#define CHANNEL_CONNECT_TIMEOUT             10 /* seconds */
+
+/* Data messages sent as is after one that did not compress */
+#define CHANNEL_DEFLATE_BACKOFF             16
+
+/* One MSG_CHANNEL_DATA in flight. Descriptors sit in front of the ring
+   data, in the same pool buffer, indexed by sn modulo the window. */
+typedef struct channel_segment {
+    MessageHeader hdr;                  /* Encoded, sent by reference */
+    uint8_t resent;
+    uint8_t acked;
+    uint8_t path;                       /* Of the peer, last sent by */
+    uint16_t sn;
+    uint16_t len;                       /* Ring data */
+    uint16_t size;                      /* On the wire, maybe compressed */
+    uint16_t stores;                    /* Dedup stores, from store_seq */
+    uint32_t pos;                       /* Stream offset in the ring */
+    uint32_t timeout;                   /* Retransmit deadline */
+    uint32_t sent;                      /* Last, tunnel_clock() */
+    uint32_t store_seq;
+    uint32_t zc_id;                     /* Of the buffer, last sent by */
+    Buffer *wire;                       /* Dedup payload, NULL if ring */
+} ChannelSegment;
+
+/* Pool object size of a send ring */
+#define CHANNEL_RING_BUFFER_SIZE(window, size) \
+    BUFFER_SIZE((window) * sizeof(ChannelSegment) + (size))
+
+/* Cold channel state, only needed while the channel is being set up:
+   until the server acks a client channel, or the client acks a server
+   one. Channels being set up are linked from the tunnel's opening list
+   and resend their request or ack until then. The server finds them by
+   the request, a request sent again gets the same channel.
+
+   With fast open the server connects to the remote before the client
+   acks, and a client sends the first data it reads with the request
+   sent again. The server takes it as data message 1 if it has taken no
+   data yet and tells in its acks. A client with no word of it sends
+   exactly these bytes as data message 1, taken or not they are taken
+   once. */
+typedef struct channel_setup {
+    struct channel *next;               /* Opening list */
+    struct channel *prev;
+    uint32_t sent;                      /* First sent, tunnel_clock() */
+    uint32_t timeout;                   /* Resend deadline */
+    uint16_t rto;                       /* ms, doubled every resend */
+    uint8_t resent;
+    uint8_t cookielen;                  /* For client side only */
+    uint8_t cookie[TUNNEL_COOKIE_LEN];  /* For client side only */
+    uint16_t sn;                        /* For server side only, of the */
+    struct channel *same_key;           /* request, see tunnel_find_open() */
+    uint16_t early;                     /* First data sent with the request,
+                                           or taken with it, bytes */
+    uint8_t fast;                       /* For server side only, fast open */
+    char host[TUNNEL_MAX_HOST_LEN+1];   /* For server side only */
+    char port[TUNNEL_MAX_PORT_LEN+1];   /* For server side only */
+} ChannelSetup;
+
+/* Fields are ordered by access frequency. The send path reads the first
+   cache line, the receive path and the hibernate deadline also the start
+   of the second, as checked in channel.c. Channel objects are cache line
+   aligned by the channel pool. */
 typedef struct channel {
+    /* Hot: per message */
+    uint8_t state;
+    uint8_t mode;
+    uint8_t udp2tcp_state;
+    uint8_t tcp2udp_state;
+    uint32_t id;                        /* In the peer's id space */
+
+    uint16_t udp2tcp_sn;                /* Last data taken in order */
+    uint16_t tcp2udp_sn;                /* Last data sent */
+    uint16_t tcp2udp_una;               /* Oldest data not ACKed */
+    uint16_t window;                    /* Negotiated, 1 is stop-and-wait */
+
+    uint16_t inflight;                  /* Data messages not ACKed */
+    uint8_t tcp2udp_eof;
+
+    /* Send ring from pool, only held while there is data to send. Stream
+       offsets: tail <= sent <= head. */
+    uint32_t ring_tail;                 /* First byte not ACKed */
+    uint32_t ring_sent;                 /* First byte not sent */
+    uint32_t ring_head;                 /* End of data read from TCP */
+
     Tunnel *tunnel;
+    Peer *peer;                         /* Shared tunnel address */
+    Buffer *ring;
+
+    SOCKET tcp_sock;                    /* Last, 8 bytes on 64 bit Windows */
+
+    /* Received message buffers waiting for the TCP socket, payload from
+       offset to len. Data received ahead of a gap waits in the reorder
+       list, sorted by sn. */
+    Buffer *udp2tcp_queue;
+    Buffer *udp2tcp_reorder;
+    uint32_t udp2tcp_queued;            /* bytes, both lists */
 
-    uint16_t id;
-    int state;
-    int mode;
+    /* Hibernate deadline once all data is ACKed, tunnel_clock() based */
+    uint32_t tcp2udp_timeout;
+
+    /* Warm: per timer tick */
+    struct channel *next;               /* All channels of the tunnel */
+    struct channel *prev;
 
     uint16_t sn;
+    uint8_t deflate_skip;               /* Messages left to send as is */
+    uint8_t zc_fenced;                  /* zc_fence is set */
+    uint16_t dedup_lead;                /* Unsent rest of a cut chunk */
+    uint16_t early;                     /* Data message 1 takes this, see
+                                           ChannelSetup */
+
+    /* Keep-alive deadline to older servers, linger deadline once closed.
+       tunnel_clock() based */
+    uint32_t keepalive;
 
-    /* Keep-alive */
-    struct timeval keepalive;
+    /* Zero copy send id the ring space freed by ACKs waits for */
+    uint32_t zc_fence;
 
-    /* UDP side */
-    SOCKET udp_sock;
-    SOCKET tcp_sock;
+    /* Cold */
+    ChannelSetup *setup;
 
-    /* Tunnel address */
-    struct sockaddr_storage tunnel_addr;
-    socklen_t tunnel_addr_Len;
+    /* The peer's reset token, 0 if it gave none, taken from
+       reset_after on. tunnel_clock() based */
+    uint64_t reset_token;
+    uint32_t reset_after;
 
-    /* Transmit fields */
-    int udp2tcp_state;
-    uint16_t udp2tcp_sn;
+    struct channel *peer_next;          /* Channels of the peer */
+    struct channel *peer_prev;
 
-    int tcp2udp_state;
-    uint16_t tcp2udp_sn;
-    struct timeval tcp2udp_timeout;
-    int tcp2udp_resent;
-    int tcp2udp_data_len;
-    char tcp2udp_data[TUNNEL_MAX_DATA_LEN];
+    CompressStats deflate;              /* TCP->UDP */
+    CompressStats inflate;              /* UDP->TCP */
 } Channel;
 
-Channel *channel_create_server(Tunnel *t, uint16_t cid,
+Channel *channel_create_server(Tunnel *t, uint32_t cid,
                                const char *host, const char *port,
-                               const struct sockaddr *tunnelAddr,
-                               socklen_t addrlen);
-                               
-Channel *channel_create_client(Tunnel *t, SOCKET tcp_sock, uint16_t cid,
-                               const struct sockaddr *tunnelAddr,
-                               socklen_t addrlen);
+                               Peer *peer);
+
+/* tcp_sock is INVALID_SOCKET for a channel opened ahead, see
+   channel_bind() */
+Channel *channel_create_client(Tunnel *t, SOCKET tcp_sock, uint32_t cid,
+                               Peer *peer);
 
 void channel_mark_to_close(Channel *ch);
 
+/* The peer does not have the channel: nothing is sent to it, the TCP
+   connection is reset by channel_close() so the application sees the
+   failure at once. */
+void channel_reset(Channel *ch);
+
 void channel_close(Channel *ch);
 
-int channel_connect(Channel *ch);
+/* For server side: start to connect to the remote without blocking, the
+   channel may still be half open with fast open. A connection ready for
+   the remote is taken right away. Returns -1 if it failed. */
+int channel_connect_start(Channel *ch);
+
+/* For server side: once the connect is done, take the TCP peer's data and
+   write what was queued for it. Returns 0 while connecting, -1 if it
+   failed or timed out, see CHANNEL_CONNECT_TIMEOUT. */
+int channel_connect_done(Channel *ch);
+
+/* For server side: the client has the channel */
+void channel_confirmed(Channel *ch);
+
+/* For client side: the server has the channel, and took early bytes of
+   the first data with the request. Returns -1 if the channel is to be
+   closed. */
+int channel_opened(Channel *ch, uint32_t new_id, uint16_t early);
+
+/* For client side: a channel opened ahead takes an accepted connection,
+   data the remote sent meanwhile is written to it. Returns -1 if the
+   channel is to be closed. */
+int channel_bind(Channel *ch, SOCKET tcp_sock);
+
+/* For client side: first data read while opening, *data is its start.
+   Returns its length. */
+size_t channel_early_data(Channel *ch, const char **data);
 
-void channel_opened(Channel *ch, uint16_t new_id);
+/* For server side: take the first data from the request as data message
+   1. Returns 1 if taken, 0 if out of buffers and the client is to send it
+   again, -1 if writing it to the remote failed. */
+int channel_take_early_data(Channel *ch, const char *data, size_t len);
+
+/* Start the resend timer of a request or ack just sent */
+void channel_open_sent(Channel *ch);
+
+/* Returns 1 if the request or ack is due to be sent again, -1 if the
+   channel is to be given up. */
+int channel_open_timeout(Channel *ch, uint32_t now);
+
+/* The other end has the channel, the round trip is taken if nothing was
+   sent again. Returns the ms since the first send. */
+uint32_t channel_open_done(Channel *ch);
 
 int channel_tcp2udp_data(Channel *ch);
 
-int channel_handle_message(Channel *ch, Message *msg);
+int channel_handle_message(Channel *ch, Message *msg, Buffer *buf);
+
+int channel_udp2tcp_flush(Channel *ch);
 
 int channel_idle(Channel *ch);
 
+/* Data in flight by a path of the peer that went down is sent again by
+   the others at once. Returns how many messages. */
+int channel_path_down(Channel *ch, int path);
+
 int channel_socket_isset(Channel *ch, fd_set *fds);
 
+int channel_socket_writable(Channel *ch, fd_set *wfds);
+
+/* For server side: the connect to the remote may be done */
+int channel_socket_connecting(Channel *ch, fd_set *wfds);
+
+void channel_log_stats(Channel *ch);
+
 #ifdef __cplusplus
 }
 #endif
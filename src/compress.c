@@ -0,0 +1,281 @@
+/*
+ * udptunnel : Lightweight TCP over UDP Tunneling
+ *
+ * Copyright (C) 2014 Jingyu jingyu.niu@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+
+#include "config.h"
+
+#include "compress.h"
+
+static inline uint32_t compress_read32(const uint8_t *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t compress_read64(const uint8_t *p)
+{
+    uint64_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+/* Length of the match at ip against ref, both ends within len */
+static inline size_t compress_match_len(const uint8_t *in, size_t ref,
+                                        size_t ip, size_t len)
+{
+    size_t n = 0;
+    uint64_t diff;
+
+    while (ip + n + 8 <= len) {
+        diff = compress_read64(in + ref + n) ^ compress_read64(in + ip + n);
+        if (diff) {
+#if defined(__GNUC__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+            return n + (__builtin_ctzll(diff) >> 3);
+#else
+            break;
+#endif
+        }
+        n += 8;
+    }
+
+    while (ip + n < len && in[ref + n] == in[ip + n])
+        n++;
+
+    return n;
+}
+
+static inline uint32_t compress_hash(uint32_t v)
+{
+    return (v * 2654435761U) >> (32 - COMPRESS_HASH_BITS);
+}
+
+int compress_worth(const void *src, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)src;
+    uint16_t counts[256];
+    size_t step = len > COMPRESS_SAMPLE_LEN ? len / COMPRESS_SAMPLE_LEN : 1;
+    uint32_t n = 0;
+    uint32_t sum = 0;
+    size_t i;
+
+    memset(counts, 0, sizeof(counts));
+    for (i = 0; i < len && n < COMPRESS_SAMPLE_LEN; i += step, n++)
+        counts[p[i]]++;
+
+    for (i = 0; i < 256; i++)
+        sum += (uint32_t)counts[i] * counts[i];
+
+    /* Sum of squared counts estimates the chance of two bytes being
+       equal, 1/256 for random data. Worth it below 7.5 bits per byte, a
+       chance above 1/181. */
+    return n > 1 && (sum - n) * 181 > n * (n - 1);
+}
+
+static uint8_t *compress_put_len(uint8_t *op, size_t n)
+{
+    while (n >= 255) {
+        *op++ = 255;
+        n -= 255;
+    }
+    *op++ = (uint8_t)n;
+
+    return op;
+}
+
+/* Literals and a match, or only literals if mlen is 0. Returns the end
+   of the sequence, NULL if it does not fit. */
+static uint8_t *compress_put_sequence(uint8_t *op, const uint8_t *oend,
+                                      const uint8_t *lit, size_t llen,
+                                      size_t offset, size_t mlen)
+{
+    uint8_t *token = op;
+
+    if ((size_t)(oend - op) < 1 + llen / 255 + 1 + llen + 2 + mlen / 255 + 1)
+        return NULL;
+
+    op++;
+    if (llen >= 15) {
+        *token = 15 << 4;
+        op = compress_put_len(op, llen - 15);
+    } else {
+        *token = (uint8_t)(llen << 4);
+    }
+
+    memcpy(op, lit, llen);
+    op += llen;
+
+    if (!mlen)
+        return op;
+
+    *op++ = (uint8_t)offset;
+    *op++ = (uint8_t)(offset >> 8);
+
+    mlen -= COMPRESS_MIN_MATCH;
+    if (mlen >= 15) {
+        *token |= 15;
+        op = compress_put_len(op, mlen - 15);
+    } else {
+        *token |= (uint8_t)mlen;
+    }
+
+    return op;
+}
+
+size_t compress_block(Compressor *c, const void *src, size_t len,
+                      void *dst, size_t cap)
+{
+    const uint8_t *in = (const uint8_t *)src;
+    uint8_t *op = (uint8_t *)dst;
+    const uint8_t *oend = op + cap;
+    size_t ip = 0;
+    size_t anchor = 0;
+    size_t ref;
+    size_t mlen;
+    uint32_t seq;
+    uint32_t h;
+
+    if (len > COMPRESS_MAX_LEN)
+        return 0;
+
+    while (ip + COMPRESS_MIN_MATCH <= len) {
+        seq = compress_read32(in + ip);
+        h = compress_hash(seq);
+        ref = c->table[h];
+        c->table[h] = (uint16_t)ip;
+
+        if (ref >= ip || compress_read32(in + ref) != seq) {
+            /* Step faster through data that does not match */
+            ip += 1 + ((ip - anchor) >> 5);
+            continue;
+        }
+
+        while (ip > anchor && ref > 0 && in[ip - 1] == in[ref - 1]) {
+            ip--;
+            ref--;
+        }
+
+        mlen = COMPRESS_MIN_MATCH +
+               compress_match_len(in, ref + COMPRESS_MIN_MATCH,
+                                  ip + COMPRESS_MIN_MATCH, len);
+
+        op = compress_put_sequence(op, oend, in + anchor, ip - anchor,
+                                   ip - ref, mlen);
+        if (!op)
+            return 0;
+
+        ip += mlen;
+        anchor = ip;
+
+        /* Catch matches starting right behind this one */
+        if (ip >= 2 && ip + COMPRESS_MIN_MATCH <= len)
+            c->table[compress_hash(compress_read32(in + ip - 2))] =
+                (uint16_t)(ip - 2);
+    }
+
+    op = compress_put_sequence(op, oend, in + anchor, len - anchor, 0, 0);
+    if (!op)
+        return 0;
+
+    return op - (uint8_t *)dst;
+}
+
+/* Length bytes following a 15 in the token */
+static int decompress_get_len(const uint8_t **ip, const uint8_t *iend,
+                              size_t *n)
+{
+    uint8_t b;
+
+    do {
+        if (*ip >= iend)
+            return -1;
+        b = *(*ip)++;
+        *n += b;
+    } while (b == 255);
+
+    return 0;
+}
+
+int decompress_block(const void *src, size_t len, void *dst, size_t cap)
+{
+    const uint8_t *ip = (const uint8_t *)src;
+    const uint8_t *iend = ip + len;
+    uint8_t *out = (uint8_t *)dst;
+    uint8_t *op = out;
+    const uint8_t *ref;
+    uint8_t *end;
+    uint8_t token;
+    size_t offset;
+    size_t n;
+
+    while (ip < iend) {
+        token = *ip++;
+
+        n = token >> 4;
+        if (n == 15 && decompress_get_len(&ip, iend, &n) < 0)
+            return -1;
+        if (n > (size_t)(iend - ip) || n > cap - (size_t)(op - out))
+            return -1;
+        /* Short runs are copied 16 bytes at a time when there is room */
+        if (n <= 16 && iend - ip >= 16 && cap - (size_t)(op - out) >= 16)
+            memcpy(op, ip, 16);
+        else
+            memcpy(op, ip, n);
+        op += n;
+        ip += n;
+
+        /* Last sequence, literals only */
+        if (ip == iend)
+            break;
+
+        if (iend - ip < 2)
+            return -1;
+        offset = ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - out))
+            return -1;
+
+        n = token & 15;
+        if (n == 15 && decompress_get_len(&ip, iend, &n) < 0)
+            return -1;
+        n += COMPRESS_MIN_MATCH;
+        if (n > cap - (size_t)(op - out))
+            return -1;
+
+        /* Matches may overlap their own output, 8 bytes at a time only
+           when they are that far behind */
+        ref = op - offset;
+        if (offset >= 8 && cap - (size_t)(op - out) >= n + 8) {
+            end = op + n;
+            do {
+                memcpy(op, ref, 8);
+                op += 8;
+                ref += 8;
+            } while (op < end);
+            op = end;
+        } else {
+            while (n--)
+                *op++ = *ref++;
+        }
+    }
+
+    return (int)(op - out);
+}
@@ -0,0 +1,81 @@
+/*
+ * udptunnel : Lightweight TCP over UDP Tunneling
+ *
+ * Copyright (C) 2014 Jingyu jingyu.niu@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __COMPRESS_H__
+#define __COMPRESS_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* LZ77 block codec in the LZ4 style, one message payload per block. A
+   block is a run of sequences: a token byte holding the literal count in
+   the high 4 bits and the match length - 4 in the low 4 bits, 15 meaning
+   more length bytes follow (each 255 meaning yet another), the literals,
+   then a 16-bit little endian match offset. The last sequence has only
+   literals. */
+
+/* Smaller payloads are sent as is */
+#define COMPRESS_MIN_LEN                    64
+
+#define COMPRESS_MIN_MATCH                  4
+
+#define COMPRESS_HASH_BITS                  12
+
+/* Bytes sampled by the compressibility check */
+#define COMPRESS_SAMPLE_LEN                 256
+
+/* Blocks are at most 64K, positions fit in 16 bits */
+#define COMPRESS_MAX_LEN                    0xFFFF
+
+/* Match finder state. Entries left over from earlier blocks are only
+   hints, every match is checked, so the table is never cleared. */
+typedef struct compressor {
+    uint16_t table[1 << COMPRESS_HASH_BITS];
+} Compressor;
+
+/* Per direction statistics */
+typedef struct compress_stats {
+    uint64_t in;                        /* Bytes before */
+    uint64_t out;                       /* Bytes after, as is if skipped */
+    uint32_t blocks;                    /* Compressed messages */
+    uint32_t skipped;                   /* Messages sent as is */
+    uint64_t usec;                      /* Time spent in the codec */
+} CompressStats;
+
+/* Quick order-0 entropy estimate over a sample: 0 for data that looks
+   random already (TLS, compressed or encrypted streams), 1 otherwise. */
+int compress_worth(const void *src, size_t len);
+
+/* Compress len bytes of src into dst. Returns the compressed length, 0
+   if it does not fit in cap bytes. */
+size_t compress_block(Compressor *c, const void *src, size_t len,
+                      void *dst, size_t cap);
+
+/* Returns the decompressed length, -1 if the block is malformed or
+   bigger than cap bytes. */
+int decompress_block(const void *src, size_t len, void *dst, size_t cap);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __COMPRESS_H__ */
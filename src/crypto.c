@@ -0,0 +1,1339 @@
+/*
+ * udptunnel : Lightweight TCP over UDP Tunneling
+ *
+ * Copyright (C) 2014 Jingyu jingyu.niu@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#if defined(_WIN32) || defined(_WIN64)
+#define _CRT_RAND_S                     /* rand_s() */
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#if !defined(_WIN32) && !defined(_WIN64)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "config.h"
+
+#include "log.h"
+#include "message.h"
+
+#include "crypto.h"
+
+/* Hardware paths are built for x86 with target attributes, the rest of
+   the program needs no special compiler flags. */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CRYPTO_X86
+#define CRYPTO_TARGET(s)        __attribute__((target(s)))
+#include <cpuid.h>
+#include <x86intrin.h>
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#define CRYPTO_X86
+#define CRYPTO_TARGET(s)
+#include <intrin.h>
+#include <immintrin.h>
+#endif
+
+#define CRYPTO_AES_TARGET       "aes,pclmul,ssse3"
+
+static int crypto_has_aes;              /* AES-NI and PCLMULQDQ */
+static int crypto_has_avx2;
+
+static inline uint32_t load32_le(const uint8_t *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+           (uint32_t)p[3] << 24;
+}
+
+static inline void store32_le(uint8_t *p, uint32_t v)
+{
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+static inline uint64_t load64_le(const uint8_t *p)
+{
+    return (uint64_t)load32_le(p) | (uint64_t)load32_le(p + 4) << 32;
+}
+
+static inline void store64_le(uint8_t *p, uint64_t v)
+{
+    store32_le(p, (uint32_t)v);
+    store32_le(p + 4, (uint32_t)(v >> 32));
+}
+
+static inline uint64_t crypto_cycles(void)
+{
+#ifdef CRYPTO_X86
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+void crypto_init(void)
+{
+#ifdef CRYPTO_X86
+    unsigned int r[4] = {0, 0, 0, 0};
+    unsigned int max;
+    uint64_t xcr0 = 0;
+
+#if defined(_MSC_VER)
+    __cpuid((int *)r, 0);
+    max = r[0];
+    __cpuid((int *)r, 1);
+#else
+    max = __get_cpuid_max(0, NULL);
+    if (max < 1)
+        return;
+    __cpuid(1, r[0], r[1], r[2], r[3]);
+#endif
+
+    /* AES-NI, PCLMULQDQ, SSSE3 */
+    crypto_has_aes = (r[2] & (1 << 25)) && (r[2] & (1 << 1)) &&
+                     (r[2] & (1 << 9));
+
+    /* The OS saves the AVX state: OSXSAVE and XCR0 */
+    if ((r[2] & (1 << 27)) && (r[2] & (1 << 28))) {
+#if defined(_MSC_VER)
+        xcr0 = _xgetbv(0);
+#else
+        unsigned int lo, hi;
+
+        __asm__ volatile ("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+        xcr0 = (uint64_t)hi << 32 | lo;
+#endif
+    }
+
+    if (max >= 7 && (xcr0 & 6) == 6) {
+#if defined(_MSC_VER)
+        __cpuidex((int *)r, 7, 0);
+#else
+        __cpuid_count(7, 0, r[0], r[1], r[2], r[3]);
+#endif
+        crypto_has_avx2 = (r[1] & (1 << 5)) != 0;
+    }
+#endif
+
+    log_info("Crypto: AES-NI %s, AVX2 %s.",
+             crypto_has_aes ? "yes" : "no", crypto_has_avx2 ? "yes" : "no");
+}
+
+void crypto_disable_simd(void)
+{
+    crypto_has_aes = 0;
+    crypto_has_avx2 = 0;
+}
+
+uint8_t crypto_ciphers(void)
+{
+    return CRYPTO_CHACHA20_POLY1305 |
+           (crypto_has_aes ? CRYPTO_AES256_GCM : 0);
+}
+
+uint8_t crypto_choose(uint8_t peer_ciphers)
+{
+    uint8_t both = peer_ciphers & crypto_ciphers();
+
+    if (both & CRYPTO_AES256_GCM)
+        return CRYPTO_AES256_GCM;
+
+    return both & CRYPTO_CHACHA20_POLY1305;
+}
+
+const char *crypto_cipher_name(uint8_t cipher)
+{
+    switch (cipher) {
+    case CRYPTO_CHACHA20_POLY1305:
+        return "ChaCha20-Poly1305";
+    case CRYPTO_AES256_GCM:
+        return "AES-256-GCM";
+    default:
+        return "none";
+    }
+}
+
+/* ChaCha20, RFC 8439 */
+
+#define ROTL32(v, n)            ((v) << (n) | (v) >> (32 - (n)))
+
+#define CHACHA_QR(a, b, c, d) do {                                          \
+    a += b; d ^= a; d = ROTL32(d, 16);                                      \
+    c += d; b ^= c; b = ROTL32(b, 12);                                      \
+    a += b; d ^= a; d = ROTL32(d, 8);                                       \
+    c += d; b ^= c; b = ROTL32(b, 7);                                       \
+} while (0)
+
+static void chacha20_init(uint32_t s[16], const uint8_t *key,
+                          uint32_t counter, const uint8_t *nonce)
+{
+    int i;
+
+    s[0] = 0x61707865;
+    s[1] = 0x3320646e;
+    s[2] = 0x79622d32;
+    s[3] = 0x6b206574;
+    for (i = 0; i < 8; i++)
+        s[4 + i] = load32_le(key + 4 * i);
+    s[12] = counter;
+    for (i = 0; i < 3; i++)
+        s[13 + i] = load32_le(nonce + 4 * i);
+}
+
+static void chacha20_rounds(uint32_t x[16])
+{
+    int i;
+
+    for (i = 0; i < 10; i++) {
+        CHACHA_QR(x[0], x[4], x[8], x[12]);
+        CHACHA_QR(x[1], x[5], x[9], x[13]);
+        CHACHA_QR(x[2], x[6], x[10], x[14]);
+        CHACHA_QR(x[3], x[7], x[11], x[15]);
+        CHACHA_QR(x[0], x[5], x[10], x[15]);
+        CHACHA_QR(x[1], x[6], x[11], x[12]);
+        CHACHA_QR(x[2], x[7], x[8], x[13]);
+        CHACHA_QR(x[3], x[4], x[9], x[14]);
+    }
+}
+
+static void chacha20_xor_blocks(uint32_t s[16], uint8_t *p, size_t len)
+{
+    uint32_t x[16];
+    uint8_t ks[64];
+    size_t n;
+    size_t i;
+
+    while (len) {
+        memcpy(x, s, sizeof(x));
+        chacha20_rounds(x);
+        for (i = 0; i < 16; i++)
+            store32_le(ks + 4 * i, x[i] + s[i]);
+
+        n = len < 64 ? len : 64;
+        for (i = 0; i < n; i++)
+            p[i] ^= ks[i];
+
+        s[12]++;
+        p += n;
+        len -= n;
+    }
+}
+
+#ifdef CRYPTO_X86
+#define CHACHA_QR_AVX2(a, b, c, d) do {                                     \
+    a = _mm256_add_epi32(a, b);                                             \
+    d = _mm256_shuffle_epi8(_mm256_xor_si256(d, a), rot16);                 \
+    c = _mm256_add_epi32(c, d);                                             \
+    b = _mm256_xor_si256(b, c);                                             \
+    b = _mm256_or_si256(_mm256_slli_epi32(b, 12), _mm256_srli_epi32(b, 20));\
+    a = _mm256_add_epi32(a, b);                                             \
+    d = _mm256_shuffle_epi8(_mm256_xor_si256(d, a), rot8);                  \
+    c = _mm256_add_epi32(c, d);                                             \
+    b = _mm256_xor_si256(b, c);                                             \
+    b = _mm256_or_si256(_mm256_slli_epi32(b, 7), _mm256_srli_epi32(b, 25)); \
+} while (0)
+
+/* Words x[0..7] of 8 blocks, one block per lane, to 32 bytes of each
+   block in turn */
+CRYPTO_TARGET("avx2")
+static inline void chacha20_avx2_transpose(const __m256i *x, uint8_t *ks)
+{
+    __m256i t[8];
+    __m256i u[8];
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        t[2 * i] = _mm256_unpacklo_epi32(x[2 * i], x[2 * i + 1]);
+        t[2 * i + 1] = _mm256_unpackhi_epi32(x[2 * i], x[2 * i + 1]);
+    }
+
+    for (i = 0; i < 2; i++) {
+        u[4 * i] = _mm256_unpacklo_epi64(t[4 * i], t[4 * i + 2]);
+        u[4 * i + 1] = _mm256_unpackhi_epi64(t[4 * i], t[4 * i + 2]);
+        u[4 * i + 2] = _mm256_unpacklo_epi64(t[4 * i + 1], t[4 * i + 3]);
+        u[4 * i + 3] = _mm256_unpackhi_epi64(t[4 * i + 1], t[4 * i + 3]);
+    }
+
+    for (i = 0; i < 4; i++) {
+        _mm256_storeu_si256((__m256i *)(ks + 64 * i),
+                            _mm256_permute2x128_si256(u[i], u[i + 4], 0x20));
+        _mm256_storeu_si256((__m256i *)(ks + 64 * (i + 4)),
+                            _mm256_permute2x128_si256(u[i], u[i + 4], 0x31));
+    }
+}
+
+/* 8 blocks at a time, one in each 32 bit lane */
+CRYPTO_TARGET("avx2")
+static void chacha20_xor_avx2(uint32_t s[16], uint8_t *p, size_t len)
+{
+    const __m256i rot16 = _mm256_setr_epi8(
+            2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13,
+            2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13);
+    const __m256i rot8 = _mm256_setr_epi8(
+            3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14,
+            3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14);
+    __m256i o[16];
+    __m256i x[16];
+    uint8_t ks[512];
+    size_t n;
+    size_t i;
+
+    while (len) {
+        for (i = 0; i < 16; i++)
+            o[i] = _mm256_set1_epi32((int)s[i]);
+        o[12] = _mm256_add_epi32(o[12],
+                                 _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+        memcpy(x, o, sizeof(x));
+
+        for (i = 0; i < 10; i++) {
+            CHACHA_QR_AVX2(x[0], x[4], x[8], x[12]);
+            CHACHA_QR_AVX2(x[1], x[5], x[9], x[13]);
+            CHACHA_QR_AVX2(x[2], x[6], x[10], x[14]);
+            CHACHA_QR_AVX2(x[3], x[7], x[11], x[15]);
+            CHACHA_QR_AVX2(x[0], x[5], x[10], x[15]);
+            CHACHA_QR_AVX2(x[1], x[6], x[11], x[12]);
+            CHACHA_QR_AVX2(x[2], x[7], x[8], x[13]);
+            CHACHA_QR_AVX2(x[3], x[4], x[9], x[14]);
+        }
+
+        for (i = 0; i < 16; i++)
+            x[i] = _mm256_add_epi32(x[i], o[i]);
+
+        chacha20_avx2_transpose(x, ks);
+        chacha20_avx2_transpose(x + 8, ks + 32);
+
+        n = len < sizeof(ks) ? len : sizeof(ks);
+        for (i = 0; i + 32 <= n; i += 32)
+            _mm256_storeu_si256((__m256i *)(p + i), _mm256_xor_si256(
+                    _mm256_loadu_si256((const __m256i *)(p + i)),
+                    _mm256_loadu_si256((const __m256i *)(ks + i))));
+        for (; i < n; i++)
+            p[i] ^= ks[i];
+
+        s[12] += 8;
+        p += n;
+        len -= n;
+    }
+}
+#endif
+
+static void chacha20_xor(uint32_t s[16], uint8_t *p, size_t len)
+{
+#ifdef CRYPTO_X86
+    /* Worth it beyond a couple of blocks */
+    if (crypto_has_avx2 && len > 128) {
+        chacha20_xor_avx2(s, p, len);
+        return;
+    }
+#endif
+    chacha20_xor_blocks(s, p, len);
+}
+
+/* Key from a key and 16 bytes of input, no block addition */
+static void hchacha20(const uint8_t *key, const uint8_t *in, uint8_t *out)
+{
+    uint32_t x[16];
+    int i;
+
+    chacha20_init(x, key, load32_le(in), in + 4);
+    chacha20_rounds(x);
+
+    for (i = 0; i < 4; i++) {
+        store32_le(out + 4 * i, x[i]);
+        store32_le(out + 16 + 4 * i, x[12 + i]);
+    }
+}
+
+/* Poly1305, 44 bit limbs where 128 bit products are at hand, else 26 */
+
+#if defined(__SIZEOF_INT128__)
+typedef unsigned __int128 uint128_t;
+
+typedef struct poly1305 {
+    uint64_t r[3];
+    uint64_t h[3];
+    uint64_t pad[2];
+} Poly1305;
+
+static void poly1305_init(Poly1305 *st, const uint8_t *key)
+{
+    uint64_t t0 = load64_le(key);
+    uint64_t t1 = load64_le(key + 8);
+
+    st->r[0] = t0 & 0xffc0fffffffull;
+    st->r[1] = (t0 >> 44 | t1 << 20) & 0xfffffc0ffffull;
+    st->r[2] = (t1 >> 24) & 0x00ffffffc0full;
+    st->h[0] = st->h[1] = st->h[2] = 0;
+    st->pad[0] = load64_le(key + 16);
+    st->pad[1] = load64_le(key + 24);
+}
+
+static void poly1305_blocks(Poly1305 *st, const uint8_t *m, size_t len)
+{
+    const uint64_t hibit = 1ull << 40;
+    uint64_t r0 = st->r[0], r1 = st->r[1], r2 = st->r[2];
+    uint64_t h0 = st->h[0], h1 = st->h[1], h2 = st->h[2];
+    uint64_t s1 = r1 * (5 << 2);
+    uint64_t s2 = r2 * (5 << 2);
+    uint128_t d0, d1, d2;
+    uint64_t t0, t1, c;
+
+    while (len >= 16) {
+        t0 = load64_le(m);
+        t1 = load64_le(m + 8);
+
+        h0 += t0 & 0xfffffffffffull;
+        h1 += (t0 >> 44 | t1 << 20) & 0xfffffffffffull;
+        h2 += ((t1 >> 24) & 0x3ffffffffffull) | hibit;
+
+        d0 = (uint128_t)h0 * r0 + (uint128_t)h1 * s2 + (uint128_t)h2 * s1;
+        d1 = (uint128_t)h0 * r1 + (uint128_t)h1 * r0 + (uint128_t)h2 * s2;
+        d2 = (uint128_t)h0 * r2 + (uint128_t)h1 * r1 + (uint128_t)h2 * r0;
+
+        c = (uint64_t)(d0 >> 44);
+        h0 = (uint64_t)d0 & 0xfffffffffffull;
+        d1 += c;
+        c = (uint64_t)(d1 >> 44);
+        h1 = (uint64_t)d1 & 0xfffffffffffull;
+        d2 += c;
+        c = (uint64_t)(d2 >> 42);
+        h2 = (uint64_t)d2 & 0x3ffffffffffull;
+        h0 += c * 5;
+        c = h0 >> 44;
+        h0 &= 0xfffffffffffull;
+        h1 += c;
+
+        m += 16;
+        len -= 16;
+    }
+
+    st->h[0] = h0;
+    st->h[1] = h1;
+    st->h[2] = h2;
+}
+
+static void poly1305_finish(Poly1305 *st, uint8_t *mac)
+{
+    uint64_t h0 = st->h[0], h1 = st->h[1], h2 = st->h[2];
+    uint64_t g0, g1, g2, c, t0, t1;
+
+    c = h1 >> 44; h1 &= 0xfffffffffffull; h2 += c;
+    c = h2 >> 42; h2 &= 0x3ffffffffffull; h0 += c * 5;
+    c = h0 >> 44; h0 &= 0xfffffffffffull; h1 += c;
+    c = h1 >> 44; h1 &= 0xfffffffffffull; h2 += c;
+    c = h2 >> 42; h2 &= 0x3ffffffffffull; h0 += c * 5;
+    c = h0 >> 44; h0 &= 0xfffffffffffull; h1 += c;
+
+    /* h - p, taken if not negative */
+    g0 = h0 + 5; c = g0 >> 44; g0 &= 0xfffffffffffull;
+    g1 = h1 + c; c = g1 >> 44; g1 &= 0xfffffffffffull;
+    g2 = h2 + c - (1ull << 42);
+
+    c = (g2 >> 63) - 1;
+    h0 = (h0 & ~c) | (g0 & c);
+    h1 = (h1 & ~c) | (g1 & c);
+    h2 = (h2 & ~c) | (g2 & c);
+
+    t0 = st->pad[0];
+    t1 = st->pad[1];
+    h0 += t0 & 0xfffffffffffull;
+    c = h0 >> 44; h0 &= 0xfffffffffffull;
+    h1 += ((t0 >> 44 | t1 << 20) & 0xfffffffffffull) + c;
+    c = h1 >> 44; h1 &= 0xfffffffffffull;
+    h2 += (t1 >> 24) + c;
+
+    store64_le(mac, h0 | h1 << 44);
+    store64_le(mac + 8, h1 >> 20 | h2 << 24);
+}
+#else
+typedef struct poly1305 {
+    uint32_t r[5];
+    uint32_t h[5];
+    uint32_t pad[4];
+} Poly1305;
+
+static void poly1305_init(Poly1305 *st, const uint8_t *key)
+{
+    int i;
+
+    st->r[0] = load32_le(key) & 0x3ffffff;
+    st->r[1] = (load32_le(key + 3) >> 2) & 0x3ffff03;
+    st->r[2] = (load32_le(key + 6) >> 4) & 0x3ffc0ff;
+    st->r[3] = (load32_le(key + 9) >> 6) & 0x3f03fff;
+    st->r[4] = (load32_le(key + 12) >> 8) & 0x00fffff;
+    for (i = 0; i < 5; i++)
+        st->h[i] = 0;
+    for (i = 0; i < 4; i++)
+        st->pad[i] = load32_le(key + 16 + 4 * i);
+}
+
+static void poly1305_blocks(Poly1305 *st, const uint8_t *m, size_t len)
+{
+    const uint32_t hibit = 1 << 24;
+    uint32_t r0 = st->r[0], r1 = st->r[1], r2 = st->r[2], r3 = st->r[3],
+             r4 = st->r[4];
+    uint32_t s1 = r1 * 5, s2 = r2 * 5, s3 = r3 * 5, s4 = r4 * 5;
+    uint32_t h0 = st->h[0], h1 = st->h[1], h2 = st->h[2], h3 = st->h[3],
+             h4 = st->h[4];
+    uint64_t d0, d1, d2, d3, d4;
+    uint32_t c;
+
+    while (len >= 16) {
+        h0 += load32_le(m) & 0x3ffffff;
+        h1 += (load32_le(m + 3) >> 2) & 0x3ffffff;
+        h2 += (load32_le(m + 6) >> 4) & 0x3ffffff;
+        h3 += (load32_le(m + 9) >> 6) & 0x3ffffff;
+        h4 += (load32_le(m + 12) >> 8) | hibit;
+
+        d0 = (uint64_t)h0 * r0 + (uint64_t)h1 * s4 + (uint64_t)h2 * s3 +
+             (uint64_t)h3 * s2 + (uint64_t)h4 * s1;
+        d1 = (uint64_t)h0 * r1 + (uint64_t)h1 * r0 + (uint64_t)h2 * s4 +
+             (uint64_t)h3 * s3 + (uint64_t)h4 * s2;
+        d2 = (uint64_t)h0 * r2 + (uint64_t)h1 * r1 + (uint64_t)h2 * r0 +
+             (uint64_t)h3 * s4 + (uint64_t)h4 * s3;
+        d3 = (uint64_t)h0 * r3 + (uint64_t)h1 * r2 + (uint64_t)h2 * r1 +
+             (uint64_t)h3 * r0 + (uint64_t)h4 * s4;
+        d4 = (uint64_t)h0 * r4 + (uint64_t)h1 * r3 + (uint64_t)h2 * r2 +
+             (uint64_t)h3 * r1 + (uint64_t)h4 * r0;
+
+        c = (uint32_t)(d0 >> 26); h0 = (uint32_t)d0 & 0x3ffffff;
+        d1 += c; c = (uint32_t)(d1 >> 26); h1 = (uint32_t)d1 & 0x3ffffff;
+        d2 += c; c = (uint32_t)(d2 >> 26); h2 = (uint32_t)d2 & 0x3ffffff;
+        d3 += c; c = (uint32_t)(d3 >> 26); h3 = (uint32_t)d3 & 0x3ffffff;
+        d4 += c; c = (uint32_t)(d4 >> 26); h4 = (uint32_t)d4 & 0x3ffffff;
+        h0 += c * 5; c = h0 >> 26; h0 &= 0x3ffffff;
+        h1 += c;
+
+        m += 16;
+        len -= 16;
+    }
+
+    st->h[0] = h0;
+    st->h[1] = h1;
+    st->h[2] = h2;
+    st->h[3] = h3;
+    st->h[4] = h4;
+}
+
+static void poly1305_finish(Poly1305 *st, uint8_t *mac)
+{
+    uint32_t h0 = st->h[0], h1 = st->h[1], h2 = st->h[2], h3 = st->h[3],
+             h4 = st->h[4];
+    uint32_t g0, g1, g2, g3, g4, c, mask;
+    uint64_t f;
+
+    c = h1 >> 26; h1 &= 0x3ffffff; h2 += c;
+    c = h2 >> 26; h2 &= 0x3ffffff; h3 += c;
+    c = h3 >> 26; h3 &= 0x3ffffff; h4 += c;
+    c = h4 >> 26; h4 &= 0x3ffffff; h0 += c * 5;
+    c = h0 >> 26; h0 &= 0x3ffffff; h1 += c;
+
+    /* h - p, taken if not negative */
+    g0 = h0 + 5; c = g0 >> 26; g0 &= 0x3ffffff;
+    g1 = h1 + c; c = g1 >> 26; g1 &= 0x3ffffff;
+    g2 = h2 + c; c = g2 >> 26; g2 &= 0x3ffffff;
+    g3 = h3 + c; c = g3 >> 26; g3 &= 0x3ffffff;
+    g4 = h4 + c - (1 << 26);
+
+    mask = (g4 >> 31) - 1;
+    h0 = (h0 & ~mask) | (g0 & mask);
+    h1 = (h1 & ~mask) | (g1 & mask);
+    h2 = (h2 & ~mask) | (g2 & mask);
+    h3 = (h3 & ~mask) | (g3 & mask);
+    h4 = (h4 & ~mask) | (g4 & mask);
+
+    h0 = h0 | h1 << 26;
+    h1 = h1 >> 6 | h2 << 20;
+    h2 = h2 >> 12 | h3 << 14;
+    h3 = h3 >> 18 | h4 << 8;
+
+    f = (uint64_t)h0 + st->pad[0];
+    store32_le(mac, (uint32_t)f);
+    f = (uint64_t)h1 + st->pad[1] + (f >> 32);
+    store32_le(mac + 4, (uint32_t)f);
+    f = (uint64_t)h2 + st->pad[2] + (f >> 32);
+    store32_le(mac + 8, (uint32_t)f);
+    f = (uint64_t)h3 + st->pad[3] + (f >> 32);
+    store32_le(mac + 12, (uint32_t)f);
+}
+#endif
+
+/* Data zero padded to 16 bytes */
+static void poly1305_padded(Poly1305 *st, const uint8_t *m, size_t len)
+{
+    uint8_t last[16];
+    size_t full = len & ~(size_t)15;
+
+    poly1305_blocks(st, m, full);
+    if (len > full) {
+        memset(last, 0, sizeof(last));
+        memcpy(last, m + full, len - full);
+        poly1305_blocks(st, last, sizeof(last));
+    }
+}
+
+static void chacha20_poly1305_tag(const uint8_t *otk, const uint8_t *ad,
+                                  size_t adlen, const uint8_t *c, size_t len,
+                                  uint8_t *tag)
+{
+    Poly1305 st;
+    uint8_t lens[16];
+
+    poly1305_init(&st, otk);
+    poly1305_padded(&st, ad, adlen);
+    poly1305_padded(&st, c, len);
+    store64_le(lens, adlen);
+    store64_le(lens + 8, len);
+    poly1305_blocks(&st, lens, sizeof(lens));
+    poly1305_finish(&st, tag);
+}
+
+/* One time Poly1305 key from block 0, data from block 1 */
+static void chacha20_poly1305_key(const CryptoCipher *k,
+                                  const uint8_t *nonce, uint32_t s[16],
+                                  uint8_t *otk)
+{
+    chacha20_init(s, k->key, 0, nonce);
+    memset(otk, 0, 32);
+    chacha20_xor_blocks(s, otk, 32);
+    s[12] = 1;
+}
+
+static void chacha20_poly1305_seal(const CryptoCipher *k,
+                                   const uint8_t *nonce, const uint8_t *ad,
+                                   size_t adlen, uint8_t *p, size_t len,
+                                   uint8_t *tag)
+{
+    uint32_t s[16];
+    uint8_t otk[32];
+
+    chacha20_poly1305_key(k, nonce, s, otk);
+    chacha20_xor(s, p, len);
+    chacha20_poly1305_tag(otk, ad, adlen, p, len, tag);
+}
+
+/* Authenticated before decrypted */
+static int chacha20_poly1305_open(const CryptoCipher *k,
+                                  const uint8_t *nonce, const uint8_t *ad,
+                                  size_t adlen, uint8_t *p, size_t len,
+                                  const uint8_t *tag)
+{
+    uint32_t s[16];
+    uint8_t otk[32];
+    uint8_t expect[CRYPTO_TAG_LEN];
+
+    chacha20_poly1305_key(k, nonce, s, otk);
+    chacha20_poly1305_tag(otk, ad, adlen, p, len, expect);
+    if (crypto_compare(expect, tag, CRYPTO_TAG_LEN))
+        return -1;
+
+    chacha20_xor(s, p, len);
+
+    return 0;
+}
+
+#ifdef CRYPTO_X86
+/* AES-256-GCM with AES-NI and PCLMULQDQ. GHASH works on byte reflected
+   blocks, 4 at a time with one reduction. */
+
+#define AES_EXPAND_1(rk, i, rcon) do {                                      \
+    t2 = _mm_shuffle_epi32(_mm_aeskeygenassist_si128(t3, rcon), 0xff);      \
+    t1 = aes_expand_mix(t1, t2);                                            \
+    rk[i] = t1;                                                             \
+} while (0)
+
+#define AES_EXPAND_2(rk, i) do {                                            \
+    t2 = _mm_shuffle_epi32(_mm_aeskeygenassist_si128(t1, 0), 0xaa);         \
+    t3 = aes_expand_mix(t3, t2);                                            \
+    rk[i] = t3;                                                             \
+} while (0)
+
+CRYPTO_TARGET(CRYPTO_AES_TARGET)
+static inline __m128i aes_expand_mix(__m128i a, __m128i b)
+{
+    a = _mm_xor_si128(a, _mm_slli_si128(a, 4));
+    a = _mm_xor_si128(a, _mm_slli_si128(a, 8));
+
+    return _mm_xor_si128(a, b);
+}
+
+CRYPTO_TARGET(CRYPTO_AES_TARGET)
+static inline __m128i aes_encrypt_block(const __m128i *rk, __m128i b)
+{
+    int i;
+
+    b = _mm_xor_si128(b, rk[0]);
+    for (i = 1; i < 14; i++)
+        b = _mm_aesenc_si128(b, rk[i]);
+
+    return _mm_aesenclast_si128(b, rk[14]);
+}
+
+/* 256 bit carry-less product of a and b */
+CRYPTO_TARGET(CRYPTO_AES_TARGET)
+static inline void ghash_mul(__m128i a, __m128i b, __m128i *lo, __m128i *hi)
+{
+    __m128i m = _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x10),
+                              _mm_clmulepi64_si128(a, b, 0x01));
+
+    *lo = _mm_xor_si128(*lo, _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x00),
+                                           _mm_slli_si128(m, 8)));
+    *hi = _mm_xor_si128(*hi, _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x11),
+                                           _mm_srli_si128(m, 8)));
+}
+
+/* Shift the reflected product left by one and reduce it modulo
+   x^128 + x^7 + x^2 + x + 1 */
+CRYPTO_TARGET(CRYPTO_AES_TARGET)
+static inline __m128i ghash_reduce(__m128i lo, __m128i hi)
+{
+    __m128i t7, t8, t9;
+
+    t7 = _mm_srli_epi32(lo, 31);
+    t8 = _mm_srli_epi32(hi, 31);
+    lo = _mm_slli_epi32(lo, 1);
+    hi = _mm_slli_epi32(hi, 1);
+    t9 = _mm_srli_si128(t7, 12);
+    t8 = _mm_slli_si128(t8, 4);
+    t7 = _mm_slli_si128(t7, 4);
+    lo = _mm_or_si128(lo, t7);
+    hi = _mm_or_si128(hi, t8);
+    hi = _mm_or_si128(hi, t9);
+
+    t7 = _mm_xor_si128(_mm_xor_si128(_mm_slli_epi32(lo, 31),
+                                     _mm_slli_epi32(lo, 30)),
+                       _mm_slli_epi32(lo, 25));
+    t8 = _mm_srli_si128(t7, 4);
+    lo = _mm_xor_si128(lo, _mm_slli_si128(t7, 12));
+
+    t9 = _mm_xor_si128(_mm_xor_si128(_mm_srli_epi32(lo, 1),
+                                     _mm_srli_epi32(lo, 2)),
+                       _mm_srli_epi32(lo, 7));
+    t9 = _mm_xor_si128(t9, t8);
+    lo = _mm_xor_si128(lo, t9);
+
+    return _mm_xor_si128(hi, lo);
+}
+
+CRYPTO_TARGET(CRYPTO_AES_TARGET)
+static inline __m128i ghash_mul_reduce(__m128i a, __m128i b)
+{
+    __m128i lo = _mm_setzero_si128();
+    __m128i hi = _mm_setzero_si128();
+
+    ghash_mul(a, b, &lo, &hi);
+
+    return ghash_reduce(lo, hi);
+}
+
+CRYPTO_TARGET(CRYPTO_AES_TARGET)
+static void aes_gcm_expand(CryptoCipher *k)
+{
+    const __m128i bswap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10,
+                                       11, 12, 13, 14, 15);
+    __m128i rk[15];
+    __m128i t1, t2, t3;
+    __m128i h[4];
+    int i;
+
+    t1 = _mm_loadu_si128((const __m128i *)k->key);
+    t3 = _mm_loadu_si128((const __m128i *)(k->key + 16));
+    rk[0] = t1;
+    rk[1] = t3;
+    AES_EXPAND_1(rk, 2, 0x01);
+    AES_EXPAND_2(rk, 3);
+    AES_EXPAND_1(rk, 4, 0x02);
+    AES_EXPAND_2(rk, 5);
+    AES_EXPAND_1(rk, 6, 0x04);
+    AES_EXPAND_2(rk, 7);
+    AES_EXPAND_1(rk, 8, 0x08);
+    AES_EXPAND_2(rk, 9);
+    AES_EXPAND_1(rk, 10, 0x10);
+    AES_EXPAND_2(rk, 11);
+    AES_EXPAND_1(rk, 12, 0x20);
+    AES_EXPAND_2(rk, 13);
+    AES_EXPAND_1(rk, 14, 0x40);
+
+    for (i = 0; i < 15; i++)
+        _mm_storeu_si128((__m128i *)(k->aes + 16 * i), rk[i]);
+
+    /* H = E(0), and its powers */
+    h[0] = _mm_shuffle_epi8(aes_encrypt_block(rk, _mm_setzero_si128()),
+                            bswap);
+    for (i = 1; i < 4; i++)
+        h[i] = ghash_mul_reduce(h[i - 1], h[0]);
+
+    for (i = 0; i < 4; i++)
+        _mm_storeu_si128((__m128i *)(k->ghash + 16 * i), h[i]);
+}
+
+/* Hash data zero padded to 16 bytes into x */
+CRYPTO_TARGET(CRYPTO_AES_TARGET)
+static __m128i aes_gcm_ghash(const CryptoCipher *k, __m128i x,
+                             const uint8_t *p, size_t len)
+{
+    const __m128i bswap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10,
+                                       11, 12, 13, 14, 15);
+    __m128i h[4];
+    __m128i lo, hi;
+    __m128i c;
+    uint8_t last[16];
+    int i;
+
+    for (i = 0; i < 4; i++)
+        h[i] = _mm_loadu_si128((const __m128i *)(k->ghash + 16 * i));
+
+    while (len >= 64) {
+        lo = _mm_setzero_si128();
+        hi = _mm_setzero_si128();
+        for (i = 0; i < 4; i++) {
+            c = _mm_shuffle_epi8(
+                    _mm_loadu_si128((const __m128i *)(p + 16 * i)), bswap);
+            if (i == 0)
+                c = _mm_xor_si128(c, x);
+            ghash_mul(c, h[3 - i], &lo, &hi);
+        }
+        x = ghash_reduce(lo, hi);
+        p += 64;
+        len -= 64;
+    }
+
+    while (len) {
+        if (len < 16) {
+            memset(last, 0, sizeof(last));
+            memcpy(last, p, len);
+            p = last;
+            len = 16;
+        }
+        c = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)p), bswap);
+        x = ghash_mul_reduce(_mm_xor_si128(c, x), h[0]);
+        p += 16;
+        len -= 16;
+    }
+
+    return x;
+}
+
+/* Counter mode from the counter block after j0, 8 blocks in flight */
+CRYPTO_TARGET(CRYPTO_AES_TARGET)
+static void aes_gcm_ctr(const CryptoCipher *k, __m128i j0, uint8_t *p,
+                        size_t len)
+{
+    const __m128i bswap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10,
+                                       11, 12, 13, 14, 15);
+    const __m128i one = _mm_set_epi32(0, 0, 0, 1);
+    __m128i rk[15];
+    __m128i ctr = _mm_shuffle_epi8(j0, bswap);
+    __m128i b[8];
+    uint8_t ks[16];
+    size_t n;
+    int i, r;
+
+    for (i = 0; i < 15; i++)
+        rk[i] = _mm_loadu_si128((const __m128i *)(k->aes + 16 * i));
+
+    while (len >= 128) {
+        for (i = 0; i < 8; i++) {
+            ctr = _mm_add_epi32(ctr, one);
+            b[i] = _mm_xor_si128(_mm_shuffle_epi8(ctr, bswap), rk[0]);
+        }
+        for (r = 1; r < 14; r++) {
+            for (i = 0; i < 8; i++)
+                b[i] = _mm_aesenc_si128(b[i], rk[r]);
+        }
+        for (i = 0; i < 8; i++) {
+            b[i] = _mm_aesenclast_si128(b[i], rk[14]);
+            _mm_storeu_si128((__m128i *)(p + 16 * i), _mm_xor_si128(b[i],
+                    _mm_loadu_si128((const __m128i *)(p + 16 * i))));
+        }
+        p += 128;
+        len -= 128;
+    }
+
+    while (len) {
+        ctr = _mm_add_epi32(ctr, one);
+        b[0] = aes_encrypt_block(rk, _mm_shuffle_epi8(ctr, bswap));
+        if (len >= 16) {
+            _mm_storeu_si128((__m128i *)p, _mm_xor_si128(b[0],
+                    _mm_loadu_si128((const __m128i *)p)));
+            p += 16;
+            len -= 16;
+            continue;
+        }
+
+        _mm_storeu_si128((__m128i *)ks, b[0]);
+        for (n = 0; n < len; n++)
+            p[n] ^= ks[n];
+        len = 0;
+    }
+}
+
+CRYPTO_TARGET(CRYPTO_AES_TARGET)
+static void aes_gcm_tag(const CryptoCipher *k, __m128i j0,
+                        const uint8_t *ad, size_t adlen, const uint8_t *c,
+                        size_t len, uint8_t *tag)
+{
+    const __m128i bswap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10,
+                                       11, 12, 13, 14, 15);
+    __m128i x = _mm_setzero_si128();
+    __m128i rk[15];
+    __m128i lens;
+    int i;
+
+    x = aes_gcm_ghash(k, x, ad, adlen);
+    x = aes_gcm_ghash(k, x, c, len);
+
+    /* Bit lengths, already reflected */
+    lens = _mm_set_epi64x((long long)adlen * 8, (long long)len * 8);
+    x = ghash_mul_reduce(_mm_xor_si128(x, lens),
+                         _mm_loadu_si128((const __m128i *)k->ghash));
+
+    for (i = 0; i < 15; i++)
+        rk[i] = _mm_loadu_si128((const __m128i *)(k->aes + 16 * i));
+
+    _mm_storeu_si128((__m128i *)tag,
+                     _mm_xor_si128(_mm_shuffle_epi8(x, bswap),
+                                   aes_encrypt_block(rk, j0)));
+}
+
+/* Counter block 1 of a 12 byte nonce */
+CRYPTO_TARGET(CRYPTO_AES_TARGET)
+static inline __m128i aes_gcm_j0(const uint8_t *nonce)
+{
+    uint8_t j0[16];
+
+    memcpy(j0, nonce, 12);
+    j0[12] = j0[13] = j0[14] = 0;
+    j0[15] = 1;
+
+    return _mm_loadu_si128((const __m128i *)j0);
+}
+
+CRYPTO_TARGET(CRYPTO_AES_TARGET)
+static void aes_gcm_seal(const CryptoCipher *k, const uint8_t *nonce,
+                         const uint8_t *ad, size_t adlen, uint8_t *p,
+                         size_t len, uint8_t *tag)
+{
+    __m128i j0 = aes_gcm_j0(nonce);
+
+    aes_gcm_ctr(k, j0, p, len);
+    aes_gcm_tag(k, j0, ad, adlen, p, len, tag);
+}
+
+CRYPTO_TARGET(CRYPTO_AES_TARGET)
+static int aes_gcm_open(const CryptoCipher *k, const uint8_t *nonce,
+                        const uint8_t *ad, size_t adlen, uint8_t *p,
+                        size_t len, const uint8_t *tag)
+{
+    __m128i j0 = aes_gcm_j0(nonce);
+    uint8_t expect[CRYPTO_TAG_LEN];
+
+    aes_gcm_tag(k, j0, ad, adlen, p, len, expect);
+    if (crypto_compare(expect, tag, CRYPTO_TAG_LEN))
+        return -1;
+
+    aes_gcm_ctr(k, j0, p, len);
+
+    return 0;
+}
+#endif
+
+int crypto_random(void *buf, size_t len)
+{
+    uint8_t *p = (uint8_t *)buf;
+
+#if defined(_WIN32) || defined(_WIN64)
+    unsigned int v;
+    size_t n;
+
+    while (len) {
+        if (rand_s(&v) != 0)
+            return -1;
+        n = len < sizeof(v) ? len : sizeof(v);
+        memcpy(p, &v, n);
+        p += n;
+        len -= n;
+    }
+#else
+    ssize_t rc;
+    int fd;
+
+    fd = open("/dev/urandom", O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    while (len) {
+        rc = read(fd, p, len);
+        if (rc <= 0) {
+            close(fd);
+            return -1;
+        }
+        p += rc;
+        len -= rc;
+    }
+
+    close(fd);
+#endif
+
+    return 0;
+}
+
+int crypto_parse_key(const char *hex, uint8_t *key)
+{
+    int i;
+    int v;
+    char ch;
+
+    if (strlen(hex) != 2 * CRYPTO_KEY_LEN)
+        return -1;
+
+    for (i = 0; i < 2 * CRYPTO_KEY_LEN; i++) {
+        ch = hex[i];
+        if (ch >= '0' && ch <= '9')
+            v = ch - '0';
+        else if (ch >= 'a' && ch <= 'f')
+            v = ch - 'a' + 10;
+        else if (ch >= 'A' && ch <= 'F')
+            v = ch - 'A' + 10;
+        else
+            return -1;
+
+        if (i & 1)
+            key[i / 2] |= (uint8_t)v;
+        else
+            key[i / 2] = (uint8_t)(v << 4);
+    }
+
+    return 0;
+}
+
+int crypto_compare(const void *a, const void *b, size_t len)
+{
+    const uint8_t *x = (const uint8_t *)a;
+    const uint8_t *y = (const uint8_t *)b;
+    uint8_t d = 0;
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        d |= x[i] ^ y[i];
+
+    return d != 0;
+}
+
+/* SipHash-2-4 */
+#define SIPROUND(v0, v1, v2, v3)                                        \
+    do {                                                                \
+        v0 += v1; v1 = v1 << 13 | v1 >> 51; v1 ^= v0;                   \
+        v0 = v0 << 32 | v0 >> 32;                                       \
+        v2 += v3; v3 = v3 << 16 | v3 >> 48; v3 ^= v2;                   \
+        v0 += v3; v3 = v3 << 21 | v3 >> 43; v3 ^= v0;                   \
+        v2 += v1; v1 = v1 << 17 | v1 >> 47; v1 ^= v2;                   \
+        v2 = v2 << 32 | v2 >> 32;                                       \
+    } while (0)
+
+uint64_t crypto_siphash(const uint8_t *key, const void *data, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    uint64_t k0 = load64_le(key);
+    uint64_t k1 = load64_le(key + 8);
+    uint64_t v0 = k0 ^ 0x736f6d6570736575ull;
+    uint64_t v1 = k1 ^ 0x646f72616e646f6dull;
+    uint64_t v2 = k0 ^ 0x6c7967656e657261ull;
+    uint64_t v3 = k1 ^ 0x7465646279746573ull;
+    uint64_t m;
+    size_t left = len & 7;
+    size_t i;
+
+    for (i = 0; i + 8 <= len; i += 8) {
+        m = load64_le(p + i);
+        v3 ^= m;
+        SIPROUND(v0, v1, v2, v3);
+        SIPROUND(v0, v1, v2, v3);
+        v0 ^= m;
+    }
+
+    m = (uint64_t)len << 56;
+    while (left--)
+        m |= (uint64_t)p[i + left] << (8 * left);
+    v3 ^= m;
+    SIPROUND(v0, v1, v2, v3);
+    SIPROUND(v0, v1, v2, v3);
+    v0 ^= m;
+
+    v2 ^= 0xff;
+    SIPROUND(v0, v1, v2, v3);
+    SIPROUND(v0, v1, v2, v3);
+    SIPROUND(v0, v1, v2, v3);
+    SIPROUND(v0, v1, v2, v3);
+
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+static void crypto_set_cipher(CryptoCipher *k, uint8_t cipher,
+                              const uint8_t *key, const uint8_t *salt)
+{
+    memcpy(k->key, key, CRYPTO_KEY_LEN);
+    memcpy(k->salt, salt, sizeof(k->salt));
+
+#ifdef CRYPTO_X86
+    if (cipher == CRYPTO_AES256_GCM)
+        aes_gcm_expand(k);
+#else
+    (void)cipher;
+#endif
+}
+
+int crypto_aead_seal(uint8_t cipher, const uint8_t *key,
+                     const uint8_t *nonce, const uint8_t *ad, size_t adlen,
+                     uint8_t *p, size_t len, uint8_t *tag)
+{
+    static const uint8_t salt[4];
+    CryptoCipher k;
+
+    if (!(cipher & crypto_ciphers()))
+        return -1;
+
+    crypto_set_cipher(&k, cipher, key, salt);
+#ifdef CRYPTO_X86
+    if (cipher == CRYPTO_AES256_GCM)
+        aes_gcm_seal(&k, nonce, ad, adlen, p, len, tag);
+    else
+#endif
+        chacha20_poly1305_seal(&k, nonce, ad, adlen, p, len, tag);
+
+    return 0;
+}
+
+int crypto_aead_open(uint8_t cipher, const uint8_t *key,
+                     const uint8_t *nonce, const uint8_t *ad, size_t adlen,
+                     uint8_t *p, size_t len, const uint8_t *tag)
+{
+    static const uint8_t salt[4];
+    CryptoCipher k;
+
+    if (!(cipher & crypto_ciphers()))
+        return -1;
+
+    crypto_set_cipher(&k, cipher, key, salt);
+#ifdef CRYPTO_X86
+    if (cipher == CRYPTO_AES256_GCM)
+        return aes_gcm_open(&k, nonce, ad, adlen, p, len, tag);
+#endif
+
+    return chacha20_poly1305_open(&k, nonce, ad, adlen, p, len, tag);
+}
+
+void crypto_derive(CryptoKeys *k, const uint8_t *key, uint8_t cipher,
+                   uint8_t phase, const uint8_t *client_nonce,
+                   const uint8_t *server_nonce, int server,
+                   uint8_t *confirm)
+{
+    static const uint8_t zero[12];
+    uint8_t prk[CRYPTO_KEY_LEN];
+    uint8_t okm[128];
+    uint8_t msg[2 + 2 * CRYPTO_NONCE_LEN];
+    uint32_t s[16];
+    Poly1305 st;
+
+    /* XChaCha20 style: both nonces through HChaCha20, the key stream
+       gives a key and salt per direction and a one time key for the
+       confirmation */
+    hchacha20(key, client_nonce, prk);
+    hchacha20(prk, server_nonce, prk);
+    chacha20_init(s, prk, 0, zero);
+    memset(okm, 0, sizeof(okm));
+    chacha20_xor_blocks(s, okm, sizeof(okm));
+
+    memset(k, 0, sizeof(CryptoKeys));
+    k->cipher = cipher;
+    k->phase = phase;
+    crypto_set_cipher(server ? &k->recv : &k->send, cipher, okm, okm + 96);
+    crypto_set_cipher(server ? &k->send : &k->recv, cipher, okm + 32,
+                      okm + 100);
+
+    /* Covers the choices of the server too */
+    msg[0] = cipher;
+    msg[1] = phase;
+    memcpy(msg + 2, client_nonce, CRYPTO_NONCE_LEN);
+    memcpy(msg + 2 + CRYPTO_NONCE_LEN, server_nonce, CRYPTO_NONCE_LEN);
+    poly1305_init(&st, okm + 64);
+    poly1305_padded(&st, msg, sizeof(msg));
+    poly1305_finish(&st, confirm);
+
+    memset(prk, 0, sizeof(prk));
+    memset(okm, 0, sizeof(okm));
+}
+
+Crypto *crypto_create(void)
+{
+    return (Crypto *)calloc(1, sizeof(Crypto));
+}
+
+void crypto_free(Crypto *c)
+{
+    if (!c)
+        return;
+
+    memset(c, 0, sizeof(Crypto));
+    free(c);
+}
+
+void crypto_set_keys(Crypto *c, const CryptoKeys *k, int server)
+{
+    if (server && c->keys.cipher)
+        c->next = *k;
+    else
+        c->keys = *k;
+}
+
+/* Salt and the marker and counter of the datagram */
+static inline void crypto_nonce(const CryptoCipher *k, const uint8_t *hdr,
+                                uint8_t *nonce)
+{
+    memcpy(nonce, k->salt, 4);
+    memcpy(nonce + 4, hdr, CRYPTO_HEADER_LEN);
+}
+
+size_t crypto_seal(Crypto *c, void *out, const void *hdr, size_t hlen,
+                   const void *data, size_t len)
+{
+    CryptoKeys *k = &c->keys;
+    uint8_t *o = (uint8_t *)out;
+    uint8_t *p = o + CRYPTO_HEADER_LEN;
+    uint64_t start = crypto_cycles();
+    uint64_t seq = k->send_seq++;
+    uint8_t nonce[12];
+    size_t n = hlen + len;
+    int i;
+
+    o[0] = MSG_SEALED | k->phase;
+    for (i = 7; i > 0; i--) {
+        o[i] = (uint8_t)seq;
+        seq >>= 8;
+    }
+
+    memcpy(p, hdr, hlen);
+    if (len)
+        memcpy(p + hlen, data, len);
+
+    crypto_nonce(&k->send, o, nonce);
+#ifdef CRYPTO_X86
+    if (k->cipher == CRYPTO_AES256_GCM)
+        aes_gcm_seal(&k->send, nonce, o, CRYPTO_HEADER_LEN, p, n, p + n);
+    else
+#endif
+        chacha20_poly1305_seal(&k->send, nonce, o, CRYPTO_HEADER_LEN, p, n,
+                               p + n);
+
+    c->sealed++;
+    c->seal_bytes += n;
+    c->seal_cycles += crypto_cycles() - start;
+
+    return n + CRYPTO_OVERHEAD;
+}
+
+int crypto_open(Crypto *c, void *p, size_t len)
+{
+    CryptoKeys *k = &c->keys;
+    uint8_t *q = (uint8_t *)p;
+    uint64_t start = crypto_cycles();
+    uint64_t seq = 0;
+    uint64_t *seen;
+    uint8_t nonce[12];
+    size_t n;
+    int rc;
+    int i;
+
+    if (len < CRYPTO_OVERHEAD) {
+        c->failed++;
+        return -1;
+    }
+
+    /* The other phase is the keys of a newer hello, if any */
+    if (!k->cipher || k->phase != (q[0] & 1)) {
+        k = &c->next;
+        if (!k->cipher || k->phase != (q[0] & 1)) {
+            c->failed++;
+            return -1;
+        }
+    }
+
+    for (i = 1; i < CRYPTO_HEADER_LEN; i++)
+        seq = seq << 8 | q[i];
+
+    seen = &k->recv_seen[seq / 64 % CRYPTO_REPLAY_WORDS];
+    if (seq < k->recv_top &&
+        (k->recv_top - 1 - seq >= CRYPTO_REPLAY_WINDOW - 64 ||
+         (*seen >> (seq % 64) & 1))) {
+        c->replayed++;
+        return -1;
+    }
+
+    n = len - CRYPTO_OVERHEAD;
+    crypto_nonce(&k->recv, q, nonce);
+#ifdef CRYPTO_X86
+    if (k->cipher == CRYPTO_AES256_GCM)
+        rc = aes_gcm_open(&k->recv, nonce, q, CRYPTO_HEADER_LEN,
+                          q + CRYPTO_HEADER_LEN, n,
+                          q + CRYPTO_HEADER_LEN + n);
+    else
+#endif
+        rc = chacha20_poly1305_open(&k->recv, nonce, q, CRYPTO_HEADER_LEN,
+                                    q + CRYPTO_HEADER_LEN, n,
+                                    q + CRYPTO_HEADER_LEN + n);
+    if (rc < 0) {
+        c->failed++;
+        return -1;
+    }
+
+    if (seq >= k->recv_top) {
+        /* Clear the words the window moves past */
+        uint64_t w = k->recv_top ? (k->recv_top - 1) / 64 + 1 : 0;
+        uint64_t top = seq / 64;
+
+        if (top >= w && top - w >= CRYPTO_REPLAY_WORDS)
+            w = top - CRYPTO_REPLAY_WORDS + 1;
+        for (; w <= top; w++)
+            k->recv_seen[w % CRYPTO_REPLAY_WORDS] = 0;
+        k->recv_top = seq + 1;
+    }
+    *seen |= 1ull << (seq % 64);
+
+    /* The peer took the newer keys, the old ones are done */
+    if (k == &c->next) {
+        c->keys = c->next;
+        memset(&c->next, 0, sizeof(CryptoKeys));
+    }
+
+    c->opened++;
+    c->open_bytes += n;
+    c->open_cycles += crypto_cycles() - start;
+
+    return (int)n;
+}
+
+void crypto_log_stats(const Crypto *c, const char *name)
+{
+    log_info("Peer %s crypto: %s, %lu sealed, %lu opened, %lu not "
+             "authentic, %lu replayed, %.2f cycles/byte sealing, %.2f "
+             "opening.", name, crypto_cipher_name(c->keys.cipher),
+             c->sealed, c->opened, c->failed, c->replayed,
+             c->seal_bytes ? (double)c->seal_cycles / c->seal_bytes : 0.0,
+             c->open_bytes ? (double)c->open_cycles / c->open_bytes : 0.0);
+}
@@ -0,0 +1,168 @@
+/*
+ * udptunnel : Lightweight TCP over UDP Tunneling
+ *
+ * Copyright (C) 2014 Jingyu jingyu.niu@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __CRYPTO_H__
+#define __CRYPTO_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Authenticated encryption of whole datagrams. Both ends share a key,
+   each hello derives fresh session keys from it and random nonces of
+   both ends. A sealed datagram is:
+
+     marker   1 byte, MSG_SEALED | key phase
+     counter  7 bytes, big endian, new for every datagram
+     sealed   the plaintext datagram, encrypted
+     tag      16 bytes
+
+   The marker and counter are authenticated, not encrypted. The nonce is
+   a 4 byte salt of the session keys followed by the counter. */
+
+#define CRYPTO_KEY_LEN                      32
+#define CRYPTO_NONCE_LEN                    16      /* Of a hello */
+#define CRYPTO_TAG_LEN                      16
+#define CRYPTO_HEADER_LEN                   8
+#define CRYPTO_OVERHEAD                     (CRYPTO_HEADER_LEN + \
+                                             CRYPTO_TAG_LEN)
+
+/* Ciphers, 8 bits */
+#define CRYPTO_CHACHA20_POLY1305            0x01
+#define CRYPTO_AES256_GCM                   0x02
+
+/* Counters below the newest one opened still taken, reordered on the
+   way. A ring of bits, the last word is being reused. */
+#define CRYPTO_REPLAY_WINDOW                1024
+#define CRYPTO_REPLAY_WORDS                 (CRYPTO_REPLAY_WINDOW / 64)
+
+/* One direction of the session keys */
+typedef struct crypto_cipher {
+    uint8_t key[CRYPTO_KEY_LEN];
+    uint8_t salt[4];
+    uint8_t aes[15 * 16];               /* AES round keys */
+    uint8_t ghash[4 * 16];              /* H^1..H^4, byte reflected */
+} CryptoCipher;
+
+typedef struct crypto_keys {
+    uint8_t cipher;                     /* 0 if none */
+    uint8_t phase;                      /* Low bit of the marker */
+
+    CryptoCipher send;
+    CryptoCipher recv;
+
+    uint64_t send_seq;
+    uint64_t recv_top;                  /* Newest counter opened + 1 */
+    uint64_t recv_seen[CRYPTO_REPLAY_WORDS];   /* Bit n % window */
+} CryptoKeys;
+
+/* Session with a peer */
+typedef struct crypto {
+    CryptoKeys keys;
+    CryptoKeys next;                    /* From a newer hello, used once
+                                           the peer seals with them */
+    uint32_t heard;                     /* Last opened, tunnel_clock() */
+
+    /* Statistics */
+    unsigned long sealed;
+    unsigned long opened;
+    unsigned long failed;               /* Not authentic */
+    unsigned long replayed;
+    unsigned long long seal_bytes;
+    unsigned long long open_bytes;
+    unsigned long long seal_cycles;     /* 0 where not counted */
+    unsigned long long open_cycles;
+} Crypto;
+
+/* Find what the CPU has, once. */
+void crypto_init(void);
+
+/* Leave out the AES-NI and AVX2 paths from now on, as on a CPU without
+   them. For benchmarks. */
+void crypto_disable_simd(void);
+
+/* Ciphers with a hardware path here, AES-GCM needs AES-NI and
+   PCLMULQDQ. ChaCha20-Poly1305 is always there. */
+uint8_t crypto_ciphers(void);
+
+/* Cipher for both ends: AES-GCM if both have it, else ChaCha20-Poly1305.
+   Returns 0 if there is none in common. */
+uint8_t crypto_choose(uint8_t peer_ciphers);
+
+const char *crypto_cipher_name(uint8_t cipher);
+
+/* Fill buf from the system random source, returns -1 on error. */
+int crypto_random(void *buf, size_t len);
+
+/* Key from 64 hex digits, returns -1 if malformed. */
+int crypto_parse_key(const char *hex, uint8_t *key);
+
+/* SipHash-2-4 of len bytes with a 16 byte key, a MAC for short lived
+   tokens. */
+uint64_t crypto_siphash(const uint8_t *key, const void *data, size_t len);
+
+/* Constant time, returns 0 if equal. */
+int crypto_compare(const void *a, const void *b, size_t len);
+
+/* Session keys of one hello, the tag in confirm proves the server holds
+   the key. The client's send keys are the server's receive keys. */
+void crypto_derive(CryptoKeys *k, const uint8_t *key, uint8_t cipher,
+                   uint8_t phase, const uint8_t *client_nonce,
+                   const uint8_t *server_nonce, int server,
+                   uint8_t *confirm);
+
+/* Seal len bytes at p in place with a cipher, its key and a 12 byte
+   nonce, ad is authenticated only. Returns -1 if the cipher is not there.
+   For known answer tests, datagrams are sealed by crypto_seal(). */
+int crypto_aead_seal(uint8_t cipher, const uint8_t *key,
+                     const uint8_t *nonce, const uint8_t *ad, size_t adlen,
+                     uint8_t *p, size_t len, uint8_t *tag);
+
+/* Open what crypto_aead_seal() sealed, returns -1 if not authentic. */
+int crypto_aead_open(uint8_t cipher, const uint8_t *key,
+                     const uint8_t *nonce, const uint8_t *ad, size_t adlen,
+                     uint8_t *p, size_t len, const uint8_t *tag);
+
+Crypto *crypto_create(void);
+
+void crypto_free(Crypto *c);
+
+/* Keys of a new hello. The server keeps using the old ones until the peer
+   seals with the new ones, a hello replayed on the way changes nothing. */
+void crypto_set_keys(Crypto *c, const CryptoKeys *k, int server);
+
+/* Seal the header and payload into out, which takes CRYPTO_OVERHEAD
+   bytes more. Returns the sealed length. */
+size_t crypto_seal(Crypto *c, void *out, const void *hdr, size_t hlen,
+                   const void *data, size_t len);
+
+/* Open the sealed datagram at p of len bytes in place, the plaintext
+   starts CRYPTO_HEADER_LEN bytes in. Returns its length, -1 if the
+   datagram is not authentic or was opened before. */
+int crypto_open(Crypto *c, void *p, size_t len);
+
+void crypto_log_stats(const Crypto *c, const char *name);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CRYPTO_H__ */
@@ -0,0 +1,489 @@
+/*
+ * udptunnel : Lightweight TCP over UDP Tunneling
+ *
+ * Copyright (C) 2014 Jingyu jingyu.niu@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+
+#include "log.h"
+#include "message.h"
+#include "tunnel_i.h"
+
+#include "dedup.h"
+
+/* Gear hash table for chunking, filled once */
+static uint64_t dedup_gear[256];
+
+static void dedup_init_gear(void)
+{
+    uint64_t x = 0x9E3779B97F4A7C15ull;
+    uint64_t z;
+    int i;
+
+    if (dedup_gear[0])
+        return;
+
+    /* splitmix64 */
+    for (i = 0; i < 256; i++) {
+        z = (x += 0x9E3779B97F4A7C15ull);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        dedup_gear[i] = z ^ (z >> 31);
+    }
+}
+
+/* Length of the chunk at p, limit bytes at most. *cut tells whether it
+   ends at a content defined boundary or the limit, not just the end of
+   the data. */
+static size_t dedup_chunk(const uint8_t *p, size_t len, size_t limit,
+                          int *cut)
+{
+    size_t max = len < limit ? len : limit;
+    uint64_t h = 0;
+    size_t i;
+
+    /* The hash only depends on the last 64 bytes */
+    for (i = 0; i < max; i++) {
+        h = (h << 1) + dedup_gear[p[i]];
+        if (i >= DEDUP_MIN_CHUNK - 1 && !(h >> (64 - DEDUP_AVG_BITS))) {
+            *cut = 1;
+            return i + 1;
+        }
+    }
+
+    *cut = max == limit;
+    return max;
+}
+
+static uint64_t dedup_fingerprint(const uint8_t *p, size_t len)
+{
+    uint64_t h = len * 0x9E3779B97F4A7C15ull;
+    uint64_t w;
+    size_t i;
+
+    for (i = 0; i + 8 <= len; i += 8) {
+        memcpy(&w, p + i, sizeof(w));
+        h = (h ^ w) * 0xBF58476D1CE4E5B9ull;
+        h ^= h >> 31;
+    }
+    for (; i < len; i++)
+        h = (h ^ p[i]) * 0x94D049BB133111EBull;
+
+    return h ^ (h >> 29);
+}
+
+static size_t dedup_varint_len(uint32_t v)
+{
+    size_t n = 1;
+
+    while (v >= 0x80) {
+        v >>= 7;
+        n++;
+    }
+
+    return n;
+}
+
+Dedup *dedup_create(uint32_t size, uint32_t epoch)
+{
+    Dedup *d;
+    uint32_t index_size;
+
+    if (size > DEDUP_MAX_SLOTS)
+        size = DEDUP_MAX_SLOTS;
+
+    /* Index is a power of 2, at least 4 entries per slot */
+    for (index_size = 2; index_size < size * 4; index_size *= 2)
+        ;
+
+    d = (Dedup *)calloc(1, sizeof(Dedup));
+    if (!d)
+        return NULL;
+
+    d->size = size;
+    d->epoch = epoch;
+    d->index_mask = index_size - 1;
+
+    d->send_slots = (DedupSlot *)calloc(size, sizeof(DedupSlot));
+    d->send_data = (char *)malloc((size_t)size * DEDUP_MAX_CHUNK);
+    d->index = (uint32_t *)calloc(index_size, sizeof(uint32_t));
+    d->recv_len = (uint16_t *)calloc(size, sizeof(uint16_t));
+    d->recv_gen = (uint8_t *)calloc(size, sizeof(uint8_t));
+    d->recv_data = (char *)malloc((size_t)size * DEDUP_MAX_CHUNK);
+    if (!d->send_slots || !d->send_data || !d->index || !d->recv_len ||
+        !d->recv_gen || !d->recv_data) {
+        dedup_free(d);
+        return NULL;
+    }
+
+    dedup_init_gear();
+
+    return d;
+}
+
+void dedup_free(Dedup *d)
+{
+    if (!d)
+        return;
+
+    free(d->send_slots);
+    free(d->send_data);
+    free(d->index);
+    free(d->recv_len);
+    free(d->recv_gen);
+    free(d->recv_data);
+    free(d);
+}
+
+void dedup_set_peer(Dedup *d, uint32_t slots, uint32_t epoch)
+{
+    if (slots > d->size)
+        slots = d->size;
+
+    if (epoch == d->peer_epoch) {
+        d->slots = slots;
+        return;
+    }
+
+    /* The peer's cache is a new one, what each end holds is unknown */
+    if (d->peer_epoch)
+        log_info("Dedup cache of the peer restarted, clear ours.");
+
+    memset(d->send_slots, 0, d->size * sizeof(DedupSlot));
+    memset(d->index, 0, (d->index_mask + 1) * sizeof(uint32_t));
+    memset(d->recv_len, 0, d->size * sizeof(uint16_t));
+    memset(d->recv_gen, 0, d->size * sizeof(uint8_t));
+    d->hand = 0;
+
+    d->slots = slots;
+    d->peer_epoch = epoch;
+}
+
+static inline uint32_t dedup_bucket(const Dedup *d, uint64_t fp)
+{
+    /* Buckets hold 2 entries */
+    return (uint32_t)fp & d->index_mask & ~1u;
+}
+
+/* Sender slot holding the chunk, -1 if none */
+static int32_t dedup_lookup(Dedup *d, uint64_t fp, const uint8_t *p,
+                            size_t len)
+{
+    uint32_t bucket = dedup_bucket(d, fp);
+    DedupSlot *slot;
+    uint32_t i;
+    int way;
+
+    /* Fingerprints only find the slot, the data is what matches */
+    for (way = 0; way < 2; way++) {
+        i = d->index[bucket | way];
+        if (!i-- || i >= d->slots)
+            continue;
+
+        slot = &d->send_slots[i];
+        if (slot->fp == fp && slot->len == len &&
+            memcmp(d->send_data + (size_t)i * DEDUP_MAX_CHUNK, p, len) == 0)
+            return (int32_t)i;
+    }
+
+    return -1;
+}
+
+/* Whether an index entry points at a slot still holding a chunk of the
+   bucket */
+static int dedup_index_live(const Dedup *d, uint32_t i, uint32_t bucket)
+{
+    return i-- && i < d->slots && d->send_slots[i].len &&
+           dedup_bucket(d, d->send_slots[i].fp) == bucket;
+}
+
+/* Point the index at a new slot, over an entry gone stale or the one
+   used longer ago */
+static void dedup_index_put(Dedup *d, uint64_t fp, uint32_t i)
+{
+    uint32_t bucket = dedup_bucket(d, fp);
+    uint32_t *e = &d->index[bucket];
+    int way;
+
+    if (!dedup_index_live(d, e[0], bucket))
+        way = 0;
+    else if (!dedup_index_live(d, e[1], bucket))
+        way = 1;
+    else
+        way = (int32_t)(d->send_slots[e[0] - 1].used -
+                        d->send_slots[e[1] - 1].used) < 0 ? 0 : 1;
+
+    e[way] = i + 1;
+}
+
+/* Slot to store a new chunk into, -1 if all the ones looked at may still
+   be referenced */
+static int32_t dedup_alloc(Dedup *d, uint32_t now)
+{
+    DedupSlot *slot;
+    uint32_t i;
+    int n;
+
+    for (n = 0; n < DEDUP_REUSE_PROBES; n++) {
+        i = d->hand;
+        if (++d->hand >= d->slots)
+            d->hand = 0;
+
+        slot = &d->send_slots[i];
+        if (!slot->len ||
+            CLOCK_AFTER(now, slot->used + DEDUP_REUSE_TIME * 1000))
+            return (int32_t)i;
+    }
+
+    return -1;
+}
+
+/* Literal of up to n bytes, cut short to what fits. Returns the bytes
+   taken. */
+static size_t dedup_put_literal(uint8_t *out, size_t *op, size_t cap,
+                                const uint8_t *p, size_t n)
+{
+    if (*op + dedup_varint_len((uint32_t)n << 2) + n > cap)
+        n = cap - *op - 3;
+
+    *op += message_put_varint(out + *op, (uint32_t)n << 2 | DEDUP_OP_LITERAL);
+    memcpy(out + *op, p, n);
+    *op += n;
+
+    return n;
+}
+
+size_t dedup_encode(Dedup *d, DedupBlock *b, void *dst, size_t cap,
+                    uint32_t now)
+{
+    const uint8_t *in = (const uint8_t *)b->data;
+    uint8_t *out = (uint8_t *)dst;
+    size_t max = b->max < b->len ? b->max : b->len;
+    size_t limit = DEDUP_MAX_CHUNK;
+    size_t ip = 0;
+    size_t op = 0;
+    size_t n;
+    size_t need;
+    size_t taken;
+    int known;
+    int used = 0;
+    int32_t i;
+    uint64_t fp;
+    DedupSlot *slot;
+
+    b->first = d->seq;
+    b->count = 0;
+
+    if (!d->slots || cap <= DEDUP_MIN_CHUNK + DEDUP_OP_OVERHEAD)
+        return 0;
+
+    /* Any chunk fits in a message of its own */
+    if (limit > cap - DEDUP_OP_OVERHEAD)
+        limit = cap - DEDUP_OP_OVERHEAD;
+
+    /* Chunks are found again from where the last message cut one */
+    if (b->lead) {
+        n = b->lead < max ? b->lead : max;
+        ip = dedup_put_literal(out, &op, cap, in, n);
+        b->lead -= (uint16_t)ip;
+    }
+
+    while (!b->lead && ip < max && op + 3 < cap) {
+        n = dedup_chunk(in + ip, b->len - ip, limit, &known);
+        known |= !b->more;
+
+        /* Its end may be in data not read yet, start the next message
+           with it */
+        if (!known && ip)
+            break;
+
+        i = -1;
+        if (known) {
+            fp = dedup_fingerprint(in + ip, n);
+            i = dedup_lookup(d, fp, in + ip, n);
+        }
+
+        /* Stored but not ACKed yet, sent as is again */
+        if (i >= 0 && d->send_slots[i].ready) {
+            slot = &d->send_slots[i];
+            need = dedup_varint_len((uint32_t)i << 2) + 1;
+            if (ip + n > max || op + need > cap)
+                break;
+
+            op += message_put_varint(out + op,
+                                     (uint32_t)i << 2 | DEDUP_OP_REF);
+            out[op++] = slot->gen;
+            slot->used = now;
+
+            d->lookups++;
+            d->hits++;
+            d->saved += n - need;
+            ip += n;
+            used = 1;
+            continue;
+        }
+
+        if (known && i < 0 && ip + n <= max &&
+            (i = dedup_alloc(d, now)) >= 0) {
+            need = dedup_varint_len((uint32_t)n << 2) +
+                   dedup_varint_len((uint32_t)i) + 1 + n;
+            if (op + need <= cap) {
+                slot = &d->send_slots[i];
+                slot->fp = fp;
+                slot->seq = d->seq;
+                slot->len = (uint16_t)n;
+                slot->used = now;
+                slot->ready = 0;
+                d->log[d->seq++ & (DEDUP_LOG_SIZE - 1)] = (uint32_t)i;
+                b->count++;
+                if (++slot->gen == 0)
+                    slot->gen = 1;
+                memcpy(d->send_data + (size_t)i * DEDUP_MAX_CHUNK, in + ip,
+                       n);
+                dedup_index_put(d, fp, (uint32_t)i);
+
+                op += message_put_varint(out + op,
+                                         (uint32_t)n << 2 | DEDUP_OP_STORE);
+                op += message_put_varint(out + op, (uint32_t)i);
+                out[op++] = slot->gen;
+                memcpy(out + op, in + ip, n);
+                op += n;
+
+                d->lookups++;
+                d->stored++;
+                ip += n;
+                used = 1;
+                continue;
+            }
+        }
+
+        /* Chunks are only split to fill the wire, and not for a little
+           room */
+        if (known && ip &&
+            (op + n + DEDUP_OP_OVERHEAD > cap ? cap - op < cap / 4 :
+                                                ip + n > max))
+            break;
+
+        /* Literal, what does not fit leads the next message */
+        taken = dedup_put_literal(out, &op, cap, in + ip,
+                                  ip + n <= max ? n : max - ip);
+        if (known) {
+            b->lead = (uint16_t)(n - taken);
+            d->lookups++;
+        }
+        ip += taken;
+    }
+
+    b->taken = ip;
+
+    return used ? op : 0;
+}
+
+void dedup_confirm(Dedup *d, uint32_t first, uint16_t count)
+{
+    DedupSlot *slot;
+    uint32_t seq;
+
+    /* Slots reused since, or stores gone from the log, do not match */
+    for (seq = first; seq != first + count; seq++) {
+        slot = &d->send_slots[d->log[seq & (DEDUP_LOG_SIZE - 1)]];
+        if (slot->len && slot->seq == seq)
+            slot->ready = 1;
+    }
+}
+
+int dedup_decode(Dedup *d, const void *src, size_t len, void *dst,
+                 size_t cap)
+{
+    const uint8_t *p = (const uint8_t *)src;
+    const uint8_t *end = p + len;
+    uint8_t *out = (uint8_t *)dst;
+    size_t op = 0;
+    uint32_t v;
+    uint32_t i;
+    size_t n;
+    int op_type;
+
+    while (p < end) {
+        if (!(n = message_get_varint(p, end, &v)))
+            return -1;
+        p += n;
+        op_type = v & 3;
+        v >>= 2;
+
+        switch (op_type) {
+        case DEDUP_OP_LITERAL:
+            if (v > (size_t)(end - p) || v > cap - op)
+                return -1;
+            memcpy(out + op, p, v);
+            p += v;
+            op += v;
+            break;
+
+        case DEDUP_OP_STORE:
+            if (!(n = message_get_varint(p, end, &i)))
+                return -1;
+            p += n;
+            if (i >= d->slots || !v || v > DEDUP_MAX_CHUNK ||
+                p >= end || v > (size_t)(end - p - 1) || v > cap - op)
+                return -1;
+
+            d->recv_gen[i] = *p++;
+            d->recv_len[i] = (uint16_t)v;
+            memcpy(d->recv_data + (size_t)i * DEDUP_MAX_CHUNK, p, v);
+            memcpy(out + op, p, v);
+            p += v;
+            op += v;
+            break;
+
+        case DEDUP_OP_REF:
+            if (v >= d->slots || p >= end)
+                return -1;
+
+            /* Not what the sender stored, the caches are out of step */
+            if (!d->recv_len[v] || d->recv_gen[v] != *p) {
+                d->refused++;
+                return 0;
+            }
+            p++;
+
+            n = d->recv_len[v];
+            if (n > cap - op)
+                return -1;
+            memcpy(out + op, d->recv_data + (size_t)v * DEDUP_MAX_CHUNK, n);
+            op += n;
+            d->resolved++;
+            break;
+
+        default:
+            return -1;
+        }
+    }
+
+    return (int)op;
+}
+
+void dedup_log_stats(const Dedup *d, const char *name)
+{
+    log_info("Peer %s dedup: %u slots, %lu of %lu chunks hit, %.1f%%, "
+             "%llu bytes saved, %lu stored, %lu references resolved, "
+             "%lu messages refused.", name, d->slots, d->hits, d->lookups,
+             d->lookups ? d->hits * 100.0 / d->lookups : 0.0, d->saved,
+             d->stored, d->resolved, d->refused);
+}
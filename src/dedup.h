@@ -0,0 +1,159 @@
+/*
+ * udptunnel : Lightweight TCP over UDP Tunneling
+ *
+ * Copyright (C) 2014 Jingyu jingyu.niu@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __DEDUP_H__
+#define __DEDUP_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Chunk cache shared by all the channels to a peer. Channel data is cut
+   into content defined chunks, the sender tells the receiver to store
+   chunks in numbered slots and later sends a slot number instead of a
+   chunk seen again. Both ends hold a copy of every slot, the sender picks
+   the slot to reuse.
+
+   A MSG_CHANNEL_DATA_DEDUP payload is a run of ops, each starting with a
+   varint whose low 2 bits are the op:
+
+     DEDUP_OP_LITERAL   len << 2, the bytes
+     DEDUP_OP_STORE     len << 2, varint slot, generation byte, the bytes
+     DEDUP_OP_REF       slot << 2, generation byte
+
+   The sender only references a slot once the message storing it has been
+   ACKed, and only reuses it once no message referencing it can still be
+   resent. A slot's generation goes up on every store, a reference that
+   does not match is not taken. */
+
+#define DEDUP_OP_LITERAL                    0
+#define DEDUP_OP_STORE                      1
+#define DEDUP_OP_REF                        2
+
+/* Chunk sizes, the average is 2^DEDUP_AVG_BITS */
+#define DEDUP_MIN_CHUNK                     64
+#define DEDUP_AVG_BITS                      8
+#define DEDUP_MAX_CHUNK                     1024
+
+/* Most bytes an op takes besides the chunk */
+#define DEDUP_OP_OVERHEAD                   8
+
+/* Longer than a message may be resent for, see channel.h */
+#define DEDUP_REUSE_TIME                    120 /* seconds */
+
+/* Slots looked at for one to reuse */
+#define DEDUP_REUSE_PROBES                  8
+
+/* Stores waiting for an ACK, a power of 2. Older ones are never
+   referenced. */
+#define DEDUP_LOG_SIZE                      4096
+
+#define DEDUP_MAX_SLOTS                     (1 << 20)
+
+/* Cache memory per slot, both directions */
+#define DEDUP_SLOT_SIZE                     (2 * DEDUP_MAX_CHUNK + 16)
+
+typedef struct dedup_slot {
+    uint64_t fp;                        /* Chunk fingerprint */
+    uint32_t seq;                       /* Store sequence */
+    uint32_t used;                      /* Last sent, tunnel_clock() */
+    uint16_t len;                       /* 0 if empty */
+    uint8_t gen;
+    uint8_t ready;                      /* Store ACKed */
+} DedupSlot;
+
+typedef struct dedup {
+    uint32_t size;                      /* Slots allocated */
+    uint32_t slots;                     /* Slots both ends have */
+    uint32_t epoch;                     /* Random, new per cache */
+    uint32_t peer_epoch;                /* The peer's, 0 if unknown */
+
+    /* Sender: what the peer holds, found by fingerprint */
+    DedupSlot *send_slots;
+    char *send_data;
+    uint32_t *index;                    /* Slot + 1, 0 if empty */
+    uint32_t index_mask;
+    uint32_t hand;                      /* Next slot to reuse */
+    uint32_t seq;                       /* Next store sequence */
+    uint32_t log[DEDUP_LOG_SIZE];       /* Slots by store sequence */
+
+    /* Receiver: what the peer stored */
+    uint16_t *recv_len;
+    uint8_t *recv_gen;
+    char *recv_data;
+
+    /* Statistics */
+    unsigned long lookups;
+    unsigned long hits;
+    unsigned long stored;
+    unsigned long long saved;           /* Bytes not sent */
+    unsigned long resolved;             /* References received */
+    unsigned long refused;              /* Messages not taken */
+} Dedup;
+
+/* Channel data to encode into one message */
+typedef struct dedup_block {
+    const char *data;
+    size_t len;                         /* Looked at for chunk ends */
+    size_t max;                         /* Taken at most */
+    int more;                           /* Data may follow len */
+    uint16_t lead;                      /* Rest of a chunk the last message
+                                           began, updated */
+
+    /* Out */
+    size_t taken;
+    uint32_t first;                     /* Stores made, by sequence */
+    uint16_t count;
+} DedupBlock;
+
+/* Cache of up to size slots. Returns NULL if out of memory. */
+Dedup *dedup_create(uint32_t size, uint32_t epoch);
+
+void dedup_free(Dedup *d);
+
+/* Slots the peer has and its cache epoch. Both directions start over
+   when the peer's cache is a new one. */
+void dedup_set_peer(Dedup *d, uint32_t slots, uint32_t epoch);
+
+/* Encode a block into dst of cap bytes. Chunks are cut on the stream, a
+   message ends where a chunk does, or takes what fits of the next one if
+   more than a quarter would be left unused and leaves the rest as the
+   lead of the next message. Returns the encoded length, 0 if nothing was
+   stored or referenced. */
+size_t dedup_encode(Dedup *d, DedupBlock *b, void *dst, size_t cap,
+                    uint32_t now);
+
+/* The message carrying these stores was ACKed */
+void dedup_confirm(Dedup *d, uint32_t first, uint16_t count);
+
+/* Decode a payload of len bytes into dst of cap bytes. Returns the data
+   length, 0 if a referenced chunk is not the one stored, -1 if it is
+   malformed. */
+int dedup_decode(Dedup *d, const void *src, size_t len, void *dst,
+                 size_t cap);
+
+void dedup_log_stats(const Dedup *d, const char *name);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __DEDUP_H__ */
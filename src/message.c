@@ -16,8 +16,15 @@
  * limitations under the License.
  */
 
+#if defined(__linux__)
+#define _GNU_SOURCE                     /* recvmmsg() */
+#endif
+
 #include <string.h>
 #include <assert.h>
+#if !defined(_WIN32) && !defined(_WIN64)
+#include <sys/uio.h>
+#endif
 
 #include "config.h"
 
@@ -65,6 +72,26 @@ static const char *message_get_type_name(int type)
         name = "CC";
         break;
 
+    case MSG_TUNNEL_PROBE:
+        name = "TP";
+        break;
+
+    case MSG_TUNNEL_PROBE_ACK:
+        name = "TPA";
+        break;
+
+    case MSG_CHANNEL_DATA_DEDUP:
+        name = "CDD";
+        break;
+
+    case MSG_TUNNEL_MIGRATE:
+        name = "TM";
+        break;
+
+    case MSG_TUNNEL_MIGRATE_ACK:
+        name = "TMA";
+        break;
+
     default:
         name = "N/A";
     }
@@ -73,76 +100,480 @@ static const char *message_get_type_name(int type)
 }
 #endif
 
-int message_send(SOCKET sock, uint8_t type, uint16_t cid, uint16_t sn,
-                 void *data, size_t len, 
-                 const struct sockaddr *addr, socklen_t addrlen)
+size_t message_put_varint(uint8_t *p, uint32_t v)
 {
-    int rc;
-    int msg_len;
-    char msg_buf[sizeof(Message) + TUNNEL_MAX_DATA_LEN - 1];
+    size_t n = 0;
+
+    while (v >= 0x80) {
+        p[n++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    p[n++] = (uint8_t)v;
+
+    return n;
+}
+
+size_t message_get_varint(const uint8_t *p, const uint8_t *end,
+                          uint32_t *v)
+{
+    uint32_t value = 0;
+    size_t n;
+
+    for (n = 0; n < 5 && p + n < end; n++) {
+        value |= (uint32_t)(p[n] & 0x7F) << (7 * n);
+        if (!(p[n] & 0x80)) {
+            *v = value;
+            return n + 1;
+        }
+    }
+
+    return 0;
+}
+
+size_t message_encode(uint8_t *p, int version, const Message *msg)
+{
+    uint16_t v;
+    size_t n;
+
+    if (version == MESSAGE_VERSION_1) {
+        assert(!msg->flags);
+        assert(msg->channel_id <= 0xFFFF && msg->sn <= 0xFFFF);
+
+        p[0] = msg->type;
+        p[1] = 0;
+        v = htons((uint16_t)msg->channel_id);
+        memcpy(p + 2, &v, sizeof(v));
+        v = htons((uint16_t)msg->sn);
+        memcpy(p + 4, &v, sizeof(v));
+        v = htons(msg->length);
+        memcpy(p + 6, &v, sizeof(v));
+
+        return MESSAGE_V1_HEADER_LEN;
+    }
+
+    p[0] = MSG_V2 | msg->flags | msg->type;
+    n = 1;
+    n += message_put_varint(p + n, msg->channel_id);
+    n += message_put_varint(p + n, msg->sn);
+    if (msg->flags & MSG_FLAG_ACK)
+        n += message_put_varint(p + n, msg->ack);
+    if (msg->flags & MSG_FLAG_BUNDLE)
+        n += message_put_varint(p + n, msg->length);
+
+    return n;
+}
+
+void message_init_header(MessageHeader *hdr, int version, uint8_t type,
+                         uint8_t flags, uint32_t cid, uint32_t sn,
+                         size_t len)
+{
+    Message msg;
+
+    assert(len <= TUNNEL_MAX_PAYLOAD);
+
+    memset(&msg, 0, MESSAGE_HEADER_LEN);
+    msg.type = type;
+    msg.flags = flags;
+    msg.channel_id = cid;
+    msg.sn = sn;
+    msg.length = (uint16_t)len;
+
+    hdr->len = (uint8_t)message_encode(hdr->data, version, &msg);
+}
+
+Message *message_decode(char *p, size_t len)
+{
+    const uint8_t *q = (const uint8_t *)p;
+    const uint8_t *end = q + len;
+    Message *msg;
+    uint8_t type, flags = 0;
+    uint32_t cid, sn, ack = 0, length;
+    uint16_t v;
+    size_t n;
+
+    if (len == 0)
+        return NULL;
+
+    /* Fields are read before the header is written over the wire one */
+    if (!(q[0] & MSG_V2)) {
+        if (len < MESSAGE_V1_HEADER_LEN)
+            return NULL;
+
+        type = q[0];
+        memcpy(&v, q + 2, sizeof(v));
+        cid = ntohs(v);
+        memcpy(&v, q + 4, sizeof(v));
+        sn = ntohs(v);
+        memcpy(&v, q + 6, sizeof(v));
+        length = ntohs(v);
+        q += MESSAGE_V1_HEADER_LEN;
+
+        /* Never bundled */
+        if ((size_t)(end - q) != length)
+            return NULL;
+    } else {
+        type = q[0] & MSG_TYPE_MASK;
+        flags = q[0] & MSG_FLAGS;
+        q++;
+
+        if (!(n = message_get_varint(q, end, &cid)))
+            return NULL;
+        q += n;
+        if (!(n = message_get_varint(q, end, &sn)))
+            return NULL;
+        q += n;
+
+        if (flags & MSG_FLAG_ACK) {
+            if (!(n = message_get_varint(q, end, &ack)))
+                return NULL;
+            q += n;
+        }
 
-    assert(len <= TUNNEL_MAX_DATA_LEN);
+        if (flags & MSG_FLAG_BUNDLE) {
+            if (!(n = message_get_varint(q, end, &length)))
+                return NULL;
+            q += n;
+        } else {
+            length = (uint32_t)(end - q);
+        }
 
-    msg_len = sizeof(Message) + len - 1;
-    Message *msg = (Message *)msg_buf;
+        if (length > (size_t)(end - q) || length > TUNNEL_MAX_PAYLOAD)
+            return NULL;
+    }
 
+    /* Header goes right in front of the payload */
+    msg = (Message *)((char *)q - MESSAGE_HEADER_LEN);
     msg->type = type;
-    msg->reserved = 0;
-    msg->channel_id = htons(cid);
-    msg->sn = htons(sn);
-    msg->length = htons((short)len);
+    msg->flags = flags;
+    msg->length = (uint16_t)length;
+    msg->channel_id = cid;
+    msg->sn = sn;
+    msg->ack = ack;
+
+    return msg;
+}
+
+int message_sendv(SOCKET sock, const MessageHeader *hdr, const void *data,
+                  size_t len, const struct sockaddr *addr, socklen_t addrlen)
+{
+    int rc;
+
+#if defined(_WIN32) || defined(_WIN64)
+    WSABUF bufs[2];
+    DWORD sent = 0;
+
+    bufs[0].buf = (char *)hdr->data;
+    bufs[0].len = hdr->len;
+    bufs[1].buf = (char *)data;
+    bufs[1].len = (ULONG)len;
 
-    if (data && len)
-        memcpy(msg->data, data, len);
+    rc = WSASendTo(sock, bufs, len ? 2 : 1, &sent, 0, addr, addrlen,
+                   NULL, NULL);
+    if (rc == 0)
+        rc = (int)sent;
+#else
+    struct iovec iov[2];
+    struct msghdr mh;
 
-    rc = sendto(sock, (const char *)msg, msg_len, 0, addr, addrlen);
+    iov[0].iov_base = (void *)hdr->data;
+    iov[0].iov_len = hdr->len;
+    iov[1].iov_base = (void *)data;
+    iov[1].iov_len = len;
+
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_name = (void *)addr;
+    mh.msg_namelen = addrlen;
+    mh.msg_iov = iov;
+    mh.msg_iovlen = len ? 2 : 1;
+
+    rc = sendmsg(sock, &mh, 0);
+#endif
 
 #ifdef _TRACE_MESSSAG
-    if (rc == msg_len) {
-        log_debug("=>>U Message[type=%s, cid=%d, sn=%d, payload=%d] to %s.",
-                  message_get_type_name(type), cid, sn, len, 
-                  socket_addr_name(addr));
+    if (rc == (int)(hdr->len + len)) {
+        log_debug("=>>U Message[header=%d, payload=%d] to %s.",
+                  hdr->len, len, socket_addr_name(addr));
     } else {
-        log_error("=>>U Message[type=%s, cid=%d, sn=%d, payload=%d] to %s. "
-                  "error:%d",
-                  message_get_type_name(type), cid, sn, len, 
-                  socket_addr_name(addr), socket_errno());
+        log_error("=>>U Message[header=%d, payload=%d] to %s. error:%d",
+                  hdr->len, len, socket_addr_name(addr), socket_errno());
     }
 #endif
 
     return rc;
 }
 
-/* return value: 0 on success, -1 on error, 1 on invalid message */
-int message_receive(SOCKET sock, Message *msg, 
-                    struct sockaddr *from, socklen_t *fromlen)
+int message_send(SOCKET sock, int version, uint8_t type, uint32_t cid,
+                 uint32_t sn, void *data, size_t len, 
+                 const struct sockaddr *addr, socklen_t addrlen)
+{
+    MessageHeader hdr;
+
+    message_init_header(&hdr, version, type, 0, cid, sn, len);
+
+    return message_sendv(sock, &hdr, data, len, addr, addrlen);
+}
+
+int message_bundle_add(MessageBundle *b, uint8_t type, uint32_t cid,
+                       uint32_t sn, const void *data, size_t len)
+{
+    uint8_t hdr[MESSAGE_MAX_HEADER_LEN];
+    Message msg;
+    size_t n;
+
+    memset(&msg, 0, MESSAGE_HEADER_LEN);
+    msg.type = type;
+    msg.flags = MSG_FLAG_BUNDLE;
+    msg.channel_id = cid;
+    msg.sn = sn;
+    msg.length = (uint16_t)len;
+
+    n = message_encode(hdr, MESSAGE_VERSION_2, &msg);
+    if (b->len + n + len > MESSAGE_BUNDLE_MAX)
+        return 0;
+
+    memcpy(b->data + b->len, hdr, n);
+    if (len)
+        memcpy(b->data + b->len + n, data, len);
+    b->len += n + len;
+    b->count++;
+
+    return 1;
+}
+
+int message_bundle_send(SOCKET sock, MessageBundle *b,
+                        const struct sockaddr *addr, socklen_t addrlen)
 {
     int rc;
-    size_t msg_len = sizeof(Message) + TUNNEL_MAX_DATA_LEN - 1;
 
-    assert(msg->length == TUNNEL_MAX_DATA_LEN);
+    rc = sendto(sock, b->data, (int)b->len, 0, addr, addrlen);
 
-    rc = recvfrom(sock, (char *)msg, msg_len, 0, from, fromlen);
-    if (rc <= 0) /* closed or error */
-        return rc;
+#ifdef _TRACE_MESSSAG
+    log_debug("=>>U Bundle[count=%d, length=%d] to %s.", b->count,
+              (int)b->len, socket_addr_name(addr));
+#endif
+
+    b->count = 0;
+    b->len = 0;
+
+    return rc;
+}
+
+size_t message_put_option(char *data, size_t len, size_t size, uint8_t type,
+                          const void *value, uint8_t vlen)
+{
+    if (len + 2 + vlen > size)
+        return 0;
+
+    data[len] = (char)type;
+    data[len + 1] = (char)vlen;
+    memcpy(data + len + 2, value, vlen);
+
+    return len + 2 + vlen;
+}
+
+size_t message_put_option_u16(char *data, size_t len, size_t size,
+                              uint8_t type, uint16_t value)
+{
+    value = htons(value);
+
+    return message_put_option(data, len, size, type, &value, sizeof(value));
+}
+
+const void *message_next_option(const char *data, size_t len, size_t *pos,
+                                uint8_t type, uint8_t *vlen)
+{
+    const char *value;
+    uint8_t l;
+
+    while (*pos + 2 <= len) {
+        l = (uint8_t)data[*pos + 1];
+        if (*pos + 2 + l > len)
+            break;
+
+        value = data + *pos + 2;
+        *pos += 2 + l;
+
+        if ((uint8_t)value[-2] == type) {
+            *vlen = l;
+            return value;
+        }
+    }
+
+    return NULL;
+}
+
+const void *message_get_option(const char *data, size_t len, uint8_t type,
+                               uint8_t *vlen)
+{
+    size_t pos = 0;
+
+    return message_next_option(data, len, &pos, type, vlen);
+}
+
+uint16_t message_get_option_u16(const char *data, size_t len, uint8_t type,
+                                uint16_t def)
+{
+    const void *value;
+    uint8_t vlen;
+    uint16_t v;
+
+    value = message_get_option(data, len, type, &vlen);
+    if (!value || vlen != sizeof(v))
+        return def;
+
+    memcpy(&v, value, sizeof(v));
+
+    return ntohs(v);
+}
+
+size_t message_put_option_u32(char *data, size_t len, size_t size,
+                              uint8_t type, uint32_t value)
+{
+    value = htonl(value);
+
+    return message_put_option(data, len, size, type, &value, sizeof(value));
+}
+
+uint32_t message_get_option_u32(const char *data, size_t len, uint8_t type,
+                                uint32_t def)
+{
+    const void *value;
+    uint8_t vlen;
+    uint32_t v;
+
+    value = message_get_option(data, len, type, &vlen);
+    if (!value || vlen != sizeof(v))
+        return def;
+
+    memcpy(&v, value, sizeof(v));
+
+    return ntohl(v);
+}
+
+/* Decode a received datagram, NULL if it is not a valid message. */
+static Message *message_decode_datagram(char *p, int rc, size_t size,
+                                        const struct sockaddr *from)
+{
+    Message *msg = NULL;
+
+    /* Oversized datagrams were cut short */
+    if ((size_t)rc <= size)
+        msg = message_decode(p, rc);
 
-    msg->length = ntohs(msg->length);
-    if ((size_t)rc != sizeof(Message) + msg->length - 1) {
-        /* Invalid message, ignore */
 #ifdef _TRACE_MESSSAG
-        log_warning("<<=T Message invalid, ignore!");
+    if (msg)
+        log_debug("<<=U Message[type=%s, cid=%u, sn=%u, payload=%d] from %s.",
+                  message_get_type_name(msg->type), msg->channel_id, msg->sn,
+                  msg->length, socket_addr_name(from));
+    else
+        log_warning("<<=U Message invalid from %s, ignore!",
+                    socket_addr_name(from));
+#else
+    (void)from;
+#endif
+
+    return msg;
+}
+
+int message_receive(SOCKET sock, char *buf, size_t size, Message **msg,
+                    struct sockaddr *from, socklen_t *fromlen)
+{
+    int rc;
+    char *p = buf + MESSAGE_HEADER_LEN;
+
+#if defined(_WIN32) || defined(_WIN64)
+    rc = recvfrom(sock, p, (int)size + 1, 0, from, fromlen);
+#else
+    /* Never block, the socket may be readable for its error queue only */
+    rc = recvfrom(sock, p, size + 1, MSG_DONTWAIT, from, fromlen);
 #endif
+    if (rc <= 0) /* closed or error */
+        return rc;
+
+    *msg = message_decode_datagram(p, rc, size, from);
+    if (!*msg)
         rc = 1;
+
+    return rc;
+}
+
+int message_receive_batch(SOCKET sock, Buffer **bufs, size_t size,
+                          struct sockaddr_storage *from, socklen_t *fromlen,
+                          int count)
+{
+    int rc;
+    int i;
+    char *p;
+
+#if defined(__linux__)
+    struct mmsghdr mm[MESSAGE_BATCH_MAX];
+    struct iovec iov[MESSAGE_BATCH_MAX];
+
+    if (count > MESSAGE_BATCH_MAX)
+        count = MESSAGE_BATCH_MAX;
+
+    memset(mm, 0, sizeof(struct mmsghdr) * count);
+    for (i = 0; i < count; i++) {
+        iov[i].iov_base = bufs[i]->data + MESSAGE_HEADER_LEN;
+        iov[i].iov_len = size + 1;
+
+        mm[i].msg_hdr.msg_name = &from[i];
+        mm[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+        mm[i].msg_hdr.msg_iov = &iov[i];
+        mm[i].msg_hdr.msg_iovlen = 1;
     }
 
-    msg->channel_id = ntohs(msg->channel_id);
-    msg->sn = ntohs(msg->sn);
+    rc = recvmmsg(sock, mm, count, MSG_DONTWAIT, NULL);
+    if (rc < 0)
+        return socket_would_block() ? 0 : -1;
 
-#ifdef _TRACE_MESSSAG
-    log_debug("<<=U Message[type=%s, cid=%d, sn=%d, payload=%d] from %s.",
-              message_get_type_name(msg->type), msg->channel_id, msg->sn,
-              msg->length, socket_addr_name(from));
+    for (i = 0; i < rc; i++) {
+        fromlen[i] = mm[i].msg_hdr.msg_namelen;
+        bufs[i]->len = (int)mm[i].msg_len;
+    }
+#else
+    /* One datagram per readiness, a second recvfrom() could block */
+    fromlen[0] = sizeof(struct sockaddr_storage);
+    rc = recvfrom(sock, bufs[0]->data + MESSAGE_HEADER_LEN, (int)size + 1, 0,
+                  (struct sockaddr *)&from[0], &fromlen[0]);
+    if (rc < 0)
+        return socket_would_block() ? 0 : -1;
+
+    bufs[0]->len = rc;
+    rc = 1;
 #endif
 
+    for (i = 0; i < rc; i++) {
+        p = bufs[i]->data + MESSAGE_HEADER_LEN;
+        if (bufs[i]->len > 0 && (size_t)bufs[i]->len <= size &&
+            ((uint8_t)p[0] & MSG_SEALED_MASK) == MSG_SEALED) {
+            /* Opened by the caller */
+            bufs[i]->offset = MESSAGE_HEADER_LEN;
+            bufs[i]->len += MESSAGE_HEADER_LEN;
+            continue;
+        }
+
+        if (!message_decode_buffer(bufs[i], p, bufs[i]->len, size,
+                                   (const struct sockaddr *)&from[i]))
+            bufs[i]->len = 0;
+    }
+
     return rc;
 }
+
+Message *message_decode_buffer(Buffer *buf, char *p, size_t len,
+                               size_t size, const struct sockaddr *from)
+{
+    Message *msg;
+
+    msg = message_decode_datagram(p, (int)len, size, from);
+    if (msg) {
+        buf->offset = (int)((char *)msg - buf->data);
+        buf->len = (int)(p + len - buf->data);
+    } else {
+        buf->offset = 0;
+        buf->len = 0;
+    }
+
+    return msg;
+}
@@ -22,12 +22,13 @@
 #include <stdint.h>
 
 #include "socket.h"
+#include "buffer.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-/* Message types, 8 bits */
+/* Message types, 4 bits */
 #define MSG_TUNNEL_HELLO                    0x01
 #define MSG_TUNNEL_HELLO_ACK                0x02
 #define MSG_TUNNEL_NEW_CHANNEL              0x03
@@ -38,16 +39,100 @@ extern "C" {
 #define MSG_CHANNEL_DATA_ACK                0x07
 #define MSG_CHANNEL_CLOSE                   0x0F
 
+#define MSG_CHANNEL_DATA_DEDUP              0x0A    /* See dedup.h */
+#define MSG_CHANNEL_RESET                   0x0B    /* See tunnel_i.h */
+
+#define MSG_TUNNEL_PROBE                    0x08    /* Padded, path MTU */
+#define MSG_TUNNEL_PROBE_ACK                0x09
+
+#define MSG_TUNNEL_MIGRATE                  0x0C    /* See tunnel_i.h */
+#define MSG_TUNNEL_MIGRATE_ACK              0x0D
+
+/* Handshake options, 8 bits. Options are type, length, value triplets
+   following the request string of MSG_TUNNEL_HELLO and
+   MSG_TUNNEL_NEW_CHANNEL, or making up the payload of the ACKs. Peers skip
+   unknown ones. */
+#define MSG_OPT_WINDOW                      0x01    /* uint16, messages */
+#define MSG_OPT_MAX_PAYLOAD                 0x02    /* uint16, bytes */
+#define MSG_OPT_VERSION                     0x03    /* uint16, highest */
+#define MSG_OPT_CAPS                        0x04    /* uint32, MSG_CAP_* */
+#define MSG_OPT_DEDUP                       0x05    /* uint32 slots, epoch */
+#define MSG_OPT_CRYPTO                      0x06    /* See tunnel.c */
+#define MSG_OPT_COOKIE                      0x07    /* See tunnel_i.h */
+#define MSG_OPT_EARLY_DATA                  0x08    /* Bytes, repeated */
+#define MSG_OPT_EARLY_TAKEN                 0x09    /* uint16, bytes */
+#define MSG_OPT_SESSION                     0x0A    /* uint32, of the run */
+#define MSG_OPT_RESET                       0x0B    /* Reset token */
+#define MSG_OPT_CONN_ID                     0x0C    /* uint32, see tunnel_i.h */
+#define MSG_OPT_CONN_KEY                    0x0D    /* 16 bytes */
+#define MSG_OPT_CONN_PROOF                  0x0E    /* MAC of a challenge */
+#define MSG_OPT_PATH                        0x0F    /* uint16, see tunnel_i.h */
+
+/* Wire format versions. Version 1 is a fixed 8 byte header: type,
+   reserved, channel id, sn and payload length, 16 bits each in network
+   order but the first two. Version 2 is a compact header:
+
+     type     1 byte, MSG_V2 | flags | type
+     cid      varint, 32 bits
+     sn       varint, 32 bits
+     ack      varint, 32 bits, with MSG_FLAG_ACK
+     length   varint, with MSG_FLAG_BUNDLE, else the payload runs to the
+              end of the datagram
+
+   Varints are 7 bits per byte, least significant first. The top bit of
+   the first byte tells the versions apart, version 1 types are below
+   0x10. Hello is always sent in version 1, everything after in the
+   version negotiated with the peer. */
+#define MESSAGE_VERSION_1                   1
+#define MESSAGE_VERSION_2                   2
+#define MESSAGE_VERSION_MAX                 MESSAGE_VERSION_2
+
+#define MSG_V2                              0x80
+#define MSG_FLAG_ACK                        0x10    /* Piggybacked data ACK */
+#define MSG_FLAG_BUNDLE                     0x20    /* Length, more follow */
+#define MSG_FLAG_COMPRESSED                 0x40    /* Data, see compress.h */
+#define MSG_FLAGS                           (MSG_FLAG_ACK | MSG_FLAG_BUNDLE | \
+                                             MSG_FLAG_COMPRESSED)
+#define MSG_TYPE_MASK                       0x0F
+
+/* First byte of a sealed datagram, see crypto.h. Above the version 1
+   types and below version 2, the low bit is the key phase. */
+#define MSG_SEALED                          0x40
+#define MSG_SEALED_MASK                     0xFE
+
+/* Capabilities, 32 bits, for features a version 2 peer may leave out */
+#define MSG_CAP_BUNDLE                      0x00000001  /* Takes bundles */
+#define MSG_CAP_COMPRESS                    0x00000002  /* Compressed data */
+#define MSG_CAP_DEDUP                       0x00000004  /* Chunk cache */
+#define MSG_CAP_COOKIE                      0x00000008  /* Returns cookies */
+#define MSG_CAP_FAST_OPEN                   0x00000010  /* Early data */
+#define MSG_CAP_KEEPALIVE                   0x00000020  /* Per peer probes */
+#define MSG_CAP_RESET                       0x00000040  /* Takes resets */
+#define MSG_CAP_MIGRATE                     0x00000080  /* Address changes */
+#define MSG_CAP_MULTIPATH                   0x00000100  /* Joins paths */
+
+/* Always taken, others depend on the tunnel config */
+#define MSG_CAPS                            (MSG_CAP_BUNDLE | MSG_CAP_COOKIE | \
+                                             MSG_CAP_KEEPALIVE | \
+                                             MSG_CAP_RESET | MSG_CAP_MIGRATE | \
+                                             MSG_CAP_MULTIPATH)
+
+#define MESSAGE_V1_HEADER_LEN               8
+#define MESSAGE_MAX_HEADER_LEN              (1 + 5 + 5 + 5 + 3)
+
 #ifdef _MSC_VER
 #pragma pack(push, 1)
 #endif
+/* Decoded message, in host order. Received messages are decoded in place
+   right in front of their payload. */
 struct message
 {
     uint8_t type;
-    uint8_t reserved;
-    uint16_t channel_id;
-    uint16_t sn;
+    uint8_t flags;
     uint16_t length;
+    uint32_t channel_id;
+    uint32_t sn;
+    uint32_t ack;                       /* With MSG_FLAG_ACK */
     char data[1];
 } 
 #ifdef __GNUC__
@@ -60,13 +145,133 @@ __attribute__ ((__packed__))
 
 typedef struct message Message;
 
-int message_send(SOCKET sock, uint8_t type, uint16_t cid, uint16_t sn,
-                 void *data, size_t len, 
+/* Decoded header length, the room needed in front of a payload */
+#define MESSAGE_HEADER_LEN                  (sizeof(Message) - 1)
+
+/* Buffer room to receive datagrams of up to size bytes: the decoded
+   header may take more room than the wire one, one more byte tells
+   oversized datagrams. */
+#define MESSAGE_BUFFER_LEN(size)            (MESSAGE_HEADER_LEN + (size) + 1)
+
+/* Encoded wire header, sent in front of the payload */
+typedef struct message_header {
+    uint8_t len;
+    uint8_t data[MESSAGE_MAX_HEADER_LEN];
+} MessageHeader;
+
+/* Varint of up to 5 bytes, returns its length */
+size_t message_put_varint(uint8_t *p, uint32_t v);
+
+/* Returns the varint length, 0 if truncated or too long */
+size_t message_get_varint(const uint8_t *p, const uint8_t *end,
+                          uint32_t *v);
+
+/* Encode the header of msg, whose length is the payload length. Version
+   1 has no flags. Returns the header length. */
+size_t message_encode(uint8_t *p, int version, const Message *msg);
+
+void message_init_header(MessageHeader *hdr, int version, uint8_t type,
+                         uint8_t flags, uint32_t cid, uint32_t sn,
+                         size_t len);
+
+/* Decode the message at p of len bytes in place. Returns the message, or
+   NULL if it is not valid. Needs MESSAGE_HEADER_LEN bytes of room in
+   front of p. */
+Message *message_decode(char *p, size_t len);
+
+/* Decoded message of a received buffer */
+static inline Message *message_of(Buffer *buf)
+{
+    return (Message *)(buf->data + buf->offset);
+}
+
+/* Send an encoded header plus the payload in place, no copy is made. */
+int message_sendv(SOCKET sock, const MessageHeader *hdr, const void *data,
+                  size_t len, const struct sockaddr *addr, socklen_t addrlen);
+
+int message_send(SOCKET sock, int version, uint8_t type, uint32_t cid,
+                 uint32_t sn, void *data, size_t len, 
                  const struct sockaddr *addr, socklen_t addrlen);
 
-int message_receive(SOCKET sock, Message *msg, 
+/* Bundle size, the datagram every peer takes */
+#define MESSAGE_BUNDLE_MAX                  (MESSAGE_V1_HEADER_LEN + 1024)
+
+/* Version 2 messages sent together in one datagram */
+typedef struct message_bundle {
+    int count;
+    size_t len;
+    char data[MESSAGE_BUNDLE_MAX];
+} MessageBundle;
+
+/* Append a message, returns 0 if it does not fit. */
+int message_bundle_add(MessageBundle *b, uint8_t type, uint32_t cid,
+                       uint32_t sn, const void *data, size_t len);
+
+/* Send the bundle and empty it. Same return value as message_send(). */
+int message_bundle_send(SOCKET sock, MessageBundle *b,
+                        const struct sockaddr *addr, socklen_t addrlen);
+
+/* Receive one datagram of up to size bytes into buf, which holds
+   MESSAGE_BUFFER_LEN(size) bytes. *msg is the decoded message.
+   Returns the datagram length, 1 if it is not a valid message, <= 0 on
+   error. */
+int message_receive(SOCKET sock, char *buf, size_t size, Message **msg,
                     struct sockaddr *from, socklen_t *fromlen);
 
+/* Append an option to data of len bytes, returns the new length or 0 if
+   it does not fit in size. */
+size_t message_put_option(char *data, size_t len, size_t size, uint8_t type,
+                          const void *value, uint8_t vlen);
+
+size_t message_put_option_u16(char *data, size_t len, size_t size,
+                              uint8_t type, uint16_t value);
+
+size_t message_put_option_u32(char *data, size_t len, size_t size,
+                              uint8_t type, uint32_t value);
+
+/* Find an option, returns its value or NULL. */
+const void *message_get_option(const char *data, size_t len, uint8_t type,
+                               uint8_t *vlen);
+
+/* Find the next option of a type from *pos on, for options that repeat.
+   *pos moves past it. */
+const void *message_next_option(const char *data, size_t len, size_t *pos,
+                                uint8_t type, uint8_t *vlen);
+
+/* Returns the option value, or def if it is absent or malformed. */
+uint16_t message_get_option_u16(const char *data, size_t len, uint8_t type,
+                                uint16_t def);
+
+uint32_t message_get_option_u32(const char *data, size_t len, uint8_t type,
+                                uint32_t def);
+
+/* Max datagrams received by one message_receive_batch() */
+#define MESSAGE_BATCH_MAX                   32
+
+/* Receive up to count datagrams of up to size bytes without blocking,
+   each into its own buffer of MESSAGE_BUFFER_LEN(size) bytes with the
+   first message decoded in place. A buffer's offset is where the decoded
+   message is, its len the end of the datagram or 0 if it is not a valid
+   message. Sealed datagrams are left as they are, offset at the first
+   byte, see message_sealed(). Returns the number of datagrams received,
+   0 if none, -1 on error. */
+int message_receive_batch(SOCKET sock, Buffer **bufs, size_t size,
+                          struct sockaddr_storage *from, socklen_t *fromlen,
+                          int count);
+
+/* Decode the datagram of len bytes at p within buf in place, sets the
+   buffer's offset and len as message_receive_batch() does. Returns the
+   message, NULL if it is not valid or larger than size. */
+Message *message_decode_buffer(Buffer *buf, char *p, size_t len,
+                               size_t size, const struct sockaddr *from);
+
+/* A received datagram still to be opened */
+static inline int message_sealed(const Buffer *buf)
+{
+    return buf->len > 0 &&
+           ((uint8_t)buf->data[buf->offset] & MSG_SEALED_MASK) == MSG_SEALED;
+}
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,277 @@
+/*
+ * udptunnel : Lightweight TCP over UDP Tunneling
+ *
+ * Copyright (C) 2014 Jingyu jingyu.niu@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+#include <assert.h>
+
+#include "config.h"
+
+#include "tunnel_i.h"
+
+#include "path.h"
+
+void path_init(Path *p, struct peer *peer, const struct sockaddr *addr,
+               socklen_t addrlen, uint8_t local, uint32_t now)
+{
+    assert(addrlen <= sizeof(struct sockaddr_storage));
+
+    memset(p, 0, sizeof(Path));
+    p->peer = peer;
+    memcpy(&p->addr, addr, addrlen);
+    p->addrlen = addrlen;
+    p->local = local;
+    p->state = PATH_DOWN;
+    p->weight = PATH_INIT_WEIGHT;
+    p->heard = now;
+    p->min_rtt_time = now;
+}
+
+void path_rtt_sample(Path *p, uint32_t rtt, uint32_t now)
+{
+    uint32_t delta;
+
+    if (rtt > PEER_MAX_RTO)
+        rtt = PEER_MAX_RTO;
+    if (!rtt)
+        rtt = 1;
+
+    if (!p->min_rtt || rtt < p->min_rtt)
+        p->min_rtt = (uint16_t)rtt;
+    if (!p->min_next || rtt < p->min_next)
+        p->min_next = (uint16_t)rtt;
+    if (CLOCK_AFTER(now, p->min_rtt_time + PATH_MIN_RTT_TIME * 1000)) {
+        p->min_rtt = p->min_next;
+        p->min_next = 0;
+        p->min_rtt_time = now;
+    }
+
+    if (!p->srtt) {
+        p->srtt = (uint16_t)rtt;
+        p->rttvar = (uint16_t)(rtt / 2);
+        return;
+    }
+
+    delta = rtt > p->srtt ? rtt - p->srtt : p->srtt - rtt;
+    p->rttvar = (uint16_t)((3 * p->rttvar + delta) / 4);
+    p->srtt = (uint16_t)((7 * p->srtt + rtt) / 8);
+    if (!p->srtt)
+        p->srtt = 1;
+}
+
+uint16_t path_rtt(const Path *p)
+{
+    return p->srtt ? p->srtt : PATH_INIT_RTT;
+}
+
+uint16_t path_rto(const Path *p)
+{
+    uint32_t rto;
+
+    if (!p->srtt)
+        return PEER_INIT_RTO;
+
+    rto = p->srtt + 4 * p->rttvar;
+    if (rto < PEER_MIN_RTO)
+        rto = PEER_MIN_RTO;
+    else if (rto > PEER_MAX_RTO)
+        rto = PEER_MAX_RTO;
+
+    return (uint16_t)rto;
+}
+
+void path_heard(Path *p, uint32_t now)
+{
+    p->heard = now;
+}
+
+void path_sent(Path *p, uint32_t now)
+{
+    if (!p->inflight++)
+        p->busy = now;
+    p->sent++;
+}
+
+void path_acked(Path *p, uint32_t rtt, uint32_t now)
+{
+    uint32_t queued;
+
+    if (p->inflight)
+        p->inflight--;
+
+    if (!rtt)
+        return;
+
+    path_rtt_sample(p, rtt, now);
+
+    /* Only a path holding its weight tells if it takes more */
+    if (p->inflight + 1 < p->weight)
+        return;
+
+    queued = (uint32_t)p->weight * (rtt - p->min_rtt) / rtt;
+    if (queued < PATH_QUEUE_LOW) {
+        if (p->startup || ++p->acks >= p->weight) {
+            p->acks = 0;
+            if (p->weight < PATH_MAX_WEIGHT)
+                p->weight++;
+        }
+    } else if (queued > PATH_QUEUE_HIGH) {
+        if (p->startup) {
+            /* Overshot, take the queue back out */
+            p->startup = 0;
+            p->acks = 0;
+            queued -= PATH_QUEUE_LOW;
+            p->weight = p->weight > queued + PATH_MIN_WEIGHT ?
+                        (uint16_t)(p->weight - queued) : PATH_MIN_WEIGHT;
+        } else if (++p->acks >= p->weight) {
+            p->acks = 0;
+            if (p->weight > PATH_MIN_WEIGHT)
+                p->weight--;
+        }
+    } else {
+        p->startup = 0;
+    }
+}
+
+void path_lost(Path *p, uint32_t now)
+{
+    path_forget(p);
+    p->lost++;
+    p->lost_time = now;
+    p->startup = 0;
+
+    if (!CLOCK_AFTER(now, p->cut + path_rtt(p)))
+        return;
+
+    p->cut = now;
+    p->acks = 0;
+    p->weight = p->weight / 2 > PATH_MIN_WEIGHT ? p->weight / 2 :
+                                                  PATH_MIN_WEIGHT;
+}
+
+void path_forget(Path *p)
+{
+    if (p->inflight)
+        p->inflight--;
+}
+
+int path_silent(const Path *p, uint32_t now)
+{
+    uint32_t since = CLOCK_AFTER(p->busy, p->heard) ? p->busy : p->heard;
+    uint32_t timeout = 4 * path_rto(p);
+
+    if (timeout < PATH_DOWN_TIME)
+        timeout = PATH_DOWN_TIME;
+
+    return p->inflight && CLOCK_AFTER(now, since + timeout);
+}
+
+void path_down(Path *p)
+{
+    p->state = PATH_DOWN;
+    p->probe_wait = 0;
+    p->probe_missed = 0;
+    p->downs++;
+}
+
+void path_up(Path *p, uint32_t now)
+{
+    p->state = PATH_UP;
+    p->startup = 1;
+    p->weight = PATH_INIT_WEIGHT;
+    p->acks = 0;
+    p->heard = now;
+    p->probe_missed = 0;
+    p->backoff = 0;
+}
+
+/* Lost a message and not heard from since: likely gone, it takes
+   nothing new until it is heard again or goes down */
+static int path_stalled(const Path *p)
+{
+    return p->lost && CLOCK_AFTER(p->lost_time, p->heard);
+}
+
+int path_pick(const Path *paths, int count, int avoid)
+{
+    const Path *p;
+    uint32_t rtt = 0;
+    uint32_t load = 0;
+    int room = -1;
+    int full = -1;
+    int last = 0;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        p = &paths[i];
+        if (CLOCK_AFTER(p->heard, paths[last].heard))
+            last = i;
+
+        if (p->state != PATH_UP || i == avoid || path_stalled(p))
+            continue;
+
+        if (p->inflight < p->weight) {
+            if (room < 0 || path_rtt(p) < rtt) {
+                room = i;
+                rtt = path_rtt(p);
+            }
+        } else if (full < 0 ||
+                   ((uint32_t)p->inflight + 1) * 256 / p->weight < load) {
+            full = i;
+            load = ((uint32_t)p->inflight + 1) * 256 / p->weight;
+        }
+    }
+
+    if (room >= 0)
+        return room;
+    if (full >= 0)
+        return full;
+    if (avoid >= 0 && avoid < count && paths[avoid].state == PATH_UP)
+        return avoid;
+
+    return last;
+}
+
+int path_room(const Path *paths, int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++)
+        if (paths[i].state == PATH_UP && !path_stalled(&paths[i]) &&
+            paths[i].inflight < paths[i].weight)
+            return 1;
+
+    return 0;
+}
+
+int path_best(const Path *paths, int count)
+{
+    int best = -1;
+    int last = 0;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        if (CLOCK_AFTER(paths[i].heard, paths[last].heard))
+            last = i;
+
+        if (paths[i].state == PATH_UP && !path_stalled(&paths[i]) &&
+            (best < 0 || path_rtt(&paths[i]) < path_rtt(&paths[best])))
+            best = i;
+    }
+
+    return best >= 0 ? best : last;
+}
@@ -0,0 +1,169 @@
+/*
+ * udptunnel : Lightweight TCP over UDP Tunneling
+ *
+ * Copyright (C) 2014 Jingyu jingyu.niu@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __PATH_H__
+#define __PATH_H__
+
+#include <stdint.h>
+
+#include "socket.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct peer;
+
+/* One way to a peer with several: a local socket and the peer's address
+   seen from it. A client with several local addresses has a path from
+   each to the server, the server has one to each address of the client.
+   Data messages are spread over the paths that are up, see path_pick().
+   Each path holds a weight of data messages in flight, Vegas style: it
+   grows while the round trips show no queue on the path and shrinks
+   once they show one, halves on loss. */
+
+/* A new path holds this many in flight until its acks tell more */
+#define PATH_INIT_WEIGHT                    4
+#define PATH_MIN_WEIGHT                     2
+#define PATH_MAX_WEIGHT                     1024
+
+/* Data messages queued on the path, from the round trip over the lowest
+   one, it holds more below the low mark and less above the high one */
+#define PATH_QUEUE_LOW                      2
+#define PATH_QUEUE_HIGH                     6
+
+/* The lowest round trip is taken anew after this long, routes change */
+#define PATH_MIN_RTT_TIME                   10 /* seconds */
+
+/* Nothing heard on a path with data in flight for 4 RTOs of it, this
+   long at least: it is down, its data goes over the others */
+#define PATH_DOWN_TIME                      1000 /* ms */
+
+/* Round trip taken for a path not measured yet */
+#define PATH_INIT_RTT                       500 /* ms */
+
+#define PATH_DOWN                           0
+#define PATH_UP                             1
+
+typedef struct path {
+    struct path *next;                  /* Address hash chain, for server
+                                           side only */
+    struct peer *peer;
+    uint32_t hash;
+
+    struct sockaddr_storage addr;       /* Of the peer */
+    socklen_t addrlen;
+    uint8_t local;                      /* Tunnel socket it goes from */
+    uint8_t state;
+    uint8_t startup;                    /* Weight doubles per round trip */
+
+    uint16_t srtt;                      /* ms, 0 if not measured */
+    uint16_t rttvar;
+    uint16_t min_rtt;                   /* Of the last PATH_MIN_RTT_TIME */
+    uint16_t min_next;                  /* Of this one so far */
+    uint32_t min_rtt_time;              /* Started, tunnel_clock() */
+
+    uint16_t weight;                    /* Data messages it holds */
+    uint16_t inflight;                  /* Data messages not acked */
+    uint16_t acks;                      /* Toward the next weight step */
+    uint32_t cut;                       /* Last halved, tunnel_clock() */
+    uint32_t lost_time;                 /* Last lost, tunnel_clock() */
+
+    uint32_t heard;                     /* Last received, tunnel_clock() */
+    uint32_t busy;                      /* Something in flight since */
+
+    /* Probes, for client side only. A path down is joined again and
+       probed from retry on, backing off. */
+    uint8_t probe_wait;
+    uint8_t probe_missed;
+    uint16_t probe_sn;
+    uint32_t probe_sent;
+    uint32_t probe;                     /* Next, tunnel_clock() */
+    uint32_t retry;
+    uint16_t backoff;                   /* ms */
+    unsigned long long quiet_bytes;     /* bytes_out when last heard */
+
+    /* Statistics */
+    unsigned long sent;                 /* Data messages */
+    unsigned long lost;                 /* Data messages sent again */
+    unsigned long downs;
+    unsigned long long bytes_in;
+    unsigned long long bytes_out;
+} Path;
+
+/* Down with no round trip yet, to the peer's address from the socket */
+void path_init(Path *p, struct peer *peer, const struct sockaddr *addr,
+               socklen_t addrlen, uint8_t local, uint32_t now);
+
+static inline const struct sockaddr *path_addr(const Path *p)
+{
+    return (const struct sockaddr *)&p->addr;
+}
+
+/* Round trip of a message that was not resent, in ms */
+void path_rtt_sample(Path *p, uint32_t rtt, uint32_t now);
+
+uint16_t path_rtt(const Path *p);
+
+uint16_t path_rto(const Path *p);
+
+/* Heard on the path */
+void path_heard(Path *p, uint32_t now);
+
+/* A data message goes over the path */
+void path_sent(Path *p, uint32_t now);
+
+/* A data message sent over the path was acked, rtt is 0 if it was
+   resent and tells nothing */
+void path_acked(Path *p, uint32_t rtt, uint32_t now);
+
+/* A data message sent over the path is taken for lost, the weight is
+   halved once per round trip */
+void path_lost(Path *p, uint32_t now);
+
+/* A data message sent over the path is not waited for any more */
+void path_forget(Path *p);
+
+/* Returns 1 if a path with data in flight has been quiet too long */
+int path_silent(const Path *p, uint32_t now);
+
+void path_down(Path *p);
+
+/* Up with the weight of a new path */
+void path_up(Path *p, uint32_t now);
+
+/* Path for the next data message: of the paths up with room in their
+   weight, the lowest round trip. With all full, the one with the least
+   in flight for its weight, a weighted round robin. A path that lost a
+   message and was not heard from since is left out, as is the path
+   avoid a message was lost on unless no other is up, -1 for none.
+   Returns the path that was heard last if none is up. */
+int path_pick(const Path *paths, int count, int avoid);
+
+/* Returns 1 if a path that is up has room in its weight */
+int path_room(const Path *paths, int count);
+
+/* Path for a control message: the lowest round trip of the paths up,
+   leaving out those path_pick() does */
+int path_best(const Path *paths, int count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __PATH_H__ */
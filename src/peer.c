@@ -0,0 +1,431 @@
+/*
+ * udptunnel : Lightweight TCP over UDP Tunneling
+ *
+ * Copyright (C) 2014 Jingyu jingyu.niu@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "config.h"
+
+#include "log.h"
+#include "dedup.h"
+#include "crypto.h"
+#include "tunnel_i.h"
+
+#include "peer.h"
+
+/* FNV-1a over the raw address bytes */
+static uint32_t peer_hash(const struct sockaddr *addr, socklen_t addrlen)
+{
+    const unsigned char *p = (const unsigned char *)addr;
+    uint32_t h = 2166136261u;
+    socklen_t i;
+
+    for (i = 0; i < addrlen; i++) {
+        h ^= p[i];
+        h *= 16777619u;
+    }
+
+    return h;
+}
+
+Peer *peer_find(Tunnel *t, const struct sockaddr *addr, socklen_t addrlen)
+{
+    uint32_t hash = peer_hash(addr, addrlen);
+    Path *path;
+    Peer *p;
+
+    p = (Peer *)hashtable_get(t->peers, hash);
+    for (; p; p = p->next) {
+        if (p->addrlen == addrlen && memcmp(&p->addr, addr, addrlen) == 0)
+            return p;
+    }
+
+    /* Or another path of one */
+    if (!t->path_addrs)
+        return NULL;
+
+    path = (Path *)hashtable_get(t->path_addrs, hash);
+    for (; path; path = path->next) {
+        if (path->addrlen == addrlen &&
+            memcmp(&path->addr, addr, addrlen) == 0)
+            return path->peer;
+    }
+
+    return NULL;
+}
+
+Peer *peer_get(Tunnel *t, const struct sockaddr *addr, socklen_t addrlen)
+{
+    uint32_t hash;
+    Peer *head;
+    Peer *p;
+
+    assert(addrlen <= sizeof(struct sockaddr_storage));
+
+    p = peer_find(t, addr, addrlen);
+    if (p) {
+        p->heard = tunnel_clock();
+        return peer_ref(p);
+    }
+
+    hash = peer_hash(addr, addrlen);
+    head = (Peer *)hashtable_get(t->peers, hash);
+
+    p = (Peer *)pool_alloc(&t->peer_pool);
+    if (!p)
+        return NULL;
+
+    memset(p, 0, sizeof(Peer));
+    p->hash = hash;
+    p->refcnt = 1;
+    memcpy(&p->addr, addr, addrlen);
+    p->addrlen = addrlen;
+    p->heard = tunnel_clock();
+    pmtu_init(&p->pmtu, TUNNEL_MAX_DATA_LEN, TUNNEL_MAX_DATA_LEN);
+    p->version = MESSAGE_VERSION_1;
+
+    p->next = head;
+    if (!hashtable_put(t->peers, hash, p)) {
+        pool_free(&t->peer_pool, p);
+        return NULL;
+    }
+
+    log_debug("Peer %s added.", socket_addr_name(addr));
+
+    return p;
+}
+
+Peer *peer_ref(Peer *p)
+{
+    p->refcnt++;
+    return p;
+}
+
+void peer_set_max_payload(Peer *p, uint16_t max)
+{
+    if (max == p->pmtu.ceiling)
+        return;
+
+    pmtu_init(&p->pmtu, TUNNEL_MAX_DATA_LEN, max);
+
+    log_debug("Peer %s takes %d bytes payload.",
+              socket_addr_name(peer_addr(p)), p->pmtu.ceiling);
+}
+
+void peer_rtt_sample(Peer *p, uint32_t rtt)
+{
+    uint32_t delta;
+
+    if (rtt > PEER_MAX_RTO)
+        rtt = PEER_MAX_RTO;
+
+    if (!p->srtt) {
+        p->srtt = (uint16_t)(rtt ? rtt : 1);
+        p->rttvar = (uint16_t)(rtt / 2);
+        return;
+    }
+
+    delta = rtt > p->srtt ? rtt - p->srtt : p->srtt - rtt;
+    p->rttvar = (uint16_t)((3 * p->rttvar + delta) / 4);
+    p->srtt = (uint16_t)((7 * p->srtt + rtt) / 8);
+    if (!p->srtt)
+        p->srtt = 1;
+}
+
+uint16_t peer_rto(const Peer *p)
+{
+    uint32_t rto;
+
+    if (!p->srtt)
+        return PEER_INIT_RTO;
+
+    rto = p->srtt + 4 * p->rttvar;
+    if (rto < PEER_MIN_RTO)
+        rto = PEER_MIN_RTO;
+    else if (rto > PEER_MAX_RTO)
+        rto = PEER_MAX_RTO;
+
+    return (uint16_t)rto;
+}
+
+int peer_open_fresh(Peer *p, uint16_t sn)
+{
+    uint16_t d = sn - p->open_top;
+    uint16_t back;
+
+    if (!p->open_seen || (d && d < 0x8000)) {
+        /* Newer, slide the window up to it */
+        p->open_seen = p->open_seen && d < 64 ? p->open_seen << d : 0;
+        p->open_seen |= 1;
+        p->open_top = sn;
+        return 1;
+    }
+
+    back = -d;
+    if (back >= 64 || (p->open_seen & ((uint64_t)1 << back)))
+        return 0;
+
+    p->open_seen |= (uint64_t)1 << back;
+    return 1;
+}
+
+static int peer_link(Tunnel *t, Peer *p)
+{
+    p->next = (Peer *)hashtable_get(t->peers, p->hash);
+    return hashtable_put(t->peers, p->hash, p);
+}
+
+static void peer_unlink(Tunnel *t, Peer *p)
+{
+    Peer *head;
+    Peer *prev;
+
+    head = (Peer *)hashtable_get(t->peers, p->hash);
+    if (head == p) {
+        if (p->next)
+            hashtable_put(t->peers, p->hash, p->next);
+        else
+            hashtable_remove(t->peers, p->hash, NULL);
+    } else {
+        for (prev = head; prev && prev->next != p; prev = prev->next)
+            ;
+        if (prev)
+            prev->next = p->next;
+    }
+}
+
+static int peer_link_path(Tunnel *t, Path *path)
+{
+    path->next = (Path *)hashtable_get(t->path_addrs, path->hash);
+    return hashtable_put(t->path_addrs, path->hash, path);
+}
+
+static void peer_unlink_path(Tunnel *t, Path *path)
+{
+    Path *head;
+    Path *prev;
+
+    head = (Path *)hashtable_get(t->path_addrs, path->hash);
+    if (head == path) {
+        if (path->next)
+            hashtable_put(t->path_addrs, path->hash, path->next);
+        else
+            hashtable_remove(t->path_addrs, path->hash, NULL);
+    } else {
+        for (prev = head; prev && prev->next != path; prev = prev->next)
+            ;
+        if (prev)
+            prev->next = path->next;
+    }
+}
+
+int peer_init_paths(Tunnel *t, Peer *p, int count)
+{
+    uint32_t now = tunnel_clock();
+    int i;
+
+    assert(count > 0 && count <= PEER_MAX_PATHS);
+
+    peer_free_paths(t, p);
+
+    p->paths = (Path *)calloc(PEER_MAX_PATHS, sizeof(Path));
+    if (!p->paths)
+        return -1;
+
+    for (i = 0; i < count; i++)
+        path_init(&p->paths[i], p, peer_addr(p), p->addrlen, (uint8_t)i,
+                  now);
+    p->npaths = (uint8_t)count;
+
+    /* Data goes over paths of any MTU, at the size they all take */
+    pmtu_init(&p->pmtu, TUNNEL_MAX_DATA_LEN, p->pmtu.ceiling);
+
+    return 0;
+}
+
+int peer_add_path(Tunnel *t, Peer *p, const struct sockaddr *addr,
+                  socklen_t addrlen)
+{
+    Path *path = NULL;
+    int i;
+
+    assert(addrlen <= sizeof(struct sockaddr_storage));
+
+    if (peer_find(t, addr, addrlen))
+        return -1;
+
+    if (!p->paths) {
+        if (peer_init_paths(t, p, 1) < 0)
+            return -1;
+        path_up(&p->paths[0], tunnel_clock());
+    }
+
+    if (p->npaths < PEER_MAX_PATHS) {
+        i = p->npaths++;
+    } else {
+        /* The one down longest */
+        for (i = -1, path = p->paths + 1; path < p->paths + p->npaths;
+             path++) {
+            if (path->state == PATH_DOWN &&
+                (i < 0 || CLOCK_AFTER(p->paths[i].heard, path->heard)))
+                i = (int)(path - p->paths);
+        }
+        if (i < 0)
+            return -1;
+        peer_unlink_path(t, &p->paths[i]);
+    }
+
+    path = &p->paths[i];
+    path_init(path, p, addr, addrlen, 0, tunnel_clock());
+    path->hash = peer_hash(addr, addrlen);
+    if (!peer_link_path(t, path)) {
+        log_error("Peer %s, out of memory.", socket_addr_name(addr));
+        /* Taken up again by the next one */
+        path->addrlen = 0;
+        return -1;
+    }
+    path_up(path, tunnel_clock());
+
+    return i;
+}
+
+int peer_path(const Peer *p, int local, const struct sockaddr *addr,
+              socklen_t addrlen)
+{
+    const Path *path;
+    int i;
+
+    for (i = 0; i < p->npaths; i++) {
+        path = &p->paths[i];
+        if (path->local == local && path->addrlen == addrlen &&
+            memcmp(&path->addr, addr, addrlen) == 0)
+            return i;
+    }
+
+    return -1;
+}
+
+void peer_free_paths(Tunnel *t, Peer *p)
+{
+    int i;
+
+    if (!p->paths)
+        return;
+
+    for (i = 1; t->path_addrs && i < p->npaths; i++) {
+        if (p->paths[i].addrlen)
+            peer_unlink_path(t, &p->paths[i]);
+    }
+
+    free(p->paths);
+    p->paths = NULL;
+    p->npaths = 0;
+}
+
+static void peer_free(Tunnel *t, Peer *p)
+{
+    peer_unlink(t, p);
+    peer_free_paths(t, p);
+    if (p->conn_id && t->conn_ids)
+        hashtable_remove(t->conn_ids, p->conn_id, NULL);
+    if (p->hello_keys)
+        t->hello_keys--;
+    if (p->dedup)
+        t->dedup_peers--;
+
+    log_debug("Peer %s removed.", socket_addr_name(peer_addr(p)));
+
+    hashtable_free(p->ids, NULL);
+    dedup_free(p->dedup);
+    crypto_free(p->crypto);
+    pool_free(&t->peer_pool, p);
+}
+
+void peer_release(Tunnel *t, Peer *p)
+{
+    if (!p || --p->refcnt > 0)
+        return;
+
+    /* Stays in the hash with no reference until it expires */
+    if (p->hello_keys && !p->verified) {
+        p->expire = tunnel_clock() + PEER_HELLO_LINGER * 1000;
+        return;
+    }
+    if (p->crypto || p->verified) {
+        p->expire = tunnel_clock() + PEER_LINGER * 1000;
+        return;
+    }
+
+    peer_free(t, p);
+}
+
+int peer_move(Tunnel *t, Peer *p, const struct sockaddr *addr,
+              socklen_t addrlen)
+{
+    assert(addrlen <= sizeof(struct sockaddr_storage));
+
+    if (peer_find(t, addr, addrlen))
+        return -1;
+
+    peer_unlink(t, p);
+    memcpy(&p->addr, addr, addrlen);
+    p->addrlen = addrlen;
+    p->hash = peer_hash(addr, addrlen);
+    if (!peer_link(t, p)) {
+        log_error("Peer %s, out of memory.", socket_addr_name(addr));
+        return -1;
+    }
+
+    /* Another path, another MTU */
+    pmtu_init(&p->pmtu, TUNNEL_MAX_DATA_LEN, p->pmtu.ceiling);
+
+    if (p->paths) {
+        memcpy(&p->paths[0].addr, addr, addrlen);
+        p->paths[0].addrlen = addrlen;
+    }
+
+    return 0;
+}
+
+void peer_expire(Tunnel *t, int all)
+{
+    Peer *expired[PEER_EXPIRE_BATCH];
+    uint32_t now = tunnel_clock();
+    uint32_t hash;
+    int count;
+    int rc;
+    int i;
+    Peer *p;
+
+    /* Freeing unlinks from the hash, collect first */
+    do {
+        count = 0;
+        rc = hashtable_first(t->peers, &hash, (void **)&p);
+        while (rc && count < PEER_EXPIRE_BATCH) {
+            for (; p && count < PEER_EXPIRE_BATCH; p = p->next) {
+                if (!p->refcnt && (all || CLOCK_AFTER(now, p->expire)))
+                    expired[count++] = p;
+            }
+            rc = hashtable_next(t->peers, &hash, (void **)&p);
+        }
+
+        for (i = 0; i < count; i++)
+            peer_free(t, expired[i]);
+    } while (count == PEER_EXPIRE_BATCH);
+}
@@ -0,0 +1,210 @@
+/*
+ * udptunnel : Lightweight TCP over UDP Tunneling
+ *
+ * Copyright (C) 2014 Jingyu jingyu.niu@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __PEER_H__
+#define __PEER_H__
+
+#include <stdint.h>
+
+#include "socket.h"
+#include "pmtu.h"
+#include "path.h"
+#include "hashtable.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct tunnel;
+struct channel;
+struct dedup;
+struct crypto;
+
+/* Time a peer with session keys or a verified address, and its chunk
+   cache if any, is kept once it has no channels, new channels from the
+   same address find them there */
+#define PEER_LINGER                         600 /* seconds */
+
+/* Time a peer with session keys of a hello only is kept, a client that
+   holds the key seals its first channel request with them right away */
+#define PEER_HELLO_LINGER                   10 /* seconds */
+
+/* Resend timeout of the open handshake, from the round trips measured on
+   it, RFC 6298 style */
+#define PEER_INIT_RTO                       500 /* ms */
+#define PEER_MIN_RTO                        100 /* ms */
+#define PEER_MAX_RTO                        8000 /* ms */
+
+/* While it has channels, a client probes a server with MSG_CAP_KEEPALIVE
+   this often, the acks give RTT and loss. Channels of a peer not heard
+   from for PEER_TIMEOUT are closed, on either side. */
+#define PEER_KEEPALIVE_TIME                 15 /* seconds */
+#define PEER_TIMEOUT                        300 /* seconds */
+
+/* A client that sent and heard nothing back for PEER_QUIET_TIME probes
+   at once. A probe not acked in 4 RTOs, PEER_PROBE_TIMEOUT at least, is
+   lost. With PEER_PROBES_LOST in a row the server is taken for gone. */
+#define PEER_QUIET_TIME                     1000 /* ms */
+#define PEER_PROBE_TIMEOUT                  1000 /* ms */
+#define PEER_PROBES_LOST                    2
+
+/* Connection key the server gives a client, see MSG_TUNNEL_MIGRATE */
+#define PEER_CONN_KEY_LEN                   16
+
+/* Paths to a peer with several at most, see path.h */
+#define PEER_MAX_PATHS                      4
+
+/* Unused peers freed by one peer_expire() */
+#define PEER_EXPIRE_BATCH                   16
+
+/* Remote end of the tunnel. Shared by all the channels to/from the same
+   address, reference counted. On server side it is the client's session:
+   its channels go together when it is lost or the client starts over. */
+typedef struct peer {
+    struct peer *next;                  /* Hash chain */
+    uint32_t hash;
+    int refcnt;
+
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+
+    Pmtu pmtu;                          /* Max data payload to the peer */
+
+    uint8_t version;                    /* Wire format, negotiated */
+    uint32_t caps;                      /* MSG_CAP_* both sides have */
+
+    uint16_t srtt;                      /* ms, 0 if not measured */
+    uint16_t rttvar;
+
+    uint32_t heard;                     /* Last received, tunnel_clock() */
+
+    /* Session */
+    struct channel *channels;           /* Linked by peer_next */
+    int nchannels;
+    Hashtable *ids;                     /* Channels by id, NULL if none
+                                           yet */
+    uint32_t cid;                       /* For server side only, last
+                                           channel id given */
+    uint32_t session;                   /* Of the other end's run, 0 if
+                                           none */
+    uint32_t last_session;
+    unsigned long opened;               /* Channels, all time */
+    unsigned long long bytes_in;        /* Channel messages, payload */
+    unsigned long long bytes_out;       /* Messages, payload */
+
+    /* Connection id given by the server, the client keeps its session
+       with it when its address changes */
+    uint32_t conn_id;                   /* 0 if none yet */
+    uint8_t conn_key[PEER_CONN_KEY_LEN];
+    uint32_t conn_sent;                 /* Last told, for client side
+                                           only */
+
+    /* Last channel reset sent, the same one goes again after an RTO */
+    uint32_t reset_cid;
+    uint32_t reset_sent;                /* tunnel_clock() */
+
+    /* Keepalive probes, for client side only */
+    uint8_t keepalive_wait;             /* Probe not acked yet */
+    uint8_t keepalive_missed;           /* Lost in a row */
+    uint16_t keepalive_sn;
+    uint32_t keepalive_sent;            /* tunnel_clock() */
+    uint32_t keepalive;                 /* Next probe, tunnel_clock() */
+    unsigned long keepalives;
+    unsigned long keepalives_lost;
+    unsigned long long quiet_bytes;     /* bytes_out when last heard */
+
+    /* For server side only: the peer acked a channel, it gets fast open
+       and a chunk cache. And the new channel requests seen lately, bit n
+       for top - n. */
+    uint8_t verified;
+    uint16_t open_top;
+    uint64_t open_seen;
+
+    /* Paths, NULL while the peer has one. Path 0 goes to the address
+       above. Client: one from each tunnel socket. Server: one to each
+       address the client joined from. */
+    Path *paths;
+    uint8_t npaths;
+
+    struct dedup *dedup;                /* Chunk cache, NULL if off */
+    struct crypto *crypto;              /* Session keys, NULL if off */
+    uint8_t hello_keys;                 /* Server: nothing opened yet */
+    uint32_t expire;                    /* Unused since, see peer_expire() */
+} Peer;
+
+Peer *peer_get(struct tunnel *t, const struct sockaddr *addr,
+               socklen_t addrlen);
+
+/* Lookup only, no reference is taken. */
+Peer *peer_find(struct tunnel *t, const struct sockaddr *addr,
+                socklen_t addrlen);
+
+Peer *peer_ref(Peer *p);
+
+/* Max payload the peer takes, starts the path MTU search if larger than
+   the base. */
+void peer_set_max_payload(Peer *p, uint16_t max);
+
+/* Round trip of a handshake message that was not resent, in ms */
+void peer_rtt_sample(Peer *p, uint32_t rtt);
+
+uint16_t peer_rto(const Peer *p);
+
+/* Returns 1 if a new channel request sn was not seen before, and
+   remembers it. A request that may have been seen is a late copy, or too
+   old to tell. */
+int peer_open_fresh(Peer *p, uint16_t sn);
+
+void peer_release(struct tunnel *t, Peer *p);
+
+/* The peer is at addr from now on, with all its channels. Returns -1 if
+   another peer is there. */
+int peer_move(struct tunnel *t, Peer *p, const struct sockaddr *addr,
+              socklen_t addrlen);
+
+/* Paths from local sockets 0 to count - 1 to the peer's address, all
+   down. Returns -1 if out of memory. */
+int peer_init_paths(struct tunnel *t, Peer *p, int count);
+
+/* For server side: the peer has another path, to addr. A path down
+   gives its slot if all are taken, never path 0. Returns the path, -1
+   if another peer is at addr or no slot is free. */
+int peer_add_path(struct tunnel *t, Peer *p, const struct sockaddr *addr,
+                  socklen_t addrlen);
+
+/* Path of a datagram from addr to the local socket, -1 if none */
+int peer_path(const Peer *p, int local, const struct sockaddr *addr,
+              socklen_t addrlen);
+
+/* Back to the one path to the peer's address */
+void peer_free_paths(struct tunnel *t, Peer *p);
+
+/* Free unused peers kept for their chunk cache or keys once PEER_LINGER
+   is over, or all of them. */
+void peer_expire(struct tunnel *t, int all);
+
+static inline const struct sockaddr *peer_addr(const Peer *p)
+{
+    return (const struct sockaddr *)&p->addr;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __PEER_H__ */
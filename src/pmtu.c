@@ -0,0 +1,126 @@
+/*
+ * udptunnel : Lightweight TCP over UDP Tunneling
+ *
+ * Copyright (C) 2014 Jingyu jingyu.niu@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+
+#include "config.h"
+
+#include "log.h"
+#include "tunnel_i.h"
+
+#include "pmtu.h"
+
+void pmtu_init(Pmtu *pmtu, uint16_t base, uint16_t ceiling)
+{
+    memset(pmtu, 0, sizeof(Pmtu));
+
+    if (ceiling < base)
+        ceiling = base;
+
+    pmtu->base = base;
+    pmtu->ceiling = ceiling;
+    pmtu->size = base;
+    pmtu->high = ceiling + 1;
+    pmtu->state = ceiling > base ? PMTU_SEARCHING : PMTU_DISABLED;
+}
+
+uint16_t pmtu_next_probe(Pmtu *pmtu, uint32_t now)
+{
+    if (pmtu->state == PMTU_DISABLED)
+        return 0;
+
+    if (pmtu->state == PMTU_DONE) {
+        if (!CLOCK_AFTER(now, pmtu->timer))
+            return 0;
+
+        /* The path may have grown */
+        pmtu->high = pmtu->ceiling + 1;
+        pmtu->state = PMTU_SEARCHING;
+    }
+
+    if (pmtu->probe) {
+        if (!CLOCK_AFTER(now, pmtu->timer))
+            return 0;
+
+        if (++pmtu->probe_count < PMTU_MAX_PROBES)
+            return pmtu->probe;
+
+        /* Lost every time, too big */
+        pmtu->high = pmtu->probe;
+        pmtu->probe = 0;
+    }
+
+    if (pmtu->high - pmtu->size <= PMTU_SEARCH_STEP) {
+        pmtu->state = PMTU_DONE;
+        pmtu->timer = now + PMTU_RAISE_TIME * 1000;
+        log_debug("PMTU search done, max payload %d.", pmtu->size);
+        return 0;
+    }
+
+    /* Try the ceiling first, most paths take it */
+    if (pmtu->high > pmtu->ceiling)
+        pmtu->probe = pmtu->ceiling;
+    else
+        pmtu->probe = pmtu->size + (pmtu->high - pmtu->size) / 2;
+    pmtu->probe_count = 0;
+
+    return pmtu->probe;
+}
+
+void pmtu_probe_sent(Pmtu *pmtu, uint16_t sn, uint32_t now)
+{
+    pmtu->probe_sn = sn;
+    pmtu->timer = now + PMTU_PROBE_TIMEOUT * 1000;
+}
+
+int pmtu_probe_acked(Pmtu *pmtu, uint16_t sn, uint32_t now)
+{
+    if (!pmtu->probe || pmtu->probe_sn != sn)
+        return 0;
+
+    pmtu->size = pmtu->probe;
+    pmtu->probe = 0;
+    pmtu->timer = now;
+
+    log_debug("PMTU probe of %d bytes acked.", pmtu->size);
+
+    return 1;
+}
+
+void pmtu_probe_failed(Pmtu *pmtu, uint32_t now)
+{
+    pmtu->high = pmtu->probe;
+    pmtu->probe = 0;
+    pmtu->timer = now;
+}
+
+void pmtu_black_hole(Pmtu *pmtu, uint32_t now)
+{
+    if (pmtu->size <= pmtu->base)
+        return;
+
+    log_warning("PMTU black hole at %d bytes, back to %d.",
+                pmtu->size, pmtu->base);
+
+    /* Search again below the size that stopped working */
+    pmtu->high = pmtu->size;
+    pmtu->size = pmtu->base;
+    pmtu->probe = 0;
+    pmtu->state = PMTU_SEARCHING;
+    pmtu->timer = now;
+}
@@ -0,0 +1,90 @@
+/*
+ * udptunnel : Lightweight TCP over UDP Tunneling
+ *
+ * Copyright (C) 2014 Jingyu jingyu.niu@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __PMTU_H__
+#define __PMTU_H__
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Packetization layer path MTU discovery (RFC 8899 style), in terms of
+   message payload. Probes are padded MSG_TUNNEL_PROBE messages sent with
+   DF set, a probe is lost if not ACKed in time. The search is a binary
+   search between the validated size and the ceiling negotiated with the
+   peer. */
+
+/* Probe ACK timeout */
+#define PMTU_PROBE_TIMEOUT          1 /* seconds */
+
+/* Probes of the same size before it is taken as too big */
+#define PMTU_MAX_PROBES             3
+
+/* Search is done once the bounds are this close */
+#define PMTU_SEARCH_STEP            32
+
+/* Time before searching for a larger size again */
+#define PMTU_RAISE_TIME             600 /* seconds */
+
+/* Data resends of a message above the base size that signal a black
+   hole */
+#define PMTU_BLACK_HOLE_RESENDS     3
+
+#define PMTU_DISABLED               0
+#define PMTU_SEARCHING              1
+#define PMTU_DONE                   2
+
+typedef struct pmtu {
+    uint16_t base;                  /* Always works */
+    uint16_t ceiling;               /* Negotiated with the peer */
+    uint16_t size;                  /* Validated, used for data */
+    uint16_t high;                  /* Smallest size known too big + 1 */
+
+    uint16_t probe;                 /* Size in flight, 0 if none */
+    uint16_t probe_sn;
+    uint8_t probe_count;
+    uint8_t state;
+
+    uint32_t timer;                 /* Probe timeout or raise timer */
+} Pmtu;
+
+void pmtu_init(Pmtu *pmtu, uint16_t base, uint16_t ceiling);
+
+/* Returns the payload size to probe now, 0 if none. The caller sends the
+   probe and records it with pmtu_probe_sent(). */
+uint16_t pmtu_next_probe(Pmtu *pmtu, uint32_t now);
+
+void pmtu_probe_sent(Pmtu *pmtu, uint16_t sn, uint32_t now);
+
+/* Returns 1 if the ACK matched the probe in flight. */
+int pmtu_probe_acked(Pmtu *pmtu, uint16_t sn, uint32_t now);
+
+/* Probe could not even be sent, too big for the local interface. */
+void pmtu_probe_failed(Pmtu *pmtu, uint32_t now);
+
+/* Data above the base size keeps getting lost, fall back to base and
+   search again. */
+void pmtu_black_hole(Pmtu *pmtu, uint32_t now);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __PMTU_H__ */
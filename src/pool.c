@@ -0,0 +1,149 @@
+/*
+ * udptunnel : Lightweight TCP over UDP Tunneling
+ *
+ * Copyright (C) 2014 Jingyu jingyu.niu@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+#include "config.h"
+
+#include "log.h"
+
+#include "pool.h"
+
+/* Keep every object pointer aligned */
+#define POOL_ALIGN(size)    (((size) + sizeof(void *) - 1) & \
+                             ~(sizeof(void *) - 1))
+
+/* Slab header is padded to keep the first object cache line aligned,
+   malloc() only guarantees 8 or 16 bytes alignment. */
+#define POOL_SLAB_HDR       (sizeof(PoolSlab) + POOL_CACHELINE)
+
+void pool_init(Pool *pool, const char *name, size_t obj_size,
+               int objs_per_slab)
+{
+    assert(obj_size > 0 && objs_per_slab > 0);
+
+    memset(pool, 0, sizeof(Pool));
+
+    pool->name = name;
+    pool->obj_size = POOL_ALIGN(obj_size < sizeof(void *) ?
+                                sizeof(void *) : obj_size);
+    pool->objs_per_slab = objs_per_slab;
+}
+
+void pool_destroy(Pool *pool)
+{
+    PoolSlab *slab;
+
+    if (pool->in_use)
+        log_warning("Pool(%s) destroyed with %d objects in use.",
+                    pool->name, pool->in_use);
+
+    while (pool->slabs) {
+        slab = pool->slabs;
+        pool->slabs = slab->next;
+        free(slab);
+    }
+
+    pool->free = NULL;
+    pool->slab_count = 0;
+    pool->capacity = 0;
+    pool->in_use = 0;
+}
+
+void pool_set_limit(Pool *pool, int max_objects)
+{
+    pool->max_objects = max_objects;
+}
+
+static int pool_grow(Pool *pool)
+{
+    PoolSlab *slab;
+    char *obj;
+    int i;
+
+    slab = (PoolSlab *)malloc(POOL_SLAB_HDR +
+                              pool->obj_size * pool->objs_per_slab);
+    if (!slab)
+        return -1;
+
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+
+    /* Thread the new objects onto the free list */
+    obj = (char *)POOL_CACHELINE_ALIGN((uintptr_t)(slab + 1));
+    for (i = 0; i < pool->objs_per_slab; i++) {
+        *(void **)obj = pool->free;
+        pool->free = obj;
+        obj += pool->obj_size;
+    }
+
+    pool->slab_count++;
+    pool->capacity += pool->objs_per_slab;
+
+    log_debug("Pool(%s) grown to %d objects.", pool->name, pool->capacity);
+
+    return 0;
+}
+
+void *pool_alloc(Pool *pool)
+{
+    void *obj;
+
+    if (pool->max_objects && pool->in_use >= pool->max_objects) {
+        pool->failures++;
+        return NULL;
+    }
+
+    if (!pool->free && pool_grow(pool) < 0)
+        return NULL;
+
+    obj = pool->free;
+    pool->free = *(void **)obj;
+
+    pool->allocs++;
+    if (++pool->in_use > pool->high_water)
+        pool->high_water = pool->in_use;
+
+    return obj;
+}
+
+void pool_free(Pool *pool, void *obj)
+{
+    if (!obj)
+        return;
+
+    assert(pool->in_use > 0);
+
+    *(void **)obj = pool->free;
+    pool->free = obj;
+
+    pool->frees++;
+    pool->in_use--;
+}
+
+void pool_log_stats(Pool *pool)
+{
+    log_info("Pool(%s): %d/%d in use, high water %d, %d slabs of %d x %d "
+             "bytes, %lu allocs, %lu frees, %lu over limit.",
+             pool->name, pool->in_use, pool->capacity, pool->high_water,
+             pool->slab_count, pool->objs_per_slab, (int)pool->obj_size,
+             pool->allocs, pool->frees, pool->failures);
+}
@@ -0,0 +1,82 @@
+/*
+ * udptunnel : Lightweight TCP over UDP Tunneling
+ *
+ * Copyright (C) 2014 Jingyu jingyu.niu@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Fixed size object pool. Objects are carved out of slabs which are kept
+   until the pool is destroyed, so alloc/free never touch the heap once the
+   pool has grown to its working size. A pool is not thread safe, every
+   thread (tunnel) owns its own pools. */
+
+#define POOL_CACHELINE              64
+
+/* Objects of a size rounded up by this macro are cache line aligned */
+#define POOL_CACHELINE_ALIGN(size)  (((size) + POOL_CACHELINE - 1) & \
+                                     ~(size_t)(POOL_CACHELINE - 1))
+
+typedef struct pool_slab {
+    struct pool_slab *next;
+} PoolSlab;
+
+typedef struct pool {
+    const char *name;
+
+    size_t obj_size;
+    int objs_per_slab;
+
+    void *free;
+    PoolSlab *slabs;
+
+    int max_objects;                    /* 0 for unlimited */
+
+    /* Statistics */
+    int slab_count;
+    int capacity;
+    int in_use;
+    int high_water;
+    unsigned long allocs;
+    unsigned long frees;
+    unsigned long failures;             /* Allocs refused by the limit */
+} Pool;
+
+void pool_init(Pool *pool, const char *name, size_t obj_size,
+               int objs_per_slab);
+
+void pool_destroy(Pool *pool);
+
+/* Cap the objects in use, pool_alloc() returns NULL beyond it. */
+void pool_set_limit(Pool *pool, int max_objects);
+
+void *pool_alloc(Pool *pool);
+
+void pool_free(Pool *pool, void *obj);
+
+void pool_log_stats(Pool *pool);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __POOL_H__ */
@@ -0,0 +1,302 @@
+/*
+ * udptunnel : Lightweight TCP over UDP Tunneling
+ *
+ * Copyright (C) 2014 Jingyu jingyu.niu@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__linux__)
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif
+
+#include "config.h"
+
+#include "log.h"
+#include "tunnel_i.h"
+
+#include "prewarm.h"
+
+void prewarm_init(Prewarm *pw, int max)
+{
+    memset(pw, 0, sizeof(Prewarm));
+
+    if (max < 0)
+        max = 0;
+    pw->max = max > PREWARM_MAX_IDLE ? PREWARM_MAX_IDLE : max;
+}
+
+static void prewarm_free(PrewarmRemote *r)
+{
+    int i;
+
+    for (i = 0; i < r->nidle; i++)
+        socket_close(r->idle[i].sock);
+    for (i = 0; i < r->npending; i++)
+        socket_close(r->pending[i].sock);
+
+    free(r);
+}
+
+void prewarm_destroy(Prewarm *pw)
+{
+    PrewarmRemote *r;
+
+    while (pw->remotes) {
+        r = pw->remotes;
+        pw->remotes = r->next;
+        prewarm_free(r);
+    }
+
+    pw->count = 0;
+}
+
+/* Still open: nothing to read, or what the remote sends first. A FIN
+   queued behind that is only seen from the TCP state. */
+static int prewarm_alive(SOCKET s)
+{
+    char c;
+    int rc;
+#if defined(__linux__)
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+
+    if (!getsockopt(s, IPPROTO_TCP, TCP_INFO, &info, &len))
+        return info.tcpi_state == TCP_ESTABLISHED;
+#endif
+
+    rc = recv(s, &c, 1, MSG_PEEK);
+    return rc > 0 || (rc < 0 && socket_would_block());
+}
+
+static PrewarmRemote *prewarm_find(Prewarm *pw, const char *host,
+                                   const char *port)
+{
+    PrewarmRemote *r;
+
+    for (r = pw->remotes; r; r = r->next) {
+        if (!strcmp(r->host, host) && !strcmp(r->port, port))
+            return r;
+    }
+
+    return NULL;
+}
+
+static PrewarmRemote *prewarm_add(Prewarm *pw, const char *host,
+                                  const char *port, uint32_t now)
+{
+    PrewarmRemote *r;
+
+    if (pw->count >= PREWARM_MAX_REMOTES ||
+        strlen(host) > TUNNEL_MAX_HOST_LEN ||
+        strlen(port) > TUNNEL_MAX_PORT_LEN)
+        return NULL;
+
+    r = (PrewarmRemote *)calloc(1, sizeof(PrewarmRemote));
+    if (!r)
+        return NULL;
+
+    /* Resolved by the next check, not on the way of this open */
+    strcpy(r->host, host);
+    strcpy(r->port, port);
+    r->used = now;
+
+    r->next = pw->remotes;
+    pw->remotes = r;
+    pw->count++;
+
+    return r;
+}
+
+/* Move finished connects to the idle ones, give up on slow ones */
+static void prewarm_check_pending(PrewarmRemote *r, uint32_t now)
+{
+    int i = 0;
+    int rc;
+
+    while (i < r->npending) {
+        rc = socket_connect_done(r->pending[i].sock);
+        if (rc == 0 && !CLOCK_AFTER(now, r->pending[i].since +
+                                         PREWARM_CONNECT_TIMEOUT * 1000)) {
+            i++;
+            continue;
+        }
+
+        if (rc > 0) {
+            r->idle[r->nidle].sock = r->pending[i].sock;
+            r->idle[r->nidle].since = now;
+            r->nidle++;
+            r->connects++;
+        } else {
+            r->failed++;
+            socket_close(r->pending[i].sock);
+        }
+
+        r->pending[i] = r->pending[--r->npending];
+    }
+}
+
+/* Drop idle ones closed by the remote, or about to be for being idle */
+static void prewarm_check_idle(PrewarmRemote *r, uint32_t now)
+{
+    int i;
+    int n = 0;
+
+    for (i = 0; i < r->nidle; i++) {
+        if (!prewarm_alive(r->idle[i].sock)) {
+            r->dead++;
+            socket_close(r->idle[i].sock);
+        } else if (CLOCK_AFTER(now, r->idle[i].since +
+                                    PREWARM_IDLE_TIME * 1000)) {
+            r->aged++;
+            socket_close(r->idle[i].sock);
+        } else {
+            r->idle[n++] = r->idle[i];
+        }
+    }
+
+    r->nidle = n;
+}
+
+/* Twice the average opens per check, or the opens of this check so far
+   if more, at least one while in use */
+static int prewarm_target(Prewarm *pw, PrewarmRemote *r)
+{
+    uint32_t rate = r->opens * PREWARM_RATE_SCALE;
+    int n;
+
+    if (rate < r->rate)
+        rate = r->rate;
+    n = (2 * rate + PREWARM_RATE_SCALE - 1) / PREWARM_RATE_SCALE;
+
+    return n > pw->max ? pw->max : n;
+}
+
+/* Start connects up to the target */
+static void prewarm_fill(Prewarm *pw, PrewarmRemote *r, uint32_t now)
+{
+    SOCKET s;
+    int n;
+
+    if (!r->addrlen)
+        return;
+
+    for (n = prewarm_target(pw, r) - r->nidle - r->npending; n > 0; n--) {
+        s = socket_connect_start((struct sockaddr *)&r->addr, r->addrlen);
+        if (s == INVALID_SOCKET) {
+            r->failed++;
+            return;
+        }
+
+        r->pending[r->npending].sock = s;
+        r->pending[r->npending].since = now;
+        r->npending++;
+    }
+}
+
+SOCKET prewarm_take(Prewarm *pw, const char *host, const char *port,
+                    uint32_t now)
+{
+    PrewarmRemote *r;
+    SOCKET s;
+
+    if (!pw->max)
+        return INVALID_SOCKET;
+
+    r = prewarm_find(pw, host, port);
+    if (!r && !(r = prewarm_add(pw, host, port, now)))
+        return INVALID_SOCKET;
+
+    r->opens++;
+    r->used = now;
+
+    /* Connects done since the last check count too */
+    if (!r->nidle)
+        prewarm_check_pending(r, now);
+
+    while (r->nidle) {
+        s = r->idle[0].sock;
+        r->nidle--;
+        memmove(&r->idle[0], &r->idle[1], r->nidle * sizeof(PrewarmSocket));
+
+        if (prewarm_alive(s)) {
+            r->hits++;
+            prewarm_fill(pw, r, now);
+            return s;
+        }
+
+        r->dead++;
+        socket_close(s);
+    }
+
+    r->misses++;
+    prewarm_fill(pw, r, now);
+
+    return INVALID_SOCKET;
+}
+
+
+void prewarm_check(Prewarm *pw, uint32_t now)
+{
+    PrewarmRemote **p = &pw->remotes;
+    PrewarmRemote *r;
+
+    while ((r = *p)) {
+        if (CLOCK_AFTER(now, r->used + PREWARM_EXPIRE_TIME * 1000)) {
+            log_debug("Prewarm %s:%s, not opened lately, dropped.",
+                      r->host, r->port);
+            *p = r->next;
+            pw->count--;
+            prewarm_free(r);
+            continue;
+        }
+
+        /* Added again by the next open */
+        if (!r->addrlen &&
+            socket_resolve(AF_INET, SOCK_STREAM, r->host, r->port,
+                           &r->addr, &r->addrlen) < 0) {
+            log_warning("Prewarm %s:%s, does not resolve, dropped.",
+                        r->host, r->port);
+            *p = r->next;
+            pw->count--;
+            prewarm_free(r);
+            continue;
+        }
+        p = &r->next;
+
+        r->rate = r->rate - r->rate / 8 + r->opens * PREWARM_RATE_SCALE / 8;
+        r->opens = 0;
+
+        prewarm_check_pending(r, now);
+        prewarm_check_idle(r, now);
+        prewarm_fill(pw, r, now);
+    }
+}
+
+void prewarm_log_stats(Prewarm *pw)
+{
+    PrewarmRemote *r;
+
+    for (r = pw->remotes; r; r = r->next) {
+        log_info("Prewarm %s:%s: %d idle, %d connecting, %.1f opens per "
+                 "check, %lu taken, %lu missed, %lu connected, %lu failed, "
+                 "%lu closed by the remote, %lu idle too long.",
+                 r->host, r->port, r->nidle, r->npending,
+                 (double)r->rate / PREWARM_RATE_SCALE, r->hits, r->misses,
+                 r->connects, r->failed, r->dead, r->aged);
+    }
+}
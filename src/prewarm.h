@@ -0,0 +1,110 @@
+/*
+ * udptunnel : Lightweight TCP over UDP Tunneling
+ *
+ * Copyright (C) 2014 Jingyu jingyu.niu@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __PREWARM_H__
+#define __PREWARM_H__
+
+#include <stdint.h>
+
+#include "socket.h"
+#include "tunnel.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Server side connections to the remotes channels open most, connected
+   ahead and kept idle until a channel takes one. Each remote keeps
+   about twice as many as it is opened per check, from a moving
+   average, so a burst finds them ready. Idle ones are checked for
+   being closed by the remote, and closed themselves before the remote
+   would time them out. */
+
+#define PREWARM_MAX_IDLE                    64  /* Per remote */
+#define PREWARM_MAX_REMOTES                 32
+
+/* Idle connections are closed after this long */
+#define PREWARM_IDLE_TIME                   30 /* seconds */
+
+/* A remote not opened for this long is dropped */
+#define PREWARM_EXPIRE_TIME                 60 /* seconds */
+
+#define PREWARM_CONNECT_TIMEOUT             5 /* seconds */
+
+/* Opens per check are averaged in 1/256ths over about 8 checks */
+#define PREWARM_RATE_SCALE                  256
+
+typedef struct prewarm_socket {
+    SOCKET sock;
+    uint32_t since;                     /* Connect started or done,
+                                           tunnel_clock() */
+} PrewarmSocket;
+
+typedef struct prewarm_remote {
+    struct prewarm_remote *next;
+
+    char host[TUNNEL_MAX_HOST_LEN+1];
+    char port[TUNNEL_MAX_PORT_LEN+1];
+    struct sockaddr_storage addr;       /* Resolved once */
+    socklen_t addrlen;                  /* 0 until resolved */
+
+    PrewarmSocket idle[PREWARM_MAX_IDLE];       /* Oldest first */
+    int nidle;
+    PrewarmSocket pending[PREWARM_MAX_IDLE];    /* Connecting */
+    int npending;
+
+    uint32_t opens;                     /* Since the last check */
+    uint32_t rate;                      /* Opens per check, scaled */
+    uint32_t used;                      /* Last open, tunnel_clock() */
+
+    /* Statistics */
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long connects;
+    unsigned long failed;
+    unsigned long dead;                 /* Closed by the remote */
+    unsigned long aged;                 /* Idle too long */
+} PrewarmRemote;
+
+typedef struct prewarm {
+    int max;                            /* Idle per remote, 0 if off */
+    int count;
+    PrewarmRemote *remotes;
+} Prewarm;
+
+/* Keep up to max idle connections per remote, 0 disables. */
+void prewarm_init(Prewarm *pw, int max);
+
+void prewarm_destroy(Prewarm *pw);
+
+/* A connected socket to host and port, non blocking, or INVALID_SOCKET
+   if none is ready. Counts an open of the remote either way. */
+SOCKET prewarm_take(Prewarm *pw, const char *host, const char *port,
+                    uint32_t now);
+
+/* Finish connects, drop dead and old connections and connect more for
+   the remotes opened lately. Called every tunnel check. */
+void prewarm_check(Prewarm *pw, uint32_t now);
+
+void prewarm_log_stats(Prewarm *pw);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __PREWARM_H__ */
@@ -21,6 +21,9 @@
 #if !defined(_WIN32) && !defined(_WIN64)
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <sys/select.h>
 #endif
 
 #include "config.h"
@@ -112,6 +115,76 @@ SOCKET socket_connect(int family, int type, const char *host, const char *port)
     return sock;
 }
 
+int socket_resolve(int family, int type, const char *host, const char *port,
+                   struct sockaddr_storage *addr, socklen_t *addrlen)
+{
+    struct addrinfo hints;
+    struct addrinfo *ai;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = family;
+    hints.ai_socktype = type;
+
+    if (getaddrinfo(host, port, &hints, &ai) != 0)
+        return -1;
+
+    memcpy(addr, ai->ai_addr, ai->ai_addrlen);
+    *addrlen = (socklen_t)ai->ai_addrlen;
+
+    freeaddrinfo(ai);
+    return 0;
+}
+
+SOCKET socket_connect_start(const struct sockaddr *addr, socklen_t addrlen)
+{
+    SOCKET sock;
+    int rc;
+
+    sock = socket(addr->sa_family, SOCK_STREAM, IPPROTO_TCP);
+    if (sock == INVALID_SOCKET)
+        return INVALID_SOCKET;
+
+    if (socket_set_nonblock(sock) < 0) {
+        socket_close(sock);
+        return INVALID_SOCKET;
+    }
+
+    rc = connect(sock, addr, addrlen);
+#if defined(_WIN32) || defined(_WIN64)
+    if (rc != 0 && WSAGetLastError() != WSAEWOULDBLOCK) {
+#else
+    if (rc != 0 && errno != EINPROGRESS) {
+#endif
+        socket_close(sock);
+        return INVALID_SOCKET;
+    }
+
+    return sock;
+}
+
+int socket_connect_done(SOCKET s)
+{
+    struct timeval tv = { 0, 0 };
+    fd_set wfds;
+    fd_set efds;
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    FD_ZERO(&wfds);
+    FD_ZERO(&efds);
+    FD_SET(s, &wfds);
+    FD_SET(s, &efds);
+
+    /* Windows tells failures in the exception set */
+    if (select((int)s + 1, NULL, &wfds, &efds, &tv) <= 0)
+        return 0;
+
+    if (getsockopt(s, SOL_SOCKET, SO_ERROR, (char *)&err, &len) != 0 || err)
+        return -1;
+
+    return FD_ISSET(s, &wfds) ? 1 : -1;
+}
+
 int socket_close(SOCKET s)
 {
 #if !defined(_WIN32) && !defined(_WIN64)
@@ -121,6 +194,17 @@ int socket_close(SOCKET s)
 #endif
 }
 
+int socket_set_abortive(SOCKET s)
+{
+    struct linger l;
+
+    l.l_onoff = 1;
+    l.l_linger = 0;
+
+    return setsockopt(s, SOL_SOCKET, SO_LINGER, (const char *)&l,
+                      sizeof(l));
+}
+
 /* NOTICE: Not reentrant function. */
 const char *socket_addr_name(const struct sockaddr *addr)
 {
@@ -167,3 +251,106 @@ int socket_errno()
     return errno;
 #endif
 }
+
+int socket_would_block()
+{
+#if defined(_WIN32) || defined(_WIN64)
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
+}
+
+int socket_set_nonblock(SOCKET s)
+{
+#if defined(_WIN32) || defined(_WIN64)
+    u_long mode = 1;
+
+    return ioctlsocket(s, FIONBIO, &mode) == 0 ? 0 : -1;
+#else
+    int flags = fcntl(s, F_GETFL, 0);
+
+    if (flags < 0)
+        return -1;
+
+    return fcntl(s, F_SETFL, flags | O_NONBLOCK);
+#endif
+}
+
+int socket_set_dontfrag(SOCKET s)
+{
+#if defined(_WIN32) || defined(_WIN64)
+    DWORD on = 1;
+
+    return setsockopt(s, IPPROTO_IP, IP_DONTFRAGMENT, (const char *)&on,
+                      sizeof(on));
+#elif defined(IP_MTU_DISCOVER) && defined(IP_PMTUDISC_PROBE)
+    int mode = IP_PMTUDISC_PROBE;
+
+    return setsockopt(s, IPPROTO_IP, IP_MTU_DISCOVER, &mode, sizeof(mode));
+#elif defined(IP_DONTFRAG)
+    int on = 1;
+
+    return setsockopt(s, IPPROTO_IP, IP_DONTFRAG, &on, sizeof(on));
+#else
+    (void)s;
+    return -1;
+#endif
+}
+
+int socket_set_bufsize(SOCKET s, int size)
+{
+    int rc;
+
+    rc = setsockopt(s, SOL_SOCKET, SO_RCVBUF, (const char *)&size,
+                    sizeof(size));
+    if (rc == 0)
+        rc = setsockopt(s, SOL_SOCKET, SO_SNDBUF, (const char *)&size,
+                        sizeof(size));
+
+    return rc;
+}
+
+int socket_sendv(SOCKET s, const void **bufs, const size_t *lens, int count)
+{
+#if defined(_WIN32) || defined(_WIN64)
+    WSABUF wbufs[SOCKET_SENDV_MAX];
+    DWORD sent = 0;
+    int i;
+
+    if (count > SOCKET_SENDV_MAX)
+        count = SOCKET_SENDV_MAX;
+
+    for (i = 0; i < count; i++) {
+        wbufs[i].buf = (char *)bufs[i];
+        wbufs[i].len = (ULONG)lens[i];
+    }
+
+    if (WSASend(s, wbufs, count, &sent, 0, NULL, NULL) != 0)
+        return -1;
+
+    return (int)sent;
+#else
+    struct iovec iov[SOCKET_SENDV_MAX];
+    struct msghdr mh;
+    int i;
+
+    if (count > SOCKET_SENDV_MAX)
+        count = SOCKET_SENDV_MAX;
+
+    for (i = 0; i < count; i++) {
+        iov[i].iov_base = (void *)bufs[i];
+        iov[i].iov_len = lens[i];
+    }
+
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = iov;
+    mh.msg_iovlen = count;
+
+#ifdef MSG_NOSIGNAL
+    return sendmsg(s, &mh, MSG_NOSIGNAL);
+#else
+    return sendmsg(s, &mh, 0);
+#endif
+#endif
+}
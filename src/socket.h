@@ -44,8 +44,24 @@ SOCKET socket_create(int family, int type, const char *host, const char *port);
 
 SOCKET socket_connect(int family, int type, const char *host, const char *port);
 
+/* First address of host and port, returns -1 if it does not resolve. */
+int socket_resolve(int family, int type, const char *host, const char *port,
+                   struct sockaddr_storage *addr, socklen_t *addrlen);
+
+/* Start a TCP connect to addr without blocking, the socket is left non
+   blocking. Returns INVALID_SOCKET if it failed right away. */
+SOCKET socket_connect_start(const struct sockaddr *addr, socklen_t addrlen);
+
+/* Returns 1 once a connect started by socket_connect_start() is done, 0
+   while in progress, -1 if it failed. Does not block. */
+int socket_connect_done(SOCKET s);
+
 int socket_close(SOCKET s);
 
+/* Closing the TCP socket s sends a reset instead of a FIN, the other end
+   sees an error rather than the end of the data. */
+int socket_set_abortive(SOCKET s);
+
 const char *socket_addr_name(const struct sockaddr *addr);
 
 const char *socket_local_name(SOCKET sock);
@@ -54,6 +70,24 @@ const char *socket_remote_name(SOCKET sock);
 
 int socket_errno();
 
+/* Last socket call failed because it would block */
+int socket_would_block();
+
+int socket_set_nonblock(SOCKET s);
+
+/* Set DF on outgoing datagrams and leave path MTU discovery to the
+   caller, oversized sends fail with EMSGSIZE. */
+int socket_set_dontfrag(SOCKET s);
+
+/* Set both send and receive buffer sizes, the system may cap them. */
+int socket_set_bufsize(SOCKET s, int size);
+
+#define SOCKET_SENDV_MAX            16
+
+/* Gather write of up to SOCKET_SENDV_MAX buffers to a stream socket,
+   returns bytes sent or -1 on error. */
+int socket_sendv(SOCKET s, const void **bufs, const size_t *lens, int count);
+
 #ifdef __cplusplus
 }
 #endif
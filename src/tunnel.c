@@ -20,6 +20,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
 #include <sys/time.h>
 
 #include "config.h"
@@ -28,104 +29,911 @@
 #include "message.h"
 #include "log.h"
 #include "acl.h"
+#include "dedup.h"
+#include "crypto.h"
 
 #include "tunnel_i.h"
 #include "tunnel.h"
 
 #define TUNNEL_DEFAULT_PROFILE          "UDPTunnel/1.2"
 
-static int tunnel_say_hello(Tunnel *t, const char *host, const char *port)
+static void tunnel_init_pools(Tunnel *t)
 {
+    size_t budget = t->config.buffer_budget / 2;
+    int window = t->config.window;
+    int payload;
+    uint32_t ring_data;
+
+    /* Sealed datagrams take more room on the wire and in the buffers */
+    t->overhead = t->config.encrypt ? CRYPTO_OVERHEAD : 0;
+    payload = t->config.mtu - TUNNEL_PACKET_OVERHEAD - t->overhead;
+
+    if (payload < TUNNEL_MAX_DATA_LEN)
+        payload = TUNNEL_MAX_DATA_LEN;
+    else if (payload > TUNNEL_MAX_PAYLOAD)
+        payload = TUNNEL_MAX_PAYLOAD;
+    t->max_payload = (uint16_t)payload;
+
+    if (window < 1)
+        window = 1;
+    else if (window > TUNNEL_MAX_WINDOW)
+        window = TUNNEL_MAX_WINDOW;
+
+    /* Round down to a power of 2 */
+    for (t->window = 1; t->window * 2 <= window; t->window *= 2)
+        ;
+
+    /* The ring holds a full window of data, within bounds */
+    ring_data = t->window * t->max_payload;
+    if (ring_data > TUNNEL_MAX_RING_SIZE)
+        ring_data = TUNNEL_MAX_RING_SIZE;
+    for (t->ring_size = TUNNEL_MIN_RING_SIZE; t->ring_size < ring_data;
+         t->ring_size *= 2)
+        ;
+
+    pool_init(&t->channel_pool, "channel",
+              POOL_CACHELINE_ALIGN(sizeof(Channel)),
+              TUNNEL_CHANNEL_POOL_SLAB);
+    pool_init(&t->data_pool, "data",
+              BUFFER_SIZE(MESSAGE_BUFFER_LEN(MESSAGE_V1_HEADER_LEN +
+                                             t->max_payload + t->overhead)),
+              TUNNEL_DATA_POOL_SLAB);
+    pool_init(&t->ring_pool, "ring",
+              CHANNEL_RING_BUFFER_SIZE(t->window, t->ring_size),
+              TUNNEL_RING_POOL_SLAB);
+    pool_init(&t->peer_pool, "peer", sizeof(Peer), TUNNEL_PEER_POOL_SLAB);
+    pool_init(&t->setup_pool, "setup", sizeof(ChannelSetup),
+              TUNNEL_SETUP_POOL_SLAB);
+
+    /* Budget is split between received data and send rings */
+    if (budget) {
+        pool_set_limit(&t->data_pool, budget / t->data_pool.obj_size + 1);
+        pool_set_limit(&t->ring_pool, budget / t->ring_pool.obj_size + 1);
+    }
+}
+
+/* What a session holds now, and has moved */
+static void tunnel_log_session(Tunnel *t, Peer *p)
+{
+    unsigned long long queued = 0;
+    int rings = 0;
+    Channel *ch;
+
+    for (ch = p->channels; ch; ch = ch->peer_next) {
+        queued += ch->udp2tcp_queued;
+        if (ch->ring)
+            rings++;
+    }
+
+    log_info("Session %s: id %08x, %d channels, %lu opened, %llu bytes in, "
+             "%llu bytes out, %llu bytes queued to TCP, %d send rings.",
+             socket_addr_name(peer_addr(p)),
+             t->mode == TUNNEL_MODE_CLIENT ? t->session : p->session,
+             p->nchannels, p->opened, p->bytes_in, p->bytes_out, queued,
+             rings);
+}
+
+static void tunnel_log_paths(Tunnel *t, Peer *peer)
+{
+    uint32_t now = tunnel_clock();
+    const char *name;
+    Path *p;
+    int i;
+
+    for (i = 0; i < peer->npaths; i++) {
+        p = &peer->paths[i];
+        name = t->mode == TUNNEL_MODE_CLIENT ?
+               socket_local_name(t->udp_socks[p->local]) :
+               socket_addr_name(path_addr(p));
+        log_info("Path %d %s: %s, RTT %d ms (min %d, var %d), weight %d, "
+                 "%d in flight, %lu sent, %.1f%% lost, %llu bytes in, "
+                 "%llu bytes out, %lu downs, heard %u ms ago.", i, name,
+                 p->state == PATH_UP ? "up" : "down", p->srtt, p->min_rtt,
+                 p->rttvar, p->weight, p->inflight, p->sent,
+                 p->sent ? 100.0 * p->lost / p->sent : 0.0, p->bytes_in,
+                 p->bytes_out, p->downs, now - p->heard);
+    }
+}
+
+static void tunnel_dump_stats(Tunnel *t)
+{
+    int channels = t->nchannels;
+    int hibernated = 0;
+    size_t idle_size = t->channel_pool.obj_size + sizeof(Hashentry);
+    size_t total = channels * idle_size +
+                   t->data_pool.in_use * t->data_pool.obj_size;
+    uint32_t hash;
+    Channel *ch;
+    Peer *p;
     int rc;
-    int retry;
 
-    struct sockaddr_storage fromaddr;
-    socklen_t addrlen;
+    for (ch = t->channels; ch; ch = ch->next) {
+        if (!ch->ring)
+            hibernated++;
+        channel_log_stats(ch);
+    }
 
-    uint16_t sn;
+    log_info("Tunnel stats: %d channels, %d hibernated, %d peers.",
+             channels, hibernated, t->peer_pool.in_use);
+    log_info("Received %lu messages in %lu batches, %.1f per batch, "
+             "%lu more in bundles.",
+             t->recv_messages, t->recv_batches,
+             t->recv_batches ?
+             (double)t->recv_messages / t->recv_batches : 0.0,
+             t->recv_bundled);
+    log_info("Sent %lu messages in %lu bundles.",
+             t->sent_bundled, t->sent_bundles);
+    log_info("Channel memory: %d bytes per idle channel, %d bytes per "
+             "channel on average.",
+             (int)idle_size, channels ? (int)(total / channels) : 0);
+    log_info("Channel opens: %lu, %.1f ms on average, %u ms at most, "
+             "%lu sent again, %lu given up.", t->opened,
+             t->opened ? (double)t->open_ms / t->opened : 0.0,
+             t->open_max_ms, t->open_resent, t->open_failed);
+    if (t->config.fast_open >= 0)
+        log_info("Fast opens: %lu, early data taken with %lu, %llu bytes.",
+                 t->fast_opened, t->early_taken, t->early_bytes);
+    if (t->config.pool)
+        log_info("Channel pool: %d ready, %d opening, %lu taken, %lu "
+                 "missed, %lu refilled in %.1f ms on average, %u ms at "
+                 "most.", t->pool_ready, t->pool_opening, t->pool_hits,
+                 t->pool_misses, t->pool_refills,
+                 t->pool_refills ?
+                 (double)t->pool_refill_ms / t->pool_refills : 0.0,
+                 t->pool_refill_max_ms);
+    if (t->mode == TUNNEL_MODE_SERVER)
+        log_info("Half open channels: %u, %u peers with hello keys only, "
+                 "%u with a dedup cache, %lu cookies sent, %lu returned, "
+                 "%lu refused.",
+                 t->half_open, t->hello_keys, t->dedup_peers,
+                 t->cookies_sent, t->cookies_taken, t->cookies_refused);
+    log_info("Channel resets: %lu sent, %lu taken, %lu refused.",
+             t->resets_sent, t->resets_taken, t->resets_refused);
+    if (t->mode == TUNNEL_MODE_CLIENT)
+        log_info("Address changes: id told %lu times, %lu challenges "
+                 "answered.", t->migrate_told, t->migrate_answered);
+    else
+        log_info("Address changes: %lu challenges sent, %lu peers moved, "
+                 "%lu refused.", t->migrate_challenged, t->migrated,
+                 t->migrate_refused);
+    if (t->nsocks > 1 || t->path_joins)
+        log_info("Multipath: %lu paths joined, %lu went down, %lu messages "
+                 "sent again by another path.", t->path_joins, t->path_downs,
+                 t->path_moved);
+    if (t->mode == TUNNEL_MODE_CLIENT)
+        log_info("Hello acked after %u ms. Reconnects: %lu, %.1f ms on "
+                 "average, %u ms at most, %lu server restarts, %lu "
+                 "connections reset while down.", t->up_ms,
+                 t->reconnects, t->reconnects ?
+                 (double)t->reconnect_ms / t->reconnects : 0.0,
+                 t->reconnect_max_ms, t->restarts, t->rejected);
+    prewarm_log_stats(&t->prewarm);
+
+    rc = hashtable_first(t->peers, &hash, (void **)&p);
+    while (rc) {
+        for (; p; p = p->next) {
+            log_info("Peer %s: version %d, caps 0x%x, max payload %d of %d, "
+                     "PMTU %s, RTT %d ms (var %d), %lu keepalives, %lu "
+                     "lost, heard %u ms ago.",
+                     socket_addr_name(peer_addr(p)), p->version, p->caps,
+                     p->pmtu.size, p->pmtu.ceiling,
+                     p->pmtu.state == PMTU_SEARCHING ? "searching" :
+                     p->pmtu.state == PMTU_DONE ? "done" : "disabled",
+                     p->srtt, p->rttvar, p->keepalives, p->keepalives_lost,
+                     tunnel_clock() - p->heard);
+            if (p->paths)
+                tunnel_log_paths(t, p);
+            if (p->opened)
+                tunnel_log_session(t, p);
+            if (p->dedup)
+                dedup_log_stats(p->dedup, socket_addr_name(peer_addr(p)));
+            if (p->crypto)
+                crypto_log_stats(p->crypto, socket_addr_name(peer_addr(p)));
+        }
+        rc = hashtable_next(t->peers, &hash, (void **)&p);
+    }
 
-    struct addrinfo hints;
-    struct addrinfo *ai;
-    struct addrinfo *p = NULL;
+    pool_log_stats(&t->channel_pool);
+    pool_log_stats(&t->data_pool);
+    pool_log_stats(&t->ring_pool);
+    pool_log_stats(&t->peer_pool);
+    pool_log_stats(&t->setup_pool);
 
-    struct timeval timeout;
+    zerocopy_log_stats(&t->zc);
+}
 
-    fd_set fds;
+static uint32_t tunnel_caps(Tunnel *t)
+{
+    return MSG_CAPS | (t->config.compress ? MSG_CAP_COMPRESS : 0) |
+           (t->config.dedup_cache ? MSG_CAP_DEDUP : 0) |
+           (t->config.fast_open >= 0 ? MSG_CAP_FAST_OPEN : 0);
+}
+
+/* Append the slots and epoch of the peer's chunk cache, if it has one */
+static size_t tunnel_put_dedup_option(Peer *peer, char *data, size_t len,
+                                      size_t size)
+{
+    uint32_t value[2];
+
+    if (!peer->dedup || !(peer->caps & MSG_CAP_DEDUP))
+        return len;
+
+    value[0] = htonl(peer->dedup->size);
+    value[1] = htonl(peer->dedup->epoch);
+
+    return message_put_option(data, len, size, MSG_OPT_DEDUP, value,
+                              sizeof(value));
+}
+
+/* Slots are what both ends have, the peer tells its cache is a new one
+   by a new epoch */
+static void tunnel_negotiate_dedup(Peer *peer, const char *opts, size_t len)
+{
+    const void *value;
+    uint8_t vlen;
+    uint32_t v[2];
+
+    if (!peer->dedup)
+        return;
+
+    value = message_get_option(opts, len, MSG_OPT_DEDUP, &vlen);
+    if (!value || vlen != sizeof(v) || !(peer->caps & MSG_CAP_DEDUP)) {
+        dedup_set_peer(peer->dedup, 0, peer->dedup->peer_epoch);
+        return;
+    }
+
+    memcpy(v, value, sizeof(v));
+    dedup_set_peer(peer->dedup, ntohl(v[0]), ntohl(v[1]));
+}
+
+/* Append what this end takes: max payload, wire version and
+   capabilities, and the paths a client bonds. Returns the new length. */
+static size_t tunnel_put_peer_options(Tunnel *t, char *data, size_t len,
+                                      size_t size)
+{
+    len = message_put_option_u16(data, len, size, MSG_OPT_MAX_PAYLOAD,
+                                 t->max_payload);
+    len = message_put_option_u16(data, len, size, MSG_OPT_VERSION,
+                                 MESSAGE_VERSION_MAX);
+    len = message_put_option_u32(data, len, size, MSG_OPT_CAPS,
+                                 tunnel_caps(t));
+    len = message_put_option_u32(data, len, size, MSG_OPT_SESSION,
+                                 t->session);
+    if (t->nsocks > 1)
+        len = message_put_option_u16(data, len, size, MSG_OPT_PATH,
+                                     (uint16_t)t->nsocks);
+
+    return len;
+}
+
+/* Take the smaller of both ends. Older peers send no options, they take
+   the base size in version 1. A peer with channels keeps its version,
+   their ids may not fit a lower one. Returns -1 if it asks for one. */
+static int tunnel_negotiate_peer(Tunnel *t, Peer *peer, const char *opts,
+                                 size_t len)
+{
+    uint16_t max_payload;
+    uint16_t version;
+
+    version = message_get_option_u16(opts, len, MSG_OPT_VERSION,
+                                     MESSAGE_VERSION_1);
+    if (version > MESSAGE_VERSION_MAX)
+        version = MESSAGE_VERSION_MAX;
+    if (version < peer->version && peer->nchannels)
+        return -1;
+
+    max_payload = message_get_option_u16(opts, len, MSG_OPT_MAX_PAYLOAD,
+                                         TUNNEL_MAX_DATA_LEN);
+    peer_set_max_payload(peer, max_payload < t->max_payload ?
+                               max_payload : t->max_payload);
+
+    if (version != peer->version)
+        log_debug("Peer %s takes wire format version %d.",
+                  socket_addr_name(peer_addr(peer)), version);
+    peer->version = (uint8_t)version;
+
+    peer->caps = version > MESSAGE_VERSION_1 ?
+                 message_get_option_u32(opts, len, MSG_OPT_CAPS, 0) &
+                 tunnel_caps(t) : 0;
+
+    /* A server makes a chunk cache for a client that acked a channel
+       before, TUNNEL_MAX_DEDUP_PEERS at most. Random epoch, the peer
+       starts over when this end restarts. */
+    if ((peer->caps & MSG_CAP_DEDUP) && !peer->dedup &&
+        (t->mode == TUNNEL_MODE_CLIENT ||
+         (peer->verified && t->dedup_peers < TUNNEL_MAX_DEDUP_PEERS))) {
+        peer->dedup = dedup_create(
+                (uint32_t)(t->config.dedup_cache / DEDUP_SLOT_SIZE),
+                ((uint32_t)tunnel_clock_us() * 2654435761u ^
+                 (uint32_t)time(NULL)) | 1);
+        if (peer->dedup)
+            t->dedup_peers++;
+        else
+            log_error("Peer %s dedup cache, out of memory.",
+                      socket_addr_name(peer_addr(peer)));
+    }
+    if (!peer->dedup)
+        peer->caps &= ~MSG_CAP_DEDUP;
+
+    /* A client bonding paths is paced by them from its first channel,
+       before the others join */
+    if ((peer->caps & MSG_CAP_MULTIPATH) && !peer->paths &&
+        message_get_option_u16(opts, len, MSG_OPT_PATH, 0) > 1 &&
+        peer_init_paths(t, peer, 1) == 0)
+        path_up(&peer->paths[0], tunnel_clock());
+
+    return 0;
+}
+
+/* Channels are found by id in the table of their peer, every peer has
+   an id space of its own. A client keys its opening channels by the
+   request sn, negated. */
+static inline uint32_t tunnel_channel_key(Channel *ch)
+{
+    return ch->mode == CHANNEL_MODE_CLIENT && ch->setup ? -ch->id : ch->id;
+}
+
+int tunnel_add_channel(Channel *ch)
+{
+    Peer *peer = ch->peer;
+
+    if (!peer->ids && !(peer->ids = hashtable_create(16, 0.8f)))
+        return 0;
+
+    return hashtable_put(peer->ids, tunnel_channel_key(ch), ch);
+}
+
+Channel *tunnel_get_channel(Peer *peer, uint32_t cid)
+{
+    if (!peer || !peer->ids)
+        return NULL;
+
+    return (Channel *)hashtable_get(peer->ids, cid);
+}
+
+uint32_t tunnel_next_cid(Peer *peer)
+{
+    uint32_t max = peer->version > MESSAGE_VERSION_1 ? TUNNEL_MAX_CID :
+                                                       0xFFFF;
+    uint32_t i;
+
+    for (i = 0; i < max; i++) {
+        if (++peer->cid > max)
+            peer->cid = 1;
+        if (!tunnel_get_channel(peer, peer->cid))
+            return peer->cid;
+    }
+
+    return 0;
+}
+
+static inline Channel *tunnel_get_opening_channel(Peer *peer, uint16_t sn)
+{
+    uint32_t key = -(uint32_t)sn;
+
+    Channel *ch = tunnel_get_channel(peer, key);
+    if (ch)
+        hashtable_remove(peer->ids, key, NULL);
+
+    return ch;
+}
+
+/* A channel opened ahead is gone before it was taken */
+static void tunnel_pool_remove(Tunnel *t, Channel *ch)
+{
+    int i;
+
+    for (i = 0; i < t->pool_ready && t->pool[i] != ch; i++)
+        ;
+    if (i == t->pool_ready)
+        return;
+
+    t->pool_ready--;
+    memmove(&t->pool[i], &t->pool[i + 1],
+            (t->pool_ready - i) * sizeof(Channel *));
+}
+
+void tunnel_delete_channel(Tunnel *t, Channel *ch)
+{
+    uint32_t key = tunnel_channel_key(ch);
+
+    /* No connection yet, opening or ready in the pool */
+    if (ch->mode == CHANNEL_MODE_CLIENT && ch->tcp_sock == INVALID_SOCKET) {
+        if (ch->setup)
+            t->pool_opening--;
+        else
+            tunnel_pool_remove(t, ch);
+    }
+
+    /* Found by the request sn until opened, the server has no such id */
+    if (ch->mode == CHANNEL_MODE_CLIENT && ch->setup)
+        channel_mark_to_close(ch);
+
+    if (tunnel_get_channel(ch->peer, key) == ch)
+        hashtable_remove(ch->peer->ids, key, NULL);
+    channel_close(ch);
+}
+
+/* All the channels of a peer closed in one go, the peer is gone or has
+   none of them any more. Their connections are reset if reset. Returns
+   how many. */
+static int tunnel_end_session(Tunnel *t, Peer *peer, int reset)
+{
+    int n = 0;
+
+    while (peer->channels) {
+        if (reset)
+            channel_reset(peer->channels);
+        else
+            channel_mark_to_close(peer->channels);
+        tunnel_delete_channel(t, peer->channels);
+        n++;
+    }
+
+    return n;
+}
+
+/* Port and address of addr to MAC, 18 bytes at most. Returns the
+   length. */
+static size_t tunnel_put_addr(uint8_t *p, const struct sockaddr *addr)
+{
+    if (addr->sa_family == AF_INET6) {
+        const struct sockaddr_in6 *a = (const struct sockaddr_in6 *)addr;
+        memcpy(p, &a->sin6_port, 2);
+        memcpy(p + 2, &a->sin6_addr, 16);
+        return 2 + 16;
+    } else {
+        const struct sockaddr_in *a = (const struct sockaddr_in *)addr;
+        memcpy(p, &a->sin_port, 2);
+        memcpy(p + 2, &a->sin_addr, 4);
+        return 2 + 4;
+    }
+}
+
+/* MAC of a cookie the message type answers with, for the request sn or
+   connection id from a client address */
+static uint64_t tunnel_cookie_mac(Tunnel *t, const uint8_t *time, uint8_t type,
+                                  uint32_t id, const struct sockaddr *from)
+{
+    uint8_t data[4 + 1 + 4 + 2 + 16];
+    size_t len;
+
+    memcpy(data, time, 4);
+    data[4] = type;
+    data[5] = (uint8_t)(id >> 24);
+    data[6] = (uint8_t)(id >> 16);
+    data[7] = (uint8_t)(id >> 8);
+    data[8] = (uint8_t)id;
+    len = 9 + tunnel_put_addr(data + 9, from);
+
+    return crypto_siphash(t->cookie_key, data, len);
+}
+
+/* Server time in ms and the MAC of it */
+static void tunnel_make_cookie(Tunnel *t, uint8_t type, uint32_t id,
+                               const struct sockaddr *from, uint8_t *cookie)
+{
+    uint32_t now = tunnel_clock();
+    uint64_t mac;
+
+    cookie[0] = (uint8_t)(now >> 24);
+    cookie[1] = (uint8_t)(now >> 16);
+    cookie[2] = (uint8_t)(now >> 8);
+    cookie[3] = (uint8_t)now;
+    mac = tunnel_cookie_mac(t, cookie, type, id, from);
+    memcpy(cookie + 4, &mac, sizeof(mac));
+}
+
+/* Returns 0 if a cookie returned from addr is ours and not too old */
+static int tunnel_cookie_valid(Tunnel *t, const uint8_t *cookie,
+                               uint8_t type, uint32_t id,
+                               const struct sockaddr *from)
+{
+    uint32_t time = (uint32_t)cookie[0] << 24 | (uint32_t)cookie[1] << 16 |
+                    (uint32_t)cookie[2] << 8 | cookie[3];
+    uint64_t mac = tunnel_cookie_mac(t, cookie, type, id, from);
+
+    if (tunnel_clock() - time > TUNNEL_COOKIE_LIFETIME * 1000 ||
+        crypto_compare(&mac, cookie + 4, sizeof(mac)))
+        return -1;
+
+    return 0;
+}
+
+/* Every encrypted hello gets keys before the client proves anything.
+   While too many peers hold keys nothing was opened with yet, a client
+   has to show it gets replies at its address first: the hello is
+   answered with a cookie and nothing is kept. Returns 0 to go on with
+   the hello, -1 if it was answered or dropped. */
+static int tunnel_check_hello_cookie(Tunnel *t, uint16_t sn,
+                                     const char *opts, size_t optslen,
+                                     const struct sockaddr *from,
+                                     socklen_t fromlen)
+{
+    uint8_t cookie[TUNNEL_COOKIE_LEN];
+    char data[TUNNEL_MAX_OPTIONS_LEN];
+    const uint8_t *v;
+    uint8_t vlen;
+    size_t len;
+    Peer *peer;
+
+    if (t->config.open_cookies < 0 ||
+        t->hello_keys < (uint32_t)t->config.open_cookies)
+        return 0;
+
+    /* New keys of a peer that has some already keep nothing more */
+    peer = peer_find(t, from, fromlen);
+    if (peer && peer->crypto)
+        return 0;
+
+    v = (const uint8_t *)message_get_option(opts, optslen, MSG_OPT_COOKIE,
+                                            &vlen);
+    if (v && vlen == TUNNEL_COOKIE_LEN &&
+        !tunnel_cookie_valid(t, v, MSG_TUNNEL_HELLO_ACK, sn, from)) {
+        t->cookies_taken++;
+        return 0;
+    }
+
+    /* Nothing to tell older clients, they try again later */
+    if (!(message_get_option_u32(opts, optslen, MSG_OPT_CAPS, 0) &
+          MSG_CAP_COOKIE)) {
+        t->cookies_refused++;
+        return -1;
+    }
+
+    /* A late one is answered with a new cookie, the client may just have
+       been slow */
+    if (v)
+        t->cookies_refused++;
+
+    tunnel_make_cookie(t, MSG_TUNNEL_HELLO_ACK, sn, from, cookie);
+
+    /* Smaller than the hello, nothing to gain from a spoofed one */
+    len = message_put_option(data, 0, sizeof(data), MSG_OPT_COOKIE, cookie,
+                             sizeof(cookie));
+    message_send(t->udp_svr_sock, MESSAGE_VERSION_1, MSG_TUNNEL_HELLO_ACK,
+                 0, sn, data, len, from, fromlen);
+    t->cookies_sent++;
 
+    return -1;
+}
+
+/* Keys for the hello from a client, the peer is kept for them until its
+   channels come, not long if nothing is opened with them. At most
+   TUNNEL_MAX_HELLO_KEYS peers hold keys of a hello only. Returns the
+   length of opts with the ack option added, 0 if the hello is denied. */
+static size_t tunnel_accept_keys(Tunnel *t, const char *hello_opts,
+                                 size_t hello_len,
+                                 const struct sockaddr *from,
+                                 socklen_t fromlen, char *opts, size_t len,
+                                 size_t size)
+{
+    const uint8_t *value;
+    uint8_t vlen;
+    uint8_t ack[TUNNEL_CRYPTO_ACK_LEN];
+    CryptoKeys keys;
+    Crypto *c;
+    Peer *peer;
+
+    value = (const uint8_t *)message_get_option(hello_opts, hello_len,
+                                                MSG_OPT_CRYPTO, &vlen);
+    if (!value || vlen != TUNNEL_CRYPTO_HELLO_LEN) {
+        log_warning("Hello from %s denied, not encrypted.",
+                    socket_addr_name(from));
+        return 0;
+    }
+
+    ack[0] = crypto_choose(value[0]);
+    if (!ack[0]) {
+        log_warning("Hello from %s denied, no cipher in common.",
+                    socket_addr_name(from));
+        return 0;
+    }
+
+    if (crypto_random(ack + 2, CRYPTO_NONCE_LEN) < 0) {
+        log_error("Hello from %s, random nonce error:%d.",
+                  socket_addr_name(from), errno);
+        return 0;
+    }
+
+    peer = peer_find(t, from, fromlen);
+    if ((!peer || !peer->crypto) &&
+        t->hello_keys >= TUNNEL_MAX_HELLO_KEYS) {
+        log_debug("Hello from %s denied, too many keys not used yet.",
+                  socket_addr_name(from));
+        return 0;
+    }
+
+    peer = peer_get(t, from, fromlen);
+    if (peer && !peer->crypto) {
+        peer->crypto = crypto_create();
+        if (peer->crypto) {
+            peer->hello_keys = 1;
+            t->hello_keys++;
+        }
+    }
+    if (!peer || !peer->crypto) {
+        log_error("Hello from %s, out of memory.", socket_addr_name(from));
+        peer_release(t, peer);
+        return 0;
+    }
+    c = peer->crypto;
+
+    /* Keys already there stay in use until the client seals with the new
+       ones, in the other phase */
+    ack[1] = c->keys.cipher ? !c->keys.phase : 0;
+    crypto_derive(&keys, t->config.key, ack[0], ack[1], value + 1, ack + 2,
+                  1, ack + 2 + CRYPTO_NONCE_LEN);
+    crypto_set_keys(c, &keys, 1);
+    peer_release(t, peer);
+
+    log_debug("Hello from %s, %s keys in phase %d.", socket_addr_name(from),
+              crypto_cipher_name(ack[0]), ack[1]);
+
+    return message_put_option(opts, len, size, MSG_OPT_CRYPTO, ack,
+                              sizeof(ack));
+}
+
+/* Keys from the hello ack, the server proves it has the same key.
+   Returns -1 if it does not. */
+static int tunnel_hello_keys(Tunnel *t, const uint8_t *nonce,
+                             const char *opts, size_t len,
+                             const struct sockaddr *from, CryptoKeys *keys)
+{
+    const uint8_t *value;
+    uint8_t vlen;
+    uint8_t confirm[CRYPTO_TAG_LEN];
+
+    value = (const uint8_t *)message_get_option(opts, len, MSG_OPT_CRYPTO,
+                                                &vlen);
+    if (!value || vlen != TUNNEL_CRYPTO_ACK_LEN ||
+        crypto_choose(value[0]) != value[0]) {
+        log_error("Hello to %s failed, the server does not encrypt.",
+                  socket_addr_name(from));
+        return -1;
+    }
+
+    crypto_derive(keys, t->config.key, value[0], value[1] & 1, nonce,
+                  value + 2, 0, confirm);
+    if (crypto_compare(confirm, value + 2 + CRYPTO_NONCE_LEN,
+                       CRYPTO_TAG_LEN)) {
+        log_error("Hello to %s failed, the server has another key.",
+                  socket_addr_name(from));
+        return -1;
+    }
+
+    log_info("Hello to %s, encrypted with %s.", socket_addr_name(from),
+             crypto_cipher_name(value[0]));
+
+    return 0;
+}
+
+/* The path a message to peer goes by: the one given, else the one of
+   the datagram it answers, else the best one. -1 for a peer with one. */
+static int tunnel_pick_path(Tunnel *t, Peer *peer, int path)
+{
+    if (!peer->paths)
+        return -1;
+
+    if (path >= 0 && path < peer->npaths)
+        return path;
+
+    if (t->rx_peer == peer && t->rx_path >= 0)
+        return t->rx_path;
+
+    return path_best(peer->paths, peer->npaths);
+}
+
+/* Socket a message to peer goes from by path, and the address it goes
+   to */
+static SOCKET tunnel_path_socket(Tunnel *t, Peer *peer, int path,
+                                 const struct sockaddr **addr,
+                                 socklen_t *addrlen)
+{
+    Path *p;
+
+    if (path < 0) {
+        *addr = peer_addr(peer);
+        *addrlen = peer->addrlen;
+        return t->udp_svr_sock;
+    }
+
+    p = &peer->paths[path];
+    *addr = path_addr(p);
+    *addrlen = p->addrlen;
+
+    return t->udp_socks[p->local];
+}
+
+/* Hello to the server at addr from the local socket with request sn.
+   With encryption a new nonce goes into nonce, only the ack to the last
+   one is taken. Returns > 0 on success. */
+static int tunnel_send_hello(Tunnel *t, uint16_t sn, uint8_t *nonce,
+                             const uint8_t *cookie, int local,
+                             const struct sockaddr *addr, socklen_t addrlen)
+{
+    char data[TUNNEL_MAX_DATA_LEN];
+    uint8_t hello[TUNNEL_CRYPTO_HELLO_LEN];
     size_t len;
 
-    char msg_buf[sizeof(Message) + TUNNEL_MAX_DATA_LEN - 1];
-    Message *msg = (Message *)msg_buf;
+    len = sprintf(data, "%s:%s:%s", TUNNEL_DEFAULT_PROFILE,
+                  t->remote_host, t->remote_port) + 1;
+    len = tunnel_put_peer_options(t, data, len, sizeof(data));
+
+    if (t->config.encrypt) {
+        hello[0] = crypto_ciphers();
+        if (crypto_random(hello + 1, CRYPTO_NONCE_LEN) < 0) {
+            log_error("Hello, random nonce error:%d.", errno);
+            return -1;
+        }
+        memcpy(nonce, hello + 1, CRYPTO_NONCE_LEN);
+        len = message_put_option(data, len, sizeof(data), MSG_OPT_CRYPTO,
+                                 hello, sizeof(hello));
+    }
+    if (cookie)
+        len = message_put_option(data, len, sizeof(data), MSG_OPT_COOKIE,
+                                 cookie, TUNNEL_COOKIE_LEN);
+
+    return message_send(t->udp_socks[local], MESSAGE_VERSION_1,
+                        MSG_TUNNEL_HELLO, 0, sn, data, len, addr, addrlen);
+}
+
+/* The server at addr acked the hello sent at start with nonce from the
+   local socket, it is t->peer from now on. A server run other than the
+   one of the last hello has none of the channels, they are reset. A
+   server that joins paths has the one of the hello up, the others are
+   joined from the keepalive. Returns -1 if the hello failed. */
+static int tunnel_hello_done(Tunnel *t, Message *msg, const uint8_t *nonce,
+                             uint32_t start, int local,
+                             const struct sockaddr *addr, socklen_t addrlen)
+{
+    CryptoKeys keys;
+    uint32_t session;
+    Peer *peer;
+    int n;
+
+    if (t->config.encrypt &&
+        tunnel_hello_keys(t, nonce, msg->data, msg->length, addr,
+                          &keys) < 0)
+        return -1;
+
+    peer = peer_get(t, addr, addrlen);
+    if (peer && t->config.encrypt && !peer->crypto)
+        peer->crypto = crypto_create();
+    if (!peer || (t->config.encrypt && !peer->crypto)) {
+        log_error("Hello to %s, out of memory.", socket_addr_name(addr));
+        peer_release(t, peer);
+        return -1;
+    }
+
+    if (peer->crypto) {
+        crypto_set_keys(peer->crypto, &keys, 0);
+        peer->crypto->heard = tunnel_clock();
+    }
+
+    /* Channels of another server are gone with it */
+    if (t->peer && t->peer != peer && t->peer->nchannels) {
+        n = tunnel_end_session(t, t->peer, 1);
+        log_warning("Server %s gone, %d channels reset.",
+                    socket_addr_name(peer_addr(t->peer)), n);
+    }
+
+    peer_release(t, t->peer);
+    t->peer = peer;
+
+    /* First guess of the open handshake timeout */
+    peer_rtt_sample(peer, tunnel_clock() - start);
+
+    /* Older servers send none */
+    session = message_get_option_u32(msg->data, msg->length,
+                                     MSG_OPT_SESSION, 0);
+    if (session != peer->session) {
+        if (peer->session) {
+            t->restarts++;
+            n = tunnel_end_session(t, peer, 1);
+            log_warning("Server %s restarted, %d channels reset.",
+                        socket_addr_name(addr), n);
+        }
+        peer->session = session;
+    }
+
+    /* Only now, the channels of a restarted server are reset above in
+       the version they were opened with */
+    if (tunnel_negotiate_peer(t, peer, msg->data, msg->length) < 0) {
+        log_warning("Server %s takes a lower version with channels open, "
+                    "ignored.", socket_addr_name(addr));
+        return -1;
+    }
+
+    /* One path on its own, by socket 0 */
+    if (t->nsocks < 2 || !(peer->caps & MSG_CAP_MULTIPATH))
+        peer_free_paths(t, peer);
+    else if (peer_init_paths(t, peer, t->nsocks) < 0)
+        log_error("Paths to %s, out of memory.", socket_addr_name(addr));
+    else
+        path_up(&peer->paths[local], tunnel_clock());
+
+    return 0;
+}
+
+/* For client side: the addresses the tunnel server resolves to, each is
+   said hello to. Returns -1 if none. */
+static int tunnel_resolve_server(Tunnel *t)
+{
+    int rc;
+
+    struct addrinfo hints;
+    struct addrinfo *ai;
+    struct addrinfo *p;
+
+    TunnelHello *h;
 
     memset(&hints, 0, sizeof(hints));
     hints.ai_family = AF_INET;
     hints.ai_socktype = SOCK_DGRAM;
     hints.ai_protocol = IPPROTO_UDP;
 
-    rc = getaddrinfo(host, port,  &hints, &ai);
+    rc = getaddrinfo(t->tunnel_host, t->tunnel_port,  &hints, &ai);
     if (rc != 0) {
+        log_error("Resolve tunnel server %s:%s error:%d.", t->tunnel_host,
+                  t->tunnel_port, rc);
         return -1;
     }
 
-    for (retry = 0; retry < TUNNEL_HELLO_MEX_RETRY && !p; retry++) {
-        for (p = ai; p; p = p->ai_next) {
-            log_info("Hello to %s.", socket_addr_name(p->ai_addr));
-
-            sn = t->sn++;
+    for (p = ai; p && t->nhellos < TUNNEL_MAX_HELLO_ADDRS; p = p->ai_next) {
+        if (p->ai_addrlen > sizeof(h->addr))
+            continue;
 
-            len = sprintf(msg->data, "%s:%s:%s", TUNNEL_DEFAULT_PROFILE, 
-                          t->remote_host, t->remote_port);
-            rc = message_send(t->udp_svr_sock, MSG_TUNNEL_HELLO, 0, sn, 
-                              msg->data, len + 1,
-                              p->ai_addr, p->ai_addrlen);
-            if (rc <= 0) {
-                log_warning("Send hello to %s error:%d.", 
-                            socket_addr_name(p->ai_addr), socket_errno());
-                continue;
-            }
+        h = &t->hellos[t->nhellos++];
+        memcpy(&h->addr, p->ai_addr, p->ai_addrlen);
+        h->addrlen = p->ai_addrlen;
+    }
 
-            timerclear(&timeout);
-            timeout.tv_sec = 1;
-            FD_ZERO(&fds);
-            FD_SET(t->udp_svr_sock, &fds);
+    freeaddrinfo(ai);
 
-            rc = select(FD_SETSIZE, &fds, NULL, NULL, &timeout);
-            if (rc <= 0) { // Timeout or error
-                if (errno != EINTR)
-                    log_warning("Receive hello ack from %s timeout.",
-                                socket_addr_name(p->ai_addr));
-                continue;
-            }
+    return t->nhellos ? 0 : -1;
+}
 
-            addrlen = sizeof(fromaddr);
-            msg->length = TUNNEL_MAX_DATA_LEN;
-            rc = message_receive(t->udp_svr_sock, msg, 
-                                 (struct sockaddr *)&fromaddr, &addrlen);
-            if (rc <= 1) {
-                log_warning("Receive hello ack from %s error:%d.", 
-                           socket_addr_name((const struct sockaddr *)&fromaddr),
-                           socket_errno());
-                continue;
-            }
+/* For client side: hello to every server address from the event loop,
+   see TUNNEL_HELLO_STAGGER. New connections wait meanwhile. */
+static void tunnel_hello_start(Tunnel *t, uint32_t now)
+{
+    uint32_t stagger = TUNNEL_HELLO_STAGGER;
+    uint32_t backoff = TUNNEL_HELLO_BACKOFF_MIN;
+    TunnelHello tmp;
+    TunnelHello *h;
+    int i;
+
+    if (t->peer && t->peer->srtt) {
+        if (peer_rto(t->peer) < stagger)
+            stagger = peer_rto(t->peer);
+        if (peer_rto(t->peer) > backoff)
+            backoff = peer_rto(t->peer);
+    }
 
-            if (msg->type != MSG_TUNNEL_HELLO_ACK ||
-                msg->sn != sn || addrlen != p->ai_addrlen ||
-                memcmp(p->ai_addr, &fromaddr, addrlen) != 0) {
-                log_warning("Receive unexpected message from %s, ignore.", 
-                          socket_addr_name((const struct sockaddr *)&fromaddr));
-                continue;
-            }
+    for (i = 0; i < t->nhellos; i++) {
+        h = &t->hellos[i];
 
-            memcpy(&t->tunnel_addr, p->ai_addr, p->ai_addrlen);
-            t->tunnel_addr_len = p->ai_addrlen;
-            goto done;
+        /* The last server first */
+        if (i && t->peer && h->addrlen == t->peer->addrlen &&
+            !memcmp(&h->addr, peer_addr(t->peer), h->addrlen)) {
+            tmp = t->hellos[0];
+            t->hellos[0] = *h;
+            *h = tmp;
         }
     }
 
-done:
-    freeaddrinfo(ai);
+    for (i = 0; i < t->nhellos; i++) {
+        h = &t->hellos[i];
+        h->next = now + i * stagger;
+        h->backoff = backoff;
+        h->tries = 0;
+    }
 
-    return p == NULL ? -1 : 0;
+    t->down = 1;
+    t->down_since = now;
+
+    tunnel_sockets_clear(t, t->tcp_svr_sock);
 }
 
 static int tunnel_hello_ack(Tunnel *t, uint16_t sn, void *data, size_t datalen,
@@ -134,15 +942,24 @@ static int tunnel_hello_ack(Tunnel *t, uint16_t sn, void *data, size_t datalen,
     int rc;
     char *profile, *host, *port;
     char *tokc = NULL;
+    char opts[TUNNEL_MAX_OPTIONS_LEN];
+    const char *hello_opts;
+    size_t hello_len;
+    size_t len;
 
-    /* Data format is: profile:host:port\0 */
+    /* Data format is: profile:host:port\0[options]. The options are read
+       again on new channel requests, the peer is only kept for channels
+       or keys. */
 
-    if (strnlen((char *)data, datalen) == datalen) {
+    len = strnlen((char *)data, datalen);
+    if (len == datalen) {
         /* no null terminal */
         log_warning("Hello from %s denied, invalid request.",
                     socket_addr_name(from));
         return -1;
     }
+    hello_opts = (char *)data + len + 1;
+    hello_len = datalen - len - 1;
 
     profile = strtok_r((char *)data, ":", &tokc);
     host = strtok_r(NULL, ":", &tokc);
@@ -170,8 +987,19 @@ static int tunnel_hello_ack(Tunnel *t, uint16_t sn, void *data, size_t datalen,
         return -1;
     }
 
-    rc = message_send(t->udp_svr_sock, MSG_TUNNEL_HELLO_ACK, 0, sn, 
-                      NULL, 0, from, fromlen);
+    len = tunnel_put_peer_options(t, opts, 0, sizeof(opts));
+    if (t->config.encrypt) {
+        if (tunnel_check_hello_cookie(t, sn, hello_opts, hello_len, from,
+                                      fromlen) < 0)
+            return -1;
+        len = tunnel_accept_keys(t, hello_opts, hello_len, from, fromlen,
+                                 opts, len, sizeof(opts));
+        if (!len)
+            return -1;
+    }
+
+    rc = message_send(t->udp_svr_sock, MESSAGE_VERSION_1,
+                      MSG_TUNNEL_HELLO_ACK, 0, sn, opts, len, from, fromlen);
     if (rc <= 0) {
         log_error("Hello from %s, send ack error:%d.",
                   socket_addr_name(from), socket_errno());
@@ -183,7 +1011,33 @@ static int tunnel_hello_ack(Tunnel *t, uint16_t sn, void *data, size_t datalen,
     return 0;
 }
 
-Tunnel *tunnel_create_server(const char *host, const char *port, char *acl)
+/* Sealed datagrams are copied once anyway, zero copy sends are off */
+static void tunnel_init_send(Tunnel *t)
+{
+    if (t->config.encrypt) {
+        crypto_init();
+        if (t->config.zerocopy_threshold)
+            log_warning("MSG_ZEROCOPY not used with encryption.");
+        zerocopy_init(&t->zc, t->udp_svr_sock, 0);
+        return;
+    }
+
+    zerocopy_init(&t->zc, t->udp_svr_sock, t->config.zerocopy_threshold);
+}
+
+void tunnel_config_init(TunnelConfig *cfg)
+{
+    memset(cfg, 0, sizeof(TunnelConfig));
+
+    cfg->buffer_budget = TUNNEL_DEFAULT_BUFFER_BUDGET;
+    cfg->window = TUNNEL_DEFAULT_WINDOW;
+    cfg->mtu = TUNNEL_DEFAULT_MTU;
+    cfg->open_cookies = TUNNEL_DEFAULT_OPEN_COOKIES;
+    cfg->fast_open = -1;
+}
+
+Tunnel *tunnel_create_server(const char *host, const char *port, char *acl,
+                             const TunnelConfig *cfg)
 {
     if (port == NULL || *port == 0)
         return NULL;
@@ -194,12 +1048,23 @@ Tunnel *tunnel_create_server(const char *host, const char *port, char *acl)
         return NULL;
     }
 
+    t->config = *cfg;
+
+    tunnel_init_pools(t);
+
     if (acl_init(acl, &t->acl) < 0) {
         log_error("Create tunnel, invalid ACL.");
         free(t);
         return NULL;
     }
 
+    if (crypto_random(t->cookie_key, sizeof(t->cookie_key)) < 0 ||
+        crypto_random(t->reset_key, sizeof(t->reset_key)) < 0) {
+        log_error("Create tunnel, no random source.");
+        free(t);
+        return NULL;
+    }
+
     t->udp_svr_sock = socket_create(AF_INET, SOCK_DGRAM, host, port);
     if (t->udp_svr_sock == INVALID_SOCKET) {
         log_error("Create socket and bind to %s:%s error:%d.",
@@ -208,18 +1073,42 @@ Tunnel *tunnel_create_server(const char *host, const char *port, char *acl)
         return NULL;
     }
 
-    t->channels = hashtable_create(512, 0.8f);
-    if (!t->channels) {
+    t->udp_socks[0] = t->udp_svr_sock;
+    t->nsocks = 1;
+
+    t->peers = hashtable_create(64, 0.8f);
+    t->opens = hashtable_create(64, 0.8f);
+    t->conn_ids = hashtable_create(64, 0.8f);
+    t->path_addrs = hashtable_create(16, 0.8f);
+    if (!t->peers || !t->opens || !t->conn_ids || !t->path_addrs) {
         log_error("Create tunnel, out of memory.");
         socket_close(t->udp_svr_sock);
+        hashtable_free(t->peers, NULL);
+        hashtable_free(t->opens, NULL);
+        hashtable_free(t->conn_ids, NULL);
+        hashtable_free(t->path_addrs, NULL);
         free(t);
         return NULL;
     }
 
     t->mode = TUNNEL_MODE_SERVER;
+    t->resets_left = TUNNEL_MAX_RESETS;
+
+    /* Clients tell a restart by it */
+    t->session = ((uint32_t)tunnel_clock_us() * 2654435761u ^
+                  (uint32_t)time(NULL)) | 1;
     t->tcp_svr_sock = INVALID_SOCKET;
 
+    prewarm_init(&t->prewarm, t->config.prewarm);
+
+    socket_set_bufsize(t->udp_svr_sock, TUNNEL_UDP_BUFFER_SIZE);
+    /* Large messages are only sent once probed, never fragmented */
+    if (t->max_payload > TUNNEL_MAX_DATA_LEN)
+        socket_set_dontfrag(t->udp_svr_sock);
+    tunnel_init_send(t);
+
     FD_ZERO(&t->fds);
+    FD_ZERO(&t->wfds);
     FD_SET(t->udp_svr_sock, &t->fds);
 
     log_info("Tunnel server start on %s.", socket_local_name(t->udp_svr_sock));
@@ -227,19 +1116,92 @@ Tunnel *tunnel_create_server(const char *host, const char *port, char *acl)
     return t;
 }
 
-Tunnel *tunnel_create_client(const char *host, const char *port,
-                             const char *tunnel_host, char *tunnel_port,
-                             const char *remote_host, char *remote_port)
+static void tunnel_close_paths(Tunnel *t)
 {
-    if (port == NULL || *port == 0 ||
-        tunnel_host == NULL || *tunnel_host == 0 ||
-        tunnel_port == NULL || *tunnel_port == 0 ||
+    int i;
+
+    for (i = 0; i < t->nsocks; i++)
+        socket_close(t->udp_socks[i]);
+
+    t->nsocks = 0;
+    t->udp_svr_sock = INVALID_SOCKET;
+}
+
+/* For client side: a UDP socket on each local address to bond paths
+   from, or one on any. Returns -1 on error. */
+static int tunnel_create_paths(Tunnel *t)
+{
+    char addrs[TUNNEL_MAX_HOST_LEN+1];
+    char *tokc = NULL;
+    char *host;
+    SOCKET s;
+
+    if (!t->config.local_addrs) {
+        t->udp_svr_sock = socket_create(AF_INET, SOCK_DGRAM, NULL, NULL);
+        if (t->udp_svr_sock == INVALID_SOCKET) {
+            log_error("Create UDP socket error:%d.", socket_errno());
+            return -1;
+        }
+
+        t->udp_socks[t->nsocks++] = t->udp_svr_sock;
+        return 0;
+    }
+
+    if (strlen(t->config.local_addrs) > TUNNEL_MAX_HOST_LEN) {
+        log_error("Too many local addresses to bond.");
+        return -1;
+    }
+
+    strcpy(addrs, t->config.local_addrs);
+    for (host = strtok_r(addrs, ",", &tokc); host;
+         host = strtok_r(NULL, ",", &tokc)) {
+        if (t->nsocks == PEER_MAX_PATHS) {
+            log_error("More than %d local addresses to bond.",
+                      PEER_MAX_PATHS);
+            tunnel_close_paths(t);
+            return -1;
+        }
+
+        s = socket_create(AF_INET, SOCK_DGRAM, host, "0");
+        if (s == INVALID_SOCKET) {
+            log_error("Create UDP socket and bind to %s error:%d.", host,
+                      socket_errno());
+            tunnel_close_paths(t);
+            return -1;
+        }
+
+        t->udp_socks[t->nsocks++] = s;
+        log_info("Path %d from %s.", t->nsocks - 1, socket_local_name(s));
+    }
+
+    if (!t->nsocks) {
+        log_error("No local address to bond.");
+        return -1;
+    }
+
+    t->udp_svr_sock = t->udp_socks[0];
+
+    return 0;
+}
+
+Tunnel *tunnel_create_client(const char *host, const char *port,
+                             const char *tunnel_host, char *tunnel_port,
+                             const char *remote_host, char *remote_port,
+                             const TunnelConfig *cfg)
+{
+    int i;
+
+    if (port == NULL || *port == 0 ||
+        tunnel_host == NULL || *tunnel_host == 0 ||
+        tunnel_port == NULL || *tunnel_port == 0 ||
         remote_host == NULL || *remote_host == 0 ||
         remote_port == NULL || *remote_port == 0)
         return NULL;
 
     if (strlen(remote_host) > TUNNEL_MAX_HOST_LEN || 
-        strlen(remote_port) > TUNNEL_MAX_PORT_LEN)
+        strlen(remote_port) > TUNNEL_MAX_PORT_LEN ||
+        strlen(tunnel_host) > TUNNEL_MAX_HOST_LEN ||
+        strlen(tunnel_port) > TUNNEL_MAX_PORT_LEN)
         return NULL;
 
     Tunnel *t = (Tunnel *)calloc(1, sizeof(Tunnel));
@@ -248,6 +1210,16 @@ Tunnel *tunnel_create_client(const char *host, const char *port,
         return NULL;
     }
 
+    t->config = *cfg;
+
+    if (crypto_random(t->reset_key, sizeof(t->reset_key)) < 0) {
+        log_error("Create tunnel, no random source.");
+        free(t);
+        return NULL;
+    }
+
+    tunnel_init_pools(t);
+
     t->tcp_svr_sock = socket_create(AF_INET, SOCK_STREAM, host, port);
     if (t->tcp_svr_sock == INVALID_SOCKET) {
         log_error("Create socket and bind to %s:%s error:%d.",
@@ -256,81 +1228,616 @@ Tunnel *tunnel_create_client(const char *host, const char *port,
         return NULL;
     }
 
-    t->udp_svr_sock = socket_create(AF_INET, SOCK_DGRAM, NULL, NULL);
-    if (t->udp_svr_sock == INVALID_SOCKET) {
-        log_error("Create UDP socket error:%d.", socket_errno());
+    if (tunnel_create_paths(t) < 0) {
         socket_close(t->tcp_svr_sock);
         free(t);
         return NULL;
     }
 
-    t->channels = hashtable_create(512, 0.8f);
-    if (!t->channels) {
+    if (t->config.pool < 0)
+        t->config.pool = 0;
+    else if (t->config.pool > TUNNEL_MAX_POOL)
+        t->config.pool = TUNNEL_MAX_POOL;
+
+    t->peers = hashtable_create(16, 0.8f);
+    if (t->config.pool)
+        t->pool = (Channel **)calloc(t->config.pool, sizeof(Channel *));
+    if (!t->peers || (t->config.pool && !t->pool)) {
         log_error("Create tunnel, out of memory.");
-        socket_close(t->udp_svr_sock);
+        tunnel_close_paths(t);
         socket_close(t->tcp_svr_sock);
+        hashtable_free(t->peers, NULL);
+        free(t->pool);
         free(t);
         return NULL;
     }
 
     t->mode = TUNNEL_MODE_CLIENT;
+    t->resets_left = TUNNEL_MAX_RESETS;
+
+    /* The server tells a restart by it */
+    t->session = ((uint32_t)tunnel_clock_us() * 2654435761u ^
+                  (uint32_t)time(NULL)) | 1;
+
+    for (i = 0; i < t->nsocks; i++) {
+        socket_set_bufsize(t->udp_socks[i], TUNNEL_UDP_BUFFER_SIZE);
+        /* Large messages are only sent once probed, never fragmented */
+        if (t->max_payload > TUNNEL_MAX_DATA_LEN)
+            socket_set_dontfrag(t->udp_socks[i]);
+    }
+    tunnel_init_send(t);
 
+    strcpy(t->tunnel_host, tunnel_host);
+    strcpy(t->tunnel_port, tunnel_port);
     strcpy(t->remote_host, remote_host);
     strcpy(t->remote_port, remote_port);
 
-    if (tunnel_say_hello(t, tunnel_host, tunnel_port) < 0) {
-        socket_close(t->udp_svr_sock);
+    if (tunnel_resolve_server(t) < 0) {
+        tunnel_close_paths(t);
         socket_close(t->tcp_svr_sock);
-        hashtable_free(t->channels, NULL);
+        hashtable_free(t->peers, NULL);
+        pool_destroy(&t->peer_pool);
+        zerocopy_destroy(&t->zc);
+        free(t->pool);
         free(t);
         return NULL;
     }
 
     FD_ZERO(&t->fds);
+    FD_ZERO(&t->wfds);
     FD_SET(t->tcp_svr_sock, &t->fds);
-    FD_SET(t->udp_svr_sock, &t->fds);
+    for (i = 0; i < t->nsocks; i++)
+        FD_SET(t->udp_socks[i], &t->fds);
+
+    /* Connections wait in the backlog until the server answers */
+    tunnel_hello_start(t, tunnel_clock());
 
     log_info("Tunnel client start on %s.", socket_local_name(t->tcp_svr_sock));
 
     return t;
 }
 
-static inline uint16_t tunnel_next_cid(Tunnel *t)
+/* For server side: a client that started over has none of the channels
+   of its last session. Taken from new channel requests, sealed with
+   encryption. Returns -1 for a late request of the last session. */
+static int tunnel_check_session(Tunnel *t, Peer *peer, const char *opts,
+                                size_t len)
 {
-    /* Channel 0 is reserved for tunnel */
-    if (++t->cid == 0)
-        ++t->cid;
+    uint32_t session = message_get_option_u32(opts, len, MSG_OPT_SESSION, 0);
+    int n;
+
+    if (!session || session == peer->session)
+        return 0;
+
+    if (session == peer->last_session)
+        return -1;
+
+    if (peer->session) {
+        n = tunnel_end_session(t, peer, 0);
+        log_info("Peer %s started over, %d channels of its last session "
+                 "closed.", socket_addr_name(peer_addr(peer)), n);
+
+        /* Request sns start over too */
+        peer->open_seen = 0;
+    }
 
-    return t->cid;
+    peer->last_session = peer->session;
+    peer->session = session;
+
+    return 0;
+}
+
+/* Half open server channels by the peer and sn of their request, chained
+   on the same key */
+static inline uint32_t tunnel_open_key(const Peer *peer, uint16_t sn)
+{
+    return peer->hash ^ (sn * 2654435761u);
 }
 
-static inline int tunnel_add_channel(Tunnel *t, Channel *ch, int opening)
+static Channel *tunnel_find_open(Tunnel *t, const Peer *peer, uint16_t sn)
 {
-    int32_t cid = opening ? -ch->id : ch->id;
+    Channel *ch = (Channel *)hashtable_get(t->opens,
+                                           tunnel_open_key(peer, sn));
 
-    return hashtable_put(t->channels, cid, ch);
+    for (; ch; ch = ch->setup->same_key) {
+        if (ch->peer == peer && ch->setup->sn == sn)
+            return ch;
+    }
+
+    return NULL;
 }
 
-static inline Channel *tunnel_get_channel(Tunnel *t, uint16_t cid)
+static int tunnel_add_open(Tunnel *t, Channel *ch, uint16_t sn)
 {
-    return (Channel *)hashtable_get(t->channels, cid);
+    uint32_t key = tunnel_open_key(ch->peer, sn);
+
+    ch->setup->sn = sn;
+    ch->setup->same_key = (Channel *)hashtable_get(t->opens, key);
+
+    return hashtable_put(t->opens, key, ch);
 }
 
-static inline Channel *tunnel_get_opening_channel(Tunnel *t, uint16_t cid)
+void tunnel_forget_open(Tunnel *t, Channel *ch)
 {
-    int32_t id = -cid;
+    uint32_t key = tunnel_open_key(ch->peer, ch->setup->sn);
+    Channel *head = (Channel *)hashtable_get(t->opens, key);
+    Channel *prev;
+
+    if (head == ch) {
+        if (ch->setup->same_key)
+            hashtable_put(t->opens, key, ch->setup->same_key);
+        else
+            hashtable_remove(t->opens, key, NULL);
+        return;
+    }
 
-    Channel *ch = (Channel *)hashtable_get(t->channels, id);
-    if (ch)
-        hashtable_remove(t->channels, id, NULL);
+    for (prev = head; prev && prev->setup->same_key != ch;
+         prev = prev->setup->same_key)
+        ;
+    if (prev)
+        prev->setup->same_key = ch->setup->same_key;
+}
 
-    return ch;
+static void tunnel_open_stats(Tunnel *t, uint32_t ms)
+{
+    t->opened++;
+    t->open_ms += ms;
+    if (ms > t->open_max_ms)
+        t->open_max_ms = ms;
+}
+
+/* Both sides end up with the smaller window, a power of 2 */
+static uint16_t tunnel_negotiate_window(Tunnel *t, uint16_t window)
+{
+    uint16_t w = 1;
+
+    while (w < t->window && w * 2 <= window)
+        w *= 2;
+
+    return w;
+}
+
+/* Token of channel cid with the peer at addr, never 0 */
+static uint64_t tunnel_reset_token(Tunnel *t, const struct sockaddr *addr,
+                                   uint32_t cid)
+{
+    uint8_t data[4 + 2 + 16];
+    uint64_t token;
+    size_t len;
+
+    data[0] = (uint8_t)(cid >> 24);
+    data[1] = (uint8_t)(cid >> 16);
+    data[2] = (uint8_t)(cid >> 8);
+    data[3] = (uint8_t)cid;
+    len = 4 + tunnel_put_addr(data + 4, addr);
+
+    token = crypto_siphash(t->reset_key, data, len);
+    return token ? token : 1;
+}
+
+static size_t tunnel_put_reset_option(Tunnel *t, Peer *peer, uint32_t cid,
+                                      char *opts, size_t len, size_t size)
+{
+    uint64_t token = tunnel_reset_token(t, peer_addr(peer), cid);
+
+    return message_put_option(opts, len, size, MSG_OPT_RESET, &token,
+                              sizeof(token));
+}
+
+/* The peer's token from the options of its ack, kept as sent */
+static void tunnel_take_reset_token(Channel *ch, const char *opts,
+                                    size_t optslen)
+{
+    const void *v;
+    uint8_t vlen;
+
+    v = message_get_option(opts, optslen, MSG_OPT_RESET, &vlen);
+    if (!v || vlen != TUNNEL_RESET_TOKEN_LEN || ch->reset_token)
+        return;
+
+    memcpy(&ch->reset_token, v, TUNNEL_RESET_TOKEN_LEN);
+    ch->reset_after = tunnel_clock() + peer_rto(ch->peer);
+}
+
+/* MAC of a migrate challenge under the peer's connection key */
+static uint64_t tunnel_conn_proof(const Peer *peer, const uint8_t *challenge)
+{
+    uint8_t data[4 + TUNNEL_COOKIE_LEN];
+
+    data[0] = (uint8_t)(peer->conn_id >> 24);
+    data[1] = (uint8_t)(peer->conn_id >> 16);
+    data[2] = (uint8_t)(peer->conn_id >> 8);
+    data[3] = (uint8_t)peer->conn_id;
+    memcpy(data + 4, challenge, TUNNEL_COOKIE_LEN);
+
+    return crypto_siphash(peer->conn_key, data, sizeof(data));
+}
+
+/* For server side: the peer's connection id and key, given with the
+   acks of its channels. Returns the new length. */
+static size_t tunnel_put_conn_options(Tunnel *t, Peer *peer, char *opts,
+                                      size_t len, size_t size)
+{
+    uint32_t id;
+    int i;
+
+    if (!(peer->caps & MSG_CAP_MIGRATE))
+        return len;
+
+    /* Random, tried again on the rare clash */
+    for (i = 0; i < 4 && !peer->conn_id; i++) {
+        if (crypto_random(&id, sizeof(id)) < 0 ||
+            crypto_random(peer->conn_key, sizeof(peer->conn_key)) < 0)
+            return len;
+        if (id && !hashtable_exist(t->conn_ids, id) &&
+            hashtable_put(t->conn_ids, id, peer))
+            peer->conn_id = id;
+    }
+    if (!peer->conn_id)
+        return len;
+
+    len = message_put_option_u32(opts, len, size, MSG_OPT_CONN_ID,
+                                 peer->conn_id);
+    return message_put_option(opts, len, size, MSG_OPT_CONN_KEY,
+                              peer->conn_key, sizeof(peer->conn_key));
+}
+
+/* For client side: the server's connection id and key from the options
+   of its ack */
+static void tunnel_take_conn_id(Peer *peer, const char *opts, size_t len)
+{
+    uint32_t id = message_get_option_u32(opts, len, MSG_OPT_CONN_ID, 0);
+    const void *key;
+    uint8_t klen;
+
+    key = message_get_option(opts, len, MSG_OPT_CONN_KEY, &klen);
+    if (!id || !key || klen != sizeof(peer->conn_key))
+        return;
+
+    peer->conn_id = id;
+    memcpy(peer->conn_key, key, klen);
+}
+
+/* For client side: the connection id from whatever address this end has
+   now, with the answer to the server's challenge if any. In the clear,
+   a server that has the client at another address cannot open it. By a
+   path it joins that path to the session, -1 moves the peer. */
+static int tunnel_send_migrate(Tunnel *t, Peer *peer, int path,
+                               const uint8_t *challenge)
+{
+    char data[TUNNEL_MAX_OPTIONS_LEN];
+    const struct sockaddr *addr;
+    socklen_t addrlen;
+    uint64_t proof;
+    size_t len;
+    SOCKET s;
+
+    len = message_put_option_u32(data, 0, sizeof(data), MSG_OPT_CONN_ID,
+                                 peer->conn_id);
+    if (path >= 0)
+        len = message_put_option_u16(data, len, sizeof(data), MSG_OPT_PATH,
+                                     (uint16_t)path);
+    if (challenge) {
+        proof = tunnel_conn_proof(peer, challenge);
+        len = message_put_option(data, len, sizeof(data), MSG_OPT_COOKIE,
+                                 challenge, TUNNEL_COOKIE_LEN);
+        len = message_put_option(data, len, sizeof(data),
+                                 MSG_OPT_CONN_PROOF, &proof, sizeof(proof));
+    } else {
+        peer->conn_sent = tunnel_clock();
+        t->migrate_told++;
+    }
+
+    s = tunnel_path_socket(t, peer, path, &addr, &addrlen);
+
+    return message_send(s, MESSAGE_VERSION_1, MSG_TUNNEL_MIGRATE, 0, 0,
+                        data, len, addr, addrlen);
 }
 
-static inline int tunnel_delete_channel(Tunnel *t, Channel *ch)
+/* For server side: a client tells its connection id. Told from another
+   address, the peer moves there with its channels once the client
+   answers a challenge sent there, or has a path there too if it tells
+   a path. Returns -1 if refused. */
+static int tunnel_handle_migrate(Tunnel *t, Peer *known, Message *msg,
+                                 const struct sockaddr *from,
+                                 socklen_t fromlen)
 {
-    return hashtable_remove(t->channels, ch->id, 
-                            (hashtable_entry_free)channel_close);
+    char data[TUNNEL_MAX_OPTIONS_LEN];
+    uint8_t cookie[TUNNEL_COOKIE_LEN];
+    char old[128];
+    const uint8_t *challenge;
+    const void *proof;
+    uint8_t clen, plen;
+    uint64_t mac;
+    uint32_t id;
+    size_t len;
+    int path;
+    Peer *peer;
+
+    id = message_get_option_u32(msg->data, msg->length, MSG_OPT_CONN_ID, 0);
+    peer = id ? (Peer *)hashtable_get(t->conn_ids, id) : NULL;
+
+    /* Still at its address */
+    if (!peer || peer == known)
+        return 0;
+
+    challenge = (const uint8_t *)message_get_option(msg->data, msg->length,
+                                                    MSG_OPT_COOKIE, &clen);
+    if (!challenge) {
+        tunnel_make_cookie(t, MSG_TUNNEL_MIGRATE_ACK, id, from, cookie);
+        len = message_put_option(data, 0, sizeof(data), MSG_OPT_COOKIE,
+                                 cookie, sizeof(cookie));
+        message_send(t->udp_svr_sock, MESSAGE_VERSION_1,
+                     MSG_TUNNEL_MIGRATE_ACK, 0, msg->sn, data, len, from,
+                     fromlen);
+        t->migrate_challenged++;
+        return 0;
+    }
+
+    proof = message_get_option(msg->data, msg->length, MSG_OPT_CONN_PROOF,
+                               &plen);
+    if (clen != TUNNEL_COOKIE_LEN || !proof ||
+        plen != TUNNEL_CONN_PROOF_LEN ||
+        tunnel_cookie_valid(t, challenge, MSG_TUNNEL_MIGRATE_ACK, id,
+                            from) < 0)
+        goto refused;
+
+    mac = tunnel_conn_proof(peer, challenge);
+    if (crypto_compare(&mac, proof, sizeof(mac)))
+        goto refused;
+
+    if (message_get_option(msg->data, msg->length, MSG_OPT_PATH, &clen)) {
+        if (!(peer->caps & MSG_CAP_MULTIPATH) ||
+            (path = peer_add_path(t, peer, from, fromlen)) < 0)
+            goto refused;
+
+        t->path_joins++;
+        strcpy(old, socket_addr_name(peer_addr(peer)));
+        log_info("Peer %s, path %d joined from %s.", old, path,
+                 socket_addr_name(from));
+        return 0;
+    }
+
+    strcpy(old, socket_addr_name(peer_addr(peer)));
+    if (peer_move(t, peer, from, fromlen) < 0)
+        goto refused;
+
+    peer->heard = tunnel_clock();
+    t->migrated++;
+    log_info("Peer %s moved to %s, %d channels kept.", old,
+             socket_addr_name(from), peer->nchannels);
+
+    return 0;
+
+refused:
+    log_debug("Peer move to %s, refused.", socket_addr_name(from));
+    t->migrate_refused++;
+    return -1;
+}
+
+/* Answer a message on a channel that is not here with a reset, to peers
+   that take them. Once per RTO for the same channel of a peer. A peer
+   gone with its last channel is sent one in the clear, in version 2 and
+   for data only. TUNNEL_MAX_RESETS per check at most. */
+static void tunnel_send_reset(Tunnel *t, Peer *peer, const Message *msg,
+                              const struct sockaddr *from, socklen_t fromlen)
+{
+    uint32_t cid = msg->channel_id;
+    uint32_t now = tunnel_clock();
+    uint64_t token;
+    int rc;
+
+    if (t->resets_left <= 0)
+        return;
+
+    if (peer) {
+        if (!(peer->caps & MSG_CAP_RESET) ||
+            (peer->reset_cid == cid &&
+             !CLOCK_AFTER(now, peer->reset_sent + peer_rto(peer))))
+            return;
+
+        peer->reset_cid = cid;
+        peer->reset_sent = now;
+    } else if (t->config.encrypt ||
+               (msg->type != MSG_CHANNEL_DATA &&
+                msg->type != MSG_CHANNEL_DATA_DEDUP)) {
+        return;
+    }
+
+    /* Given under the peer's address, whatever path this came by */
+    token = tunnel_reset_token(t, peer ? peer_addr(peer) : from, cid);
+    if (peer)
+        rc = tunnel_send_message(t, peer, MSG_CHANNEL_RESET, cid, 0, &token,
+                                 sizeof(token));
+    else
+        rc = message_send(t->udp_svr_sock, MESSAGE_VERSION_2,
+                          MSG_CHANNEL_RESET, cid, 0, &token, sizeof(token),
+                          from, fromlen);
+    if (rc > 0)
+        t->resets_sent++;
+    t->resets_left--;
+
+    log_debug("Channel(%d) is not here, reset sent to %s.", cid,
+              socket_addr_name(from));
+}
+
+/* Close the channel a good reset is for. Returns -1 if it is refused. */
+static int tunnel_handle_reset(Tunnel *t, Peer *peer, Message *msg)
+{
+    Channel *ch = tunnel_get_channel(peer, msg->channel_id);
+
+    /* Gone here as well */
+    if (!ch)
+        return 0;
+
+    if (!ch->reset_token || msg->length != TUNNEL_RESET_TOKEN_LEN ||
+        crypto_compare(&ch->reset_token, msg->data,
+                       TUNNEL_RESET_TOKEN_LEN) ||
+        !CLOCK_AFTER(tunnel_clock(), ch->reset_after)) {
+        log_debug("Channel(%d) reset from %s, refused.", ch->id,
+                  socket_addr_name(peer_addr(peer)));
+        t->resets_refused++;
+        /* The server may be gone, or have this end at another address:
+           a probe tells sooner */
+        if (t->mode == TUNNEL_MODE_CLIENT) {
+            peer->keepalive = tunnel_clock();
+            if (peer->conn_id &&
+                CLOCK_AFTER(tunnel_clock(), peer->conn_sent + peer_rto(peer)))
+                tunnel_send_migrate(t, peer, peer->paths ? t->rx_path : -1,
+                                    NULL);
+        }
+        return -1;
+    }
+
+    t->resets_taken++;
+    channel_reset(ch);
+    tunnel_delete_channel(t, ch);
+
+    return 0;
+}
+
+/* While too many channels are half open, a client has to show it gets
+   replies at its address before a channel is set up: the request is
+   answered with a cookie and nothing is kept. Returns 0 to go on with
+   the request, 1 if it returned a good cookie, -1 if it was answered or
+   dropped. */
+static int tunnel_check_cookie(Tunnel *t, uint16_t sn, const char *opts,
+                               size_t optslen, const struct sockaddr *from,
+                               socklen_t fromlen)
+{
+    uint8_t cookie[TUNNEL_COOKIE_LEN];
+    char data[TUNNEL_MAX_OPTIONS_LEN];
+    const uint8_t *v;
+    uint8_t vlen;
+    size_t len;
+
+    /* Encrypted, a request only opens with keys the client derived from
+       the key, and hellos hand out keys under their own cookie check, see
+       tunnel_check_hello_cookie() */
+    if (t->config.encrypt || t->config.open_cookies < 0 ||
+        t->half_open < (uint32_t)t->config.open_cookies)
+        return 0;
+
+    v = (const uint8_t *)message_get_option(opts, optslen, MSG_OPT_COOKIE,
+                                            &vlen);
+    if (v && vlen == TUNNEL_COOKIE_LEN) {
+        if (!tunnel_cookie_valid(t, v, MSG_TUNNEL_NEW_CHANNEL_ACK, sn,
+                                 from)) {
+            t->cookies_taken++;
+            return 1;
+        }
+
+        log_debug("New channel request from %s, bad cookie.",
+                  socket_addr_name(from));
+        t->cookies_refused++;
+        return -1;
+    }
+
+    /* Nothing to tell older clients, they try again later */
+    if (!(message_get_option_u32(opts, optslen, MSG_OPT_CAPS, 0) &
+          MSG_CAP_COOKIE)) {
+        t->cookies_refused++;
+        return -1;
+    }
+
+    tunnel_make_cookie(t, MSG_TUNNEL_NEW_CHANNEL_ACK, sn, from, cookie);
+
+    /* Smaller than the request, nothing to gain from a spoofed one */
+    len = message_put_option(data, 0, sizeof(data), MSG_OPT_COOKIE, cookie,
+                             sizeof(cookie));
+    message_send(t->udp_svr_sock, MESSAGE_VERSION_1,
+                 MSG_TUNNEL_NEW_CHANNEL_ACK, 0, sn, data, len,
+                 from, fromlen);
+    t->cookies_sent++;
+
+    return -1;
+}
+
+static int tunnel_server_ack(Tunnel *t, Channel *ch)
+{
+    char opts[TUNNEL_MAX_OPTIONS_LEN];
+    size_t len;
+
+    len = message_put_option_u16(opts, 0, sizeof(opts), MSG_OPT_WINDOW,
+                                 ch->window);
+    len = tunnel_put_dedup_option(ch->peer, opts, len, sizeof(opts));
+    if (ch->setup->early)
+        len = message_put_option_u16(opts, len, sizeof(opts),
+                                     MSG_OPT_EARLY_TAKEN, ch->setup->early);
+    len = tunnel_put_reset_option(t, ch->peer, ch->id, opts, len,
+                                  sizeof(opts));
+    len = tunnel_put_conn_options(t, ch->peer, opts, len, sizeof(opts));
+
+    return tunnel_send_message(t, ch->peer, MSG_TUNNEL_NEW_CHANNEL_ACK,
+                               ch->id, ch->setup->sn, opts, len);
+}
+
+/* Take the first data sent with a fast open request, all of it or none.
+   Only once, every ack tells the same. Returns -1 if the channel is to
+   be closed. */
+static int tunnel_take_early_data(Tunnel *t, Channel *ch, const char *opts,
+                                  size_t optslen)
+{
+    char data[TUNNEL_MAX_DATA_LEN];
+    size_t max = sizeof(data);
+    size_t pos = 0;
+    size_t len = 0;
+    const char *v;
+    uint8_t vlen;
+    int rc;
+
+    if (!ch->setup->fast || ch->setup->early)
+        return 0;
+
+    if ((size_t)t->config.fast_open < max)
+        max = t->config.fast_open;
+
+    while ((v = (const char *)message_next_option(opts, optslen, &pos,
+                                                  MSG_OPT_EARLY_DATA,
+                                                  &vlen))) {
+        if (len + vlen > max) {
+            log_debug("Channel(%d) early data, more than %d bytes.",
+                      ch->id, (int)max);
+            return 0;
+        }
+
+        memcpy(data + len, v, vlen);
+        len += vlen;
+    }
+
+    if (!len)
+        return 0;
+
+    rc = channel_take_early_data(ch, data, len);
+    if (rc > 0) {
+        ch->setup->early = (uint16_t)len;
+        t->early_taken++;
+        t->early_bytes += len;
+    }
+
+    return rc < 0 ? -1 : 0;
+}
+
+/* The client has the channel: it acked, or sent on it */
+static int tunnel_server_opened(Tunnel *t, Channel *ch)
+{
+    tunnel_open_stats(t, channel_open_done(ch));
+
+    /* It gets replies at its address: fast open and a chunk cache from
+       now on */
+    ch->peer->verified = 1;
+
+    /* Connecting since the request with fast open, or from now on */
+    if (ch->state == CHANNEL_CONNECTING &&
+        (ch->tcp_sock == INVALID_SOCKET ? channel_connect_start(ch) :
+                                          channel_connect_done(ch)) < 0) {
+        tunnel_delete_channel(t, ch);
+        return -1;
+    }
+
+    channel_confirmed(ch);
+
+    return 0;
 }
 
 static int tunnel_server_new_channel(Tunnel *t, uint16_t sn, 
@@ -341,18 +1848,33 @@ static int tunnel_server_new_channel(Tunnel *t, uint16_t sn,
     int rc;
     char *profile, *host, *port;
     char *tokc = NULL;
-    uint16_t cid;
+    uint32_t cid;
+    uint16_t window;
+    size_t len;
+    const char *peer_opts;
+    size_t peer_optslen;
+    int verified;
+    int fresh;
     Channel *ch;
+    Peer *peer;
 
-    /* Data format is: profile:host:port\0 */
+    /* Data format is: profile:host:port\0[options] */
 
-    if (strnlen((char *)data, datalen) == datalen) {
+    len = strnlen((char *)data, datalen);
+    if (len == datalen) {
         /* no null terminal */
         log_warning("New channel request from %s denied, invalid request.",
                     socket_addr_name(from));
         return -1;
     }
 
+    /* Older clients send no options, they are stop-and-wait */
+    peer_opts = (char *)data + len + 1;
+    peer_optslen = datalen - len - 1;
+    window = message_get_option_u16(peer_opts, peer_optslen, MSG_OPT_WINDOW,
+                                    1);
+    window = tunnel_negotiate_window(t, window);
+
     profile = strtok_r((char *)data, ":", &tokc);
     host = strtok_r(NULL, ":", &tokc);
     port = strtok_r(NULL, ":", &tokc);
@@ -378,121 +1900,917 @@ static int tunnel_server_new_channel(Tunnel *t, uint16_t sn,
         return -1;
     }
 
-    cid = tunnel_next_cid(t);
-    
+    /* Sent again, the ack was lost or is late */
+    peer = peer_find(t, from, fromlen);
+    ch = peer ? tunnel_find_open(t, peer, sn) : NULL;
+    if (ch) {
+        log_debug("New channel(%d) request from %s again.", ch->id,
+                  socket_addr_name(from));
+
+        /* Maybe with the first data now */
+        if (tunnel_take_early_data(t, ch, peer_opts, peer_optslen) < 0) {
+            tunnel_delete_channel(t, ch);
+            return -1;
+        }
+
+        return tunnel_server_ack(t, ch) > 0 ? 0 : -1;
+    }
+
+    rc = tunnel_check_cookie(t, sn, peer_opts, peer_optslen, from, fromlen);
+    if (rc < 0)
+        return -1;
+
+    /* Fast open only for a client known to get replies at its address */
+    verified = rc > 0 || t->config.encrypt || t->config.fast_open_any;
+
+    peer = peer_get(t, from, fromlen);
+    if (!peer) {
+        log_error("New channel request from %s, out of memory.",
+                  socket_addr_name(from));
+        return -1;
+    }
+    if (tunnel_check_session(t, peer, peer_opts, peer_optslen) < 0) {
+        log_debug("New channel request from %s, of its last session, "
+                  "ignored.", socket_addr_name(from));
+        peer_release(t, peer);
+        return -1;
+    }
+    if (tunnel_negotiate_peer(t, peer, peer_opts, peer_optslen) < 0) {
+        log_warning("New channel request from %s denied, lower version "
+                    "with channels open.", socket_addr_name(from));
+        peer_release(t, peer);
+        return -1;
+    }
+    tunnel_negotiate_dedup(peer, peer_opts, peer_optslen);
+
+    /* The id width depends on the wire format */
+    cid = tunnel_next_cid(peer);
+    if (!cid) {
+        log_warning("New channel request from %s denied, out of channels.",
+                    socket_addr_name(from));
+        peer_release(t, peer);
+        return -1;
+    }
+
     log_debug("New channel(%d) request from %s to %s:%s.", cid,
               socket_addr_name(from), host, port);
 
-    ch = channel_create_server(t, cid, host, port, from, fromlen);
-    if (!ch) {
+    /* A late copy of a request whose channel may be gone already is set
+       up the slow way, nothing is sent to the remote twice */
+    fresh = peer_open_fresh(peer, sn);
+    verified = verified || peer->verified;
+
+    /* Channel holds its own reference to the peer */
+    ch = channel_create_server(t, cid, host, port, peer);
+    peer_release(t, peer);
+    if (!ch)
+        return -1;
+
+    ch->window = window;
+    ch->setup->fast = t->config.fast_open >= 0 && verified && fresh;
+
+    rc = tunnel_add_open(t, ch, sn);
+    if (!rc) {
         channel_close(ch);
+        log_error("New channel(%d) from %s to %s:%s failed, out of memory.",
+                  cid, socket_addr_name(from), host, port);
         return -1;
     }
-    
-    rc = message_send(t->udp_svr_sock, MSG_TUNNEL_NEW_CHANNEL_ACK, cid, sn,
-                      NULL, 0, from, fromlen);
+
+    /* Not connected yet, queued for the remote */
+    if (tunnel_take_early_data(t, ch, peer_opts, peer_optslen) < 0) {
+        channel_close(ch);
+        return -1;
+    }
+
+    rc = tunnel_server_ack(t, ch);
     if (rc <= 0) {
         channel_close(ch);
-        log_error("New channel(%d) request from %s to %s:%d failed, "
+        log_error("New channel(%d) request from %s to %s:%s failed, "
                   "send ack error:%d.",
                   cid, socket_addr_name(from), host, port, socket_errno());
         return -1;
     }
 
-    rc = tunnel_add_channel(t, ch, 0);
+    rc = tunnel_add_channel(ch);
     if (!rc) {
         channel_close(ch);
-        log_error("New channel(%d) from %s to %s:%d failed, out of memory.",
+        log_error("New channel(%d) from %s to %s:%s failed, out of memory.",
                   cid, socket_addr_name(from), host, port);
         return -1;
     }
 
-    log_debug("Channel(%d) is opening, waiting for handshake.", cid);
+    channel_open_sent(ch);
+
+    /* Failing that, connected once the client acks */
+    if (ch->setup->fast) {
+        if (channel_connect_start(ch) < 0) {
+            tunnel_delete_channel(t, ch);
+            return -1;
+        }
+        t->fast_opened++;
+    }
+
+    log_debug("Channel(%d) is opening, waiting for handshake.", cid);
+    return 0;
+}
+
+/* Append the first data read while opening, with fast open. The bytes
+   sent first are sent again every time, room is left for a cookie. */
+static size_t tunnel_put_early_data(Tunnel *t, Channel *ch, char *data,
+                                    size_t len, size_t size)
+{
+    ChannelSetup *s = ch->setup;
+    const char *p;
+    size_t room;
+    size_t chunk;
+    size_t n;
+
+    n = channel_early_data(ch, &p);
+    if (!s->early) {
+        if (!n || t->config.fast_open <= 0 ||
+            !(t->peer->caps & MSG_CAP_FAST_OPEN))
+            return len;
+
+        room = size - len;
+        if (!s->cookielen)
+            room = room > 2 + TUNNEL_COOKIE_LEN ?
+                   room - 2 - TUNNEL_COOKIE_LEN : 0;
+
+        /* 2 bytes per option of up to 255 */
+        room = room / 257 * 255 + (room % 257 > 2 ? room % 257 - 2 : 0);
+        if (n > room)
+            n = room;
+        if (n > (size_t)t->config.fast_open)
+            n = t->config.fast_open;
+        if (!n)
+            return len;
+
+        s->early = (uint16_t)n;
+        t->fast_opened++;
+    }
+
+    for (n = 0; n < s->early; n += chunk) {
+        chunk = s->early - n < 255 ? s->early - n : 255;
+        len = message_put_option(data, len, size, MSG_OPT_EARLY_DATA,
+                                 p + n, (uint8_t)chunk);
+    }
+
+    return len;
+}
+
+/* New channel request of an opening channel, whose id is the sn, with
+   the cookie the server returned and early data if any */
+static int tunnel_client_request(Tunnel *t, Channel *ch)
+{
+    char data[TUNNEL_MAX_DATA_LEN];
+    size_t len;
+
+    len = sprintf(data, "%s:%s:%s", TUNNEL_DEFAULT_PROFILE, 
+                  t->remote_host, t->remote_port) + 1;
+    len = message_put_option_u16(data, len, sizeof(data), MSG_OPT_WINDOW,
+                                 t->window);
+    len = tunnel_put_peer_options(t, data, len, sizeof(data));
+    len = tunnel_put_dedup_option(t->peer, data, len, sizeof(data));
+    if (ch->setup->cookielen)
+        len = message_put_option(data, len, sizeof(data), MSG_OPT_COOKIE,
+                                 ch->setup->cookie, ch->setup->cookielen);
+    len = tunnel_put_early_data(t, ch, data, len, sizeof(data));
+
+    return tunnel_send_message(t, t->peer, MSG_TUNNEL_NEW_CHANNEL, 0, ch->id,
+                               data, len);
+}
+
+/* Client channels opened ahead have no connection yet */
+static const char *tunnel_client_name(SOCKET s)
+{
+    return s != INVALID_SOCKET ? socket_remote_name(s) : "the pool";
+}
+
+/* Open a channel for connection s, or ahead into the pool if s is
+   INVALID_SOCKET */
+static int tunnel_client_new_channel(Tunnel *t, SOCKET s)
+{
+    int rc;
+    uint16_t sn;
+    Channel *ch;
+
+    sn = t->sn++;
+
+    log_debug("Connecting from %s, send new channel(%d) request.", 
+               tunnel_client_name(s), -sn);
+
+    /* Initial channel ID is sn */
+    ch = channel_create_client(t, s, sn, t->peer);
+    if (!ch)
+        return -1;
+
+    /* Fast open reads while opening, data sent with the connect goes
+       with the request */
+    if (s != INVALID_SOCKET && t->config.fast_open > 0 &&
+        (t->peer->caps & MSG_CAP_FAST_OPEN)) {
+        tunnel_sockets_set(t, s);
+        if (channel_tcp2udp_data(ch) <= 0) {
+            channel_mark_to_close(ch);
+            channel_close(ch);
+            return -1;
+        }
+    }
+
+    rc = tunnel_client_request(t, ch);
+    if (rc <= 0) {
+        log_error("Send new channel(%d) request error:%d.",
+                  -sn, socket_errno());
+        channel_mark_to_close(ch);
+        channel_close(ch);
+        return -1;
+    }
+
+    rc = tunnel_add_channel(ch);
+    if (!rc) {
+        channel_mark_to_close(ch);
+        channel_close(ch);
+        log_error("New channel(%d) failed, out of memory.", -sn);
+        return -1;
+    }
+
+    channel_open_sent(ch);
+    if (s == INVALID_SOCKET)
+        t->pool_opening++;
+
+    log_debug("Channel(%d) for %s is opening, waiting for handshake.", 
+              -sn, tunnel_client_name(s));
+
+    return 0;
+}
+
+/* Fast open: the first data came while opening, the request is sent
+   again with it */
+static int tunnel_client_early_data(Tunnel *t, Channel *ch)
+{
+    const char *data;
+
+    if (ch->setup->early || !channel_early_data(ch, &data))
+        return 0;
+
+    if (tunnel_client_request(t, ch) <= 0) {
+        log_error("Send new channel(%d) request error:%d.",
+                  -ch->id, socket_errno());
+        return -1;
+    }
+
+    return 0;
+}
+
+/* The server is busy and wants its cookie back first */
+static int tunnel_client_cookie(Tunnel *t, uint16_t sn, const char *opts,
+                                size_t optslen)
+{
+    Channel *ch = tunnel_get_channel(t->peer, -(uint32_t)sn);
+    const void *cookie;
+    uint8_t len;
+
+    cookie = message_get_option(opts, optslen, MSG_OPT_COOKIE, &len);
+    if (!ch || !cookie || len != TUNNEL_COOKIE_LEN)
+        return -1;
+
+    log_debug("Channel(%d) for %s, server returned a cookie.",
+              -sn, tunnel_client_name(ch->tcp_sock));
+
+    /* Sent again with it until acked */
+    memcpy(ch->setup->cookie, cookie, len);
+    ch->setup->cookielen = len;
+    if (tunnel_client_request(t, ch) <= 0) {
+        log_error("Send new channel(%d) request error:%d.",
+                  -sn, socket_errno());
+        return -1;
+    }
+
+    return 0;
+}
+
+/* For client side: a new connection id is a new session on the server,
+   it has only the path its answer came by. The others join again. */
+static void tunnel_rejoin_paths(Tunnel *t, Peer *peer)
+{
+    uint32_t now = tunnel_clock();
+    Path *p;
+    int i;
+
+    for (i = 0; i < peer->npaths; i++) {
+        p = &peer->paths[i];
+        if (i == t->rx_path || p->state != PATH_UP)
+            continue;
+
+        path_down(p);
+        p->retry = now + TUNNEL_PATH_RETRY_MIN;
+        p->backoff = TUNNEL_PATH_RETRY_MIN * 2;
+        tunnel_send_migrate(t, peer, i, NULL);
+    }
+}
+
+static int tunnel_client_new_channel_ack(Tunnel *t, Channel *ch,
+                                         uint32_t new_cid, uint16_t sn,
+                                         const char *opts, size_t optslen)
+{
+    char data[TUNNEL_MAX_OPTIONS_LEN];
+    uint32_t id = t->peer->conn_id;
+    size_t len;
+    int rc;
+    int old_cid = ch->id;
+    int ahead = ch->tcp_sock == INVALID_SOCKET;
+    uint32_t ms;
+    uint16_t early;
+
+    if (ahead)
+        t->pool_opening--;
+
+    /* Older servers send no options, they are stop-and-wait */
+    ch->window = tunnel_negotiate_window(t,
+            message_get_option_u16(opts, optslen, MSG_OPT_WINDOW, 1));
+    tunnel_negotiate_dedup(t->peer, opts, optslen);
+    early = message_get_option_u16(opts, optslen, MSG_OPT_EARLY_TAKEN, 0);
+    tunnel_take_reset_token(ch, opts, optslen);
+    tunnel_take_conn_id(t->peer, opts, optslen);
+    if (t->peer->paths && id && id != t->peer->conn_id)
+        tunnel_rejoin_paths(t, t->peer);
+
+    /* If lost, the server sends its ack again */
+    len = tunnel_put_reset_option(t, t->peer, new_cid, data, 0,
+                                  sizeof(data));
+    rc = tunnel_send_message(t, t->peer, MSG_TUNNEL_NEW_CHANNEL_ACK, new_cid,
+                             sn, data, len);
+    if (rc <= 0)
+        log_warning("New channel(%d) for %s, handshake error:%d.", 
+                    -old_cid, tunnel_client_name(ch->tcp_sock),
+                    socket_errno());
+
+    ms = channel_open_done(ch);
+    tunnel_open_stats(t, ms);
+    if (early && early == ch->setup->early) {
+        t->early_taken++;
+        t->early_bytes += early;
+    }
+
+    if (channel_opened(ch, new_cid, early) < 0) {
+        channel_close(ch);
+        return -1;
+    }
+
+    rc = tunnel_add_channel(ch);
+    if (!rc) {
+        channel_close(ch);
+        log_error("New channel(%d) for %s failed, out of memory.",
+                  -old_cid, tunnel_client_name(ch->tcp_sock));
+        return -1;
+    }
+
+    if (ahead) {
+        t->pool[t->pool_ready++] = ch;
+        t->pool_refills++;
+        t->pool_refill_ms += ms;
+        if (ms > t->pool_refill_max_ms)
+            t->pool_refill_max_ms = ms;
+    }
+
+    return 0;
+}
+
+/* Open channels ahead until the pool is full, the rest is left to the
+   next check if the server cannot be asked now */
+static void tunnel_fill_pool(Tunnel *t)
+{
+    if (t->down)
+        return;
+
+    while (t->pool_ready + t->pool_opening < t->config.pool) {
+        if (tunnel_client_new_channel(t, INVALID_SOCKET) < 0)
+            break;
+    }
+}
+
+/* Connection s takes the oldest channel ready in the pool, what the
+   remote sends first is there by then. Returns -1 if there is none. */
+static int tunnel_take_pooled(Tunnel *t, SOCKET s)
+{
+    Channel *ch;
+
+    if (!t->config.pool)
+        return -1;
+
+    if (!t->pool_ready) {
+        t->pool_misses++;
+        return -1;
+    }
+
+    ch = t->pool[0];
+    tunnel_pool_remove(t, ch);
+
+    t->pool_hits++;
+    if (channel_bind(ch, s) < 0)
+        tunnel_delete_channel(t, ch);
+
+    return 0;
+}
+
+/* Send the request or ack of channels being set up again, give up on
+   the ones never answered */
+static void tunnel_check_opens(Tunnel *t)
+{
+    uint32_t now = tunnel_clock();
+    Channel *next;
+    Channel *ch;
+    int rc;
+
+    for (ch = t->opening; ch; ch = next) {
+        next = ch->setup->next;
+
+        rc = channel_open_timeout(ch, now);
+        if (rc > 0) {
+            t->open_resent++;
+            if (ch->mode == CHANNEL_MODE_CLIENT)
+                tunnel_client_request(t, ch);
+            else
+                tunnel_server_ack(t, ch);
+        } else if (rc < 0) {
+            t->open_failed++;
+            if (ch->mode == CHANNEL_MODE_CLIENT)
+                log_warning("Channel(%d) for %s, no answer from %s:%s.",
+                            -ch->id, tunnel_client_name(ch->tcp_sock),
+                            t->tunnel_host, t->tunnel_port);
+            else
+                log_debug("Channel(%d) from %s, no ack.", ch->id,
+                          socket_addr_name(peer_addr(ch->peer)));
+            tunnel_delete_channel(t, ch);
+        }
+    }
+}
+
+static void tunnel_probe_peers(Tunnel *t)
+{
+    static char padding[TUNNEL_MAX_PAYLOAD];
+
+    uint32_t now = tunnel_clock();
+    uint32_t hash;
+    uint16_t size;
+    uint16_t sn;
+    MessageHeader hdr;
+    Peer *p;
+    int rc;
+
+    rc = hashtable_first(t->peers, &hash, (void **)&p);
+    while (rc) {
+        for (; p; p = p->next) {
+            /* Kept for the chunk cache only. Data goes by any of several
+               paths at the base size. */
+            if (!p->refcnt || p->paths)
+                continue;
+
+            size = pmtu_next_probe(&p->pmtu, now);
+            if (!size)
+                continue;
+
+            /* Version 1 headers are never smaller than version 2 data
+               headers, the probe covers the data messages of its size */
+            sn = t->sn++;
+            message_init_header(&hdr, MESSAGE_VERSION_1, MSG_TUNNEL_PROBE,
+                                0, 0, sn, size);
+            if (tunnel_sendv(t, p, -1, &hdr, padding, size, NULL) <= 0) {
+                /* EMSGSIZE, larger than the local interface takes */
+                log_debug("PMTU probe of %d bytes to %s error:%d.", size,
+                          socket_addr_name(peer_addr(p)), socket_errno());
+                pmtu_probe_failed(&p->pmtu, now);
+            } else {
+                pmtu_probe_sent(&p->pmtu, sn, now);
+            }
+        }
+
+        rc = hashtable_next(t->peers, &hash, (void **)&p);
+    }
+}
+
+/* For client side: the server looks gone, hello again in the background
+   until it answers */
+static void tunnel_reconnect(Tunnel *t, const char *why)
+{
+    if (t->down)
+        return;
+
+    log_warning("Tunnel server %s:%s %s, hello again.", t->tunnel_host,
+                t->tunnel_port, why);
+
+    tunnel_hello_start(t, tunnel_clock());
+}
+
+/* For client side, while down: the next hello to each address once its
+   time is up, half the backoff and a random part of the other half
+   later */
+static void tunnel_hello_again(Tunnel *t, uint32_t now)
+{
+    TunnelHello *h;
+    uint32_t jitter;
+    int i;
+
+    /* Kept waiting long enough, reset from now on */
+    if (CLOCK_AFTER(now, t->down_since + TUNNEL_DOWN_HOLD * 1000))
+        tunnel_sockets_set(t, t->tcp_svr_sock);
+
+    for (i = 0; i < t->nhellos; i++) {
+        h = &t->hellos[i];
+        if (CLOCK_AFTER(h->next, now))
+            continue;
+
+        if (!h->tries)
+            log_info("Hello to %s.",
+                     socket_addr_name((struct sockaddr *)&h->addr));
+
+        /* From each local address in turn, one of them gets through */
+        h->local = (uint8_t)(h->tries++ % t->nsocks);
+        h->sn = t->sn++;
+        h->sent = now;
+        h->cookied = 0;
+        if (tunnel_send_hello(t, h->sn, h->nonce, NULL, h->local,
+                              (struct sockaddr *)&h->addr, h->addrlen) <= 0)
+            log_warning("Send hello to %s error:%d.",
+                        socket_addr_name((struct sockaddr *)&h->addr),
+                        socket_errno());
+
+        jitter = 0;
+        crypto_random(&jitter, sizeof(jitter));
+        h->next = now + h->backoff / 2 + jitter % (h->backoff / 2 + 1);
+        h->backoff *= 2;
+        if (h->backoff > TUNNEL_HELLO_BACKOFF_MAX)
+            h->backoff = TUNNEL_HELLO_BACKOFF_MAX;
+    }
+}
+
+/* For client side: the hello try a hello ack from addr answers, NULL if
+   none */
+static TunnelHello *tunnel_find_hello(Tunnel *t, uint16_t sn,
+                                      const struct sockaddr *addr,
+                                      socklen_t addrlen)
+{
+    TunnelHello *h;
+    int i;
+
+    for (i = 0; i < t->nhellos; i++) {
+        h = &t->hellos[i];
+        if (h->tries && h->sn == sn && h->addrlen == addrlen &&
+            !memcmp(&h->addr, addr, addrlen))
+            return h;
+    }
+
+    return NULL;
+}
+
+/* For client side: the first server address to answer a hello while
+   down, the tries to the others are over */
+static int tunnel_hello_back(Tunnel *t, TunnelHello *h, Message *msg)
+{
+    uint32_t now = tunnel_clock();
+    uint32_t ms = now - t->down_since;
+    int first = !t->peer;
+    Peer *p;
+
+    /* Tried again later, the server may get the key back */
+    if (tunnel_hello_done(t, msg, h->nonce, h->sent, h->local,
+                          (struct sockaddr *)&h->addr, h->addrlen) < 0)
+        return -1;
+
+    p = t->peer;
+    p->heard = now;
+    p->keepalive_wait = 0;
+    p->keepalive_missed = 0;
+    p->keepalive = now + PEER_KEEPALIVE_TIME * 1000;
+
+    t->down = 0;
+    tunnel_sockets_set(t, t->tcp_svr_sock);
+
+    if (first) {
+        t->up_ms = ms;
+        log_info("Tunnel server %s:%s answered from %s after %u ms.",
+                 t->tunnel_host, t->tunnel_port,
+                 socket_addr_name(peer_addr(p)), ms);
+    } else if (t->rekey) {
+        log_debug("Tunnel server %s:%s, new keys after %u ms.",
+                  t->tunnel_host, t->tunnel_port, ms);
+    } else {
+        t->reconnects++;
+        t->reconnect_ms += ms;
+        if (ms > t->reconnect_max_ms)
+            t->reconnect_max_ms = ms;
+        log_info("Tunnel server %s:%s answered again from %s after %u ms.",
+                 t->tunnel_host, t->tunnel_port,
+                 socket_addr_name(peer_addr(p)), ms);
+    }
+    t->rekey = 0;
+
+    tunnel_fill_pool(t);
+
     return 0;
 }
 
-static int tunnel_client_new_channel(Tunnel *t, SOCKET s)
+/* For client side: the server is busy and wants its cookie back with
+   the hello first, once per try. Returns 0 if the ack has no cookie. */
+static int tunnel_hello_cookie(Tunnel *t, TunnelHello *h, Message *msg)
 {
-    int rc;
-    uint16_t sn;
+    const void *cookie;
+    uint8_t len;
+
+    cookie = message_get_option(msg->data, msg->length, MSG_OPT_COOKIE,
+                                &len);
+    if (!cookie)
+        return 0;
+    if (h->cookied || len != TUNNEL_COOKIE_LEN)
+        return 1;
+
+    log_debug("Hello to %s, server returned a cookie.",
+              socket_addr_name((struct sockaddr *)&h->addr));
+
+    h->cookied = 1;
+    h->sent = tunnel_clock();
+    if (tunnel_send_hello(t, h->sn, h->nonce, cookie, h->local,
+                          (struct sockaddr *)&h->addr, h->addrlen) <= 0)
+        log_warning("Send hello to %s error:%d.",
+                    socket_addr_name((struct sockaddr *)&h->addr),
+                    socket_errno());
+
+    return 1;
+}
+
+/* A path of peer went quiet or lost its probes: its data goes by the
+   others if any is up, and a client joins it again */
+static void tunnel_path_down(Tunnel *t, Peer *peer, int path,
+                             const char *why)
+{
+    Path *p = &peer->paths[path];
     Channel *ch;
-    char data[TUNNEL_MAX_DATA_LEN];
-    size_t len;
+    int moved = 0;
+    int i;
 
-    sn = t->sn++;
+    path_down(p);
+    p->retry = tunnel_clock();
+    p->backoff = TUNNEL_PATH_RETRY_MIN;
+    t->path_downs++;
 
-    log_debug("Connecting from %s, send new channel(%d) request.", 
-               socket_remote_name(s), -sn);
+    for (i = 0; i < peer->npaths; i++) {
+        if (peer->paths[i].state == PATH_UP)
+            break;
+    }
+    for (ch = peer->channels; ch && i < peer->npaths; ch = ch->peer_next)
+        moved += channel_path_down(ch, path);
+    t->path_moved += moved;
 
-    /* Initial channel ID is sn */
-    ch = channel_create_client(t, s, sn,
-                               (const struct sockaddr *)&t->tunnel_addr,
-                               t->tunnel_addr_len);
-    if (!ch)
-        return -1;
+    log_warning("Peer %s, path %d %s, down. %d messages sent again.",
+                socket_addr_name(peer_addr(peer)), path, why, moved);
+}
 
-    len = sprintf(data, "%s:%s:%s", TUNNEL_DEFAULT_PROFILE, 
-                  t->remote_host, t->remote_port);
-    rc = message_send(t->udp_svr_sock, MSG_TUNNEL_NEW_CHANNEL,
-                      0, sn, data, len+1,
-                      (const struct sockaddr *)&t->tunnel_addr,
-                      t->tunnel_addr_len);
-    if (rc <= 0) {
-        log_error("Send new channel(%d) request error:%d.",
-                  -sn, socket_errno());
-        channel_mark_to_close(ch);
-        channel_close(ch);
-        return -1;
-    }
+/* Paths quiet too long with data in flight are down, on either side */
+static void tunnel_check_paths(Tunnel *t, uint32_t now)
+{
+    uint32_t hash;
+    Peer *p;
+    int rc;
+    int i;
+
+    rc = hashtable_first(t->peers, &hash, (void **)&p);
+    while (rc) {
+        for (; p; p = p->next) {
+            for (i = 0; p->paths && i < p->npaths; i++) {
+                if (p->paths[i].state == PATH_UP &&
+                    path_silent(&p->paths[i], now))
+                    tunnel_path_down(t, p, i, "not heard from");
+            }
+        }
 
-    rc = tunnel_add_channel(t, ch, 1);
-    if (!rc) {
-        channel_mark_to_close(ch);
-        channel_close(ch);
-        log_error("New channel(%d) failed, out of memory.", -sn);
-        return -1;
+        rc = hashtable_next(t->peers, &hash, (void **)&p);
     }
+}
 
-    log_debug("Channel(%d) for %s is opening, waiting for handshake.", 
-              -sn, socket_remote_name(s));
+/* For client side: a keepalive probe by a path of the server */
+static void tunnel_send_path_probe(Tunnel *t, Peer *peer, int path,
+                                   uint32_t now)
+{
+    Path *p = &peer->paths[path];
+    MessageHeader hdr;
+
+    p->probe_wait = 1;
+    p->probe_sn = t->sn++;
+    p->probe_sent = now;
+    p->probe = now + PEER_KEEPALIVE_TIME * 1000;
+    peer->keepalives++;
+
+    message_init_header(&hdr, peer->version, MSG_TUNNEL_PROBE, 0, 0,
+                        p->probe_sn, 0);
+    if (tunnel_sendv(t, peer, path, &hdr, NULL, 0, NULL) <= 0)
+        log_warning("Keepalive to %s by path %d error:%d.",
+                    socket_addr_name(peer_addr(peer)), path,
+                    socket_errno());
+}
 
-    return 0;
+/* For client side: the ack of a probe by a path, the path is up once
+   the server tells the connection id with it. Returns 0 if it is not
+   the path's probe. */
+static int tunnel_path_probe_acked(Tunnel *t, Peer *peer, int path,
+                                   const Message *msg)
+{
+    Path *p = &peer->paths[path];
+    uint32_t now = tunnel_clock();
+
+    if (!p->probe_wait || (uint16_t)msg->sn != p->probe_sn)
+        return 0;
+
+    p->probe_wait = 0;
+    p->probe_missed = 0;
+    path_rtt_sample(p, now - p->probe_sent, now);
+
+    if (p->state == PATH_DOWN && peer->conn_id &&
+        message_get_option_u32(msg->data, msg->length, MSG_OPT_CONN_ID,
+                               0) == peer->conn_id) {
+        path_up(p, now);
+        t->path_joins++;
+        log_info("Peer %s, path %d up, RTT %d ms.",
+                 socket_addr_name(peer_addr(peer)), path, p->srtt);
+    }
+
+    return 1;
 }
 
-static int tunnel_client_new_channel_ack(Tunnel *t, Channel *ch,
-                                         uint16_t new_cid, uint16_t sn)
+/* For client side: the keepalive of tunnel_keepalive() by every path up.
+   Paths down are joined again with a probe, backing off. The server is
+   only taken for gone with all of them down. */
+static void tunnel_keepalive_paths(Tunnel *t, Peer *peer, uint32_t now)
 {
-    int rc;
-    int old_cid = ch->id;
+    uint32_t timeout;
+    Path *p;
+    int up = 0;
+    int i;
+
+    for (i = 0; i < peer->npaths; i++) {
+        p = &peer->paths[i];
+
+        timeout = 4 * path_rto(p);
+        if (timeout < PEER_PROBE_TIMEOUT)
+            timeout = PEER_PROBE_TIMEOUT;
+        if (p->probe_wait && CLOCK_AFTER(now, p->probe_sent + timeout)) {
+            p->probe_wait = 0;
+            if (p->state == PATH_UP) {
+                peer->keepalives_lost++;
+                if (++p->probe_missed >= PEER_PROBES_LOST)
+                    tunnel_path_down(t, peer, i, "not answering");
+                p->probe = now;
+            }
+        }
 
-    rc = message_send(t->udp_svr_sock, MSG_TUNNEL_NEW_CHANNEL_ACK, new_cid, sn,
-                      NULL, 0, (const struct sockaddr *)&t->tunnel_addr, 
-                      t->tunnel_addr_len);
-    if (rc <= 0) {
-        log_error("New channel(%d) for %s, handshake error:%d.", 
-                  -old_cid, socket_remote_name(ch->tcp_sock), socket_errno());
-        channel_close(ch);
-        return -1;
+        if (p->state == PATH_DOWN) {
+            if (!peer->conn_id || CLOCK_AFTER(p->retry, now))
+                continue;
+
+            tunnel_send_migrate(t, peer, i, NULL);
+            tunnel_send_path_probe(t, peer, i, now);
+
+            p->retry = now + p->backoff;
+            p->backoff = p->backoff * 2 > TUNNEL_PATH_RETRY_MAX ?
+                         TUNNEL_PATH_RETRY_MAX : p->backoff * 2;
+            continue;
+        }
+        up++;
+
+        /* Sent something by it since it went quiet */
+        if (!CLOCK_AFTER(now, p->heard + PEER_QUIET_TIME))
+            p->quiet_bytes = p->bytes_out;
+        else if (p->bytes_out != p->quiet_bytes && !p->probe_wait)
+            p->probe = now;
+
+        if (!p->probe_wait && !CLOCK_AFTER(p->probe, now))
+            tunnel_send_path_probe(t, peer, i, now);
     }
 
-    channel_opened(ch, new_cid);
+    if (!up)
+        tunnel_reconnect(t, "not answering by any path");
+}
 
-    rc = tunnel_add_channel(t, ch, 0);
-    if (!rc) {
-        channel_close(ch);
-        log_error("New channel(%d) for %s failed, out of memory."
-                  -old_cid, socket_remote_name(ch->tcp_sock));
-        return -1;
+/* For client side: a keepalive probe per keepalive time while there are
+   channels, one stream however many, and right away when the server
+   went quiet. Lost ones in a row take the server for gone. */
+static void tunnel_keepalive(Tunnel *t, uint32_t now)
+{
+    Peer *p = t->peer;
+    uint32_t timeout;
+
+    if (!p || !(p->caps & MSG_CAP_KEEPALIVE) || t->down)
+        return;
+
+    /* Nothing to lose while idle, the timeout starts with a channel */
+    if (!p->nchannels) {
+        p->heard = now;
+        p->keepalive_wait = 0;
+        p->keepalive_missed = 0;
+        return;
     }
 
-    return 0;
+    if (p->paths) {
+        tunnel_keepalive_paths(t, p, now);
+        return;
+    }
+
+    timeout = 4 * peer_rto(p);
+    if (timeout < PEER_PROBE_TIMEOUT)
+        timeout = PEER_PROBE_TIMEOUT;
+    if (p->keepalive_wait &&
+        CLOCK_AFTER(now, p->keepalive_sent + timeout)) {
+        p->keepalive_wait = 0;
+        p->keepalives_lost++;
+        if (++p->keepalive_missed >= PEER_PROBES_LOST) {
+            p->keepalive_missed = 0;
+            tunnel_reconnect(t, "not answering");
+            return;
+        }
+        p->keepalive = now;
+    }
+
+    /* Sent something since it went quiet */
+    if (!CLOCK_AFTER(now, p->heard + PEER_QUIET_TIME))
+        p->quiet_bytes = p->bytes_out;
+    else if (p->bytes_out != p->quiet_bytes && !p->keepalive_wait)
+        p->keepalive = now;
+
+    if (p->keepalive_wait || CLOCK_AFTER(p->keepalive, now))
+        return;
+
+    /* This end may have moved, a NAT rebinding say */
+    if (p->conn_id && CLOCK_AFTER(now, p->heard + PEER_QUIET_TIME))
+        tunnel_send_migrate(t, p, -1, NULL);
+
+    p->keepalive_wait = 1;
+    p->keepalive_sn = t->sn++;
+    p->keepalive_sent = now;
+    p->keepalive = now + PEER_KEEPALIVE_TIME * 1000;
+    p->keepalives++;
+
+    if (tunnel_send_message(t, p, MSG_TUNNEL_PROBE, 0, p->keepalive_sn,
+                            NULL, 0) <= 0)
+        log_warning("Keepalive to %s error:%d.",
+                    socket_addr_name(peer_addr(p)), socket_errno());
+}
+
+/* Not heard from for too long. A client only knows with servers that
+   probe replies keep coming from. */
+static int tunnel_peer_lost(Tunnel *t, Peer *p, uint32_t now)
+{
+    if (t->mode == TUNNEL_MODE_CLIENT && !(p->caps & MSG_CAP_KEEPALIVE))
+        return 0;
+
+    return CLOCK_AFTER(now, p->heard + PEER_TIMEOUT * 1000);
+}
+
+/* Sessions of lost peers end with all their channels. Closing channels
+   may free peers, collect first. */
+static void tunnel_expire_sessions(Tunnel *t, uint32_t now)
+{
+    Peer *lost[PEER_EXPIRE_BATCH];
+    uint32_t hash;
+    int count;
+    int rc;
+    int n;
+    int i;
+    Peer *p;
+
+    do {
+        count = 0;
+        rc = hashtable_first(t->peers, &hash, (void **)&p);
+        while (rc && count < PEER_EXPIRE_BATCH) {
+            for (; p && count < PEER_EXPIRE_BATCH; p = p->next) {
+                if (p->channels && tunnel_peer_lost(t, p, now))
+                    lost[count++] = peer_ref(p);
+            }
+            rc = hashtable_next(t->peers, &hash, (void **)&p);
+        }
+
+        for (i = 0; i < count; i++) {
+            n = tunnel_end_session(t, lost[i], 0);
+            log_warning("Peer %s not heard from for %d seconds, %d channels "
+                        "closed.", socket_addr_name(peer_addr(lost[i])),
+                        PEER_TIMEOUT, n);
+            peer_release(t, lost[i]);
+        }
+    } while (count == PEER_EXPIRE_BATCH);
 }
 
-static int tunnel_handle_message(Tunnel *t, Message *msg,  
+/* peer sent it, NULL if not known yet. Channels are looked up in its id
+   space only. */
+static int tunnel_handle_message(Tunnel *t, Buffer *buf, Peer *peer,
                                  const struct sockaddr *from, socklen_t fromlen)
 {
+    Message *msg = message_of(buf);
+    char data[TUNNEL_MAX_OPTIONS_LEN];
+    size_t len;
     int rc = 0;
     Channel *ch;
+    TunnelHello *h;
+    const void *v;
+    uint8_t vlen;
+    int path;
 
     switch (msg->type) {
     case MSG_TUNNEL_HELLO:
@@ -509,46 +2827,165 @@ static int tunnel_handle_message(Tunnel *t, Message *msg,
 
     case MSG_TUNNEL_NEW_CHANNEL_ACK:
         if (t->mode == TUNNEL_MODE_SERVER) {
-            ch = tunnel_get_channel(t, msg->channel_id);
+            ch = tunnel_get_channel(peer, msg->channel_id);
             if (!ch) {
                 log_warning("Unknown channal from %s, ignored.",
                              socket_addr_name(from));
+                tunnel_send_reset(t, peer, msg, from, fromlen);
                 return -1;
             }
 
-            rc = channel_connect(ch);
-            if (rc < 0)
-                tunnel_delete_channel(t, ch);
+            peer->heard = tunnel_clock();
+            tunnel_take_reset_token(ch, msg->data, msg->length);
+
+            /* Acked again, or after data that opened it */
+            if (ch->setup && ch->setup->sn == msg->sn)
+                rc = tunnel_server_opened(t, ch);
         } else if (t->mode == TUNNEL_MODE_CLIENT) {
-            ch = tunnel_get_opening_channel(t, msg->sn);
+            if (msg->channel_id == 0) {
+                rc = tunnel_client_cookie(t, msg->sn, msg->data,
+                                          msg->length);
+                break;
+            }
+
+            ch = peer ? tunnel_get_opening_channel(peer, msg->sn) : NULL;
             if (!ch) {
+                /* Sent again, our ack got lost */
+                ch = tunnel_get_channel(peer, msg->channel_id);
+                if (ch) {
+                    peer->heard = tunnel_clock();
+                    len = tunnel_put_reset_option(t, peer, ch->id, data, 0,
+                                                  sizeof(data));
+                    rc = tunnel_send_message(t, peer,
+                                             MSG_TUNNEL_NEW_CHANNEL_ACK,
+                                             ch->id, msg->sn, data, len);
+                    break;
+                }
+
                 log_warning("Unknown channal from %s, ignored.",
                              socket_addr_name(from));
                 return -1;
             }
 
-            tunnel_client_new_channel_ack(t, ch, msg->channel_id, msg->sn);
+            peer->heard = tunnel_clock();
+            tunnel_client_new_channel_ack(t, ch, msg->channel_id, msg->sn,
+                                          msg->data, msg->length);
             /* on error, the channel will be closed in 
                tunnel_client_new_channel_ack*/
         }
         break;
 
+    case MSG_TUNNEL_PROBE:
+        /* The padding is not echoed, only the sn. The run tells a client
+           if this is the server it said hello to. */
+        len = message_put_option_u32(data, 0, sizeof(data), MSG_OPT_SESSION,
+                                     t->session);
+        /* A client joining a path takes it up by it */
+        if (peer && peer->conn_id && (peer->caps & MSG_CAP_MULTIPATH) &&
+            t->mode == TUNNEL_MODE_SERVER)
+            len = message_put_option_u32(data, len, sizeof(data),
+                                         MSG_OPT_CONN_ID, peer->conn_id);
+        if (peer) {
+            peer->heard = tunnel_clock();
+            rc = tunnel_send_message(t, peer, MSG_TUNNEL_PROBE_ACK, 0,
+                                     msg->sn, data, len);
+        } else
+            rc = message_send(t->udp_svr_sock, MESSAGE_VERSION_1,
+                              MSG_TUNNEL_PROBE_ACK, 0, msg->sn, data, len,
+                              from, fromlen);
+        break;
+
+    case MSG_TUNNEL_PROBE_ACK:
+        if (!peer)
+            break;
+
+        if (t->mode == TUNNEL_MODE_CLIENT && peer->session &&
+            message_get_option_u32(msg->data, msg->length, MSG_OPT_SESSION,
+                                   peer->session) != peer->session) {
+            tunnel_reconnect(t, "restarted");
+            break;
+        }
+
+        peer->heard = tunnel_clock();
+        if (t->mode == TUNNEL_MODE_CLIENT && peer->paths &&
+            t->rx_path >= 0 &&
+            tunnel_path_probe_acked(t, peer, t->rx_path, msg))
+            break;
+        if (peer->keepalive_wait && (uint16_t)msg->sn == peer->keepalive_sn) {
+            peer->keepalive_wait = 0;
+            peer->keepalive_missed = 0;
+            peer_rtt_sample(peer, peer->heard - peer->keepalive_sent);
+        } else {
+            pmtu_probe_acked(&peer->pmtu, msg->sn, peer->heard);
+        }
+        break;
+
     case MSG_CHANNEL_KEEPALIVE:
     case MSG_CHANNEL_DATA:
+    case MSG_CHANNEL_DATA_DEDUP:
     case MSG_CHANNEL_DATA_ACK:
     case MSG_CHANNEL_CLOSE:
-        ch = tunnel_get_channel(t, msg->channel_id);
+        ch = tunnel_get_channel(peer, msg->channel_id);
         if (!ch) {
             log_warning("Unknown channal(%d) from %s, ignored.",
                          msg->channel_id, socket_addr_name(from));
 
+            /* It is closing anyway */
+            if (msg->type != MSG_CHANNEL_CLOSE)
+                tunnel_send_reset(t, peer, msg, from, fromlen);
             return -1;
         }
-        rc = channel_handle_message(ch, msg);
+
+        peer->heard = tunnel_clock();
+        peer->bytes_in += msg->length;
+
+        /* The client has the channel if it sends on it, its ack may be
+           lost or late */
+        if (ch->setup && ch->mode == CHANNEL_MODE_SERVER &&
+            msg->type != MSG_CHANNEL_CLOSE &&
+            tunnel_server_opened(t, ch) < 0)
+            return -1;
+
+        rc = channel_handle_message(ch, msg, buf);
         if (rc < 0)
             tunnel_delete_channel(t, ch);
         break;
 
+    case MSG_CHANNEL_RESET:
+        if (peer)
+            rc = tunnel_handle_reset(t, peer, msg);
+        break;
+
+    case MSG_TUNNEL_HELLO_ACK:
+        /* for client side, the first answer while down */
+        if (t->mode == TUNNEL_MODE_CLIENT && t->down &&
+            (h = tunnel_find_hello(t, (uint16_t)msg->sn, from, fromlen)) &&
+            !tunnel_hello_cookie(t, h, msg))
+            rc = tunnel_hello_back(t, h, msg);
+        break;
+
+    case MSG_TUNNEL_MIGRATE:
+        /* for server side */
+        if (t->mode == TUNNEL_MODE_SERVER)
+            rc = tunnel_handle_migrate(t, peer, msg, from, fromlen);
+        break;
+
+    case MSG_TUNNEL_MIGRATE_ACK:
+        /* for client side, answer the challenge from the server */
+        v = message_get_option(msg->data, msg->length, MSG_OPT_COOKIE,
+                               &vlen);
+        if (t->mode == TUNNEL_MODE_CLIENT && peer && peer == t->peer &&
+            peer->conn_id && v && vlen == TUNNEL_COOKIE_LEN) {
+            path = peer->paths ? t->rx_path : -1;
+            rc = tunnel_send_migrate(t, peer, path, (const uint8_t *)v);
+            t->migrate_answered++;
+
+            /* Up once the server has it */
+            if (path >= 0 && peer->paths[path].state == PATH_DOWN)
+                tunnel_send_path_probe(t, peer, path, tunnel_clock());
+        }
+        break;
+
     default:
         log_warning("Unknown message from %s, ignored.",
                     socket_addr_name(from));
@@ -558,18 +2995,316 @@ static int tunnel_handle_message(Tunnel *t, Message *msg,
     return rc;
 }
 
+/* A datagram of peer came to the local socket from addr, replies to it
+   go by its path. The server takes a path it hears from up again. */
+static void tunnel_heard_by(Tunnel *t, Peer *peer, int local,
+                            const struct sockaddr *from, socklen_t fromlen,
+                            int len)
+{
+    uint32_t now = tunnel_clock();
+    Path *p;
+
+    t->rx_peer = peer;
+    t->rx_path = peer->paths ? peer_path(peer, local, from, fromlen) : -1;
+    if (t->rx_path < 0)
+        return;
+
+    p = &peer->paths[t->rx_path];
+    path_heard(p, now);
+    p->bytes_in += len;
+
+    if (t->mode == TUNNEL_MODE_SERVER && p->state == PATH_DOWN) {
+        path_up(p, now);
+        log_info("Peer %s, path %d up again.",
+                 socket_addr_name(peer_addr(peer)), t->rx_path);
+    }
+}
+
+/* Handle the messages of a datagram to the local socket in turn. A data
+   message is always the last one, its channel takes the buffer. */
+static void tunnel_handle_datagram(Tunnel *t, Buffer *buf, int local,
+                                   const struct sockaddr *from,
+                                   socklen_t fromlen)
+{
+    Message *msg = message_of(buf);
+    int end = buf->len;
+    char *next;
+    Peer *peer = NULL;
+
+    for (;;) {
+        next = NULL;
+        if ((msg->flags & MSG_FLAG_BUNDLE) &&
+            msg->type != MSG_CHANNEL_DATA &&
+            msg->type != MSG_CHANNEL_DATA_DEDUP)
+            next = msg->data + msg->length;
+
+        /* Once per datagram, a hello or new channel of the bundle may add
+           the peer. Held until the rest is handled. */
+        if (!peer && (peer = peer_find(t, from, fromlen))) {
+            peer_ref(peer);
+            tunnel_heard_by(t, peer, local, from, fromlen, end);
+        }
+
+        tunnel_handle_message(t, buf, peer, from, fromlen);
+
+        if (!next || next == buf->data + end)
+            break;
+
+        msg = message_decode(next, buf->data + end - next);
+        if (!msg) {
+            log_warning("Tunnel received an invalid bundle from %s, "
+                        "ignore the rest.", socket_addr_name(from));
+            break;
+        }
+
+        buf->offset = (int)((char *)msg - buf->data);
+        t->recv_bundled++;
+    }
+
+    t->rx_peer = NULL;
+    if (peer)
+        peer_release(t, peer);
+}
+
+/* Seal into the tunnel buffer and send by path, never in the clear */
+static int tunnel_send_sealed(Tunnel *t, Peer *peer, int path,
+                              const void *hdr, size_t hlen, const void *data,
+                              size_t len)
+{
+    const struct sockaddr *addr;
+    socklen_t addrlen;
+    SOCKET s;
+    size_t n;
+
+    if (!peer->crypto) {
+        log_error("No keys for %s, message not sent.",
+                  socket_addr_name(peer_addr(peer)));
+        return -1;
+    }
+
+    n = crypto_seal(peer->crypto, t->seal_buf, hdr, hlen, data, len);
+    s = tunnel_path_socket(t, peer, path, &addr, &addrlen);
+
+    return sendto(s, t->seal_buf, (int)n, 0, addr, addrlen);
+}
+
+static void tunnel_flush_bundle(Tunnel *t)
+{
+    Peer *peer = t->bundle_peer;
+    int count = t->bundle.count;
+    const struct sockaddr *addr;
+    socklen_t addrlen;
+    SOCKET s;
+    int rc;
+
+    if (!peer)
+        return;
+
+    if (t->config.encrypt) {
+        rc = tunnel_send_sealed(t, peer, t->bundle_path, t->bundle.data,
+                                t->bundle.len, NULL, 0);
+        t->bundle.count = 0;
+        t->bundle.len = 0;
+    } else {
+        s = tunnel_path_socket(t, peer, t->bundle_path, &addr, &addrlen);
+        rc = message_bundle_send(s, &t->bundle, addr, addrlen);
+    }
+
+    if (rc <= 0) {
+        log_warning("Send bundle to %s error:%d.",
+                    socket_addr_name(peer_addr(peer)), socket_errno());
+    } else {
+        t->sent_bundles++;
+        t->sent_bundled += count;
+    }
+
+    t->bundle_peer = NULL;
+    peer_release(t, peer);
+}
+
+int tunnel_send_message(Tunnel *t, Peer *peer, uint8_t type, uint32_t cid,
+                        uint32_t sn, void *data, size_t len)
+{
+    MessageHeader hdr;
+    int path = tunnel_pick_path(t, peer, -1);
+
+    if (t->bundling && (peer->caps & MSG_CAP_BUNDLE)) {
+        if (t->bundle_peer == peer && t->bundle_path == path &&
+            message_bundle_add(&t->bundle, type, cid, sn, data, len))
+            goto bundled;
+
+        tunnel_flush_bundle(t);
+        if (message_bundle_add(&t->bundle, type, cid, sn, data, len)) {
+            t->bundle_peer = peer_ref(peer);
+            t->bundle_path = path;
+            goto bundled;
+        }
+    }
+
+    message_init_header(&hdr, peer->version, type, 0, cid, sn, len);
+
+    return tunnel_sendv(t, peer, path, &hdr, data, len, NULL);
+
+bundled:
+    peer->bytes_out += len;
+    if (path >= 0)
+        peer->paths[path].bytes_out += len;
+    return 1;
+}
+
+int tunnel_sendv(Tunnel *t, Peer *peer, int path, const MessageHeader *hdr,
+                 const void *data, size_t len, Buffer *buf)
+{
+    const struct sockaddr *addr;
+    socklen_t addrlen;
+    SOCKET s;
+
+    path = tunnel_pick_path(t, peer, path);
+
+    peer->bytes_out += len;
+    if (path >= 0)
+        peer->paths[path].bytes_out += len;
+
+    if (t->config.encrypt)
+        return tunnel_send_sealed(t, peer, path, hdr->data, hdr->len, data,
+                                  len);
+
+    s = tunnel_path_socket(t, peer, path, &addr, &addrlen);
+
+    /* Zero copy sends are tracked on the one socket */
+    if (buf && s == t->udp_svr_sock)
+        return zerocopy_send(&t->zc, buf, hdr, data, len, addr, addrlen);
+
+    return message_sendv(s, hdr, data, len, addr, addrlen);
+}
+
+/* Open the sealed datagrams of a batch in one go before any is handled.
+   Only a hello and a migrate go in the clear, anything else that does
+   not open is dropped. */
+static void tunnel_open_batch(Tunnel *t, Buffer **bufs,
+                              const struct sockaddr_storage *from,
+                              const socklen_t *fromlen, int count)
+{
+    uint32_t now = tunnel_clock();
+    const struct sockaddr *addr;
+    Buffer *buf;
+    Message *msg;
+    Peer *peer;
+    char *p;
+    int len;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        buf = bufs[i];
+        addr = (const struct sockaddr *)&from[i];
+
+        if (!message_sealed(buf)) {
+            msg = message_of(buf);
+            if (buf->len > 0 && msg->type != MSG_TUNNEL_HELLO &&
+                msg->type != MSG_TUNNEL_HELLO_ACK &&
+                msg->type != MSG_TUNNEL_MIGRATE &&
+                msg->type != MSG_TUNNEL_MIGRATE_ACK) {
+                log_debug("Message in the clear from %s, dropped.",
+                          socket_addr_name(addr));
+                buf->len = 0;
+            }
+            continue;
+        }
+
+        peer = peer_find(t, addr, fromlen[i]);
+        p = buf->data + buf->offset;
+        len = -1;
+        if (peer && peer->crypto)
+            len = crypto_open(peer->crypto, p, buf->len - buf->offset);
+        if (len < 0) {
+            log_debug("Sealed message from %s does not open, dropped.",
+                      socket_addr_name(addr));
+            buf->len = 0;
+            continue;
+        }
+
+        peer->crypto->heard = now;
+        if (peer->hello_keys) {
+            /* The client holds the key, its peer is kept as any other */
+            peer->hello_keys = 0;
+            t->hello_keys--;
+        }
+        message_decode_buffer(buf, p + CRYPTO_HEADER_LEN, len,
+                              MESSAGE_V1_HEADER_LEN + t->max_payload, addr);
+    }
+}
+
+/* Receive a batch of messages from the local socket into pooled
+   buffers, channels keep a reference to the buffers they queue. Returns
+   < 0 on error. */
+static int tunnel_receive(Tunnel *t, int local)
+{
+    Buffer **bufs = t->recv_bufs;
+    struct sockaddr_storage from[MESSAGE_BATCH_MAX];
+    socklen_t fromlen[MESSAGE_BATCH_MAX];
+    int count;
+    int rc;
+    int i;
+
+    for (count = 0; count < MESSAGE_BATCH_MAX; count++) {
+        if (!bufs[count])
+            bufs[count] = buffer_alloc(&t->data_pool);
+        if (!bufs[count])
+            break;
+    }
+
+    if (count == 0) {
+        /* Budget exhausted, leave the datagrams to the socket buffer */
+        log_warning("Tunnel receive, out of buffers.");
+        return 0;
+    }
+
+    rc = message_receive_batch(t->udp_socks[local], bufs,
+                               MESSAGE_V1_HEADER_LEN + t->max_payload +
+                               t->overhead, from, fromlen, count);
+    if (rc < 0) {
+        log_error("Tunnel recevie message error:%d.", socket_errno());
+    } else if (rc > 0) {
+        t->recv_batches++;
+        t->recv_messages += rc;
+    }
+
+    if (t->config.encrypt && rc > 0)
+        tunnel_open_batch(t, bufs, from, fromlen, rc);
+
+    /* Replies to the same peer go out together once the batch is done */
+    t->bundling = 1;
+    for (i = 0; i < rc; i++) {
+        if (bufs[i]->len > 0)
+            tunnel_handle_datagram(t, bufs[i], local,
+                                   (const struct sockaddr *)&from[i],
+                                   fromlen[i]);
+        else
+            log_warning("Tunnel recevied an invalid message, ingnore.");
+    }
+    t->bundling = 0;
+    tunnel_flush_bundle(t);
+
+    for (i = 0; i < rc; i++) {
+        if (buffer_shared(bufs[i])) {
+            buffer_release(bufs[i]);
+            bufs[i] = NULL;
+        }
+    }
+
+    return rc;
+}
+
 int tunnel_run(Tunnel *t)
 {
     fd_set fds;
+    fd_set wfds;
     int nfds;
     int rc;
+    int i;
 
     Channel *ch;
-    uint32_t cid;
-
-    /* receive message data */
-    char msg_buf[sizeof(Message) + TUNNEL_MAX_DATA_LEN - 1];
-    Message *msg;
+    Channel *next;
 
     struct sockaddr_storage from;
     socklen_t fromlen;
@@ -586,8 +3321,6 @@ int tunnel_run(Tunnel *t)
     check_interval.tv_usec = 500000;
     timeradd(&now, &check_interval, &check_time);
 
-    msg = (Message *)msg_buf;
-
     if (t->mode == TUNNEL_MODE_CLIENT) {
         rc = listen(t->tcp_svr_sock, TUNNEL_SERVER_BACKLOG);
         if (rc != 0) {
@@ -595,6 +3328,8 @@ int tunnel_run(Tunnel *t)
                       socket_local_name(t->tcp_svr_sock), socket_errno());
             return rc;
         }
+
+        tunnel_fill_pool(t);
     }
 
     while (!t->stop) {
@@ -602,56 +3337,85 @@ int tunnel_run(Tunnel *t)
             timeout.tv_usec = 50000;
 
         fds = t->fds;
-        nfds = select(FD_SETSIZE, &fds, NULL, NULL, &timeout);
+        wfds = t->wfds;
+        nfds = select(FD_SETSIZE, &fds, &wfds, NULL, &timeout);
         if (nfds < 0) {
-            if (errno != EINTR)
+            /* Interrupted by signal, stop flag is checked by the loop. */
+            if (errno == EINTR)
+                nfds = 0;
+            else {
                 log_error("Tunnel select error:%d.", socket_errno());
-            break;
+                break;
+            }
+        }
+
+        if (t->dump_stats) {
+            t->dump_stats = 0;
+            tunnel_dump_stats(t);
+        }
+
+        if (t->opening && CLOCK_AFTER(tunnel_clock(), t->open_check)) {
+            tunnel_check_opens(t);
+            t->open_check = tunnel_clock() + TUNNEL_OPEN_CHECK_INTERVAL;
         }
 
+        if (t->down)
+            tunnel_hello_again(t, tunnel_clock());
+
         /* Go through all the channels. */
         gettimeofday(&now, NULL);
         if (timercmp(&now, &check_time, >)) {
-            rc = hashtable_first(t->channels, &cid, (void **)&ch);
-            while (rc) {
-                rc = channel_idle(ch);
-                if (rc < 0)
+            tunnel_expire_sessions(t, tunnel_clock());
+            t->resets_left = TUNNEL_MAX_RESETS;
+
+            for (ch = t->channels; ch; ch = next) {
+                next = ch->next;
+                if (channel_idle(ch) < 0)
                     tunnel_delete_channel(t, ch);
+            }
 
-                rc = hashtable_next(t->channels, &cid, (void **)&ch);
+            tunnel_check_paths(t, tunnel_clock());
+            if (t->mode == TUNNEL_MODE_CLIENT)
+                tunnel_keepalive(t, tunnel_clock());
+
+            tunnel_probe_peers(t);
+            peer_expire(t, 0);
+
+            if (t->mode == TUNNEL_MODE_CLIENT)
+                tunnel_fill_pool(t);
+            else
+                prewarm_check(&t->prewarm, tunnel_clock());
+
+            /* The server forgets the keys of a peer with no channels
+               after a while */
+            if (t->peer && t->peer->crypto && !t->down &&
+                t->peer->refcnt == 1 &&
+                CLOCK_AFTER(tunnel_clock(), t->peer->crypto->heard +
+                                            TUNNEL_REKEY_IDLE * 1000)) {
+                t->rekey = 1;
+                tunnel_hello_start(t, tunnel_clock());
             }
 
             /* Next check time */
             timeradd(&now, &check_interval, &check_time);
         }
 
-        if (nfds > 0 && FD_ISSET(t->udp_svr_sock, &fds)) {
-            msg->type = 0;
-            msg->reserved = 0;
-            msg->channel_id = 0;
-            msg->sn = 0;
-            msg->length = TUNNEL_MAX_DATA_LEN;
-            fromlen = sizeof(from);
-
-            rc = message_receive(t->udp_svr_sock, msg, 
-                                 (struct sockaddr *)&from, &fromlen);
-            if (rc == 0) {
-                log_info("Tunnel closed.");
-                break;
-            } else if (rc < 0) {
-                log_error("Tunnel recevie message error:%d.", socket_errno());
-                break;
-            } 
+        /* Zero copy completions also make the UDP socket readable */
+        if (zerocopy_busy(&t->zc))
+            zerocopy_reap(&t->zc);
 
-            if (rc != 1) {
-                tunnel_handle_message(t, msg, (const struct sockaddr *)&from,
-                                      fromlen);
-            } else {
-                log_warning("Tunnel recevied an invalid message, ingnore.");
-            }
+        rc = 0;
+        for (i = 0; i < t->nsocks && nfds > 0 && rc >= 0; i++) {
+            if (!FD_ISSET(t->udp_socks[i], &fds))
+                continue;
 
+            /* Nothing received if woken up by an error queue notification
+               only */
+            rc = tunnel_receive(t, i);
             nfds--;
         }
+        if (rc < 0)
+            break;
 
         if (t->mode == TUNNEL_MODE_CLIENT) {
             if (nfds > 0 && FD_ISSET(t->tcp_svr_sock, &fds)) {
@@ -659,8 +3423,15 @@ int tunnel_run(Tunnel *t)
                 fromlen = sizeof(from);
 
                 s = accept(t->tcp_svr_sock, (struct sockaddr *)&from, &fromlen);
-                if (s != INVALID_SOCKET) {
-                    tunnel_client_new_channel(t, s);
+                if (s != INVALID_SOCKET && t->down) {
+                    /* Held long enough, fail fast instead */
+                    socket_set_abortive(s);
+                    socket_close(s);
+                    t->rejected++;
+                } else if (s != INVALID_SOCKET) {
+                    if (tunnel_take_pooled(t, s) < 0)
+                        tunnel_client_new_channel(t, s);
+                    tunnel_fill_pool(t);
                 } else {
                     log_error("Accept client connection error:%d.",
                               socket_errno());
@@ -670,17 +3441,33 @@ int tunnel_run(Tunnel *t)
         }
 
         /* Go through all connected channels*/
-        if (nfds > 0) {
-            rc = hashtable_first(t->channels, &cid, (void **)&ch);
-            while (rc && nfds > 0) {
-                if (channel_socket_isset(ch, &fds)) {
-                    if (channel_tcp2udp_data(ch) <= 0) {
-                        tunnel_delete_channel(t, ch);
-                    }
-
-                    nfds--;
+        for (ch = t->channels; ch && nfds > 0; ch = next) {
+            next = ch->next;
+            if (channel_socket_connecting(ch, &wfds)) {
+                nfds--;
+                if (channel_connect_done(ch) < 0)
+                    tunnel_delete_channel(t, ch);
+                continue;
+            }
+
+            if (channel_socket_writable(ch, &wfds)) {
+                nfds--;
+                if (channel_udp2tcp_flush(ch) < 0) {
+                    if (channel_socket_isset(ch, &fds))
+                        nfds--;
+                    tunnel_delete_channel(t, ch);
+                    continue;
+                }
+            }
+
+            if (channel_socket_isset(ch, &fds)) {
+                if (channel_tcp2udp_data(ch) <= 0 ||
+                    (ch->setup && ch->mode == CHANNEL_MODE_CLIENT &&
+                     tunnel_client_early_data(t, ch) < 0)) {
+                    tunnel_delete_channel(t, ch);
                 }
-                rc = hashtable_next(t->channels, &cid, (void **)&ch);
+
+                nfds--;
             }
         }
     }
@@ -692,14 +3479,40 @@ int tunnel_run(Tunnel *t)
 
 void tunnel_close(Tunnel *t)
 {
-    if (t->udp_svr_sock != INVALID_SOCKET)
-        socket_close(t->udp_svr_sock);
+    int i;
+
+    for (i = 0; i < t->nsocks; i++)
+        socket_close(t->udp_socks[i]);
 
     if (t->mode == TUNNEL_MODE_CLIENT && t->tcp_svr_sock != INVALID_SOCKET)
         socket_close(t->tcp_svr_sock);
 
-    if (t->channels)
-        hashtable_free(t->channels, (hashtable_entry_free)channel_close);
+    while (t->channels)
+        channel_close(t->channels);
+
+    if (t->peer)
+        peer_release(t, t->peer);
+    peer_expire(t, 1);
+
+    /* Unpin buffers still held by zero copy sends */
+    zerocopy_destroy(&t->zc);
+
+    prewarm_destroy(&t->prewarm);
+
+    for (i = 0; i < MESSAGE_BATCH_MAX; i++)
+        buffer_release(t->recv_bufs[i]);
+
+    hashtable_free(t->peers, NULL);
+    hashtable_free(t->opens, NULL);
+    hashtable_free(t->conn_ids, NULL);
+    hashtable_free(t->path_addrs, NULL);
+    free(t->pool);
+
+    pool_destroy(&t->data_pool);
+    pool_destroy(&t->channel_pool);
+    pool_destroy(&t->peer_pool);
+    pool_destroy(&t->setup_pool);
+    pool_destroy(&t->ring_pool);
 
     free(t);
 }
@@ -710,6 +3523,43 @@ void tunnel_stop(Tunnel *t)
         t->stop = 1;
 }
 
+void tunnel_request_stats(Tunnel *t)
+{
+    if (t)
+        t->dump_stats = 1;
+}
+
+uint32_t tunnel_clock(void)
+{
+#if defined(_WIN32) || defined(_WIN64)
+    return (uint32_t)GetTickCount();
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+#endif
+}
+
+uint64_t tunnel_clock_us(void)
+{
+#if defined(_WIN32) || defined(_WIN64)
+    LARGE_INTEGER count;
+    LARGE_INTEGER freq;
+
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&freq);
+    return (uint64_t)(count.QuadPart / freq.QuadPart * 1000000 +
+                      count.QuadPart % freq.QuadPart * 1000000 /
+                      freq.QuadPart);
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
 void tunnel_sockets_set(Tunnel *t, SOCKET sock)
 {
     if (!FD_ISSET(sock, &t->fds)) {
@@ -718,6 +3568,16 @@ void tunnel_sockets_set(Tunnel *t, SOCKET sock)
     }
 }
 
+void tunnel_sockets_set_write(Tunnel *t, SOCKET sock)
+{
+    FD_SET(sock, &t->wfds);
+}
+
+void tunnel_sockets_clear_write(Tunnel *t, SOCKET sock)
+{
+    FD_CLR(sock, &t->wfds);
+}
+
 void tunnel_sockets_clear(Tunnel *t, SOCKET sock)
 {
     if (FD_ISSET(sock, &t->fds)) {
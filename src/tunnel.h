@@ -31,11 +31,78 @@ extern "C" {
 struct tunnel;
 typedef struct tunnel Tunnel;
 
-Tunnel *tunnel_create_server(const char *host, const char *port, char *acl);
+/* Tunnel tuning options, tunnel_config_init() fills the defaults. */
+typedef struct tunnel_config {
+    /* Send MSG_CHANNEL_DATA payloads of at least this many bytes with
+       MSG_ZEROCOPY, 0 disables. Linux only. */
+    int zerocopy_threshold;
+
+    /* Max bytes of pooled message buffers, shared by received data waiting
+       for TCP peers and sent data waiting for ACK. */
+    size_t buffer_budget;
+
+    /* Channel data messages in flight, 1 for stop-and-wait. Rounded down
+       to a power of 2. */
+    int window;
+
+    /* Largest IP packet to probe the path for, data payloads are sized
+       from the discovered path MTU. Peers always take 1024 bytes. */
+    int mtu;
+
+    /* Offer to compress channel data, used if the peer offers it too */
+    int compress;
+
+    /* Bytes of chunk cache per peer to leave out data sent before, 0 for
+       none. Used if the peer has one too. */
+    size_t dedup_cache;
+
+    /* Encrypt with session keys derived from this key on every hello,
+       both ends must have the same one. Only the hello goes in the
+       clear. */
+    int encrypt;
+    unsigned char key[32];
+
+    /* Server: half open channels before new channel requests have to
+       return a cookie first, 0 for always, -1 for never. Older clients
+       are refused meanwhile. Not used with encryption, only peers with
+       the key get that far. */
+    int open_cookies;
+
+    /* Fast open, -1 for off. Server: connect to the remote as soon as a
+       channel is requested, and take up to this many bytes of the
+       client's first data along with the request. Client: send up to
+       this many bytes of the first data with the request. */
+    int fast_open;
+
+    /* Server: fast open for any client. Otherwise only for clients whose
+       address is known to be theirs: with encryption, with a returned
+       cookie, or once they acked a channel before. */
+    int fast_open_any;
+
+    /* Server: connections to the remotes opened lately kept ready for new
+       channels, up to this many per remote. 0 for none. */
+    int prewarm;
+
+    /* Client: channels opened ahead of connections, an accepted
+       connection takes one that is ready. The server connects each to the
+       remote right away. 0 for none. */
+    int pool;
+
+    /* Client: local addresses to bond paths to the server from, comma
+       separated, a UDP socket on each. NULL for one path from any
+       address. */
+    const char *local_addrs;
+} TunnelConfig;
+
+void tunnel_config_init(TunnelConfig *cfg);
+
+Tunnel *tunnel_create_server(const char *host, const char *port, char *acl,
+                             const TunnelConfig *cfg);
 
 Tunnel *tunnel_create_client(const char *host, const char *port,
                              const char *tunnel_host, char *tunnel_port,
-                             const char *remote_host, char *remote_port);
+                             const char *remote_host, char *remote_port,
+                             const TunnelConfig *cfg);
 
 void tunnel_close(Tunnel *t);
 
@@ -43,6 +110,9 @@ int tunnel_run(Tunnel *t);
 
 void tunnel_stop(Tunnel *t);
 
+/* Safe to call from a signal handler, stats are logged by tunnel_run(). */
+void tunnel_request_stats(Tunnel *t);
+
 #ifdef __cplusplus
 }
 #endif
@@ -28,6 +28,13 @@
 
 #include "socket.h"
 #include "hashtable.h"
+#include "pool.h"
+#include "peer.h"
+#include "message.h"
+#include "zerocopy.h"
+#include "compress.h"
+#include "crypto.h"
+#include "prewarm.h"
 #include "acl.h"
 
 #include "tunnel.h"
@@ -36,46 +43,367 @@
 extern "C" {
 #endif
 
-/* Max tunnel message payload length */
+/* Message payload every peer takes, path MTU search starts from it */
 #define TUNNEL_MAX_DATA_LEN                 1024
 
+/* Largest payload of a UDP datagram over IPv4 */
+#define TUNNEL_MAX_PAYLOAD                  (65535 - 28 - 8)
+
+/* IPv4 + UDP + message header */
+#define TUNNEL_PACKET_OVERHEAD              (20 + 8 + 8)
+
+#define TUNNEL_DEFAULT_MTU                  1500
+
+/* Max handshake options length */
+#define TUNNEL_MAX_OPTIONS_LEN              64
+
+/* MSG_OPT_CRYPTO of a hello: ciphers of the client and its nonce. Of the
+   ack: cipher and key phase the server picked, its nonce and the tag
+   confirming the keys. */
+#define TUNNEL_CRYPTO_HELLO_LEN             (1 + CRYPTO_NONCE_LEN)
+#define TUNNEL_CRYPTO_ACK_LEN               (2 + CRYPTO_NONCE_LEN + \
+                                             CRYPTO_TAG_LEN)
+
+/* MSG_OPT_COOKIE: a server under an open flood sends a
+   MSG_TUNNEL_NEW_CHANNEL_ACK with no channel and a cookie, the client
+   asks again with the cookie. Under a flood of encrypted hellos, a
+   MSG_TUNNEL_HELLO_ACK with no keys and a cookie, the client says hello
+   again with it and the same sn. Server time in ms and a MAC of it, the
+   client address and the request sn. The server keeps no state. */
+#define TUNNEL_COOKIE_LEN                   (4 + 8)
+#define TUNNEL_COOKIE_LIFETIME              10 /* seconds */
+
+/* MSG_CHANNEL_RESET: answers a message on a channel the sender does not
+   have, so the other end closes it at once instead of resending. Each
+   end gives the peer a token per channel with the open handshake, the
+   server in its ack and the client in the ack back. A reset carries the
+   token, a MAC of the channel id and the peer address, nothing is kept.
+   Taken one RTO after the token at the earliest, data may overtake the
+   handshake. */
+#define TUNNEL_RESET_TOKEN_LEN              8
+#define TUNNEL_MAX_RESETS                   64 /* Sent per check */
+
+/* MSG_TUNNEL_MIGRATE: a client whose address changed, a NAT rebinding
+   its port say, keeps its session. The server gives each client a
+   connection id and key with the channel acks, sealed with encryption.
+   A client that hears nothing back, or gets a reset with a token it did
+   not give, tells its id in the clear. Told from another address, the
+   server answers there with a challenge, a cookie of the id and that
+   address, and moves the peer with all its channels once the client
+   returns it with a MAC under the key. Nothing is kept until then. */
+#define TUNNEL_CONN_PROOF_LEN               8
+
+/* Multipath: a client with several local addresses bonds a path from
+   each to the server, see path.h. The hello goes by one, the others
+   join the session with a MSG_TUNNEL_MIGRATE telling MSG_OPT_PATH, the
+   client's path number. The client proves its connection key as for a
+   move, and the server adds the address as another path of the peer.
+   Channel requests tell the number of paths in MSG_OPT_PATH too, the
+   server paces by the first one until the others join.
+   A client takes a path up once a probe by it is acked with its
+   connection id. A path quiet with data in flight goes down, its data
+   is sent again by the others, and the client joins it again backing
+   off from TUNNEL_PATH_RETRY_MIN to TUNNEL_PATH_RETRY_MAX. Replies go
+   by the path of the message they answer. */
+#define TUNNEL_PATH_RETRY_MIN               500 /* ms */
+#define TUNNEL_PATH_RETRY_MAX               8000 /* ms */
+
+/* Channels being set up are checked for resends this often */
+#define TUNNEL_OPEN_CHECK_INTERVAL          20 /* ms */
+
+/* Half open channels before new ones need a cookie, and peers with keys
+   of a hello only before new hellos do */
+#define TUNNEL_DEFAULT_OPEN_COOKIES         64
+
+/* Peers with keys of a hello only, nothing opened with them yet, at most.
+   Hellos beyond are denied until they expire, see PEER_HELLO_LINGER. */
+#define TUNNEL_MAX_HELLO_KEYS               1024
+
+/* Peers with a chunk cache of -D MB at most, for server side only. Only
+   clients that acked a channel get one, at their next request. */
+#define TUNNEL_MAX_DEDUP_PEERS              32
+
+/* A client hellos from the event loop, at start and again once the
+   server looks gone: keepalive probes lost, or a probe ack from another
+   run of the server. Every address the server resolves to is tried, the
+   last server first, the others TUNNEL_HELLO_STAGGER apart or one RTO of
+   the last server if less. The first ack wins. Tries to each address
+   back off from TUNNEL_HELLO_BACKOFF_MIN, or that RTO if more, to
+   TUNNEL_HELLO_BACKOFF_MAX, jittered. A hello ack from another run
+   resets all channels. */
+#define TUNNEL_MAX_HELLO_ADDRS              8
+#define TUNNEL_HELLO_STAGGER                250 /* ms */
+#define TUNNEL_HELLO_BACKOFF_MIN            250 /* ms */
+#define TUNNEL_HELLO_BACKOFF_MAX            30000 /* ms */
+
+/* New connections wait in the listen backlog while the tunnel is down,
+   after this long they are reset until it is up again */
+#define TUNNEL_DOWN_HOLD                    3 /* seconds */
+
+/* Channels a client keeps open ahead of connections at most */
+#define TUNNEL_MAX_POOL                     256
+
 /* TCP server backlog on tunnel client side */
 #define TUNNEL_SERVER_BACKLOG               16
 
-#define TUNNEL_HELLO_MEX_RETRY              5
-
 #define TUNNEL_MODE_CLIENT                  0
 #define TUNNEL_MODE_SERVER                  1
 
+/* Channel ids a server gives each peer, the client keys its opening
+   channels above by request sn. Version 1 peers take 16 bits. */
+#define TUNNEL_MAX_CID                      0x7FFFFFFF
+
+/* Objects carved per pool slab */
+#define TUNNEL_CHANNEL_POOL_SLAB            64
+#define TUNNEL_DATA_POOL_SLAB               32
+#define TUNNEL_PEER_POOL_SLAB               16
+#define TUNNEL_SETUP_POOL_SLAB              16
+#define TUNNEL_RING_POOL_SLAB               4
+
+#define TUNNEL_DEFAULT_BUFFER_BUDGET        (64 * 1024 * 1024)
+
+/* Channel data messages in flight, a power of 2 */
+#define TUNNEL_DEFAULT_WINDOW               32
+#define TUNNEL_MAX_WINDOW                   1024
+
+/* UDP socket buffers, room for the windows of many channels */
+#define TUNNEL_UDP_BUFFER_SIZE              (4 * 1024 * 1024)
+
+/* A client with no channels hellos again after this long, well before
+   the server forgets its keys */
+#define TUNNEL_REKEY_IDLE                   (PEER_LINGER / 2) /* seconds */
+
+/* Channel send ring bounds, the smallest keeps TCP reads large in
+   stop-and-wait */
+#define TUNNEL_MIN_RING_SIZE                (16 * 1024)
+#define TUNNEL_MAX_RING_SIZE                (256 * 1024)
+
+/* Hello tries to one server address, for client side only */
+typedef struct tunnel_hello {
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    uint16_t sn;                                /* Last try, only its ack
+                                                   is taken */
+    uint32_t sent;                              /* tunnel_clock() */
+    uint32_t next;
+    uint32_t backoff;                           /* ms */
+    uint8_t local;                              /* Socket of the last try */
+    uint8_t cookied;                            /* Last try sent again
+                                                   with a cookie */
+    unsigned long tries;
+    uint8_t nonce[CRYPTO_NONCE_LEN];
+} TunnelHello;
+
 typedef struct tunnel {
     int mode;
 
+    TunnelConfig config;
+
     SOCKET udp_svr_sock;
     SOCKET tcp_svr_sock;                        /* For client side only */
 
+    /* A client bonding paths has one per local address, the first is
+       udp_svr_sock. Others have that one only. */
+    SOCKET udp_socks[PEER_MAX_PATHS];
+    int nsocks;
+
     fd_set fds;
+    fd_set wfds;                                /* TCP peers with backlog */
     int nfds;
 
     uint16_t sn;
-    uint16_t cid;
 
     int stop;
+    int dump_stats;
+    int rekey;                                  /* Hello for new keys */
 
     AccessControlList acl;                      /* For server side only */
 
-    Hashtable *channels;
+    /* Open handshake statistics */
+    unsigned long opened;
+    unsigned long open_resent;
+    unsigned long open_failed;
+    unsigned long long open_ms;                 /* Total, first send to ack */
+    uint32_t open_max_ms;
+
+    /* Fast open statistics. Server: connected early, client: requests
+       with early data */
+    unsigned long fast_opened;
+    unsigned long early_taken;
+    unsigned long long early_bytes;
+
+    /* Open flood protection, for server side only */
+    uint32_t half_open;                         /* Waiting for client ack */
+    uint32_t hello_keys;                        /* Peers, see
+                                                   TUNNEL_MAX_HELLO_KEYS */
+    uint32_t dedup_peers;                       /* See
+                                                   TUNNEL_MAX_DEDUP_PEERS */
+    uint8_t cookie_key[16];
+    unsigned long cookies_sent;
+    unsigned long cookies_taken;
+    unsigned long cookies_refused;              /* Bad, late or none */
+
+    /* Channel resets, see TUNNEL_RESET_TOKEN_LEN */
+    uint8_t reset_key[16];                      /* New every run */
+    int resets_left;                            /* Until the next check */
+    unsigned long resets_sent;
+    unsigned long resets_taken;
+    unsigned long resets_refused;               /* Bad token, or early */
 
+    /* Address changes, see TUNNEL_CONN_PROOF_LEN. Client: ids told and
+       challenges answered. Server: challenges sent, peers moved and
+       refused. */
+    unsigned long migrate_told;
+    unsigned long migrate_answered;
+    unsigned long migrate_challenged;
+    unsigned long migrated;
+    unsigned long migrate_refused;
+
+    /* Multipath, see TUNNEL_PATH_RETRY_MIN. Paths joined, gone down and
+       data messages sent again by another one. */
+    unsigned long path_joins;
+    unsigned long path_downs;
+    unsigned long path_moved;
+
+    struct channel *channels;                   /* All, found by id in the
+                                                   peer's table */
+    int nchannels;
+    Hashtable *peers;                           /* Keyed by address hash */
+    Hashtable *conn_ids;                        /* Peers by connection id,
+                                                   for server side only */
+    Hashtable *path_addrs;                      /* Joined paths by address
+                                                   hash, for server side
+                                                   only */
+    Hashtable *opens;                           /* Half open, by request */
+
+    struct channel *opening;                    /* Being set up */
+    uint32_t open_check;                        /* Next, tunnel_clock() */
+
+    /* Channels opened ahead of connections, for client side only. Ready
+       ones have no TCP socket yet, the oldest is taken first. */
+    struct channel **pool;
+    int pool_ready;
+    int pool_opening;
+    unsigned long pool_hits;
+    unsigned long pool_misses;
+    unsigned long pool_refills;
+    unsigned long long pool_refill_ms;          /* Total, request to ack */
+    uint32_t pool_refill_max_ms;
+
+    Pool channel_pool;
+    Pool data_pool;                             /* Header + payload */
+    Pool peer_pool;
+    Pool setup_pool;
+    Pool ring_pool;                             /* Channel send rings */
+
+    uint16_t window;                            /* Local window */
+    uint16_t max_payload;                       /* Local receive limit */
+    uint16_t overhead;                          /* Sealing, per datagram */
+    uint32_t ring_size;                         /* Power of 2 */
+
+    Zerocopy zc;
+
+    Compressor compressor;
+
+    Prewarm prewarm;                            /* For server side only */
+
+    /* Receive buffers kept across batches, a buffer is only replaced when a
+       channel holds on to it. */
+    Buffer *recv_bufs[MESSAGE_BATCH_MAX];
+
+    /* Peer and path of the datagram being handled, replies go by it */
+    Peer *rx_peer;
+    int rx_path;
+
+    /* Control messages to one peer while a receive batch is handled, sent
+       together once it is done */
+    int bundling;
+    Peer *bundle_peer;
+    int bundle_path;
+    MessageBundle bundle;
+
+    /* Receive statistics */
+    unsigned long recv_batches;
+    unsigned long recv_messages;
+    unsigned long recv_bundled;                 /* Beyond the first */
+
+    /* Send statistics */
+    unsigned long sent_bundles;
+    unsigned long sent_bundled;
+
+    /* Datagrams are sealed here before they are sent */
+    char seal_buf[CRYPTO_OVERHEAD + MESSAGE_MAX_HEADER_LEN +
+                  TUNNEL_MAX_PAYLOAD];
+
+    char tunnel_host[TUNNEL_MAX_HOST_LEN+1];    /* For client side only */
+    char tunnel_port[TUNNEL_MAX_PORT_LEN+1];    /* For client side only */
     char remote_host[TUNNEL_MAX_HOST_LEN+1];    /* For client side only */
     char remote_port[TUNNEL_MAX_PORT_LEN+1];    /* For client side only */
 
-    struct sockaddr_storage tunnel_addr;        /* For client side only */
-    socklen_t tunnel_addr_len;                  /* For client side only */
+    Peer *peer;                                 /* For client side only */
+    uint32_t session;                           /* New every run, the peer
+                                                   tells a restart by it */
+
+    /* Hello in the background, for client side only */
+    TunnelHello hellos[TUNNEL_MAX_HELLO_ADDRS]; /* Resolved once */
+    int nhellos;
+    int down;                                   /* Until a hello ack */
+    uint32_t down_since;                        /* tunnel_clock() */
+    uint32_t up_ms;                             /* First hello to ack */
+    unsigned long reconnects;
+    unsigned long restarts;                     /* Of the server, seen */
+    unsigned long rejected;                     /* Connections while down */
+    unsigned long long reconnect_ms;            /* Total, down to up */
+    uint32_t reconnect_max_ms;
 } Tunnel;
 
+/* Monotonic clock in milliseconds, wraps every 49 days. Compare with
+   CLOCK_AFTER() only. */
+uint32_t tunnel_clock(void);
+
+#define CLOCK_AFTER(a, b)                   ((int32_t)((a) - (b)) > 0)
+
+/* Monotonic clock in microseconds, for timing work */
+uint64_t tunnel_clock_us(void);
+
+/* Send a message to peer in the wire format it takes. Messages to a
+   peer with MSG_CAP_BUNDLE are bundled while a receive batch is handled.
+   Returns > 0 on success. */
+int tunnel_send_message(Tunnel *t, Peer *peer, uint8_t type, uint32_t cid,
+                        uint32_t sn, void *data, size_t len);
+
+/* Send an encoded header plus the payload to peer by path, sealed if the
+   tunnel encrypts. Path -1 for the path of the datagram being answered,
+   or the best one. buf holds the payload for a zero copy send, may be
+   NULL. Returns > 0 on success. */
+int tunnel_sendv(Tunnel *t, Peer *peer, int path, const MessageHeader *hdr,
+                 const void *data, size_t len, Buffer *buf);
+
+/* A half open server channel is set up or gone, a request sent again
+   is a new one */
+void tunnel_forget_open(Tunnel *t, struct channel *ch);
+
+/* Channels by id in the table of their peer. Returns 0 if out of
+   memory. */
+int tunnel_add_channel(struct channel *ch);
+
+struct channel *tunnel_get_channel(Peer *peer, uint32_t cid);
+
+/* For server side. Channel 0 is reserved for tunnel, long lived channels
+   keep theirs. Returns 0 if all are in use. */
+uint32_t tunnel_next_cid(Peer *peer);
+
+/* Out of the peer's table and closed */
+void tunnel_delete_channel(Tunnel *t, struct channel *ch);
+
 void tunnel_sockets_set(Tunnel *t, SOCKET sock);
 
 void tunnel_sockets_clear(Tunnel *t, SOCKET sock);
 
+void tunnel_sockets_set_write(Tunnel *t, SOCKET sock);
+
+void tunnel_sockets_clear_write(Tunnel *t, SOCKET sock);
+
 #ifdef __cplusplus
 }
 #endif
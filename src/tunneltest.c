@@ -0,0 +1,692 @@
+/*
+ * udptunnel : Lightweight TCP over UDP Tunneling
+ *
+ * Copyright (C) 2014 Jingyu jingyu.niu@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Runs a udptunnel server and client on loopback and measures them from
+   the outside: the remote is an echo server in this process. POSIX only,
+   the tunnel ends are started with fork() and exec(). */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+
+#if !defined(_WIN32) && !defined(_WIN64)
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#include "socket.h"
+#include "message.h"
+
+/* Seconds an idle channel keeps its send ring, CHANNEL_HIBERNATE_TIME */
+#define HIBERNATE_TIME          5
+
+/* TUNNEL_DEFAULT_PROFILE of tunnel.c */
+#define PROFILE                 "UDPTunnel/1.2"
+
+/* Connections of the echo server and of this end of the tunnel */
+#define MAX_CONNS               4096
+
+#define ECHO_LEN                16
+
+static const char *udptunnel;
+
+/* More options for the server and for the client */
+static char **server_opts;
+static int server_nopts;
+static char **client_opts;
+static int client_nopts;
+
+static pid_t server_pid;
+static pid_t client_pid;
+static pid_t flood_pid;
+
+static char server_port[8];
+static char client_port[8];
+static char echo_port[8];
+
+static SOCKET echo_sock = INVALID_SOCKET;
+static SOCKET echo_conns[MAX_CONNS];
+static int echo_count;
+
+static SOCKET conns[MAX_CONNS];
+static int conn_count;
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Port of a socket bound to any free loopback port, the tunnel ends bind
+   it again. */
+static int free_port(int type, char *port)
+{
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    SOCKET s;
+
+    s = socket_create(AF_INET, type, "127.0.0.1", "0");
+    if (s == INVALID_SOCKET)
+        return -1;
+
+    if (getsockname(s, (struct sockaddr *)&addr, &addrlen) < 0) {
+        socket_close(s);
+        return -1;
+    }
+
+    sprintf(port, "%d", ntohs(addr.sin_port));
+    socket_close(s);
+    return 0;
+}
+
+/* Start udptunnel with args, its output goes nowhere */
+static pid_t start(const char *args[])
+{
+    const char *argv[16];
+    pid_t pid;
+    int null;
+    int i;
+
+    argv[0] = udptunnel;
+    for (i = 0; args[i] && i < 14; i++)
+        argv[i + 1] = args[i];
+    argv[i + 1] = NULL;
+
+    pid = fork();
+    if (pid < 0) {
+        printf("Fork error(%d).\n", errno);
+        return -1;
+    }
+
+    if (pid == 0) {
+        null = open("/dev/null", O_WRONLY);
+        if (null >= 0) {
+            dup2(null, 1);
+            dup2(null, 2);
+        }
+        execv(udptunnel, (char *const *)argv);
+        _exit(127);
+    }
+
+    return pid;
+}
+
+static void stop(pid_t *pid)
+{
+    if (*pid <= 0)
+        return;
+
+    kill(*pid, SIGTERM);
+    waitpid(*pid, NULL, 0);
+    *pid = 0;
+}
+
+static void stop_all(void)
+{
+    stop(&flood_pid);
+    stop(&client_pid);
+    stop(&server_pid);
+}
+
+static pid_t start_server(void)
+{
+    char addr[32];
+    const char *args[12] = { "-s", addr, "-v", "0" };
+    int i;
+
+    sprintf(addr, "127.0.0.1:%s", server_port);
+    for (i = 0; i < server_nopts && i < 7; i++)
+        args[4 + i] = server_opts[i];
+    args[4 + i] = NULL;
+    return start(args);
+}
+
+static pid_t start_client(void)
+{
+    char addr[32];
+    char tunnel[32];
+    char remote[32];
+    const char *args[16] = { "-c", addr, "-t", tunnel, "-r", remote,
+                             "-v", "0" };
+    int i;
+
+    sprintf(addr, "127.0.0.1:%s", client_port);
+    sprintf(tunnel, "127.0.0.1:%s", server_port);
+    sprintf(remote, "127.0.0.1:%s", echo_port);
+    for (i = 0; i < client_nopts && i < 5; i++)
+        args[8 + i] = client_opts[i];
+    args[8 + i] = NULL;
+    return start(args);
+}
+
+/* Resident set of a process in KB, -1 if unknown */
+static long rss_kb(pid_t pid)
+{
+    char path[64];
+    char line[128];
+    long kb = -1;
+    FILE *f;
+
+    sprintf(path, "/proc/%d/status", (int)pid);
+    f = fopen(path, "r");
+    if (!f)
+        return -1;
+
+    while (fgets(line, sizeof(line), f)) {
+        if (strncmp(line, "VmRSS:", 6) == 0) {
+            kb = atol(line + 6);
+            break;
+        }
+    }
+
+    fclose(f);
+    return kb;
+}
+
+static int echo_start(void)
+{
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+
+    echo_sock = socket_create(AF_INET, SOCK_STREAM, "127.0.0.1", "0");
+    if (echo_sock == INVALID_SOCKET ||
+        getsockname(echo_sock, (struct sockaddr *)&addr, &addrlen) < 0 ||
+        listen(echo_sock, 128) < 0) {
+        printf("Echo server socket error(%d).\n", socket_errno());
+        return -1;
+    }
+
+    sprintf(echo_port, "%d", ntohs(addr.sin_port));
+    return 0;
+}
+
+/* Accept and echo for up to ms milliseconds, or until wake is readable.
+   Connections closed by the tunnel are dropped. */
+static void echo_poll(int ms, SOCKET wake)
+{
+    struct pollfd fds[MAX_CONNS + 2];
+    char buf[4096];
+    SOCKET s;
+    int i, n, rc;
+
+    fds[0].fd = echo_sock;
+    fds[0].events = POLLIN;
+    for (i = 0; i < echo_count; i++) {
+        fds[i + 1].fd = echo_conns[i];
+        fds[i + 1].events = POLLIN;
+    }
+    fds[echo_count + 1].fd = wake;
+    fds[echo_count + 1].events = POLLIN;
+
+    n = poll(fds, echo_count + 2, ms);
+    if (n <= 0)
+        return;
+
+    for (i = echo_count - 1; i >= 0; i--) {
+        if (!fds[i + 1].revents)
+            continue;
+
+        rc = recv(echo_conns[i], buf, sizeof(buf), 0);
+        if (rc <= 0 || send(echo_conns[i], buf, rc, 0) != rc) {
+            socket_close(echo_conns[i]);
+            echo_conns[i] = echo_conns[--echo_count];
+        }
+    }
+
+    if ((fds[0].revents & POLLIN) && echo_count < MAX_CONNS) {
+        s = accept(echo_sock, NULL, NULL);
+        if (s != INVALID_SOCKET)
+            echo_conns[echo_count++] = s;
+    }
+}
+
+/* Wait for len bytes on s while echoing, up to ms milliseconds. Returns
+   0 on success, -1 if the connection failed or timed out. */
+static int echo_wait(SOCKET s, int len, int ms)
+{
+    uint64_t end = now_us() + (uint64_t)ms * 1000;
+    uint64_t now;
+    char buf[ECHO_LEN];
+    int got = 0;
+    int rc;
+
+    while (got < len) {
+        now = now_us();
+        if (now > end)
+            return -1;
+
+        echo_poll((int)((end - now) / 1000) + 1, s);
+
+        rc = recv(s, buf, sizeof(buf), MSG_DONTWAIT);
+        if (rc == 0)
+            return -1;
+        if (rc < 0) {
+            if (socket_would_block())
+                continue;
+            return -1;
+        }
+        got += rc;
+    }
+
+    return 0;
+}
+
+/* Connect through the tunnel and echo ECHO_LEN bytes. Returns the socket,
+   INVALID_SOCKET on failure. */
+static SOCKET open_conn(int ms)
+{
+    char buf[ECHO_LEN];
+    SOCKET s;
+
+    s = socket_connect(AF_INET, SOCK_STREAM, "127.0.0.1", client_port);
+    if (s == INVALID_SOCKET)
+        return INVALID_SOCKET;
+
+    memset(buf, '*', sizeof(buf));
+    if (send(s, buf, sizeof(buf), 0) != sizeof(buf) ||
+        echo_wait(s, sizeof(buf), ms) < 0) {
+        socket_close(s);
+        return INVALID_SOCKET;
+    }
+
+    return s;
+}
+
+/* Start both ends and wait for the first connection to echo */
+static int start_tunnel(void)
+{
+    SOCKET s = INVALID_SOCKET;
+    int i;
+
+    if (free_port(SOCK_DGRAM, server_port) < 0 ||
+        free_port(SOCK_STREAM, client_port) < 0) {
+        printf("No free port(%d).\n", socket_errno());
+        return -1;
+    }
+
+    server_pid = start_server();
+    if (server_pid < 0)
+        return -1;
+    usleep(200000);
+
+    client_pid = start_client();
+    if (client_pid < 0)
+        return -1;
+
+    for (i = 0; i < 50 && s == INVALID_SOCKET; i++) {
+        usleep(100000);
+        s = open_conn(1000);
+    }
+
+    if (s == INVALID_SOCKET) {
+        printf("Tunnel does not echo, is %s a udptunnel?\n", udptunnel);
+        return -1;
+    }
+
+    socket_close(s);
+    return 0;
+}
+
+/* Open count connections, each echoes once and is then left idle */
+static int open_idle(int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+        conns[conn_count] = open_conn(5000);
+        if (conns[conn_count] == INVALID_SOCKET) {
+            printf("Connection %d failed.\n", conn_count + 1);
+            return -1;
+        }
+        conn_count++;
+    }
+
+    return 0;
+}
+
+static void echo_for(int ms)
+{
+    uint64_t end = now_us() + (uint64_t)ms * 1000;
+
+    while (now_us() < end)
+        echo_poll(10, INVALID_SOCKET);
+}
+
+static void usage()
+{
+    printf("Usage: tunneltest udptunnel idle [channels]\n"
+           "   or: tunneltest udptunnel flood [rate] [seconds] [options]\n"
+           "   or: tunneltest udptunnel restart [held] [seconds] [options]\n"
+           "         udptunnel   Path of the udptunnel program to test.\n"
+           "         idle        Bytes per idle channel, of two batches of\n"
+           "                     as many channels, 400 by default.\n"
+           "         flood       Connections opened a second, without and\n"
+           "                     with a flood of spoofed channel requests,\n"
+           "                     20000 a second for 10 seconds by default.\n"
+           "                     Options go to the server.\n"
+           "         restart     Time until a new connection echoes after\n"
+           "                     the server is killed and started again,\n"
+           "                     and how as many held connections end. 20\n"
+           "                     held, 5 seconds down by default. Options\n"
+           "                     go to both ends.\n"
+           "\n");
+    exit(-1);
+}
+
+/* Memory of idle channels: the resident set grows by this much for each
+   channel of a second batch. The first batch warms the pools, an object
+   freed after set up is taken again by the second. */
+static int test_idle(int argc, char *argv[])
+{
+    int count = argc > 0 ? atoi(argv[0]) : 400;
+    long server[3], client[3];
+
+    /* The tunnel ends wait in select(), socket numbers must stay below
+       FD_SETSIZE. */
+    if (count <= 0 || 2 * count + 32 > FD_SETSIZE) {
+        printf("Channels must be 1-%d.\n", (FD_SETSIZE - 32) / 2);
+        return -1;
+    }
+
+    if (start_tunnel() < 0)
+        return -1;
+
+    server[0] = rss_kb(server_pid);
+    client[0] = rss_kb(client_pid);
+
+    if (open_idle(count) < 0)
+        return -1;
+    echo_for((HIBERNATE_TIME + 2) * 1000);
+    server[1] = rss_kb(server_pid);
+    client[1] = rss_kb(client_pid);
+
+    if (open_idle(count) < 0)
+        return -1;
+    echo_for((HIBERNATE_TIME + 2) * 1000);
+    server[2] = rss_kb(server_pid);
+    client[2] = rss_kb(client_pid);
+
+    printf("Resident set in KB, idle channels after %d s:\n",
+           HIBERNATE_TIME + 2);
+    printf("%10s %10s %10s %10s\n", "", "0", "first", "second");
+    printf("%10s %10ld %10ld %10ld\n", "server", server[0], server[1],
+           server[2]);
+    printf("%10s %10ld %10ld %10ld\n", "client", client[0], client[1],
+           client[2]);
+    printf("Bytes per idle channel: server %ld, client %ld, first batch "
+           "server %ld, client %ld.\n",
+           (server[2] - server[1]) * 1024 / count,
+           (client[2] - client[1]) * 1024 / count,
+           (server[1] - server[0]) * 1024 / count,
+           (client[1] - client[0]) * 1024 / count);
+    return 0;
+}
+
+/* Send rate channel requests a second for seconds, each from a socket
+   of its own bound to a random 127/8 address. They look like those of a
+   client that returns cookies, nobody reads the replies. */
+static void flood(int rate, int seconds)
+{
+    uint64_t end = now_us() + (uint64_t)seconds * 1000000;
+    uint64_t next = now_us();
+    struct sockaddr_in to;
+    char data[128];
+    char host[20];
+    size_t len;
+    uint16_t sn = 0;
+    uint16_t v;
+    SOCKET s;
+    int i;
+
+    memset(&to, 0, sizeof(to));
+    to.sin_family = AF_INET;
+    to.sin_port = htons((uint16_t)atoi(server_port));
+    to.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    /* Version 1 header, then profile:host:port\0 and options */
+    len = MESSAGE_V1_HEADER_LEN;
+    len += sprintf(data + len, "%s:127.0.0.1:%s", PROFILE, echo_port) + 1;
+    data[len++] = MSG_OPT_WINDOW;
+    data[len++] = 2;
+    data[len++] = 0;
+    data[len++] = 32;
+    data[len++] = MSG_OPT_VERSION;
+    data[len++] = 2;
+    data[len++] = 0;
+    data[len++] = MESSAGE_VERSION_2;
+    data[len++] = MSG_OPT_CAPS;
+    data[len++] = 4;
+    data[len++] = 0;
+    data[len++] = 0;
+    data[len++] = 0;
+    data[len++] = MSG_CAP_BUNDLE | MSG_CAP_COOKIE;
+
+    data[0] = MSG_TUNNEL_NEW_CHANNEL;
+    data[1] = 0;
+    v = 0;
+    memcpy(data + 2, &v, sizeof(v));
+    v = htons((uint16_t)(len - MESSAGE_V1_HEADER_LEN));
+    memcpy(data + 6, &v, sizeof(v));
+
+    srand((unsigned int)getpid());
+    while (now_us() < end) {
+        for (i = 0; i < rate / 100 || i < 1; i++) {
+            sprintf(host, "127.%d.%d.%d", 1 + rand() % 250, rand() % 256,
+                    1 + rand() % 254);
+            s = socket_create(AF_INET, SOCK_DGRAM, host, "0");
+            if (s == INVALID_SOCKET)
+                continue;
+
+            v = htons(++sn);
+            memcpy(data + 4, &v, sizeof(v));
+            sendto(s, data, len, 0, (struct sockaddr *)&to, sizeof(to));
+            socket_close(s);
+        }
+
+        next += 10000;
+        if (next > now_us())
+            usleep((useconds_t)(next - now_us()));
+    }
+}
+
+static int compare_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Open, echo and close connections one after another for seconds */
+static int open_rate(const char *name, int seconds)
+{
+    uint64_t end = now_us() + (uint64_t)seconds * 1000000;
+    uint32_t *ms = (uint32_t *)malloc(seconds * 20000 * sizeof(uint32_t));
+    uint64_t start;
+    int ok = 0;
+    int failed = 0;
+    SOCKET s;
+
+    if (!ms) {
+        printf("Out of memory.\n");
+        return -1;
+    }
+
+    while (now_us() < end && ok < seconds * 20000) {
+        start = now_us();
+        s = open_conn(2000);
+        if (s == INVALID_SOCKET) {
+            failed++;
+            continue;
+        }
+        socket_close(s);
+        ms[ok++] = (uint32_t)(now_us() - start);
+    }
+
+    qsort(ms, ok, sizeof(uint32_t), compare_u32);
+    printf("%-16s %8d %8d %8.1f %8.1f %8ld\n", name, ok / seconds, failed,
+           ok ? ms[ok / 2] / 1000.0 : 0.0,
+           ok ? ms[ok * 99 / 100] / 1000.0 : 0.0, rss_kb(server_pid) / 1024);
+
+    free(ms);
+    return 0;
+}
+
+/* Opens a second while the server gets a flood of spoofed channel
+   requests. Latencies in ms, the server resident set in MB. */
+static int test_flood(int argc, char *argv[])
+{
+    int rate = argc > 0 ? atoi(argv[0]) : 20000;
+    int seconds = argc > 1 ? atoi(argv[1]) : 10;
+    char name[32];
+
+    if (rate <= 0 || seconds <= 0)
+        usage();
+
+    server_opts = argv + 2;
+    server_nopts = argc > 2 ? argc - 2 : 0;
+
+    if (start_tunnel() < 0)
+        return -1;
+
+    printf("%-16s %8s %8s %8s %8s %8s\n", "", "opens/s", "failed",
+           "median", "p99", "RSS");
+
+    if (open_rate("no flood", seconds) < 0)
+        return -1;
+
+    flood_pid = fork();
+    if (flood_pid < 0) {
+        printf("Fork error(%d).\n", errno);
+        return -1;
+    }
+    if (flood_pid == 0) {
+        flood(rate, seconds + 1);
+        _exit(0);
+    }
+
+    /* The flood fills the half open channels first */
+    usleep(500000);
+    sprintf(name, "flood %d/s", rate);
+    return open_rate(name, seconds);
+}
+
+/* Kill the server with held connections through it, start it again on
+   the same port after seconds, and time until the client is back. */
+static int test_restart(int argc, char *argv[])
+{
+    int held = argc > 0 ? atoi(argv[0]) : 20;
+    double seconds = argc > 1 ? atof(argv[1]) : 5.0;
+    int reset = 0, closed = 0, open = 0;
+    uint64_t start, end;
+    char buf[ECHO_LEN];
+    SOCKET s = INVALID_SOCKET;
+    int i, rc;
+
+    if (held < 0 || held > MAX_CONNS || seconds < 0)
+        usage();
+
+    server_opts = client_opts = argv + 2;
+    server_nopts = client_nopts = argc > 2 ? argc - 2 : 0;
+
+    if (start_tunnel() < 0 || open_idle(held) < 0)
+        return -1;
+
+    kill(server_pid, SIGKILL);
+    waitpid(server_pid, NULL, 0);
+    server_pid = 0;
+    echo_for((int)(seconds * 1000));
+
+    server_pid = start_server();
+    if (server_pid < 0)
+        return -1;
+
+    start = now_us();
+    end = start + 60000000;
+    while (s == INVALID_SOCKET && now_us() < end) {
+        s = open_conn(1000);
+        if (s == INVALID_SOCKET)
+            echo_for(10);
+    }
+    if (s == INVALID_SOCKET) {
+        printf("No connection echoes 60 s after restart.\n");
+        return -1;
+    }
+    printf("Server down %.1f s, a new connection echoes %.3f s after "
+           "restart.\n", seconds, (now_us() - start) / 1e6);
+    socket_close(s);
+
+    /* Give the held connections a moment to see the reset */
+    echo_for(500);
+    for (i = 0; i < conn_count; i++) {
+        rc = recv(conns[i], buf, sizeof(buf), MSG_DONTWAIT);
+        if (rc == 0)
+            closed++;
+        else if (rc < 0 && !socket_would_block())
+            reset++;
+        else
+            open++;
+    }
+    printf("Held connections: %d reset, %d closed, %d still open.\n",
+           reset, closed, open);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int rc = 0;
+
+    if (argc < 3)
+        usage();
+
+    udptunnel = argv[1];
+    signal(SIGPIPE, SIG_IGN);
+
+    if (echo_start() < 0)
+        return 1;
+
+    if (strcmp(argv[2], "idle") == 0)
+        rc = test_idle(argc - 3, argv + 3);
+    else if (strcmp(argv[2], "flood") == 0)
+        rc = test_flood(argc - 3, argv + 3);
+    else if (strcmp(argv[2], "restart") == 0)
+        rc = test_restart(argc - 3, argv + 3);
+    else
+        usage();
+
+    stop_all();
+    return rc < 0 ? 1 : 0;
+}
+
+#else
+
+int main()
+{
+    printf("tunneltest needs fork(), it does not run on Windows.\n");
+    return 1;
+}
+
+#endif /* !_WIN32 && !_WIN64 */
@@ -30,6 +30,7 @@
 #endif
 
 #include "log.h"
+#include "crypto.h"
 #include "tunnel.h"
 
 static int mode;
@@ -43,6 +44,8 @@ static char *remote_port;
 
 static char *acl;
 
+static TunnelConfig config;
+
 #ifdef _DEBUG
 static int log_level = UDPTUNNEL_LOG_DEBUG;
 #else
@@ -60,14 +63,45 @@ static void usage()
            "  -s    server mode. server host and port\n"
            "  -a    allowed source and dest\n"
            "        src_ip,dest_ip,dest_port,allow|deny\n"
-           "        any ip is 0.0.0.0, any port is 0"
+           "        any ip is 0.0.0.0, any port is 0\n"
+           "  -o    half open channels before new ones must return a\n"
+           "        cookie first, and with -k peers with keys not used\n"
+           "        yet before new hellos must. 0 for always, -1 for\n"
+           "        never. Default is 64\n"
+           "  -F    fast open for any client, not only the ones with\n"
+           "        the key, a returned cookie or a channel acked before\n"
+           "  -b    connections kept ready to each remote opened lately,\n"
+           "        up to this many, 0 (default) for none\n"
            "\n"
            "  Client options:\n"
            "  -c    client mode. local TCP server host and port\n"
            "  -t    tunnel server host and port\n"
            "  -r    remote host and port\n"
+           "  -P    channels kept open ahead of connections, each holds\n"
+           "        a connection to the remote. 0 (default) for none\n"
+           "  -M    local addresses to bond a path to the tunnel server\n"
+           "        from each, comma separated, up to 4. Data is spread\n"
+           "        over the paths that are up\n"
            "\n"
            "  Common options:\n"
+           "  -z    send data payloads of at least this many bytes with\n"
+           "        MSG_ZEROCOPY, 0 disables (default). Linux only\n"
+           "  -m    message buffer budget in MB, 0 for unlimited,\n"
+           "        default is 64\n"
+           "  -w    channel data messages in flight, 1 for stop-and-wait,\n"
+           "        default is 32\n"
+           "  -u    largest path MTU to probe for, larger messages are\n"
+           "        only used once probed. Default is 1500\n"
+           "  -C    compress channel data if the other end does too\n"
+           "  -D    MB of chunk cache per peer to leave out data sent\n"
+           "        before, if the other end has one too. A server has\n"
+           "        one for 32 clients at most. 0 (default) disables\n"
+           "  -k    encrypt with this key, 64 hex digits. The other end\n"
+           "        must have the same key\n"
+           "  -f    fast open: the server connects to the remote on the\n"
+           "        channel request, the client sends up to this many\n"
+           "        bytes of its first data with it. 0 for no data, -1\n"
+           "        (default) disables\n"
            "  -v    verbose level, 0-3, default is 1\n"
            "        0 - Error, 1 - Warning, 2 - Info, 3 - Debug\n"
            "  -h    show this help and exit\n"
@@ -97,15 +131,28 @@ static void parse_args(int argc, char *argv[])
     static struct option long_options[] = {
         {"server",      required_argument, 0, 's'},
         {"acl",         required_argument, 0, 'a'},
+        {"open-cookies", required_argument, 0, 'o'},
+        {"fast-open-any", no_argument,     0, 'F'},
+        {"prewarm",     required_argument, 0, 'b'},
         {"client",      required_argument, 0, 'c'},
         {"tunnel",      required_argument, 0, 't'},
         {"remote",      required_argument, 0, 'r'},
+        {"pool",        required_argument, 0, 'P'},
+        {"multipath",   required_argument, 0, 'M'},
+        {"zerocopy",    required_argument, 0, 'z'},
+        {"memory",      required_argument, 0, 'm'},
+        {"window",      required_argument, 0, 'w'},
+        {"mtu",         required_argument, 0, 'u'},
+        {"compress",    no_argument,       0, 'C'},
+        {"dedup",       required_argument, 0, 'D'},
+        {"key",         required_argument, 0, 'k'},
+        {"fast-open",   required_argument, 0, 'f'},
         {"verbose",     required_argument, 0, 'v'},
         {"help",        no_argument,       0, 'h'},
     };
 
 
-    while ((opt = getopt_long(argc, argv, "s:a:c:t:r:v:h", long_options, NULL)) 
+    while ((opt = getopt_long(argc, argv, "s:a:o:Fb:c:t:r:P:M:z:m:w:u:CD:k:f:v:h", long_options, NULL)) 
             != -1) {
         switch (opt) {
         case 's':
@@ -117,6 +164,18 @@ static void parse_args(int argc, char *argv[])
             acl = optarg;
             break;
 
+        case 'o':
+            config.open_cookies = atoi(optarg);
+            break;
+
+        case 'F':
+            config.fast_open_any = 1;
+            break;
+
+        case 'b':
+            config.prewarm = atoi(optarg);
+            break;
+
         case 'c':
             mode = 'c';
             parse_addr(optarg, &host, &port);
@@ -130,6 +189,51 @@ static void parse_args(int argc, char *argv[])
             parse_addr(optarg, &remote_host, &remote_port);
             break;
 
+        case 'P':
+            config.pool = atoi(optarg);
+            break;
+
+        case 'M':
+            config.local_addrs = optarg;
+            break;
+
+        case 'z':
+            config.zerocopy_threshold = atoi(optarg);
+            break;
+
+        case 'm':
+            config.buffer_budget = (size_t)atoi(optarg) * 1024 * 1024;
+            break;
+
+        case 'w':
+            config.window = atoi(optarg);
+            break;
+
+        case 'u':
+            config.mtu = atoi(optarg);
+            break;
+
+        case 'C':
+            config.compress = 1;
+            break;
+
+        case 'D':
+            config.dedup_cache = (size_t)atoi(optarg) * 1024 * 1024;
+            break;
+
+        case 'k':
+            if (crypto_parse_key(optarg, config.key) < 0) {
+                printf("Key must be 64 hex digits.\n\n");
+                usage();
+                exit(1);
+            }
+            config.encrypt = 1;
+            break;
+
+        case 'f':
+            config.fast_open = atoi(optarg);
+            break;
+
         case 'v':
             log_level = atoi(optarg);
             break;
@@ -189,6 +293,13 @@ static void stop(int UNUSED(sig) )
     tunnel_stop(t);
 }
 
+#if !defined(_WIN32) && !defined(_WIN64)
+static void dump_stats(int UNUSED(sig) )
+{
+    tunnel_request_stats(t);
+}
+#endif
+
 int main(int argc, char *argv[])
 {
 #if defined(_WIN32) || defined(_WIN64)
@@ -197,17 +308,21 @@ int main(int argc, char *argv[])
         return -1;
 #endif
 
+    tunnel_config_init(&config);
     parse_args(argc, argv);
     utlog_set_level(log_level);
 
     signal(SIGINT, stop);
     signal(SIGTERM, stop);
+#if !defined(_WIN32) && !defined(_WIN64)
+    signal(SIGUSR1, dump_stats);
+#endif
 
     if (mode == 's')
-        t = tunnel_create_server(host, port, acl);
+        t = tunnel_create_server(host, port, acl, &config);
     else
         t = tunnel_create_client(host, port, tunnel_host, tunnel_port,
-                                 remote_host, remote_port);
+                                 remote_host, remote_port, &config);
 
     if (!t)
         return -1;
@@ -0,0 +1,249 @@
+/*
+ * udptunnel : Lightweight TCP over UDP Tunneling
+ *
+ * Copyright (C) 2014 Jingyu jingyu.niu@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+#include <errno.h>
+
+#if defined(__linux__)
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#endif
+
+#include "config.h"
+
+#include "log.h"
+
+#include "zerocopy.h"
+
+#if defined(__linux__) && defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY) && \
+    defined(SO_EE_ORIGIN_ZEROCOPY)
+#define HAVE_ZEROCOPY
+#endif
+
+#define ZEROCOPY_PIN_POOL_SLAB      64
+
+int zerocopy_init(Zerocopy *zc, SOCKET sock, int threshold)
+{
+    memset(zc, 0, sizeof(Zerocopy));
+    zc->sock = sock;
+
+    pool_init(&zc->pin_pool, "zerocopy", sizeof(ZerocopyPin),
+              ZEROCOPY_PIN_POOL_SLAB);
+
+    if (threshold <= 0)
+        return -1;
+
+#ifdef HAVE_ZEROCOPY
+    {
+        int one = 1;
+
+        if (setsockopt(sock, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one))) {
+            log_warning("MSG_ZEROCOPY not supported, error:%d.",
+                        socket_errno());
+            return -1;
+        }
+    }
+
+    zc->threshold = threshold;
+    log_info("MSG_ZEROCOPY enabled for payloads of %d bytes or more.",
+             threshold);
+
+    return 0;
+#else
+    log_warning("MSG_ZEROCOPY not supported on this platform.");
+    return -1;
+#endif
+}
+
+static void zerocopy_unpin(Zerocopy *zc, ZerocopyPin *pin)
+{
+    buffer_release(pin->buf);
+    pool_free(&zc->pin_pool, pin);
+    zc->pinned--;
+}
+
+void zerocopy_destroy(Zerocopy *zc)
+{
+    ZerocopyPin *pin;
+
+    /* The socket is closed at this point, pages are kept alive by the
+       kernel itself. */
+    while (zc->pins) {
+        pin = zc->pins;
+        zc->pins = pin->next;
+        zerocopy_unpin(zc, pin);
+    }
+
+    zc->pins_tail = NULL;
+    pool_destroy(&zc->pin_pool);
+}
+
+#ifdef HAVE_ZEROCOPY
+static int zerocopy_sendmsg(Zerocopy *zc, const MessageHeader *hdr,
+                            const void *data, size_t len,
+                            const struct sockaddr *addr, socklen_t addrlen)
+{
+    struct iovec iov[2];
+    struct msghdr mh;
+
+    iov[0].iov_base = (void *)hdr->data;
+    iov[0].iov_len = hdr->len;
+    iov[1].iov_base = (void *)data;
+    iov[1].iov_len = len;
+
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_name = (void *)addr;
+    mh.msg_namelen = addrlen;
+    mh.msg_iov = iov;
+    mh.msg_iovlen = 2;
+
+    return sendmsg(zc->sock, &mh, MSG_ZEROCOPY);
+}
+#endif
+
+int zerocopy_send(Zerocopy *zc, Buffer *buf, const MessageHeader *hdr,
+                  const void *data, size_t len,
+                  const struct sockaddr *addr, socklen_t addrlen)
+{
+#ifdef HAVE_ZEROCOPY
+    int rc;
+    ZerocopyPin *pin;
+
+    if (!zc->threshold || len < (size_t)zc->threshold)
+        return message_sendv(zc->sock, hdr, data, len, addr, addrlen);
+
+    pin = (ZerocopyPin *)pool_alloc(&zc->pin_pool);
+    if (!pin)
+        return message_sendv(zc->sock, hdr, data, len, addr, addrlen);
+
+    rc = zerocopy_sendmsg(zc, hdr, data, len, addr, addrlen);
+    if (rc < 0) {
+        pool_free(&zc->pin_pool, pin);
+
+        if (errno != ENOBUFS && errno != EMSGSIZE)
+            return rc;
+
+        /* Out of socket option memory, or more pages than a zero copy
+           datagram takes, send with a copy */
+        zc->fallbacks++;
+        return message_sendv(zc->sock, hdr, data, len, addr, addrlen);
+    }
+
+    /* Kernel numbers successful zero copy sends from 0 */
+    pin->buf = buffer_ref(buf);
+    pin->id = zc->next_id++;
+    pin->next = NULL;
+    buf->zc_id = pin->id;
+
+    if (zc->pins_tail)
+        zc->pins_tail->next = pin;
+    else
+        zc->pins = pin;
+    zc->pins_tail = pin;
+
+    zc->pinned++;
+    zc->sends++;
+
+    return rc;
+#else
+    (void)buf;
+    return message_sendv(zc->sock, hdr, data, len, addr, addrlen);
+#endif
+}
+
+#ifdef HAVE_ZEROCOPY
+/* Unpin send ids lo..hi, inclusive, wrap around safe. */
+static void zerocopy_complete(Zerocopy *zc, uint32_t lo, uint32_t hi,
+                              int copied)
+{
+    ZerocopyPin *pin = zc->pins;
+    ZerocopyPin *prev = NULL;
+    ZerocopyPin *next;
+
+    while (pin) {
+        next = pin->next;
+
+        if ((uint32_t)(pin->id - lo) <= (uint32_t)(hi - lo)) {
+            if (prev)
+                prev->next = next;
+            else
+                zc->pins = next;
+
+            if (zc->pins_tail == pin)
+                zc->pins_tail = prev;
+
+            zerocopy_unpin(zc, pin);
+        } else
+            prev = pin;
+
+        pin = next;
+    }
+
+    zc->completed += hi - lo + 1;
+    if (copied)
+        zc->copied += hi - lo + 1;
+}
+#endif
+
+void zerocopy_reap(Zerocopy *zc)
+{
+#ifdef HAVE_ZEROCOPY
+    char control[128];
+    struct msghdr mh;
+    struct cmsghdr *cm;
+    struct sock_extended_err *serr;
+
+    while (zc->pins) {
+        memset(&mh, 0, sizeof(mh));
+        mh.msg_control = control;
+        mh.msg_controllen = sizeof(control);
+
+        if (recvmsg(zc->sock, &mh, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+            break;
+
+        for (cm = CMSG_FIRSTHDR(&mh); cm; cm = CMSG_NXTHDR(&mh, cm)) {
+            if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+                !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+                continue;
+
+            serr = (struct sock_extended_err *)CMSG_DATA(cm);
+            if (serr->ee_errno != 0 ||
+                serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+
+            zerocopy_complete(zc, serr->ee_info, serr->ee_data,
+                              serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED);
+        }
+    }
+#else
+    (void)zc;
+#endif
+}
+
+void zerocopy_log_stats(Zerocopy *zc)
+{
+    if (!zc->threshold) {
+        log_info("Zero copy: disabled.");
+        return;
+    }
+
+    log_info("Zero copy: threshold %d bytes, %lu sends, %lu completed, "
+             "%lu copied by kernel, %lu fallbacks, %d buffers pinned.",
+             zc->threshold, zc->sends, zc->completed, zc->copied,
+             zc->fallbacks, zc->pinned);
+}
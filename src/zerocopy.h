@@ -0,0 +1,94 @@
+/*
+ * udptunnel : Lightweight TCP over UDP Tunneling
+ *
+ * Copyright (C) 2014 Jingyu jingyu.niu@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __ZEROCOPY_H__
+#define __ZEROCOPY_H__
+
+#include <stdint.h>
+
+#include "socket.h"
+#include "pool.h"
+#include "buffer.h"
+#include "message.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A buffer the kernel may still read from. Holds one buffer reference. */
+typedef struct zerocopy_pin {
+    struct zerocopy_pin *next;
+    Buffer *buf;
+    uint32_t id;
+} ZerocopyPin;
+
+/* MSG_ZEROCOPY state of one UDP socket (Linux only). Each zero copy send
+   pins its buffer until the completion notification for its send id is
+   read from the socket error queue. */
+typedef struct zerocopy {
+    SOCKET sock;
+    int threshold;                      /* 0 if disabled */
+
+    uint32_t next_id;
+    ZerocopyPin *pins;
+    ZerocopyPin *pins_tail;
+    Pool pin_pool;
+
+    /* Statistics */
+    int pinned;
+    unsigned long sends;
+    unsigned long completed;
+    unsigned long copied;               /* Kernel fell back to copy */
+    unsigned long fallbacks;            /* Out of optmem, sent by copy */
+} Zerocopy;
+
+/* Returns 0 if enabled, -1 if not supported or threshold is 0. */
+int zerocopy_init(Zerocopy *zc, SOCKET sock, int threshold);
+
+void zerocopy_destroy(Zerocopy *zc);
+
+/* Send hdr + payload in buf, with MSG_ZEROCOPY if len reaches the
+   threshold. Same return value as message_sendv(). */
+int zerocopy_send(Zerocopy *zc, Buffer *buf, const MessageHeader *hdr,
+                  const void *data, size_t len,
+                  const struct sockaddr *addr, socklen_t addrlen);
+
+/* Read completions from the error queue and unpin finished buffers. */
+void zerocopy_reap(Zerocopy *zc);
+
+static inline int zerocopy_busy(const Zerocopy *zc)
+{
+    return zc->pins != NULL;
+}
+
+/* The kernel may still read the buffers of send id. Also true for a done
+   one newer than the oldest pending, false for ids not sent yet. */
+static inline int zerocopy_pending(const Zerocopy *zc, uint32_t id)
+{
+    return zc->pins &&
+           (uint32_t)(id - zc->pins->id) < (uint32_t)(zc->next_id -
+                                                      zc->pins->id);
+}
+
+void zerocopy_log_stats(Zerocopy *zc);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __ZEROCOPY_H__ */